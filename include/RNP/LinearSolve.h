@@ -13,12 +13,11 @@ struct LinearSolve{
 		if(NULL != info){ *info = 0; }
 		if(0 == n || nRHS == 0){ return; }
 		
-		if(pivots){} // prevent unused parameter warning
-		
 		int iinfo = 0;
 		{ // LU decomposition
 			for(size_t j = 0; j < n; ++j){
 				size_t jp = j + RNP::TBLAS::MaximumIndex(n-j, &a[j+j*lda], 1);
+				if(NULL != pivots){ pivots[j] = jp; }
 				if(T(0) != a[jp+j*lda]){
 					if(jp != j){
 						RNP::TBLAS::Swap(n, &a[j+0*lda], lda, &a[jp+0*lda], lda);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+
 /************************* Fundamental types *************************/
 typedef double RS_real;
 
@@ -79,6 +81,72 @@ typedef struct RS_Options_{
 	// Set use_less_memory to nonzero if intermediate matrices should not
 	// be stored in memory when possible.
 	int use_less_memory;
+	// Set use_boundary_only_solve to nonzero if a planewave solution
+	// requested in the first or last layer should only compute the
+	// amplitudes in those two layers, using the S-matrix of the whole
+	// stack. Interior layers are solved individually when requested.
+	int use_boundary_only_solve;
+	// Set memory_budget to the number of bytes the solution of all layers
+	// at once may use for its workspace. If the default solver would
+	// exceed it, a two-pass solver which stores much less per layer is
+	// used instead. A value of zero means no limit.
+	size_t memory_budget;
+	// Set scratch_directory to non-NULL if the per-layer storage of the
+	// two-pass solver should be spilled to a memory mapped temporary file
+	// in the specified directory when it does not fit in memory_budget.
+	char *scratch_directory;
+	// Set use_memory_planner to nonzero if the fastest solve strategy
+	// whose estimated total memory (see RS_Simulation_EstimateMemory)
+	// fits within memory_budget should be chosen when a solution is set
+	// up. If none fit, the strategy using the least memory is chosen.
+	// This setting has no effect if memory_budget is zero.
+	int use_memory_planner;
+	// Set field_point_tolerance to a positive relative accuracy if
+	// RS_Simulation_GetFieldPoints should sum the Fourier series of the
+	// fields at the points of each plane with a non-uniform FFT instead
+	// of directly. This is much faster for many scattered points. A value
+	// of zero means direct (exact) summation.
+	RS_real field_point_tolerance;
+	// Set mode_cache_directory to non-NULL to keep the modes of layers
+	// that require an eigensolve in a cache in the specified directory,
+	// which may be shared by any number of simulations and processes. A
+	// layer whose eigenproblem exactly matches a cached one maps the
+	// stored modes instead of solving it again.
+	char *mode_cache_directory;
+	// Set mode_cache_size to the number of bytes the mode cache directory
+	// may occupy; the least recently used entries are removed to stay
+	// within it. A value of zero means no limit.
+	size_t mode_cache_size;
+	// Set partial_mode_count to a positive number k to compute only the k
+	// least evanescent eigenmodes of each patterned layer, with a
+	// shift-invert Arnoldi iteration, instead of all 2*n_G of them. The
+	// rest are approximated; they barely propagate across a thick layer,
+	// but still enter the matching at its interfaces, so the error falls
+	// off with k rather than vanishing. RS_Simulation_GetLayerModeError
+	// gives error estimates. Layers for which 2*k+18 exceeds 2*n_G, or
+	// where the iteration fails, are solved in full. A value of zero
+	// means all modes are always computed.
+	int partial_mode_count;
+	// Set mode_continuation to nonzero if the modes of each patterned
+	// layer should be kept when the frequency or incidence direction
+	// changes, and used as the starting point for the modes at the new
+	// one. They are refined by Newton iteration on the eigenvector basis,
+	// which is much cheaper than a dense eigensolve when the change is
+	// small, as in a dense sweep. Layers whose refinement does not
+	// converge are solved in full. This doubles the memory used by the
+	// modes of patterned layers.
+	int mode_continuation;
+	// Set use_symmetry_adapted_basis to nonzero if the eigensystem of
+	// each patterned layer should be split into independent blocks by
+	// the mirror and two-fold rotation symmetries about the origin that
+	// the layer and the incidence direction share, when there are any.
+	// The symmetries are read off the shapes and the lattice. Each mirror
+	// cuts the cost of the eigensolve by about a factor of four. Layers
+	// without symmetry are solved in full. The modes are stored in the
+	// full basis. When the modes of every layer fall into the sectors of
+	// the symmetries shared by the whole stack, the S-matrix is composed
+	// per sector as well; otherwise it is composed in the full basis.
+	int use_symmetry_adapted_basis;
 
 	RS_real lanczos_smoothing_width;
 	int lanczos_smoothing_power;
@@ -104,6 +172,15 @@ extern "C" {
 RS_Simulation* RS_Simulation_New(const RS_real *Lr, unsigned int nG, int *G);
 void RS_Simulation_Destroy(RS_Simulation *S);
 RS_Simulation* RS_Simulation_Clone(const RS_Simulation *S);
+// Writes the geometry, options, excitation, G list, and any computed
+// layer modes and mode amplitudes of S to a binary file.
+int RS_Simulation_Save(const RS_Simulation *S, const char *filename);
+// Creates a simulation from a file written by RS_Simulation_Save. The
+// saved layer modes are used in place from a mapping of the file, so
+// only the parts touched by later calls are ever read from disk.
+// Returns NULL if the file could not be read or is from an incompatible
+// build.
+RS_Simulation* RS_Simulation_Load(const char *filename);
 
 RS_message_handler RS_Simulation_SetMessageHandler(
 	RS_Simulation *S, RS_message_handler handler, void *data
@@ -144,6 +221,31 @@ int RS_Material_GetEpsilon(
 	const RS_Simulation *S, RS_MaterialID M, RS_real *eps
 );
 
+// Dispersion models of scalar materials, in the frequency units of
+// RS_Simulation_SetFrequency.
+#define RS_MATERIAL_DISPERSION_NONE      0 // constant epsilon
+#define RS_MATERIAL_DISPERSION_TABLE     1 // rows of {freq, n, k}
+#define RS_MATERIAL_DISPERSION_LORENTZ   2 // eps_inf, then rows of {fp, f0, gamma}
+#define RS_MATERIAL_DISPERSION_SELLMEIER 3 // eps_inf, then rows of {B, C}
+
+// Makes the epsilon of a material follow a model of nterms rows, and
+// sets it to the value at the current frequency. It is re-evaluated
+// whenever the frequency changes, and only the layers using a material
+// whose epsilon changed lose their modes and pattern Fourier coefficients.
+// A TABLE gives the refractive index n+ik at increasing frequencies; it
+// is interpolated by natural cubic splines in n and k at the real part
+// of the frequency, held constant outside the table, and squared.
+// LORENTZ is eps_inf + sum fp^2/(f0^2 - f^2 - i*gamma*f) at the complex
+// frequency, and includes Drude terms with f0 = 0. SELLMEIER is
+// eps_inf + sum B*w^2/(w^2 - C) at the wavelength w = 1/freq. NONE
+// removes the model and keeps the current epsilon, as does setting the
+// epsilon with RS_Simulation_SetMaterial. Returns 0 on success, -n if
+// the n-th argument is invalid (-2 also for a tensor material), or 1
+// on allocation failure.
+int RS_Material_SetDispersion(
+	RS_Simulation *S, RS_MaterialID M, int model, int nterms, const RS_real *params
+);
+
 /***************************/
 /* Layer related functions */
 /***************************/
@@ -191,6 +293,44 @@ int RS_Layer_SetRegionVertices(
 );
 int RS_Layer_IsCopy(RS_Simulation *S, RS_LayerID L);
 
+/***********************************/
+/* Profile layer related functions */
+/***********************************/
+// A region whose shape varies with depth, sampled at the nz depths of a
+// profile. At depth k it has the center center[2*k..2*k+1], the angle
+// angle_frac[k], and the halfwidths shape[2*k..2*k+1] (only the first
+// is used for an interval or circle) or, for a polygon, the nv vertices
+// starting at shape[2*nv*k], as for RS_Layer_SetRegionHalfwidths and
+// RS_Layer_SetRegionVertices. center and angle_frac may be NULL for 0.
+typedef struct RS_ProfileRegion_{
+	RS_MaterialID material;
+	int type;                  // RS_REGION_TYPE_*
+	int nv;                    // number of vertices of a polygon
+	const RS_real *center;     // length 2*nz, or NULL
+	const RS_real *angle_frac; // length nz, or NULL
+	const RS_real *shape;      // length 2*nz, or 2*nv*nz for a polygon
+} RS_ProfileRegion;
+
+// Appends a staircase of layers approximating a profile from depth z[0]
+// to z[nz-1] (increasing downwards) in a background material, in which
+// the parameters of the regions vary linearly between the samples. The
+// slices are made as thick as possible while no parameter varies by
+// more than 2*tol within them (angles as the arc length they move the
+// farthest vertex by), and each takes the middle of the range of every
+// parameter, so that its edges are within tol of the profile. Vertical
+// sections thus become single layers. A slice equal to an earlier one is
+// made a copy of it, and a slice differing from a solved layer only by a
+// translation has its modes obtained from that layer's without an
+// eigensolve. Layers are named name.0, name.1, ... if name is not NULL.
+// The first layer and the number of layers are returned in first and
+// nlayers if not NULL. Returns 0 on success, -n if the n-th argument is
+// invalid, or 1 on allocation failure.
+int RS_Simulation_AddProfileLayers(
+	RS_Simulation *S, const char *name, RS_MaterialID background,
+	int nz, const RS_real *z, int nregions, const RS_ProfileRegion *region,
+	RS_real tol, RS_LayerID *first, int *nlayers
+);
+
 /********************************/
 /* Excitation related functions */
 /********************************/
@@ -206,6 +346,15 @@ int RS_Simulation_ExcitationDipole(RS_Simulation *S, const double k[2], const ch
 /* Solution hint related functions */
 /***********************************/
 int RS_Simulation_SolveLayer(RS_Simulation *S, RS_LayerID L);
+// Returns error estimates for the modes of a layer computed with
+// options.partial_mode_count. residual is the largest relative residual
+// of the computed eigenmodes, and truncation is the largest amplitude
+// factor exp(-Im(q) thickness) by which a mode that was only
+// approximated propagates across the layer. Both are zero for layers
+// whose modes were all computed. The modes are computed if needed.
+int RS_Simulation_GetLayerModeError(
+	RS_Simulation *S, RS_LayerID L, RS_real *residual, RS_real *truncation
+);
 
 /****************************/
 /* Output related functions */
@@ -219,6 +368,17 @@ int RS_Simulation_GetPowerFluxes(
 	RS_Simulation *S, RS_LayerID layer, const RS_real *offset,
 	RS_real *power
 );
+// Fills the per-order flux of nlayers layers at once (all layers, in
+// order, if layers is NULL). offsets gives the z-offset within each
+// layer, or NULL for zero. powers is length 4*n_G*nlayers; entry
+// powers[4*(i*n_G+g)+k] holds, for the i-th layer and g-th order, the
+// real forward, real backward, imaginary forward and imaginary backward
+// flux for k = 0..3. Copies of a layer share one set of products, and
+// distinct layers are processed in parallel.
+int RS_Simulation_GetPowerFluxTable(
+	RS_Simulation *S, int nlayers, const RS_LayerID *layers,
+	const RS_real *offsets, RS_real *powers
+);
 // waves should be size 2*11*S->n_G
 // Each wave is length 11:
 //   { kx, ky, kzr, kzi, ux, uy, uz, cur, cui, cvr, cvi }
@@ -230,7 +390,41 @@ int RS_Simulation_GetFieldPlane(
 	RS_Simulation *S, const int nxy[2], const RS_real *xyz0,
 	RS_real *E, RS_real *H
 );
+// Evaluates the fields on nz planes at the given z-coordinates, each
+// sampled as in GetFieldPlane. E and H (either may be NULL) are length
+// 6*nxy[0]*nxy[1]*nz, one plane after another.
+int RS_Simulation_GetFieldVolume(
+	RS_Simulation *S, const int nxy[2], int nz, const RS_real *z,
+	RS_real *E, RS_real *H
+);
+// Same as GetFieldVolume, but the output is written through a memory
+// mapping of the given file: the E volume followed by the H volume.
+int RS_Simulation_GetFieldVolumeFile(
+	RS_Simulation *S, const int nxy[2], int nz, const RS_real *z,
+	const char *filename
+);
+// Evaluates the fields at npts arbitrary points; xyz is length 3*npts.
+// E and H (either may be NULL) are length 6*npts and hold the complex
+// x, y and z components of each point, as for GetFieldPlane. Points
+// sharing a layer and z-coordinate are evaluated together, with a
+// non-uniform FFT if options.field_point_tolerance is positive.
+int RS_Simulation_GetFieldPoints(
+	RS_Simulation *S, int npts, const RS_real *xyz,
+	RS_real *E, RS_real *H
+);
 
+// Returns the zz component of epsilon of the layer at z = xyz0[2] on a
+// nxy[0] x nxy[1] grid spanning one unit cell from xyz0, laid out as in
+// GetFieldPlane. RS_EPSILON_FOURIER gives the truncated Fourier series
+// used by the simulation (with any Lanczos smoothing), synthesized with
+// one FFT; RS_EPSILON_GEOMETRIC samples the layer pattern directly.
+#define RS_EPSILON_FOURIER   0
+#define RS_EPSILON_GEOMETRIC 1
+int RS_Simulation_GetEpsilonGrid(
+	RS_Simulation *S, const int nxy[2], const RS_real *xyz0, int which,
+	RS_real *eps
+); // eps is length 2*nxy[0]*nxy[1] of {real,imag}
+// Same as GetEpsilonGrid with RS_EPSILON_FOURIER.
 int RS_Simulation_GetEpsilon(
 	RS_Simulation *S, int nxy[2], const RS_real *xyz0, RS_real *eps
 ); // eps is {real,imag}
@@ -257,15 +451,324 @@ int RS_Simulation_GetLayerZIntegral(
 	RS_real *integral
 );
 
+// Returns the current capacity of the internal workspace arena and the
+// largest amount of workspace that has been in use at once, in bytes.
+int RS_Simulation_GetWorkspaceUsage(
+	const RS_Simulation *S, size_t *size, size_t *high_water
+);
+
+/*******************************/
+/* Convergence related functions */
+/*******************************/
+// Observables tracked by RS_Simulation_ConvergeNumG.
+#define RS_CONVERGE_POWER_FLUX  0 // real forward and backward flux of a layer
+#define RS_CONVERGE_ORDER_FLUX  1 // real forward and backward flux of one order
+#define RS_CONVERGE_FIELD       2 // complex E and H at a point
+typedef struct RS_ConvergenceObservable_{
+	int type;         // one of RS_CONVERGE_*
+	RS_LayerID layer; // layer of the flux observables
+	RS_real offset;   // z-offset within that layer
+	int order[2];     // G of the order, for RS_CONVERGE_ORDER_FLUX
+	RS_real xyz[3];   // point, for RS_CONVERGE_FIELD
+} RS_ConvergenceObservable;
+
+// One level of a convergence history. The two flux observables fill
+// value[0..1]; the field fills value[0..11] with E and H as for
+// GetFieldPlane. change is the largest difference of the values from
+// the previous level relative to their largest magnitude, and is
+// negative for the first level.
+typedef struct RS_ConvergenceStep_{
+	int n_G;
+	RS_real value[12];
+	RS_real change;
+} RS_ConvergenceStep;
+
+// Raises the number of G vectors from the current one by the factor
+// growth per level, following the same G selection as SetNumG, until
+// the observable changes by at most tol between levels, n_G reaches
+// nG_max, or max_steps levels are done. history (length max_steps)
+// receives each level and nsteps the number of levels. S is left at the
+// last level. Between levels the layer pattern containment trees and
+// the pattern Fourier coefficients are kept. If options.mode_continuation
+// is set, the modes of each patterned layer are also refined from those
+// of the previous level, padded with the new orders; this only pays off
+// for weakly patterned layers, and the others are solved in full. The
+// excitation must not depend on the G list other than
+// through order 0. Returns 0 once the levels are done, whether or not
+// the last change is within tol, a negative value for an invalid
+// argument, or the error of a failed solution.
+int RS_Simulation_ConvergeNumG(
+	RS_Simulation *S, const RS_ConvergenceObservable *obs,
+	int nG_max, RS_real growth, RS_real tol,
+	int max_steps, RS_ConvergenceStep *history, int *nsteps
+);
+
+/****************************/
+/* Adaptive sweep functions */
+/****************************/
+typedef struct RS_Sweep_ RS_Sweep;
+typedef struct RS_SweepInfo_{
+	int nsamples;   // number of solved frequencies
+	int nvalues;    // complex values per frequency, 4*n_G
+	int nsupport;   // support points of the rational interpolant
+	RS_real error;  // last relative error estimate
+} RS_SweepInfo;
+
+// Samples the mode amplitudes of an unpatterned layer (forward then
+// backward, as for GetAmplitudes at zero offset) over the real frequency
+// range freq[0] < freq[1], and fits one rational interpolant to all of
+// them with the AAA algorithm. Starting from ninit equally spaced
+// frequencies, each new sample is placed where the interpolants with and
+// without the previous sample differ most, until that difference
+// relative to the largest sample is at most tol or max_samples
+// frequencies have been solved. Resonances are thus resolved by the
+// poles of the interpolant rather than by dense sampling. Dispersive
+// materials are re-evaluated at each sample, while the pattern Fourier
+// coefficients of layers not using them are computed once. The frequency
+// of S is restored on return. Returns 0, a negative value for an invalid
+// argument (-2 if the layer is patterned, since its mode basis is not
+// continuous in frequency), or the error of a failed solution.
+int RS_Simulation_SweepAdaptive(
+	RS_Simulation *S, RS_LayerID layer, const RS_real *freq,
+	int ninit, int max_samples, RS_real tol, RS_Sweep **sweep
+);
+int RS_Sweep_GetInfo(const RS_Sweep *sweep, RS_SweepInfo *info);
+// Points freq and values at the solved samples, sorted by frequency;
+// sample i has the nvalues complex values starting at values[2*nvalues*i].
+// Returns the number of samples.
+int RS_Sweep_GetSamples(
+	const RS_Sweep *sweep, const RS_real **freq, const RS_real **values
+);
+// Evaluates the interpolant at nfreq frequencies, writing nvalues
+// complex values per frequency to values.
+int RS_Sweep_Evaluate(
+	const RS_Sweep *sweep, int nfreq, const RS_real *freq, RS_real *values
+);
+void RS_Sweep_Destroy(RS_Sweep *sweep);
+
+/******************************/
+/* Gradient related functions */
+/******************************/
+// Outputs differentiated by RS_Simulation_GetGradient.
+#define RS_GRADIENT_FORWARD_FLUX   0 // real forward flux of a layer, as for GetPowerFlux
+#define RS_GRADIENT_BACKWARD_FLUX  1 // real backward flux of a layer
+#define RS_GRADIENT_AMPLITUDE      2 // one complex mode amplitude, as for GetAmplitudes
+typedef struct RS_GradientOutput_{
+	int type;         // one of RS_GRADIENT_*_FLUX or RS_GRADIENT_AMPLITUDE
+	RS_LayerID layer; // the first or last layer
+	RS_real offset;   // z-offset within that layer
+	int index;        // amplitude in [0, 4*n_G): forward then backward
+} RS_GradientOutput;
+
+// Parameters with respect to which the output is differentiated.
+#define RS_GRADIENT_THICKNESS  0 // thickness of layer id
+#define RS_GRADIENT_EPSILON    1 // epsilon of material id; index 0 or 1 for real or imaginary part
+#define RS_GRADIENT_SHAPE      2 // region of layer id; index as below
+typedef struct RS_GradientParameter_{
+	int type;   // one of RS_GRADIENT_THICKNESS, EPSILON or SHAPE
+	int id;     // layer or material
+	int region; // region of the layer, in order of decreasing area
+	int index;  // component or shape parameter
+} RS_GradientParameter;
+
+// Returns the derivatives of one output with respect to nparams
+// parameters, from one adjoint solve of the structure with transposed
+// layer modes in addition to the existing solution. A flux output gives
+// nparams real values in grad; an amplitude output gives nparams complex
+// values (2*nparams reals). For a region, index is 0 and 1 for the x and
+// y coordinates of the center, 2 for angle_frac, 3 for the radius or
+// first halfwidth, 4 for the second halfwidth, and 3+2*i and 4+2*i for
+// the coordinates of vertex i of a polygon. The containment tree of the
+// regions is held fixed. Only the closed form Fourier coefficients of
+// scalar materials are differentiated, and only in the interior layers,
+// so thicknesses and regions of the first and last layers, materials
+// used there, tensor materials, and layers discretized or using the
+// polarization basis are not supported. Layers solved with partial modes
+// give approximate derivatives. Returns 0 on success, a negative value
+// for an invalid argument, 2 for an unsupported parameter, or the error
+// of a failed solution.
+int RS_Simulation_GetGradient(
+	RS_Simulation *S, const RS_GradientOutput *output,
+	int nparams, const RS_GradientParameter *param, RS_real *grad
+);
+
+/*************************************/
+/* Memory planning related functions */
+/*************************************/
+// Strategies for solving for the mode amplitudes of a planewave
+// excitation, from fastest to least memory.
+#define RS_SOLVE_STRATEGY_ALL          0 // all layers at once
+#define RS_SOLVE_STRATEGY_STREAMING    1 // two-pass, per-layer store in memory
+#define RS_SOLVE_STRATEGY_SCRATCH      2 // two-pass, per-layer store in a file
+#define RS_SOLVE_STRATEGY_LESS_MEMORY  3 // one layer at a time, kp not stored
+
+// Memory use broken down by purpose, in bytes. The Fourier transform
+// grids are carved from the workspace arena, so the total counts only
+// the larger of fft_grids and workspace.
+typedef struct RS_MemoryStats_{
+	size_t layer_modes;     // q, kp, phi, Epsilon2 and Epsilon_inv of all layers
+	size_t solution;        // mode amplitudes of all layers
+	size_t solve_workspace; // heap workspace of the amplitude solve
+	size_t fft_grids;       // real space grids of the Fourier matrix generation
+	size_t field_cache;     // cached polarization basis fields
+	size_t workspace;       // workspace arena
+	size_t total;
+} RS_MemoryStats;
+
+// Estimates the memory a full solution (modes of every layer and the
+// amplitudes of all layers) will need using the given strategy, or the
+// strategy selected by the current options if strategy is negative.
+// May be called before any solution is computed.
+int RS_Simulation_EstimateMemory(
+	const RS_Simulation *S, int strategy, RS_MemoryStats *stats
+);
+// Returns the memory currently held by the simulation. The workspace
+// entry is the largest amount of arena used so far, and solve_workspace
+// is that used by the amplitude solve of the current solution.
+int RS_Simulation_GetMemoryStats(
+	const RS_Simulation *S, RS_MemoryStats *stats
+);
+
+/***********************************/
+/* Sweep result store functions    */
+/***********************************/
+// A result store is a preallocated binary file holding one record per
+// point of a parameter sweep, stored column by column. Its header
+// describes the sweep axes, the layers and the G list. Records are
+// written straight from the solver into a shared memory mapping, so
+// several threads or processes may fill in different records of one
+// file at once. A record is marked complete only after all its columns
+// are written, so a file left by a crashed run holds valid data for
+// every complete record.
+typedef struct RS_Store_ RS_Store;
+
+// Kinds of columns. Widths are in reals per record.
+#define RS_STORE_FREQUENCY   0 // complex frequency; width 2
+#define RS_STORE_POWER_FLUX  1 // GetPowerFlux of each layer; width 4*nlayers
+#define RS_STORE_FLUX_TABLE  2 // GetPowerFluxTable of the layers; width 4*n_G*nlayers
+#define RS_STORE_WAVES       3 // GetWaves of each layer; width 2*11*n_G*nlayers
+
+typedef struct RS_StoreInfo_{
+	size_t nrecords; // product of the axis lengths
+	int naxes;
+	int nlayers;
+	int n_G;
+	int ncolumns;
+} RS_StoreInfo;
+
+// Creates (replacing any existing file) a store for a sweep over naxes
+// axes. Axis i has axis_len[i] values, stored consecutively in
+// axis_values; record r corresponds to the multi-index with the first
+// axis varying fastest. The layers, lattice and G list are taken from S.
+// Returns NULL on failure.
+RS_Store* RS_Store_Create(
+	const char *filename, const RS_Simulation *S,
+	int naxes, const char *const *axis_names, const int *axis_len,
+	const RS_real *axis_values,
+	int nlayers, const RS_LayerID *layers,
+	int ncolumns, const int *columns
+);
+// Opens an existing store for reading, or for writing records if
+// writable is nonzero. Returns NULL if the file is not a complete store.
+RS_Store* RS_Store_Open(const char *filename, int writable);
+// Flushes and unmaps the store.
+void RS_Store_Close(RS_Store *store);
+
+// Computes every column for the current state of S (which must have the
+// store's G list) directly into record r, then marks it complete. The
+// record's data is flushed to disk before its status, so a record that
+// reads as complete after a process or system crash holds all of its
+// data. Returns 2 if flushing fails.
+int RS_Store_WriteRecord(RS_Store *store, RS_Simulation *S, size_t r);
+// Forces the written records to disk.
+int RS_Store_Sync(RS_Store *store);
+
+int RS_Store_GetInfo(const RS_Store *store, RS_StoreInfo *info);
+int RS_Store_GetAxis(
+	const RS_Store *store, int i,
+	const char **name, int *length, const RS_real **values
+);
+int RS_Store_GetLayer(
+	const RS_Store *store, int i, RS_LayerID *id, const char **name
+);
+int RS_Store_GetBases(const RS_Store *store, const int **G);
+// Returns the kind and width of column i and a pointer into the mapping
+// at its data; record r starts at data[r*width].
+int RS_Store_GetColumn(
+	const RS_Store *store, int i,
+	int *kind, size_t *width, const RS_real **data
+);
+// Returns 1 if record r has been completely written, 0 if not, or a
+// negative value on error.
+int RS_Store_IsRecordComplete(const RS_Store *store, size_t r);
+
 /***************************************/
 /* Mode/band-solving related functions */
 /***************************************/
+// Computes the determinant of the upper left (forward) half S11 of the
+// S-matrix of the stack, which diverges at the modes. It is accumulated
+// from the factorizations made while the S-matrix is composed, without
+// a separate dense determinant. If k is not NULL, the in-plane Bloch
+// wavevector is first set to 2*pi*k at the current frequency, with k in
+// the units of the reciprocal lattice returned by RS_Lattice_Reciprocate;
+// this replaces the wavevector of any excitation.
 // Determinant is (rmant[0]+i*rmant[1])*base^expo
 int RS_Simulation_GetSMatrixDeterminant(
 	RS_Simulation *S, const RS_real *k,
 	RS_real *rmant, RS_real *base, int *expo
 );
 
+// Finds the resonances of the stack, the poles of its S-matrix in complex
+// frequency, inside the ellipse with the given complex center and
+// semi-axes along the real and imaginary frequency directions. The
+// S-matrix is sampled at nnodes equally spaced points of the ellipse,
+// in parallel, and probed with nprobe (at most 4*n_G) fixed random
+// vectors; contour moments are reduced to a small eigenproblem (Beyn's
+// method). Singular values of the zeroth moment below tol times the
+// largest norm of the probed samples are discarded.
+// The in-plane Bloch wavevector is that of the current frequency and
+// excitation of S, and is held fixed over the contour, whose real part
+// must stay positive. The first and last layers must be unpatterned.
+// The contour should stay clear of the Rayleigh anomalies of the
+// exterior layers, where the propagation constants branch. Tabulated
+// dispersion only follows the real part of the frequency, so materials
+// using it make the S-matrix non-analytic.
+// On return nres holds the number of resonances found, and freq (of
+// length 2*nprobe) their complex frequencies. If vectors is not NULL
+// (length 2*4*n_G*nprobe), it receives the normalized outgoing amplitudes
+// of each resonance, in the order of the rows of the S-matrix.
+// Returns 3 if every probe direction was needed; there may be more
+// resonances inside the contour than nprobe, and the results should
+// be recomputed with more probes or a smaller contour.
+int RS_Simulation_FindResonances(
+	RS_Simulation *S, const RS_real *center, const RS_real *semiaxes,
+	int nnodes, int nprobe, RS_real tol,
+	int *nres, RS_real *freq, RS_real *vectors
+);
+
+// Computes the band structure along a path of nk in-plane Bloch
+// wavevectors k (2*nk values, in the units of RS_Simulation_GetSMatrixDeterminant)
+// within the real frequency range freq_range[0] to freq_range[1]. The
+// bands at each k are the complex frequencies where the inverse of the
+// determinant of RS_Simulation_GetSMatrixDeterminant vanishes, found
+// by secant iteration to within tol times the width of the range.
+// The path is split into runs of scan_every points that are solved in
+// parallel. The first point of a run is scanned at nscan equally spaced
+// frequencies. At each following point, only a stretch around each band
+// extrapolated from the previous points is scanned, as wide as the step
+// in k (bands below the light line move no faster), so bands entering
+// the range between full scans are only found at the next one.
+// Degenerate bands are reported once.
+// On return nbands[j] holds the number of bands at k[2*j], and
+// freq[2*maxbands*j] onwards their complex frequencies in increasing
+// order of the real part. Returns 3 if some point had more than maxbands
+// bands; the lowest maxbands are kept.
+int RS_Simulation_SolveBands(
+	RS_Simulation *S, int nk, const RS_real *k,
+	const RS_real *freq_range, int nscan, int scan_every, RS_real tol,
+	int maxbands, int *nbands, RS_real *freq
+);
+
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -54,6 +54,9 @@ typedef struct{
 		// [ c d 0 ]
 		// [ 0 0 e ]
 	} eps;
+	int dispersion; // RS_MATERIAL_DISPERSION_*; eps then holds the value at the current frequency
+	int nterms;     // number of rows of the dispersion model
+	double *model;  // model parameters, followed by spline moments for tables
 } RS_Material;
 
 struct LayerModes;
@@ -64,12 +67,14 @@ typedef struct{
 	Pattern pattern;  // See pattern.h
 	RS_LayerID copy;       // See below.
 	struct LayerModes *modes;
+	struct LayerModes *prev_modes; // previous modes kept for options.mode_continuation
 } RS_Layer;
 // If a layer is a copy, then `copy' is the name of the layer that should
 // be copied, and `material' and `pattern' are inherited, and so they can
 // be arbitrary. For non-copy layers, copy should be NULL.
 
 struct FieldCache;
+struct FourierCache;
 
 typedef struct Excitation_Planewave_{
 	double hx[2],hy[2]; // re,im components of H_x,H_y field
@@ -125,6 +130,10 @@ struct RS_Simulation_{
 	RS_Options options;
 
 	struct FieldCache *field_cache; // Internal cache of vector field FT when using polarization bases
+	struct FourierCache *ft_cache; // Pattern Fourier coefficients kept while the G list grows (see fmm.h)
+	struct numalloc_arena_ *workspace; // Reusable workspace for temporaries (see numalloc.h)
+	void *restart_map; // Mapping of a file loaded by RS_Simulation_Load, holding layer modes
+	size_t restart_map_size;
 	
 	RS_message_handler msg;
 	void *msgdata;
@@ -154,6 +163,9 @@ void Simulation_Clone(const RS_Simulation *S, RS_Simulation *T);
 void Simulation_DestroySolution(RS_Simulation *S);
 void Simulation_DestroyLayerSolutions(RS_Simulation *S);
 void Simulation_DestroyLayerModes(RS_Layer *layer);
+// Destroys the modes of all layers, keeping those of patterned layers
+// in prev_modes if options.mode_continuation is set.
+void Simulation_RetireLayerModes(RS_Simulation *S);
 void RS_Simulation_DestroyLayerModes(RS_Simulation *S, RS_LayerID id);
 
 // Destroys the solution belonging to a given simulation and sets
@@ -212,6 +224,12 @@ int Simulation_MakeExcitationPlanewave(RS_Simulation *S, const double angle[2],
 int Simulation_MakeExcitationDipole(RS_Simulation *S, const double k[2], const char *layer, const double pos[2], const double moment[6]);
 
 
+// Workspace arena for temporaries needed during a call. Blocks should
+// be freed in the reverse order of allocation for the memory to be
+// reused immediately. Simulation_InitSolution sizes the arena.
+void* Simulation_WorkspaceAlloc(const RS_Simulation *S, size_t size);
+void Simulation_WorkspaceFree(const RS_Simulation *S, void *ptr);
+
 // Internal functions
 #ifdef __cplusplus
 // Field cache manipulation
@@ -271,6 +289,14 @@ int Simulation_GetWaves(RS_Simulation *S, RS_Layer *layer, double *wave);
 // Tint is a vector of time averaged stress tensor integral
 int Simulation_GetStressTensorIntegral(RS_Simulation *S, RS_Layer *layer, double offset, double Tint[6]);
 
+// Computes the modes of layers from through to (-1 for the last layer)
+// and fills M (4*S->n_G square) with the S-matrix of that part of the stack.
+// If logdet is not NULL, it receives the log of the determinant of the
+// upper left block of M, from the factorizations done while composing
+// (see GetSMatrix in rcwa.h).
+// Returns a solution error code
+int Simulation_GetSMatrix(RS_Simulation *S, int layer_from, int layer_to, std::complex<double> *M, std::complex<double> *logdet = NULL);
+
 // Returns a solution error code
 // which can be 'U', 'E', 'H', 'e'
 // 'E' is epsilon*|E|^2, 'H' is |H|^2, 'e' is |E|^2, 'U' is 'E'+'H'
@@ -300,10 +326,6 @@ int Simulation_GetEFieldPlane(RS_Simulation *S, int nxy[2], double z, double *E,
 // Returns a solution error code
 int Simulation_GetEpsilon(RS_Simulation *S, const double r[3], double eps[2]); // eps is {real,imag}
 
-// Returns a solution error code
-// Determinant is (rmant[0]+i*rmant[1])*base^expo
-int Simulation_GetSMatrixDeterminant(RS_Simulation *S, double rmant[2], double *base, int *expo);
-
 
 #ifdef __cplusplus
 }
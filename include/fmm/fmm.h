@@ -16,6 +16,17 @@ int FMMGetEpsilon_PolBasisNV(const RS_Simulation *S, const RS_Layer *L, const in
 int FMMGetEpsilon_PolBasisVL(const RS_Simulation *S, const RS_Layer *L, const int n, std::complex<double> *Epsilon2, std::complex<double> *Epsilon_inv);
 int FMMGetEpsilon_PolBasisJones(const RS_Simulation *S, const RS_Layer *L, const int n, std::complex<double> *Epsilon2, std::complex<double> *Epsilon_inv);
 
+// Pattern Fourier coefficients of each layer at the differences of G
+// vectors, kept across calls while S->ft_cache is set, so that growing
+// the G list only evaluates the new differences. It is used by
+// FMMGetEpsilon_ClosedForm for layers of scalar materials, and is only
+// valid while the lattice, patterns and materials are unchanged.
+// FourierCache_Invalidate discards the coefficients of one layer.
+struct FourierCache;
+struct FourierCache* FourierCache_New(int nlayers);
+void FourierCache_Destroy(struct FourierCache *cache);
+void FourierCache_Invalidate(struct FourierCache *cache, int layer);
+
 double GetLanczosSmoothingOrder(const RS_Simulation *S);
 double GetLanczosSmoothingFactor(double order, int power, double f[2]);
 
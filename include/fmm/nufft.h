@@ -0,0 +1,34 @@
+#ifndef _NUFFT_H_
+#define _NUFFT_H_
+
+#include <complex>
+#include <cstddef>
+
+// Type-2 (uniform to non-uniform) 2D NUFFT over the unit cell:
+//   f[j] = sum_k c[k] exp(2 pi i (k[2*k+0]*uv[2*j+0] + k[2*k+1]*uv[2*j+1]))
+// The coefficients are deconvolved and placed on an oversampled grid,
+// transformed with a single FFT, and interpolated to each point with an
+// exponential of semicircle kernel. The cost is O(m log m + npts*w^2) per
+// transform for a grid of m points and a kernel width w set by the
+// requested tolerance, instead of O(npts*nk) for direct summation.
+// When all k[2*k+1] are zero, the second dimension is skipped.
+
+typedef struct tag_nufft_plan *nufft_plan;
+
+// Creates a plan for ntrans simultaneous transforms of the nk
+// coefficients of orders k (length 2*nk) to relative accuracy tol.
+// Returns NULL on allocation failure.
+nufft_plan nufft2_plan_create(size_t nk, const int *k, size_t ntrans, double tol);
+
+// c is nk-by-ntrans (column major) and f is npts-by-ntrans. The points
+// uv are in lattice coordinates; they need not lie in [0,1).
+void nufft2_exec(
+	nufft_plan plan,
+	const std::complex<double> *c,
+	size_t npts, const double *uv,
+	std::complex<double> *f
+);
+
+void nufft2_plan_destroy(nufft_plan plan);
+
+#endif // _NUFFT_H_
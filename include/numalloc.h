@@ -9,6 +9,31 @@ void *malloc_aligned(size_t size, size_t alignment);
 void *realloc_aligned(void *ptr, size_t size, size_t alignment);
 void free_aligned(void *ptr);
 
+/* A stack-like workspace arena. Blocks are carved from a single aligned
+ * allocation and are reclaimed when the most recently allocated block
+ * is freed (blocks freed out of order are reclaimed once everything
+ * above them has been freed). Requests that do not fit are satisfied
+ * by malloc_aligned instead, and are counted in the high water mark so
+ * that the arena can be enlarged by numalloc_arena_reserve later.
+ */
+typedef struct numalloc_arena_{
+	char *base;
+	size_t size;       /* capacity of base in bytes */
+	size_t used;       /* bytes in use at the bottom of base */
+	size_t top;        /* offset of the header of the topmost block */
+	size_t overflow;   /* bytes currently allocated outside of base */
+	size_t high_water; /* maximum of used+overflow */
+	size_t alignment;
+} numalloc_arena;
+
+void numalloc_arena_init(numalloc_arena *arena, size_t alignment);
+/* Enlarges the arena to at least size bytes. This only has an effect if
+ * no blocks are currently allocated. Returns nonzero on failure. */
+int numalloc_arena_reserve(numalloc_arena *arena, size_t size);
+void *numalloc_arena_alloc(numalloc_arena *arena, size_t size);
+void numalloc_arena_free(numalloc_arena *arena, void *ptr);
+void numalloc_arena_destroy(numalloc_arena *arena);
+
 #ifdef __cplusplus
 }
 #endif
@@ -197,6 +197,57 @@ int Pattern_GetFourierTransform(
 	double FT[2]
 );
 
+/* Returns the derivative of the Fourier transform of the pattern (see
+ * pattern_get_fourier_transform) with respect to one parameter of one
+ * shape, the other shapes and the containment tree being held fixed.
+ *
+ * Arguments:
+ *    nshapes      IN   Number of shapes; length of `shapes'.
+ *    shapes       IN   Array of `shape' structures in order of decreasing
+ *                      area. (as output from pattern_get_containment_tree).
+ *    parent       IN   Immediate containing shape relationship for each
+ *                      shape. (as output from pattern_get_containment_tree).
+ *    value        IN   Interior values, as for pattern_get_fourier_transform.
+ *    ishape       IN   Index into `shapes' of the shape that is varied.
+ *    param        IN   The parameter of shapes[ishape] that is varied:
+ *                        0, 1: x and y coordinates of the center
+ *                        2: angle
+ *                        3: radius of a circle, or x halfwidth of an
+ *                           ellipse or rectangle
+ *                        4: y halfwidth of an ellipse or rectangle
+ *                        3+2*i, 4+2*i: x and y coordinates of vertex i of
+ *                           a polygon
+ *    f            IN   Point in reciprocal space, divided by 2*pi.
+ *  unit_cell_size IN Area of the unit cell in real space.
+ *    dFT          OUT  Real and imaginary part of the derivative.
+ * Return values:
+ *    0: If successful.
+ *   -n: If n-th argument is invalid.
+ */
+int pattern_get_fourier_transform_derivative(
+	int nshapes,
+	const shape *shapes,
+	const int *parent,
+	const double *value,
+	int ishape,
+	int param,
+	const double f[2],
+	int ndim,
+	double unit_cell_size,
+	double dFT[2]
+);
+/* Convenience version of the above. */
+int Pattern_GetFourierTransformDerivative(
+	const Pattern *p,
+	const double *value,
+	int ishape,
+	int param,
+	const double f[2],
+	int ndim,
+	double unit_cell_size,
+	double dFT[2]
+);
+
 /* Returns an area weighting of each shape within one cell of a uniform
  * discretization of the origin-centered unit square.
  *  The area-fraction of each shape within the rectangle
@@ -3,6 +3,7 @@
 
 #include <cstddef> // for size_t
 #include <complex>
+#include "fmm/nufft.h"
 
 // Possible values for epstype:
 #define EPSILON2_TYPE_FULL            0
@@ -37,6 +38,17 @@
 //   [  hx ]   [   B     B  ] [ b ]   B = phi
 //   [  hy ]   [            ] [   ]
 // a and b are the mode amplitudes at a particular z-location.
+// When omega is real and the eigenoperator is real to rounding error,
+// which is the case for lossless layers whose pattern is symmetric
+// under inversion about the origin, the eigensystem is solved in real
+// arithmetic and the complex conjugate pairs of modes are expanded
+// afterwards. When all ky are equal and Epsilon2 has no off-diagonal
+// blocks, as for a 1D grating, the eigensystem is solved as two n x n
+// problems. If ky is zero (planar diffraction) the hx and hy (TE and
+// TM) modes decouple; the hx modes are then the first n and phi is
+// block diagonal. Otherwise (conical diffraction) the two problems are
+// those of the planar case with q^2 shifted by -ky^2, and the first n
+// columns of phi gain an hy part.
 //
 // Arguments
 // =========
@@ -107,6 +119,161 @@ void SolveLayerEigensystem(
 	size_t lwork = 0 // set to -1 for query into work[0], at least 4*n*n+2*n
 );
 
+// Purpose
+// =======
+// Same as SolveLayerEigensystem, but computes only the nmodes least
+// evanescent eigenmodes (smallest |Im q|) with a shift-invert Arnoldi
+// iteration. The shift is placed just beyond the largest q^2 allowed by
+// the bound on epsilon given by the row sums of Epsilon2, and the
+// shifted operator is factored densely, which is much cheaper than a
+// dense eigensolve. The matching left eigenvectors are computed with the
+// same factorization, and the remaining 2n-nmodes columns of phi are set
+// to an orthonormal basis of their orthogonal complement, which spans
+// the modes that were not computed. Their q values are the square roots
+// of the Rayleigh quotients of the eigenoperator. These approximate
+// modes are strongly evanescent, so they contribute little across a
+// thick layer, but they still enter the matching at its interfaces;
+// see residual and q_cutoff.
+//
+// Arguments
+// =========
+// nmodes      - (IN/OUT) Number of modes to compute. 2*nmodes+18 must
+//               not exceed 2n. On exit, the number of modes computed,
+//               which is smaller if the requested count would split a
+//               set of degenerate modes.
+// residual    - (OUTPUT) The largest eigenpair residual of the computed
+//               modes, relative to the magnitude of q^2 or the shift.
+// q_cutoff    - (OUTPUT) The propagation constant of the least
+//               evanescent mode that was not computed. The modes that
+//               were not computed decay at least as fast as
+//               exp(-Im(q_cutoff) z).
+// work        - (IN/OUT) Workspace. If NULL or lwork is too small, then
+//               the space is internally allocated. If lwork == -1, then
+//               the desired workspace is returned in work[0].real().
+// lwork       - (INPUT) The length of the work array, at least
+//               8*n*n + 4*n.
+// See the documentation for SolveLayerEigensystem for the remaining
+// arguments.
+//
+// Returns 0 on success, -8 if nmodes is out of range, and a positive
+// value if the shifted operator is singular or the iteration did not
+// converge. On failure, q, kp and phi are not valid.
+int SolveLayerEigensystemPartial(
+	std::complex<double> omega,
+	size_t n,
+	const double *kx,
+	const double *ky,
+	const std::complex<double> *Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	const std::complex<double> *Epsilon2, // size (2*glist.n)^2 (dielectric/normal-field matrix)
+	int epstype,
+	size_t *nmodes,
+	std::complex<double> *q, // length 2*glist.n
+	std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix) (optional)
+	std::complex<double> *phi, // size (2*glist.n)^2
+	double *residual,
+	std::complex<double> *q_cutoff,
+	std::complex<double> *work = NULL, // length lwork
+	size_t lwork = 0
+);
+
+// Purpose
+// =======
+// Same as SolveLayerEigensystem, but refines a previously computed
+// eigenvector basis phi0 of a nearby problem (for example, the same
+// layer at the previous frequency of a sweep) instead of solving from
+// scratch. Each Newton step forms inv(phi) op phi and applies the first
+// order correction to phi that removes its off-diagonal part. Modes with
+// degenerate eigenvalues are allowed to mix among themselves.
+//
+// Arguments
+// =========
+// phi0        - (INPUT) The starting eigenvector basis, size (2n)^2.
+// residual    - (OUTPUT) The largest off-diagonal column norm of
+//               inv(phi) op phi relative to the largest eigenvalue.
+// work        - (IN/OUT) Workspace. If NULL or lwork is too small, then
+//               the space is internally allocated. If lwork == -1, then
+//               the desired workspace is returned in work[0].real().
+// lwork       - (INPUT) The length of the work array, at least
+//               12*n*n + 2*n.
+// See the documentation for SolveLayerEigensystem for the remaining
+// arguments.
+//
+// Returns 0 on success, -8 if phi0 is NULL, and a positive value if the
+// iteration did not converge (1), the basis became singular (2), or a
+// correction was too large to keep the pairing of old and new modes
+// (3). On failure, q, kp and phi are not valid.
+int RefineLayerEigensystem(
+	std::complex<double> omega,
+	size_t n,
+	const double *kx,
+	const double *ky,
+	const std::complex<double> *Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	const std::complex<double> *Epsilon2, // size (2*glist.n)^2 (dielectric/normal-field matrix)
+	int epstype,
+	const std::complex<double> *phi0, // size (2*glist.n)^2
+	std::complex<double> *q, // length 2*glist.n
+	std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix) (optional)
+	std::complex<double> *phi, // size (2*glist.n)^2
+	double *residual,
+	std::complex<double> *work = NULL, // length lwork
+	size_t lwork = 0
+);
+
+// Symmetries of a layer pattern about the origin, for
+// SolveLayerEigensystemSymmetric.
+#define LAYER_SYMMETRY_MIRROR_X 1 // x -> -x
+#define LAYER_SYMMETRY_MIRROR_Y 2 // y -> -y
+#define LAYER_SYMMETRY_ROTATE   4 // (x,y) -> (-x,-y)
+
+// Purpose
+// =======
+// Same as SolveLayerEigensystem, but first finds the symmetries of the
+// layer among the mirrors x -> -x and y -> -y and the two-fold rotation
+// about the origin. These require both the pattern and the set of k
+// vectors to be symmetric. Of the symmetries the pattern is known to
+// have, those that also map the k vectors onto themselves are confirmed
+// by checking that the layer eigenoperator commutes with them; if there
+// are none, the operator is not built. The operator is then block
+// diagonal in the basis of even and odd combinations of symmetry
+// related G vectors, and each block is solved separately. This takes
+// about a quarter of the time of the full solve with one symmetry, and
+// a sixteenth with two. The eigenvectors are returned in the full
+// basis, so q, kp and phi are used exactly as for SolveLayerEigensystem.
+//
+// Arguments
+// =========
+// symmetries  - (INPUT) The symmetries of the pattern of the layer, as a
+//               combination of the LAYER_SYMMETRY_* flags.
+// nblocks     - (OUTPUT) The number of symmetry blocks; 1 if the layer
+//               has no symmetry, 2 or 4 otherwise.
+// work        - (IN/OUT) Workspace. If NULL or lwork is too small, then
+//               the space is internally allocated. If lwork == -1, then
+//               the desired workspace is returned in work[0].real().
+// lwork       - (INPUT) The length of the work array, at least
+//               12*n*n + 12*n plus the workspace of the dense solve.
+// See the documentation for SolveLayerEigensystem for the remaining
+// arguments.
+//
+// Returns 0 on success, 1 if the layer has no symmetry, and another
+// positive value if the eigensolve of a block failed. On failure, q, kp
+// and phi are not valid.
+int SolveLayerEigensystemSymmetric(
+	std::complex<double> omega,
+	size_t n,
+	const double *kx,
+	const double *ky,
+	const std::complex<double> *Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	const std::complex<double> *Epsilon2, // size (2*glist.n)^2 (dielectric/normal-field matrix)
+	int epstype,
+	std::complex<double> *q, // length 2*glist.n
+	std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix) (optional)
+	std::complex<double> *phi, // size (2*glist.n)^2
+	int symmetries,
+	size_t *nblocks,
+	std::complex<double> *work = NULL, // length lwork
+	size_t lwork = 0
+);
+
 // Purpose
 // =======
 // Same as SolveLayerEigensystem, but assumes Epsilon is eps*I.
@@ -197,7 +364,16 @@ void InitSMatrix(
 
 // Purpose
 // =======
-// Computes the S-Matrix for a layer stack.
+// Computes the S-Matrix for a layer stack. When all ky are zero and
+// the phi and kp matrices of every layer are block diagonal in hx and
+// hy, as produced by SolveLayerEigensystem for planar diffraction by a
+// 1D grating, the S-matrices of the two polarizations are computed
+// separately at half the size. Otherwise, if symmetries are given and
+// the modes of every layer lie in the symmetry sectors of the stack, as
+// those of SolveLayerEigensystemSymmetric do, the S-matrix of each
+// sector is computed separately (see SolveLayerEigensystemSymmetric).
+// Uniform layers (phi = NULL) take the sector basis as their modes.
+// Stacks that do not decompose are composed in the full basis.
 //
 // Arguments
 // =========
@@ -226,6 +402,13 @@ void InitSMatrix(
 // lwork     - (INPUT) The length of the work array. If -1, then a
 //             workspace query is performed and the optimal lwork is
 //             returned in work[0].real().
+// logdet    - (OUTPUT) If not NULL, set to the log of the determinant
+//             of the upper left 2n x 2n block S11 of S, accumulated
+//             from the LU factors formed while the stack is composed.
+//             Its exponential diverges at the poles of S, the modes of
+//             the stack. The imaginary part is only defined modulo 2pi.
+// symmetries - (INPUT) The symmetries shared by the patterns of all
+//             layers, as a combination of the LAYER_SYMMETRY_* flags.
 void GetSMatrix( // appends the layers to an existing S matrix
 	size_t nlayers,
 	size_t n, // glist.n
@@ -240,7 +423,9 @@ void GetSMatrix( // appends the layers to an existing S matrix
 	std::complex<double> *S, // size (4*n)^2
 	std::complex<double> *work = NULL, // length lwork
 	size_t *iwork = NULL, // length n2
-	size_t lwork = 0 // set to -1 for query into work[0], at least 4*n*(4*n+1)
+	size_t lwork = 0, // set to -1 for query into work[0], at least 4*n*(4*n+1)
+	std::complex<double> *logdet = NULL,
+	int symmetries = 0
 );
 
 
@@ -261,6 +446,61 @@ int SolveAll(
 	size_t lwork = 0 // set to -1 for query into iwork[0], at least 6*n2^2*nlayers
 );
 
+// Purpose
+// =======
+// Computes the same solution as SolveAll, but in two passes over the
+// layer stack. A forward pass accumulates the S-matrix of the stack one
+// layer at a time and keeps only the 2n x 2n block S12(0,l) and the
+// vector S11(0,l)*a0 for each layer. A backward pass then recovers the
+// amplitudes in each layer starting from the last. The per-layer data
+// is 1/6th the size of that of SolveAll, and the remaining workspace is
+// independent of the number of layers.
+//
+// Arguments
+// =========
+// nlayers     - (INPUT) Number of layers in the stack.
+// n           - (INPUT) Number of Fourier orders.
+// kx, ky      - (INPUT) Arrays of length n. The x- and y-components
+//               of the Fourier k-vectors of the dielectric expansion.
+// thickness   - (INPUT) List of thicknesses. (See GetSMatrix).
+// q, kp, phi  - (INPUT) List of layer properties. (See GetSMatrix).
+// Epsilon_inv - (INPUT) size n^2 matrix, inverse of dielectric Fourier
+//             coupling matrix.
+// epstype     - (INPUT) Type code of the Epsilon2 matrix (see above).
+// ab          - (IN/OUT) Length 4n*nlayers. On entry, the forward
+//               amplitudes of the first layer and the backward
+//               amplitudes of the last layer (as for SolveAll). On exit,
+//               the mode amplitudes of all layers.
+// store       - (WORK) Per-layer storage of length (4n^2+2n)*nlayers.
+//               This may be memory mapped from a file since it is only
+//               accessed once in each pass. If NULL, the space is
+//               internally allocated.
+// work        - (IN/OUT) Workspace. If NULL or lwork == 0, then the
+//               space is internally allocated. If lwork == -1, then
+//               the desired workspace is returned in work[0].real().
+// iwork       - (WORK) Integer workspace, of length 4n. If NULL, the the
+//               space is internally allocated.
+// lwork       - (INPUT) The length of the work array. If -1, then a
+//               workspace query is performed and the optimal lwork is
+//               returned in work[0].real().
+int SolveAllStreaming(
+	size_t nlayers,
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const double *thickness, // list of thicknesses
+	const std::complex<double> **q, // list of q vectors
+	const std::complex<double> **Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	int *epstype,
+	const std::complex<double> **kp,
+	const std::complex<double> **phi,
+	std::complex<double> *ab, // length 4*n*nlayers
+	std::complex<double> *store = NULL, // length (n2^2+n2)*nlayers
+	std::complex<double> *work_ = NULL, // length lwork
+	size_t *iwork = NULL, // length n4
+	size_t lwork = 0 // set to -1 for query into work[0], at least 2*n4^2 + n4*(n4+1)
+);
+
 // Purpose
 // =======
 // Given input amplitudes to a layer stack, computes the mode
@@ -302,6 +542,8 @@ int SolveAll(
 // lwork       - (INPUT) The length of the work array. If -1, then a
 //               workspace query is performed and the optimal lwork is
 //               returned in work[0].real().
+// symmetries  - (INPUT) The symmetries shared by all layers (See
+//               GetSMatrix).
 int SolveInterior(
 	size_t nlayers,
 	size_t which_layer,
@@ -319,7 +561,65 @@ int SolveInterior(
 	std::complex<double> *ab, // length 4*n
 	std::complex<double> *work_ = NULL, // length lwork
 	size_t *iwork = NULL, // length n2
-	size_t lwork = 0 // set to -1 for query into work[0], at least 2*(4*n)^2 + 2*(2*n) + 4*n*(4*n+1)
+	size_t lwork = 0, // set to -1 for query into work[0], at least 2*(4*n)^2 + 2*(2*n) + 4*n*(4*n+1)
+	int symmetries = 0
+);
+
+// Purpose
+// =======
+// Computes the mode amplitudes in only the first and last layers of
+// a layer stack. The S-matrix of the entire stack is composed once
+// and applied to the input amplitudes, so the workspace required is
+// independent of the number of layers. The phase conventions of the
+// outputs are the same as for SolveInterior.
+//
+// Arguments
+// =========
+// nlayers     - (INPUT) Number of layers in the stack.
+// n           - (INPUT) Number of Fourier orders.
+// kx, ky      - (INPUT) Arrays of length n. The x- and y-components
+//               of the Fourier k-vectors of the dielectric expansion.
+// thickness   - (INPUT) List of thicknesses. (See GetSMatrix).
+// q, kp, phi  - (INPUT) List of layer properties. (See GetSMatrix).
+// Epsilon_inv - (INPUT) size n^2 matrix, inverse of dielectric Fourier
+//             coupling matrix.
+// epstype     - (INPUT) Type code of the Epsilon2 matrix (see above).
+// a0, bN      - (INPUT) Input mode amplitudes, each of length 2n.
+//               (See SolveInterior). If either is NULL, it is assumed
+//               to be a zero vector.
+// ab0, abN    - (OUTPUT) Output mode amplitudes of the first and last
+//               layers, each of length 4n, in the same format as the
+//               ab output of SolveInterior. Either may be NULL if it
+//               is not needed.
+// work        - (IN/OUT) Workspace. If NULL or lwork == 0, then the
+//               space is internally allocated. If lwork == -1, then
+//               the desired workspace is returned in work[0].real().
+// iwork       - (WORK) Integer workspace, of length 4n. If NULL, the the
+//               space is internally allocated.
+// lwork       - (INPUT) The length of the work array. If -1, then a
+//               workspace query is performed and the optimal lwork is
+//               returned in work[0].real().
+// symmetries  - (INPUT) The symmetries shared by all layers (See
+//               GetSMatrix).
+int SolveBoundary(
+	size_t nlayers,
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const double *thickness, // list of thicknesses
+	const std::complex<double> **q, // list of q vectors
+	const std::complex<double> **Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	int *epstype,
+	const std::complex<double> **kp,
+	const std::complex<double> **phi,
+	const std::complex<double> *a0, // length 2*n
+	const std::complex<double> *bN, // length 2*n
+	std::complex<double> *ab0, // length 4*n
+	std::complex<double> *abN, // length 4*n
+	std::complex<double> *work_ = NULL, // length lwork
+	size_t *iwork = NULL, // length n4
+	size_t lwork = 0, // set to -1 for query into work[0], at least (4*n)^2 + 4*n*(4*n+1)
+	int symmetries = 0
 );
 
 //////////////////////// Solution manipulators ////////////////////////
@@ -423,6 +723,172 @@ void GetZPoyntingFluxComponents(
 	std::complex<double> *work = NULL // length 4*n2 or NULL
 );
 
+// Purpose
+// =======
+// Same as GetZPoyntingFluxComponents, for nab sets of mode amplitudes
+// in the same layer (e.g. several offsets, or several copies of one
+// layer). The products with phi and the k-parallel matrix are done
+// once for all of them.
+//
+// Arguments
+// =========
+// n, kx, ky,  - (INPUT) Same as for GetZPoyntingFluxComponents.
+// omega, q,
+// Epsilon_inv,
+// epstype,
+// kp, phi
+// nab         - (INPUT) The number of sets of amplitudes.
+// ab          - (INPUT) Size 4n x nab. Each column holds the amplitudes
+//               for one set, as for GetZPoyntingFluxComponents.
+// forward,    - (OUTPUT) Size n x nab. The flux for each G-vector, one
+// backward      column per set of amplitudes.
+// work        - (WORK) Length 4*2n*nab. If NULL, then the space is
+//               internally allocated.
+void GetZPoyntingFluxComponentsBatch(
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> *q, // length 2*glist.n
+	const std::complex<double> *Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	int epstype,
+	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
+	const std::complex<double> *phi, // size (2*glist.n)^2
+	size_t nab,
+	const std::complex<double> *ab, // size 4*glist.n x nab
+	std::complex<double> *forward, // size glist.n x nab
+	std::complex<double> *backward, // size glist.n x nab
+	std::complex<double> *work = NULL // length 4*n2*nab or NULL
+);
+
+// Purpose
+// =======
+// Returns the gradients of the forward and backward z-Poynting flux
+// computed by GetZPoyntingFlux with respect to the mode amplitudes.
+// Each flux is a real quadratic form Re(w^H X w) of w = ab, and the
+// returned vector g is such that its change is Re(g^T dw). g is the
+// right hand side of the adjoint problem for a flux objective (see
+// GetLayerAdjointSensitivity).
+//
+// Arguments
+// =========
+// n, kx, ky,  - (INPUT) Same as for GetZPoyntingFlux.
+// omega, q,
+// Epsilon_inv,
+// epstype,
+// kp, phi, ab
+// gforward,   - (OUTPUT) Length 4n. The gradients of the forward and
+// gbackward     backward flux. Either may be NULL.
+// work        - (WORK) Length 2*(2n)^2 + 4*2n. If NULL, then the space
+//               is internally allocated.
+void GetZPoyntingFluxGradient(
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> *q, // length 2*glist.n
+	const std::complex<double> *Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	int epstype,
+	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
+	const std::complex<double> *phi, // size (2*glist.n)^2
+	const std::complex<double> *ab, // length 4*glist.n
+	std::complex<double> *gforward, // length 4*glist.n
+	std::complex<double> *gbackward, // length 4*glist.n
+	std::complex<double> *work = NULL // length 2*n2*n2+4*n2 or NULL
+);
+
+// Purpose
+// =======
+// Returns the modes of the adjoint (transposed) layer. The adjoint
+// layer has the same q, with modes phi^-T and an explicit k-parallel
+// matrix omega^2 kp^-T phi^-T q^2 phi^T. Passing the adjoint modes of
+// every layer to SolveAll or SolveAllStreaming, with the excitation
+// set by the derivative of the output with respect to the mode
+// amplitudes, solves the adjoint problem used by
+// GetLayerAdjointSensitivity. Layers sharing phi should share phi_adj
+// so that trivial interfaces are still detected.
+//
+// Arguments
+// =========
+// n, kx, ky,  - (INPUT) Same as for GetZPoyntingFlux.
+// omega, q,
+// Epsilon_inv,
+// epstype,
+// kp, phi
+// kp_adj      - (OUTPUT) Size (2n)^2. The adjoint k-parallel matrix.
+// phi_adj     - (OUTPUT) Size (2n)^2. The adjoint modes. Not referenced
+//               if phi is NULL, in which case the adjoint modes are
+//               also the identity (NULL).
+// work        - (WORK) Length 2*(2n)^2. If NULL, then the space is
+//               internally allocated.
+//
+// Returns 0 on success, or a positive value if phi or kp is singular.
+int GetAdjointLayerModes(
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> *q, // length 2*glist.n
+	const std::complex<double> *Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	int epstype,
+	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
+	const std::complex<double> *phi, // size (2*glist.n)^2
+	std::complex<double> *kp_adj, // size (2*glist.n)^2
+	std::complex<double> *phi_adj, // size (2*glist.n)^2
+	std::complex<double> *work = NULL // length 2*n2*n2 or NULL
+);
+
+// Purpose
+// =======
+// Accumulates the sensitivity of a linear output L = h^T w of the mode
+// amplitudes in an observation layer to the thickness and the Fourier
+// coupling matrices of one layer, given the forward and adjoint mode
+// amplitudes within that layer. The adjoint problem is solved with the
+// modes of GetAdjointLayerModes, with the excitation
+//   a_adj(first layer) = exp(-i q z) h_b, b_adj(last layer) = 0
+// for an observation point at offset z in the first layer, or
+//   b_adj(last layer) = -exp(i q (z-d)) h_a, a_adj(first layer) = 0
+// for an observation point in the last layer, where h = [h_a; h_b].
+// Then the change of L is
+//   dthickness dd + tr(dEpsilon2 Ceps) + tr(dEpsilon_inv Cinv).
+//
+// Arguments
+// =========
+// n, kx, ky,  - (INPUT) Same as for GetZPoyntingFlux.
+// omega,
+// thickness   - (INPUT) Thickness of the layer.
+// q,
+// Epsilon_inv,
+// epstype,
+// kp, phi
+// ab          - (INPUT) Length 4n. The forward mode amplitudes at the
+//               start of the layer, as returned by SolveAll.
+// ab_adj      - (INPUT) Length 4n. The adjoint mode amplitudes.
+// dthickness  - (OUTPUT) The sensitivity to the layer thickness. May be
+//               NULL.
+// Ceps        - (IN/OUT) Size (2n)^2. The sensitivity to Epsilon2 is
+//               added to it. May be NULL.
+// Cinv        - (IN/OUT) Size n^2. The sensitivity to Epsilon_inv is
+//               added to it. May be NULL.
+// work        - (WORK) Length 5*(2n)^2. If NULL, then the space is
+//               internally allocated.
+//
+// Returns 0 on success, or a positive value if phi or kp is singular.
+int GetLayerAdjointSensitivity(
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	double thickness,
+	const std::complex<double> *q, // length 2*glist.n
+	const std::complex<double> *Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	int epstype,
+	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
+	const std::complex<double> *phi, // size (2*glist.n)^2
+	const std::complex<double> *ab, // length 4*glist.n
+	const std::complex<double> *ab_adj, // length 4*glist.n
+	std::complex<double> *dthickness,
+	std::complex<double> *Ceps, // size (2*glist.n)^2
+	std::complex<double> *Cinv, // size (glist.n)^2
+	std::complex<double> *work = NULL // length 5*n2*n2 or NULL
+);
+
 // Purpose
 // =======
 // Returns the electric and/or magnetic field at a particular point
@@ -477,6 +943,85 @@ void GetEFieldAtPoint(
 	std::complex<double> *work, // 8*n2
 	int solvetype
 );
+// Purpose
+// =======
+// Returns the electric and/or magnetic field at a set of points in the
+// same plane of a layer. The Fourier coefficients of the field are
+// formed once, and the fields at blocks of FIELD_POINTS_BLOCK points are
+// obtained by a matrix product with the plane wave phases.
+//
+// Arguments
+// =========
+// n, kx, ky,  - (INPUT) Same as for GetFieldAtPoint.
+// omega, q,
+// kp, phi,
+// epsilon_inv,
+// epstype, ab
+// npts        - (INPUT) The number of points.
+// r           - (INPUT) Length 2*npts. The in-plane x- and y-coordinates
+//               of the points.
+// efield,     - (OUTPUT) Length 3*npts. The complex fields at the points,
+// hfield        stored as consecutive triples. Either may be NULL.
+// work        - (WORK) Length 8*2n + 6*n + FIELD_POINTS_BLOCK*(n+6).
+//               If NULL, then the space is internally allocated.
+#define FIELD_POINTS_BLOCK 64
+void GetFieldAtPoints(
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> *q, // length 2*glist.n
+	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
+	const std::complex<double> *phi, // size (2*glist.n)^2
+	const std::complex<double> *epsilon_inv, // size (glist.n)^2, non NULL for efield != NULL
+	int epstype,
+	const std::complex<double> *ab, // length 4*glist.n
+	size_t npts,
+	const double *r, // length 2*npts
+	std::complex<double> *efield, // length 3*npts
+	std::complex<double> *hfield, // length 3*npts
+	std::complex<double> *work = NULL // length 8*n2 + 6*n + FIELD_POINTS_BLOCK*(n+6)
+);
+// Purpose
+// =======
+// Same as GetFieldAtPoints, except that the Fourier series of the fields
+// is evaluated with a type-2 non-uniform FFT (see fmm/nufft.h) instead
+// of direct summation. The cost is O(m log m + npts) rather than
+// O(npts*n), with an accuracy set when the plan is made.
+//
+// Arguments
+// =========
+// n, G, kx,   - (INPUT) Same as for GetFieldAtPoints; G is the list of
+// ky, omega,    reciprocal lattice orders, length 2*n.
+// q, kp, phi,
+// epsilon_inv,
+// epstype, ab
+// Lk          - (INPUT) Reciprocal lattice vectors, as in G_select.
+// plan        - (INPUT) A plan from nufft2_plan_create for the n orders
+//               in G with 6 transforms.
+// npts, r,    - Same as for GetFieldAtPoints.
+// efield,
+// hfield
+// work        - (WORK) Length 8*2n + 6*n + 7*npts.
+//               If NULL, then the space is internally allocated.
+void GetFieldAtPointsNUFFT(
+	size_t n, // glist.n
+	const int *G,
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> *q, // length 2*glist.n
+	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
+	const std::complex<double> *phi, // size (2*glist.n)^2
+	const std::complex<double> *epsilon_inv, // size (glist.n)^2, non NULL for efield != NULL
+	int epstype,
+	const std::complex<double> *ab, // length 4*glist.n
+	const double Lk[4],
+	nufft_plan plan,
+	size_t npts,
+	const double *r, // length 2*npts
+	std::complex<double> *efield, // length 3*npts
+	std::complex<double> *hfield, // length 3*npts
+	std::complex<double> *work = NULL // length 8*n2 + 6*n + 7*npts
+);
 void GetFieldOnGrid(
 	size_t n, // glist.n
 	int *G, // length 2*glist.n, pairs of uv coordinates of Lk
@@ -491,7 +1036,52 @@ void GetFieldOnGrid(
 	const size_t nxy[2], // number of points per lattice direction
 	const double *xy0, // origin of grid
 	std::complex<double> *efield,
-	std::complex<double> *hfield
+	std::complex<double> *hfield,
+	std::complex<double> *work = NULL // length 8*n2 + 12*nxy[0]*nxy[1]
+);
+// Purpose
+// =======
+// Returns the electric and/or magnetic field on a grid for several
+// z-slices of one layer, in the same layout as GetFieldOnGrid. One set
+// of FFT buffers and plans is made per thread and reused for all slices,
+// and slices are processed in parallel when built with OpenMP.
+//
+// Arguments
+// =========
+// n, G, kx,   - (INPUT) Same as for GetFieldOnGrid.
+// ky, omega,
+// q, kp, phi,
+// epsilon_inv,
+// epstype
+// thickness   - (INPUT) Thickness of the layer.
+// ab          - (INPUT) Length 4n. The mode amplitudes of the layer, as
+//               used by TranslateAmplitudes.
+// nxy         - (INPUT) Number of grid points per lattice direction.
+// nz          - (INPUT) Number of slices.
+// dz          - (INPUT) Length nz. Offsets of the slices in the layer.
+// efield,     - (OUTPUT) Arrays of nz pointers to the output of each
+// hfield        slice, each of length 3*nxy[0]*nxy[1]. Either may be
+//               NULL.
+// nthreads    - (INPUT) The maximum number of threads to use, or 0 for
+//               the OpenMP default.
+void GetFieldOnGridSlices(
+	size_t n, // glist.n
+	const int *G,
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> *q, // length 2*glist.n
+	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
+	const std::complex<double> *phi, // size (2*glist.n)^2
+	const std::complex<double> *epsilon_inv, // size (glist.n)^2
+	int epstype,
+	double thickness,
+	const std::complex<double> *ab, // length 4*glist.n
+	const size_t nxy[2], // number of points per lattice direction
+	size_t nz,
+	const double *dz, // length nz
+	std::complex<double> **efield, // nz pointers, or NULL
+	std::complex<double> **hfield, // nz pointers, or NULL
+	size_t nthreads
 );
 void GetEFieldOnGrid(
 	size_t n, // glist.n
@@ -507,7 +1097,8 @@ void GetEFieldOnGrid(
 	const size_t nxy[2], // number of points per lattice direction
 	const double *xy0,
 	std::complex<double> *efield,
-	int solvetype
+	int solvetype,
+	std::complex<double> *work = NULL // length 8*n2 + 12*nxy[0]*nxy[1]
 );
 
 // Purpose
@@ -637,9 +637,10 @@ static void zgebak_(char job, char side, size_t n, size_t ilo, size_t ihi, doubl
 					continue;
 				}
 				if(i < ilo){
-					i = ilo - ii;
+					i = ilo - 1 - ii;
 				}
-				size_t k = (int)scale[i];
+				// ZGEBAL stores one-based row indices
+				size_t k = (size_t)scale[i] - 1;
 				if(k != i){
 					RNP::TBLAS::Swap(m, &v[i+0*ldv], ldv, &v[k+0*ldv], ldv);
 				}
@@ -653,9 +654,10 @@ static void zgebak_(char job, char side, size_t n, size_t ilo, size_t ihi, doubl
 					continue;
 				}
 				if(i < ilo){
-					i = ilo - ii;
+					i = ilo - 1 - ii;
 				}
-				size_t k = (int)scale[i];
+				// ZGEBAL stores one-based row indices
+				size_t k = (size_t)scale[i] - 1;
 				if(k != i){
 					RNP::TBLAS::Swap(m, &v[i+0*ldv], ldv, &v[k+0*ldv], ldv);
 				}
@@ -4278,9 +4280,10 @@ static int zhseqr_(char job, char compz, size_t n, size_t ilo, size_t ihi, std::
 		RNP::TBLAS::SetMatrix<'A'>(n, n, 0., 1., z, ldz);
 	}
 
-	// Quick return if possible
-	if(ilo == ihi){
-		w[ilo-1] = h[(ilo-1)+(ilo-1)*ldh];
+	// Quick return if possible; ZGEBAL reports ilo = ihi+1 when every
+	// eigenvalue was isolated, and those were all copied above.
+	if(ilo >= ihi){
+		if(ilo == ihi){ w[ilo-1] = h[(ilo-1)+(ilo-1)*ldh]; }
 		return 0;
 	}
 
@@ -5,11 +5,13 @@
 #include <cmath>
 #include <complex>
 #include <float.h>
+#include <algorithm>
 #include <TBLAS.h>
 #include <TLASupport.h>
 #include <LinearSolve.h>
 #include "rcwa.h"
 #include "fmm/fmm.h"
+#include "fmm/fft_iface.h"
 extern "C" {
 #include "gsel.h"
 }
@@ -19,6 +21,14 @@ extern "C" {
 
 #include <numalloc.h>
 
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
 
 void* RS_malloc(size_t size){ // for debugging
 	void* ret = malloc_aligned(size, 16);
@@ -32,6 +42,40 @@ void* RS_realloc(void *ptr, size_t size){ // for debugging
 	return ret;
 }
 
+// Maps an anonymous temporary file of the given size in directory dir.
+// The file is unlinked immediately so that it disappears once unmapped.
+static void* RS_scratch_map(const char *dir, size_t size){
+	const size_t dirlen = strlen(dir);
+	char *path = (char*)malloc(dirlen + 32);
+	if(NULL == path){ return NULL; }
+	strcpy(path, dir);
+	strcpy(path+dirlen, "/rcwa_scratch_XXXXXX");
+	int fd = mkstemp(path);
+	if(fd < 0){
+		free(path);
+		return NULL;
+	}
+	unlink(path);
+	free(path);
+	void *ret = NULL;
+	if(0 == ftruncate(fd, (off_t)size)){
+		ret = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(MAP_FAILED == ret){ ret = NULL; }
+	}
+	close(fd);
+	return ret;
+}
+static void RS_scratch_unmap(void *ptr, size_t size){
+	munmap(ptr, size);
+}
+
+void* Simulation_WorkspaceAlloc(const RS_Simulation *S, size_t size){
+	return numalloc_arena_alloc(S->workspace, size);
+}
+void Simulation_WorkspaceFree(const RS_Simulation *S, void *ptr){
+	numalloc_arena_free(S->workspace, ptr);
+}
+
 
 static double geom_norm3d(const double v[3]){
 	double a[3] = {std::abs(v[0]),std::abs(v[1]),std::abs(v[2])};
@@ -69,10 +113,18 @@ struct LayerModes{
 	std::complex<double> *Epsilon_inv; // size (glist.n)^2 inverse of usual dielectric Fourier coupling matrix
 	// max total size needed: 2n+13nn
 	int epstype;
+	int mapped; // arrays point into S->restart_map rather than a q allocation
+	void *map; // mode cache entry mapping holding the arrays, if any
+	size_t map_size;
+	int nmodes; // number of exact eigenmodes; the rest are approximate
+	double mode_residual; // largest relative residual of a partial solve
+	std::complex<double> q_cutoff; // q of the least evanescent approximate mode
 };
 struct Solution_{
 	std::complex<double> *ab;
 	int *solved;
+	int strategy; // one of RS_SOLVE_STRATEGY_*
+	size_t solve_workspace; // heap workspace used by the amplitude solve
 };
 
 // This structure caches the Fourier transform of the polarization basis
@@ -94,9 +146,10 @@ int Simulation_GetLayerSolution(RS_Simulation *S, RS_Layer *layer, LayerModes **
 // These two assume S->solution is set up already
 int Simulation_ComputeLayerSolution(RS_Simulation *S, RS_Layer *L, LayerModes **layer_modes, std::complex<double> **layer_solution);
 int Simulation_ComputeLayerModes(RS_Simulation *S, RS_Layer *L, LayerModes **layer_modes);
+static void LayerModes_Destroy(LayerModes *modes);
+static int Simulation_GetStackSymmetries(const RS_Simulation *S);
 void Simulation_SetExcitationType(RS_Simulation *S, int type);
 void Simulation_CopyExcitation(const RS_Simulation *from, RS_Simulation *to);
-int Simulation_GetSMatrix(RS_Simulation *S, int layer_from, int layer_to, std::complex<double> *M);
 
 // Field cache manipulation
 void Simulation_InvalidateFieldCache(RS_Simulation *S);
@@ -121,6 +174,8 @@ void Layer_Destroy(RS_Layer *L){
 	}
 	if(NULL != L->pattern.parent){ free(L->pattern.parent); L->pattern.parent = NULL; }
 	Simulation_DestroyLayerModes(L);
+	LayerModes_Destroy(L->prev_modes);
+	L->prev_modes = NULL;
 	RS_TRACE("< Layer_Destroy\n");
 }
 void Material_Destroy(RS_Material *M){
@@ -129,9 +184,109 @@ void Material_Destroy(RS_Material *M){
 		RS_TRACE("< Material_Destroy (failed; M == NULL)\n");
 		return;
 	}
+	free(M->name); M->name = NULL;
+	free(M->model); M->model = NULL;
 	RS_TRACE("< Material_Destroy\n");
 }
 
+// Number of parameters given to RS_Material_SetDispersion for a model.
+static int Dispersion_NumParams(int model, int nterms){
+	switch(model){
+	case RS_MATERIAL_DISPERSION_TABLE:
+		return 3*nterms;
+	case RS_MATERIAL_DISPERSION_LORENTZ:
+		return 1 + 3*nterms;
+	case RS_MATERIAL_DISPERSION_SELLMEIER:
+		return 1 + 2*nterms;
+	default:
+		return 0;
+	}
+}
+// Length of M->model: the parameters, followed for a table by the
+// second derivatives of the n and k splines at each row.
+static size_t Material_ModelSize(const RS_Material *M){
+	return Dispersion_NumParams(M->dispersion, M->nterms)
+		+ (RS_MATERIAL_DISPERSION_TABLE == M->dispersion ? 2*M->nterms : 0);
+}
+
+// Computes the second derivatives m[2*i+j] of the natural cubic splines
+// through the rows {x, n, k} of a table, for j = 0 (n) and 1 (k).
+// Returns 1 on allocation failure.
+static int Dispersion_SplineMoments(int nrows, const double *row, double *m){
+	for(int i = 0; i < 2*nrows; ++i){ m[i] = 0; }
+	if(nrows < 3){ return 0; }
+	double *c = (double*)malloc(sizeof(double) * nrows);
+	if(NULL == c){ return 1; }
+	for(int j = 0; j < 2; ++j){
+		// Tridiagonal system for the interior moments, with m = 0 at the
+		// ends, solved by forward elimination and back substitution.
+		c[0] = 0;
+		for(int i = 1; i+1 < nrows; ++i){
+			const double h0 = row[3*i] - row[3*(i-1)];
+			const double h1 = row[3*(i+1)] - row[3*i];
+			const double rhs = 6*(
+				(row[3*(i+1)+1+j] - row[3*i+1+j]) / h1 -
+				(row[3*i+1+j] - row[3*(i-1)+1+j]) / h0
+			);
+			const double d = 2*(h0+h1) - h0*c[i-1];
+			c[i] = h1 / d;
+			m[2*i+j] = (rhs - h0*m[2*(i-1)+j]) / d;
+		}
+		for(int i = nrows-3; i >= 1; --i){
+			m[2*i+j] -= c[i]*m[2*(i+1)+j];
+		}
+	}
+	free(c);
+	return 0;
+}
+
+// Evaluates the dispersion model of M at the complex frequency f.
+static std::complex<double> Material_EvaluateDispersion(
+	const RS_Material *M, const std::complex<double> &f
+){
+	const double *p = M->model;
+	const int n = M->nterms;
+	std::complex<double> eps(p[0]);
+	if(RS_MATERIAL_DISPERSION_TABLE == M->dispersion){
+		const double *m = p + 3*n;
+		const double x = f.real();
+		double nk[2];
+		if(x <= p[0] || 1 == n){
+			nk[0] = p[1]; nk[1] = p[2];
+		}else if(x >= p[3*(n-1)]){
+			nk[0] = p[3*(n-1)+1]; nk[1] = p[3*(n-1)+2];
+		}else{
+			int lo = 0, hi = n-1; // p[3*lo] <= x < p[3*hi]
+			while(hi - lo > 1){
+				const int mid = (lo+hi)/2;
+				if(p[3*mid] <= x){ lo = mid; }else{ hi = mid; }
+			}
+			const double h = p[3*hi] - p[3*lo];
+			const double a = (p[3*hi] - x) / h;
+			const double b = (x - p[3*lo]) / h;
+			for(int j = 0; j < 2; ++j){
+				nk[j] = a*p[3*lo+1+j] + b*p[3*hi+1+j]
+					+ ((a*a*a-a)*m[2*lo+j] + (b*b*b-b)*m[2*hi+j]) * h*h/6;
+			}
+		}
+		const std::complex<double> index(nk[0], nk[1]);
+		eps = index*index;
+	}else if(RS_MATERIAL_DISPERSION_LORENTZ == M->dispersion){
+		const std::complex<double> i(0, 1);
+		for(int k = 0; k < n; ++k){
+			const double *t = &p[1+3*k];
+			eps += t[0]*t[0] / (t[1]*t[1] - f*f - i*t[2]*f);
+		}
+	}else if(RS_MATERIAL_DISPERSION_SELLMEIER == M->dispersion){
+		// B w^2/(w^2 - C) = B/(1 - C f^2) at w = 1/f
+		for(int k = 0; k < n; ++k){
+			const double *t = &p[1+2*k];
+			eps += t[0] / (1. - t[1]*f*f);
+		}
+	}
+	return eps;
+}
+
 
 RS_Simulation* RS_Simulation_New(const RS_real *Lr, unsigned int nG, int *G){
 	RS_TRACE("> RS_Simulation_New(Lr=%p, nG=%u, G=%p)\n", Lr, nG, G);
@@ -193,11 +348,26 @@ RS_Simulation* RS_Simulation_New(const RS_real *Lr, unsigned int nG, int *G){
 	S->options.verbosity = 0;
 	S->options.use_experimental_fmm = 0;
 	S->options.use_less_memory = 0;
+	S->options.use_boundary_only_solve = 0;
+	S->options.memory_budget = 0;
+	S->options.scratch_directory = NULL;
+	S->options.use_memory_planner = 0;
+	S->options.field_point_tolerance = 0;
+	S->options.mode_cache_directory = NULL;
+	S->options.mode_cache_size = 0;
+	S->options.partial_mode_count = 0;
+	S->options.mode_continuation = 0;
+	S->options.use_symmetry_adapted_basis = 0;
 
 	S->options.lanczos_smoothing_width = 1.0;
 	S->options.lanczos_smoothing_power = 1;
 
 	S->field_cache = NULL;
+	S->ft_cache = NULL;
+	S->workspace = (numalloc_arena*)malloc(sizeof(numalloc_arena));
+	numalloc_arena_init(S->workspace, 64);
+	S->restart_map = NULL;
+	S->restart_map_size = 0;
 	
 	S->msg = NULL;
 	S->msgdata = NULL;
@@ -271,6 +441,19 @@ void RS_Simulation_Destroy(RS_Simulation *S){
 		free(S->options.vector_field_dump_filename_prefix);
 		S->options.vector_field_dump_filename_prefix = NULL;
 	}
+	if(NULL != S->options.scratch_directory){
+		free(S->options.scratch_directory);
+		S->options.scratch_directory = NULL;
+	}
+	if(NULL != S->options.mode_cache_directory){
+		free(S->options.mode_cache_directory);
+		S->options.mode_cache_directory = NULL;
+	}
+	numalloc_arena_destroy(S->workspace);
+	free(S->workspace);
+	if(NULL != S->restart_map){
+		munmap(S->restart_map, S->restart_map_size);
+	}
 	RS_free(S->kx);
 	RS_free(S->G);
 	free(S);
@@ -288,16 +471,41 @@ RS_Simulation* RS_Simulation_Clone(const RS_Simulation *S){
 	}
 
 	memcpy(T, S, sizeof(RS_Simulation));
+	T->solution = NULL;
+	T->field_cache = NULL;
+	T->ft_cache = NULL;
+	T->G = (int*)RS_malloc(sizeof(int)*2*S->n_G);
+	memcpy(T->G, S->G, sizeof(int)*2*S->n_G);
+	T->kx = (double*)RS_malloc(sizeof(double)*2*S->n_G);
+	memcpy(T->kx, S->kx, sizeof(double)*2*S->n_G);
+	T->ky = T->kx + T->n_G;
+	if(NULL != S->options.vector_field_dump_filename_prefix){
+		T->options.vector_field_dump_filename_prefix = strdup(S->options.vector_field_dump_filename_prefix);
+	}
+	if(NULL != S->options.scratch_directory){
+		T->options.scratch_directory = strdup(S->options.scratch_directory);
+	}
+	if(NULL != S->options.mode_cache_directory){
+		T->options.mode_cache_directory = strdup(S->options.mode_cache_directory);
+	}
 
 	T->n_materials_alloc = S->n_materials_alloc;
 	T->material = (RS_Material*)malloc(sizeof(RS_Material) * T->n_materials_alloc);
 	for(int i = 0; i < S->n_materials; ++i){
 		const RS_Material *M = &(S->material[i]);
-		RS_Simulation_SetMaterial(T, -1, M->name, M->type, &M->eps.abcde[0]);
+		RS_Material *M2 = &(T->material[i]);
+		memcpy(M2, M, sizeof(RS_Material));
+		M2->name = (NULL == M->name ? NULL : strdup(M->name));
+		if(NULL != M->model){
+			const size_t size = Material_ModelSize(M);
+			M2->model = (double*)malloc(sizeof(double) * size);
+			memcpy(M2->model, M->model, sizeof(double) * size);
+		}
 	}
 
 	T->n_layers_alloc = S->n_layers_alloc;
 	T->layer = (RS_Layer*)malloc(sizeof(RS_Layer) * T->n_layers_alloc);
+	T->n_layers = 0;
 	for(int i = 0; i < S->n_layers; ++i){
 		const RS_Layer *L = &(S->layer[i]);
 		RS_LayerID id = RS_Simulation_SetLayer(T, -1, L->name, &L->thickness, L->copy, L->material);
@@ -306,19 +514,494 @@ RS_Simulation* RS_Simulation_Clone(const RS_Simulation *S){
 		L2->pattern.nshapes = L->pattern.nshapes;
 		L2->pattern.shapes = (shape*)malloc(sizeof(shape)*L->pattern.nshapes);
 		memcpy(L2->pattern.shapes, L->pattern.shapes, sizeof(shape)*L->pattern.nshapes);
+		for(int k = 0; k < L->pattern.nshapes; ++k){
+			shape *sh = &L2->pattern.shapes[k];
+			if(POLYGON != sh->type){ continue; }
+			const double *vert = sh->vtab.polygon.vertex;
+			sh->vtab.polygon.vertex = (double*)RS_malloc(sizeof(double)*2*sh->vtab.polygon.n_vertices);
+			memcpy(sh->vtab.polygon.vertex, vert, sizeof(double)*2*sh->vtab.polygon.n_vertices);
+		}
 		L2->pattern.parent = NULL;
 		L2->modes = NULL;
 	}
 
 	Simulation_CopyExcitation(S, T);
 
-	T->solution = NULL;
-	T->field_cache = NULL;
+	T->workspace = (numalloc_arena*)malloc(sizeof(numalloc_arena));
+	numalloc_arena_init(T->workspace, 64);
+	T->restart_map = NULL;
+	T->restart_map_size = 0;
 
 	RS_TRACE("< RS_Simulation_Clone [omega=%f]\n", S->omega[0]);
 	return T;
 }
 
+// Save file layout, all in native byte order. Strings are a uint32
+// length (0xFFFFFFFF for NULL) followed by the characters. The mode and
+// amplitude arrays start on SAVE_ALIGN byte boundaries so that they can
+// be used in place from a mapping of the file.
+//   magic, version, sizeof(RS_Options)
+//   Lr[4], omega[2], k[2], n_G, G[2*n_G]
+//   options (pointers zeroed), vector_field_dump_filename_prefix,
+//     scratch_directory, mode_cache_directory
+//   n_materials, then per material: name, type, abcde[10], dispersion,
+//     nterms, model parameters
+//   n_layers, then per layer: name, thickness, material, copy, nshapes,
+//     then per shape: type, center[2], angle, vtab[2], tag, nvert, vertices
+//   excitation: type, layer index, planewave/dipole data or exterior arrays
+//   has_solution, then strategy, solved[n_layers], ab[4*n_G*n_layers]
+//   per layer: has_modes, then epstype, kp_size, phi_size, nmodes,
+//     mode_residual, q_cutoff[2], q..Epsilon2
+#define SAVE_MAGIC "RCWASAVE"
+#define SAVE_VERSION 3
+#define SAVE_ALIGN 64
+
+struct SaveWriter{
+	FILE *fp;
+	size_t offset;
+	int error;
+};
+static void save_write(SaveWriter *w, const void *p, size_t n){
+	if(0 == n || w->error){ return; }
+	if(n != fwrite(p, 1, n, w->fp)){ w->error = 1; }
+	w->offset += n;
+}
+static void save_int(SaveWriter *w, int32_t i){ save_write(w, &i, sizeof(int32_t)); }
+static void save_uint64(SaveWriter *w, uint64_t i){ save_write(w, &i, sizeof(uint64_t)); }
+static void save_string(SaveWriter *w, const char *str){
+	uint32_t len = (NULL == str ? 0xFFFFFFFF : strlen(str));
+	save_write(w, &len, sizeof(uint32_t));
+	if(NULL != str){ save_write(w, str, len); }
+}
+static void save_align(SaveWriter *w){
+	static const char zeros[SAVE_ALIGN] = {0};
+	save_write(w, zeros, (SAVE_ALIGN - w->offset % SAVE_ALIGN) % SAVE_ALIGN);
+}
+
+struct SaveReader{
+	const char *base;
+	size_t size, offset;
+	int error;
+};
+static const void* load_read(SaveReader *r, size_t n){
+	if(r->error || n > r->size - r->offset){
+		r->error = 1;
+		return NULL;
+	}
+	const void *p = r->base + r->offset;
+	r->offset += n;
+	return p;
+}
+static int32_t load_int(SaveReader *r){
+	const int32_t *p = (const int32_t*)load_read(r, sizeof(int32_t));
+	return (NULL == p ? 0 : *p);
+}
+static uint64_t load_uint64(SaveReader *r){
+	const uint64_t *p = (const uint64_t*)load_read(r, sizeof(uint64_t));
+	return (NULL == p ? 0 : *p);
+}
+static void load_doubles(SaveReader *r, double *d, size_t n){
+	const void *p = load_read(r, sizeof(double) * n);
+	if(NULL != p){ memcpy(d, p, sizeof(double) * n); }
+}
+// Returns a malloc'ed copy of the string, or NULL.
+static char* load_string(SaveReader *r){
+	const uint32_t *len = (const uint32_t*)load_read(r, sizeof(uint32_t));
+	if(NULL == len || 0xFFFFFFFF == *len){ return NULL; }
+	const char *p = (const char*)load_read(r, *len);
+	if(NULL == p){ return NULL; }
+	char *str = (char*)malloc(*len + 1);
+	memcpy(str, p, *len);
+	str[*len] = '\0';
+	return str;
+}
+static void load_align(SaveReader *r){
+	r->offset += (SAVE_ALIGN - r->offset % SAVE_ALIGN) % SAVE_ALIGN;
+	if(r->offset > r->size){ r->error = 1; }
+}
+
+int RS_Simulation_Save(const RS_Simulation *S, const char *filename){
+	RS_TRACE("> RS_Simulation_Save(S=%p, filename=%s)\n", S, (NULL != filename ? filename : ""));
+	if(NULL == S){ return -1; }
+	if(NULL == filename){ return -2; }
+
+	// Write to a temporary file and rename it into place, so that an
+	// interrupted save never leaves a truncated file under the name.
+	const size_t len = strlen(filename);
+	char *tmpname = (char*)malloc(len + 5);
+	if(NULL == tmpname){ return 1; }
+	strcpy(tmpname, filename);
+	strcpy(tmpname+len, ".tmp");
+	SaveWriter w;
+	w.fp = fopen(tmpname, "wb");
+	w.offset = 0;
+	w.error = 0;
+	if(NULL == w.fp){
+		free(tmpname);
+		RS_TRACE("< RS_Simulation_Save (failed; could not open file)\n");
+		return 1;
+	}
+
+	const size_t n = S->n_G;
+	save_write(&w, SAVE_MAGIC, 8);
+	save_int(&w, SAVE_VERSION);
+	save_int(&w, sizeof(RS_Options));
+	save_write(&w, S->Lr, sizeof(double) * 4);
+	save_write(&w, S->omega, sizeof(double) * 2);
+	save_write(&w, S->k, sizeof(double) * 2);
+	save_int(&w, S->n_G);
+	save_write(&w, S->G, sizeof(int) * 2*n);
+
+	RS_Options opts = S->options;
+	opts.vector_field_dump_filename_prefix = NULL;
+	opts.scratch_directory = NULL;
+	opts.mode_cache_directory = NULL;
+	save_write(&w, &opts, sizeof(RS_Options));
+	save_string(&w, S->options.vector_field_dump_filename_prefix);
+	save_string(&w, S->options.scratch_directory);
+	save_string(&w, S->options.mode_cache_directory);
+
+	save_int(&w, S->n_materials);
+	for(int i = 0; i < S->n_materials; ++i){
+		const RS_Material *M = &S->material[i];
+		save_string(&w, M->name);
+		save_int(&w, M->type);
+		save_write(&w, M->eps.abcde, sizeof(double) * 10);
+		save_int(&w, M->dispersion);
+		save_int(&w, M->nterms);
+		save_write(&w, M->model, sizeof(double) * Dispersion_NumParams(M->dispersion, M->nterms));
+	}
+
+	save_int(&w, S->n_layers);
+	for(int i = 0; i < S->n_layers; ++i){
+		const RS_Layer *L = &S->layer[i];
+		save_string(&w, L->name);
+		save_write(&w, &L->thickness, sizeof(double));
+		save_int(&w, L->material);
+		save_int(&w, L->copy);
+		save_int(&w, L->pattern.nshapes);
+		for(int j = 0; j < L->pattern.nshapes; ++j){
+			const shape *sh = &L->pattern.shapes[j];
+			double vtab[2] = { 0, 0 };
+			int nvert = 0;
+			switch(sh->type){
+			case CIRCLE:
+				vtab[0] = sh->vtab.circle.radius;
+				break;
+			case ELLIPSE:
+				vtab[0] = sh->vtab.ellipse.halfwidth[0];
+				vtab[1] = sh->vtab.ellipse.halfwidth[1];
+				break;
+			case RECTANGLE:
+				vtab[0] = sh->vtab.rectangle.halfwidth[0];
+				vtab[1] = sh->vtab.rectangle.halfwidth[1];
+				break;
+			case POLYGON:
+				nvert = sh->vtab.polygon.n_vertices;
+				break;
+			}
+			save_int(&w, sh->type);
+			save_write(&w, sh->center, sizeof(double) * 2);
+			save_write(&w, &sh->angle, sizeof(double));
+			save_write(&w, vtab, sizeof(double) * 2);
+			save_int(&w, sh->tag);
+			save_int(&w, nvert);
+			if(nvert > 0){
+				save_write(&w, sh->vtab.polygon.vertex, sizeof(double) * 2*nvert);
+			}
+		}
+	}
+
+	save_int(&w, S->exc.type);
+	save_int(&w, (NULL != S->exc.layer ? (int)(S->exc.layer - S->layer) : -1));
+	if(0 == S->exc.type){
+		const Excitation_Planewave *pw = &S->exc.sub.planewave;
+		save_write(&w, pw->hx, sizeof(double) * 2);
+		save_write(&w, pw->hy, sizeof(double) * 2);
+		save_uint64(&w, pw->order);
+		save_int(&w, pw->backwards);
+	}else if(1 == S->exc.type){
+		save_write(&w, S->exc.sub.dipole.pos, sizeof(double) * 2);
+		save_write(&w, S->exc.sub.dipole.moment, sizeof(double) * 6);
+	}else if(2 == S->exc.type){
+		const Excitation_Exterior *ex = &S->exc.sub.exterior;
+		save_uint64(&w, ex->n);
+		save_write(&w, ex->Gindex1, sizeof(int) * 2*ex->n);
+		save_write(&w, ex->coeff, sizeof(double) * 2*ex->n);
+	}
+
+	const Solution_ *sol = S->solution;
+	save_int(&w, NULL != sol);
+	if(NULL != sol){
+		save_int(&w, sol->strategy);
+		save_write(&w, sol->solved, sizeof(int) * S->n_layers);
+		save_align(&w);
+		save_write(&w, sol->ab, sizeof(std::complex<double>) * 4*n*S->n_layers);
+	}
+
+	for(int i = 0; i < S->n_layers; ++i){
+		const LayerModes *Lmodes = S->layer[i].modes;
+		save_int(&w, NULL != Lmodes);
+		if(NULL == Lmodes){ continue; }
+		const size_t kp_size = (NULL != Lmodes->kp ? 4*n*n : 0);
+		const size_t phi_size = (NULL != Lmodes->phi ? 4*n*n : 0);
+		save_int(&w, Lmodes->epstype);
+		save_uint64(&w, kp_size);
+		save_uint64(&w, phi_size);
+		save_int(&w, Lmodes->nmodes);
+		save_write(&w, &Lmodes->mode_residual, sizeof(double));
+		save_write(&w, &Lmodes->q_cutoff, sizeof(double) * 2);
+		save_align(&w);
+		save_write(&w, Lmodes->q, sizeof(std::complex<double>) * 2*n);
+		if(0 != kp_size){ save_write(&w, Lmodes->kp, sizeof(std::complex<double>) * kp_size); }
+		if(0 != phi_size){ save_write(&w, Lmodes->phi, sizeof(std::complex<double>) * phi_size); }
+		save_write(&w, Lmodes->Epsilon_inv, sizeof(std::complex<double>) * n*n);
+		save_write(&w, Lmodes->Epsilon2, sizeof(std::complex<double>) * 4*n*n);
+	}
+
+	if(0 != fclose(w.fp)){ w.error = 1; }
+	if(w.error || 0 != rename(tmpname, filename)){
+		remove(tmpname);
+		free(tmpname);
+		RS_TRACE("< RS_Simulation_Save (failed; write error)\n");
+		return 1;
+	}
+	free(tmpname);
+	RS_TRACE("< RS_Simulation_Save\n");
+	return 0;
+}
+
+RS_Simulation* RS_Simulation_Load(const char *filename){
+	RS_TRACE("> RS_Simulation_Load(filename=%s)\n", (NULL != filename ? filename : ""));
+	if(NULL == filename){ return NULL; }
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0){
+		RS_TRACE("< RS_Simulation_Load (failed; could not open file)\n");
+		return NULL;
+	}
+	// A private writable mapping, so that the mode arrays can be used in
+	// place; their pages are read in only when first touched.
+	void *map = NULL;
+	off_t fsize = lseek(fd, 0, SEEK_END);
+	if(fsize > 0){
+		map = mmap(NULL, fsize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if(MAP_FAILED == map){ map = NULL; }
+	}
+	close(fd);
+	if(NULL == map){
+		RS_TRACE("< RS_Simulation_Load (failed; could not map file)\n");
+		return NULL;
+	}
+	SaveReader r;
+	r.base = (const char*)map;
+	r.size = fsize;
+	r.offset = 0;
+	r.error = 0;
+
+	const char *magic = (const char*)load_read(&r, 8);
+	const int32_t version = load_int(&r);
+	const int32_t options_size = load_int(&r);
+	if(NULL == magic || 0 != memcmp(magic, SAVE_MAGIC, 8) || SAVE_VERSION != version || (int32_t)sizeof(RS_Options) != options_size){
+		munmap(map, fsize);
+		RS_TRACE("< RS_Simulation_Load (failed; not a compatible save file)\n");
+		return NULL;
+	}
+
+	double Lr[4], omega[2], k[2];
+	load_doubles(&r, Lr, 4);
+	load_doubles(&r, omega, 2);
+	load_doubles(&r, k, 2);
+	const int32_t nG = load_int(&r);
+	const int *G = (const int*)load_read(&r, sizeof(int) * 2*(size_t)(nG > 0 ? nG : 0));
+	if(r.error || nG < 1){
+		munmap(map, fsize);
+		RS_TRACE("< RS_Simulation_Load (failed; truncated file)\n");
+		return NULL;
+	}
+	RS_Simulation *S = RS_Simulation_New(Lr, nG, (int*)G);
+	S->omega[0] = omega[0]; S->omega[1] = omega[1];
+	S->k[0] = k[0]; S->k[1] = k[1];
+	S->restart_map = map;
+	S->restart_map_size = fsize;
+	const size_t n = S->n_G;
+
+	const void *opts = load_read(&r, sizeof(RS_Options));
+	if(NULL != opts){
+		memcpy(&S->options, opts, sizeof(RS_Options));
+	}
+	S->options.vector_field_dump_filename_prefix = load_string(&r);
+	S->options.scratch_directory = load_string(&r);
+	S->options.mode_cache_directory = load_string(&r);
+
+	const int nmat = load_int(&r);
+	for(int i = 0; i < nmat && !r.error; ++i){
+		char *name = load_string(&r);
+		const int type = load_int(&r);
+		double abcde[10];
+		load_doubles(&r, abcde, 10);
+		// The stored type is the internal one: 0 scalar, 1 xy tensor.
+		RS_MaterialID id = RS_Simulation_SetMaterial(S, -1, name, (0 == type ? RS_MATERIAL_TYPE_SCALAR_COMPLEX : RS_MATERIAL_TYPE_XYTENSOR_COMPLEX), abcde);
+		free(name);
+		const int dispersion = load_int(&r);
+		const int nterms = load_int(&r);
+		const int np = Dispersion_NumParams(dispersion, nterms);
+		if(np < 0 || (size_t)np > (r.size - r.offset) / sizeof(double)){
+			r.error = 1;
+		}else if(np > 0){
+			double *params = (double*)malloc(sizeof(double) * np);
+			if(NULL == params){ r.error = 1; }
+			load_doubles(&r, params, np);
+			if(!r.error && 0 != RS_Material_SetDispersion(S, id, dispersion, nterms, params)){
+				r.error = 1;
+			}
+			free(params);
+		}
+	}
+
+	const int nlayers = load_int(&r);
+	for(int i = 0; i < nlayers && !r.error; ++i){
+		char *name = load_string(&r);
+		double thickness;
+		load_doubles(&r, &thickness, 1);
+		const int material = load_int(&r);
+		const int copy = load_int(&r);
+		RS_LayerID id = RS_Simulation_SetLayer(S, -1, name, &thickness, copy, material);
+		free(name);
+		if(id != i){
+			r.error = 1;
+			break;
+		}
+		RS_Layer *L = &S->layer[id];
+		const int nshapes = load_int(&r);
+		if(nshapes > 0){
+			L->pattern.shapes = (shape*)malloc(sizeof(shape) * nshapes);
+			if(NULL == L->pattern.shapes){ r.error = 1; }
+		}
+		for(int j = 0; j < nshapes && !r.error; ++j){
+			shape *sh = &L->pattern.shapes[j];
+			double vtab[2];
+			sh->type = (shape_type)load_int(&r);
+			load_doubles(&r, sh->center, 2);
+			load_doubles(&r, &sh->angle, 1);
+			load_doubles(&r, vtab, 2);
+			sh->tag = load_int(&r);
+			const int nvert = load_int(&r);
+			switch(sh->type){
+			case CIRCLE:
+				sh->vtab.circle.radius = vtab[0];
+				break;
+			case ELLIPSE:
+				sh->vtab.ellipse.halfwidth[0] = vtab[0];
+				sh->vtab.ellipse.halfwidth[1] = vtab[1];
+				break;
+			case RECTANGLE:
+				sh->vtab.rectangle.halfwidth[0] = vtab[0];
+				sh->vtab.rectangle.halfwidth[1] = vtab[1];
+				break;
+			case POLYGON:
+				sh->vtab.polygon.n_vertices = nvert;
+				sh->vtab.polygon.vertex = (double*)RS_malloc(sizeof(double) * 2*(nvert > 0 ? nvert : 1));
+				if(NULL == sh->vtab.polygon.vertex){ r.error = 1; }
+				load_doubles(&r, sh->vtab.polygon.vertex, 2*nvert);
+				break;
+			}
+			L->pattern.nshapes = j+1;
+		}
+	}
+
+	Simulation_SetExcitationType(S, -1);
+	S->exc.type = load_int(&r);
+	const int exc_layer = load_int(&r);
+	S->exc.layer = (exc_layer >= 0 && exc_layer < S->n_layers ? &S->layer[exc_layer] : NULL);
+	if(0 == S->exc.type){
+		Excitation_Planewave *pw = &S->exc.sub.planewave;
+		load_doubles(&r, pw->hx, 2);
+		load_doubles(&r, pw->hy, 2);
+		pw->order = load_uint64(&r);
+		pw->backwards = load_int(&r);
+	}else if(1 == S->exc.type){
+		load_doubles(&r, S->exc.sub.dipole.pos, 2);
+		load_doubles(&r, S->exc.sub.dipole.moment, 6);
+	}else if(2 == S->exc.type){
+		Excitation_Exterior *ex = &S->exc.sub.exterior;
+		ex->n = load_uint64(&r);
+		if(ex->n > (r.size - r.offset) / (2*sizeof(int))){
+			ex->n = 0;
+			r.error = 1;
+		}
+		const void *g = load_read(&r, sizeof(int) * 2*ex->n);
+		const void *c = load_read(&r, sizeof(double) * 2*ex->n);
+		ex->Gindex1 = (int*)malloc(sizeof(int) * 2*ex->n);
+		ex->coeff = (double*)malloc(sizeof(double) * 2*ex->n);
+		if(NULL == ex->Gindex1 || NULL == ex->coeff){
+			r.error = 1;
+		}else if(NULL != g && NULL != c){
+			memcpy(ex->Gindex1, g, sizeof(int) * 2*ex->n);
+			memcpy(ex->coeff, c, sizeof(double) * 2*ex->n);
+		}
+	}
+
+	if(!r.error && load_int(&r)){
+		const int strategy = load_int(&r);
+		const int *solved = (const int*)load_read(&r, sizeof(int) * S->n_layers);
+		load_align(&r);
+		const void *ab = load_read(&r, sizeof(std::complex<double>) * 4*n*S->n_layers);
+		if(!r.error && 0 == Simulation_InitSolution(S)){
+			S->solution->strategy = strategy;
+			memcpy(S->solution->solved, solved, sizeof(int) * S->n_layers);
+			memcpy(S->solution->ab, ab, sizeof(std::complex<double>) * 4*n*S->n_layers);
+		}else{
+			r.error = 1;
+		}
+	}
+
+	for(int i = 0; i < S->n_layers && !r.error; ++i){
+		if(!load_int(&r)){ continue; }
+		const int epstype = load_int(&r);
+		const size_t kp_size = load_uint64(&r);
+		const size_t phi_size = load_uint64(&r);
+		const int nmodes = load_int(&r);
+		double cutoff[3];
+		load_doubles(&r, cutoff, 3);
+		load_align(&r);
+		// Only full kp and phi blocks, or none, are ever saved.
+		if((0 != kp_size && 4*n*n != kp_size) || (0 != phi_size && 4*n*n != phi_size)){
+			r.error = 1;
+			break;
+		}
+		std::complex<double> *q = (std::complex<double>*)load_read(&r,
+			sizeof(std::complex<double>) * (2*n + kp_size + phi_size + 5*n*n)
+		);
+		if(NULL == q){ break; }
+		LayerModes *Lmodes = (LayerModes*)malloc(sizeof(LayerModes));
+		if(NULL == Lmodes){
+			r.error = 1;
+			break;
+		}
+		Lmodes->q = q;
+		Lmodes->kp = (0 != kp_size ? q + 2*n : NULL);
+		Lmodes->phi = (0 != phi_size ? q + 2*n + kp_size : NULL);
+		Lmodes->Epsilon_inv = q + 2*n + kp_size + phi_size;
+		Lmodes->Epsilon2 = Lmodes->Epsilon_inv + n*n;
+		Lmodes->epstype = epstype;
+		Lmodes->mapped = 1;
+		Lmodes->map = NULL;
+		Lmodes->map_size = 0;
+		Lmodes->nmodes = nmodes;
+		Lmodes->mode_residual = cutoff[0];
+		Lmodes->q_cutoff = std::complex<double>(cutoff[1], cutoff[2]);
+		S->layer[i].modes = Lmodes;
+	}
+
+	if(r.error){
+		RS_Simulation_Destroy(S);
+		RS_TRACE("< RS_Simulation_Load (failed; truncated or inconsistent file)\n");
+		return NULL;
+	}
+	RS_TRACE("< RS_Simulation_Load\n");
+	return S;
+}
+
 RS_message_handler RS_Simulation_SetMessageHandler(
 	RS_Simulation *S, RS_message_handler handler, void *data
 ){
@@ -401,15 +1084,58 @@ int RS_Simulation_GetBases(const RS_Simulation *S, int *G){
 	}
 	return S->n_G;
 }
+// Returns whether the pattern or background of a layer uses material m.
+static bool Layer_UsesMaterial(const RS_Layer *L, int m){
+	if(L->material == m){ return true; }
+	for(int k = 0; k < L->pattern.nshapes; ++k){
+		if(L->pattern.shapes[k].tag == m){ return true; }
+	}
+	return false;
+}
+
+// Discards what depends on the epsilon of material m: the modes and the
+// cached pattern Fourier coefficients of the layers using it, and then
+// the solution. Layers made of other materials keep theirs.
+static void Simulation_InvalidateMaterial(RS_Simulation *S, int m){
+	int affected = 0;
+	for(int i = 0; i < S->n_layers; ++i){
+		const int owner = (S->layer[i].copy >= 0 ? S->layer[i].copy : i);
+		if(!Layer_UsesMaterial(&S->layer[owner], m)){ continue; }
+		Simulation_DestroyLayerModes(&S->layer[owner]);
+		FourierCache_Invalidate(S->ft_cache, i);
+		affected = 1;
+	}
+	if(affected){
+		Simulation_DestroySolution(S);
+		Simulation_InvalidateFieldCache(S);
+	}
+}
+// Evaluates the dispersion model of material m at the current frequency,
+// and invalidates the layers using it if its epsilon changed. Nothing is
+// evaluated before a frequency is set, where Drude terms diverge.
+static void Simulation_UpdateMaterialDispersion(RS_Simulation *S, int m){
+	RS_Material *M = &S->material[m];
+	if(RS_MATERIAL_DISPERSION_NONE == M->dispersion){ return; }
+	if(0 == S->omega[0] && 0 == S->omega[1]){ return; }
+	const std::complex<double> f = std::complex<double>(S->omega[0], S->omega[1]) / (2*M_PI);
+	const std::complex<double> eps = Material_EvaluateDispersion(M, f);
+	if(eps.real() == M->eps.s[0] && eps.imag() == M->eps.s[1]){ return; }
+	M->eps.s[0] = eps.real();
+	M->eps.s[1] = eps.imag();
+	Simulation_InvalidateMaterial(S, m);
+}
 int RS_Simulation_SetFrequency(RS_Simulation *S, const RS_real *freq_complex){
 	if(NULL == S){ return -1; }
 	if(NULL == freq_complex){ return -2; }
 	RS_TRACE("> RS_Simulation_SetFrequency(S=%p, freq=(%f,%f))\n", S, freq_complex[0], freq_complex[1]);
-	RS_Simulation_DestroyLayerModes(S, -1);
+	Simulation_RetireLayerModes(S);
 	Simulation_DestroySolution(S);
 	Simulation_InvalidateFieldCache(S);
 	S->omega[0] = 2*M_PI*freq_complex[0];
 	S->omega[1] = 2*M_PI*freq_complex[1];
+	for(int i = 0; i < S->n_materials; ++i){
+		Simulation_UpdateMaterialDispersion(S, i);
+	}
 	RS_TRACE("< RS_Simulation_SetFrequency\n");
 	return 0;
 }
@@ -433,6 +1159,203 @@ int RS_Simulation_TotalThickness(const RS_Simulation *S, RS_real *thickness){
 	}
 	return 0;
 }
+int RS_Simulation_GetWorkspaceUsage(const RS_Simulation *S, size_t *size, size_t *high_water){
+	if(NULL == S){ return -1; }
+	if(NULL != size){ *size = S->workspace->size; }
+	if(NULL != high_water){ *high_water = S->workspace->high_water; }
+	return 0;
+}
+
+// Number of points of the real space grid chosen by the FFT based
+// Fourier matrix generation. If full is zero, directions in which all
+// G vectors have zero extent get a single grid point.
+static size_t Simulation_GetFFTGridCount(const RS_Simulation *S, int full){
+	size_t ngrid[2] = {1,1};
+	for(int i = 0; i < 2; ++i){
+		int extent = 1;
+		int allzero = 1;
+		for(int j = 0; j < S->n_G; ++j){
+			if(abs(S->G[2*j+i]) > extent){ extent = abs(S->G[2*j+i]); }
+			if(0 != S->G[2*j+i]){ allzero = 0; }
+		}
+		if(full || !allzero){
+			ngrid[i] = fft_next_fast_size(extent * S->options.resolution);
+		}
+	}
+	return ngrid[0]*ngrid[1];
+}
+
+// Largest set of real space grids live while generating the Fourier
+// matrices of one patterned layer with the current options.
+static size_t Simulation_GetFFTGridSize(const RS_Simulation *S){
+	const size_t nn = (size_t)S->n_G * (size_t)S->n_G;
+	size_t size = 0;
+	if(S->options.use_experimental_fmm){ return 0; }
+	if(S->options.use_discretized_epsilon){
+		if(S->options.use_subpixel_smoothing){
+			return sizeof(std::complex<double>)*6*Simulation_GetFFTGridCount(S, 1);
+		}
+		size = sizeof(std::complex<double>)*6*Simulation_GetFFTGridCount(S, 0);
+	}
+	if(S->options.use_polarization_basis){
+		const int full = S->options.use_jones_vector_basis || S->options.use_normal_vector_basis;
+		const size_t ng2 = Simulation_GetFFTGridCount(S, full);
+		const size_t pol_size = sizeof(std::complex<double>)*(6*nn + 4*ng2) + sizeof(double)*2*ng2;
+		if(pol_size > size){ size = pol_size; }
+	}
+	return size;
+}
+
+// Size of the workspace arena needed for the largest set of temporaries
+// live at once: either a layer eigensolve, or an interior solve with its
+// layer property arrays.
+static size_t Simulation_GetWorkspaceSize(const RS_Simulation *S){
+	const size_t n = S->n_G;
+	const size_t n2 = 2*n;
+	const size_t n4 = 2*n2;
+	const size_t pad = 8*S->workspace->alignment;
+	std::complex<double> lwork_eigen;
+	SolveLayerEigensystem(
+		std::complex<double>(S->omega[0],S->omega[1]), n, S->kx, S->ky,
+		NULL, NULL, EPSILON2_TYPE_FULL, NULL, NULL, NULL,
+		&lwork_eigen, NULL, (size_t)-1
+	);
+	const size_t eigen_size = sizeof(std::complex<double>)*(size_t)(lwork_eigen.real() + 0.5) + sizeof(double)*4*n;
+	const size_t interior_size =
+		(sizeof(double)+sizeof(int)+4*sizeof(std::complex<double>*))*S->n_layers +
+		sizeof(std::complex<double>)*(n2+n2*n2) +
+		sizeof(std::complex<double>)*(2*n4*n4 + 2*n2 + n4*(n4+1)) + sizeof(size_t)*n4;
+	return (eigen_size > interior_size ? eigen_size : interior_size) + pad;
+}
+
+// Heap workspace of the planewave amplitude solve for a given strategy.
+// The per-layer store of the scratch strategy lives in a file mapping.
+static size_t Simulation_GetSolveWorkspaceSize(const RS_Simulation *S, int strategy){
+	const size_t n2 = 2*(size_t)S->n_G;
+	const size_t n4 = 2*n2;
+	const size_t nl = S->n_layers;
+	const size_t streaming_size =
+		sizeof(std::complex<double>)*(2*n4*n4 + n4*(n4+1)) + sizeof(size_t)*n4;
+	const size_t store_size = sizeof(std::complex<double>)*(n2*n2+n2)*nl;
+	switch(strategy){
+	case RS_SOLVE_STRATEGY_ALL:
+		return sizeof(std::complex<double>)*6*nl*n2*n2 + sizeof(size_t)*nl*n2;
+	case RS_SOLVE_STRATEGY_STREAMING:
+		return streaming_size + store_size;
+	case RS_SOLVE_STRATEGY_SCRATCH:
+		return streaming_size;
+	default:
+		return 0;
+	}
+}
+
+// The strategy selected by the options, without the memory planner.
+static int Simulation_GetSolveStrategy(const RS_Simulation *S){
+	const size_t budget = S->options.memory_budget;
+	if(S->options.use_less_memory){
+		return RS_SOLVE_STRATEGY_LESS_MEMORY;
+	}
+	if(0 == budget || Simulation_GetSolveWorkspaceSize(S, RS_SOLVE_STRATEGY_ALL) <= budget){
+		return RS_SOLVE_STRATEGY_ALL;
+	}
+	if(NULL != S->options.scratch_directory && Simulation_GetSolveWorkspaceSize(S, RS_SOLVE_STRATEGY_STREAMING) > budget){
+		return RS_SOLVE_STRATEGY_SCRATCH;
+	}
+	return RS_SOLVE_STRATEGY_STREAMING;
+}
+
+static size_t Simulation_GetLayerModesSize(const RS_Simulation *S, const RS_Layer *L, int strategy){
+	const size_t n = S->n_G;
+	const size_t n2n2 = 4*n*n;
+	size_t kp_size = n2n2;
+	size_t phi_size = n2n2;
+	if(0 == L->pattern.nshapes){
+		const RS_Material *M = &S->material[L->copy < 0 ? L->material : S->layer[L->copy].material];
+		if(0 == M->type){ phi_size = 0; }
+	}
+	if(S->options.use_less_memory || RS_SOLVE_STRATEGY_LESS_MEMORY == strategy){
+		kp_size = 0;
+	}
+	return sizeof(LayerModes) + sizeof(std::complex<double>)*(2*n + kp_size + phi_size + n*n + n2n2);
+}
+
+static void Simulation_TotalMemoryStats(RS_MemoryStats *stats){
+	stats->total =
+		stats->layer_modes + stats->solution + stats->solve_workspace + stats->field_cache +
+		(stats->fft_grids > stats->workspace ? stats->fft_grids : stats->workspace);
+}
+
+int RS_Simulation_EstimateMemory(const RS_Simulation *S, int strategy, RS_MemoryStats *stats){
+	if(NULL == S){ return -1; }
+	if(strategy > RS_SOLVE_STRATEGY_LESS_MEMORY){ return -2; }
+	if(NULL == stats){ return -3; }
+	if(strategy < 0){
+		strategy = Simulation_GetSolveStrategy(S);
+	}
+	const size_t n = S->n_G;
+	size_t npatterned = 0;
+
+	memset(stats, 0, sizeof(RS_MemoryStats));
+	for(int i = 0; i < S->n_layers; ++i){
+		const RS_Layer *L = &S->layer[i];
+		if(L->copy >= 0){ continue; } // copies share the modes of the original
+		stats->layer_modes += Simulation_GetLayerModesSize(S, L, strategy);
+		if(L->pattern.nshapes > 0){
+			++npatterned;
+			if(S->options.mode_continuation){
+				stats->layer_modes += Simulation_GetLayerModesSize(S, L, strategy);
+			}
+		}
+	}
+	stats->solution = sizeof(Solution_) + (sizeof(std::complex<double>)*4*n + sizeof(int))*S->n_layers;
+	stats->solve_workspace = Simulation_GetSolveWorkspaceSize(S, strategy);
+	if(npatterned > 0){
+		stats->fft_grids = Simulation_GetFFTGridSize(S);
+	}
+	if(S->options.use_polarization_basis){
+		stats->field_cache = npatterned * (sizeof(FieldCache) + sizeof(std::complex<double>)*(4*n*n + 2*n));
+	}
+	stats->workspace = Simulation_GetWorkspaceSize(S);
+	Simulation_TotalMemoryStats(stats);
+	return 0;
+}
+
+int RS_Simulation_GetMemoryStats(const RS_Simulation *S, RS_MemoryStats *stats){
+	if(NULL == S){ return -1; }
+	if(NULL == stats){ return -2; }
+	const size_t n = S->n_G;
+	size_t npatterned = 0;
+
+	memset(stats, 0, sizeof(RS_MemoryStats));
+	if(NULL != S->solution){
+		stats->solution = sizeof(Solution_) + (sizeof(std::complex<double>)*4*n + sizeof(int))*S->n_layers;
+		stats->solve_workspace = S->solution->solve_workspace;
+	}
+	for(int i = 0; i < S->n_layers; ++i){
+		const RS_Layer *L = &S->layer[i];
+		const LayerModes *held[2] = { L->modes, L->prev_modes };
+		for(int j = 0; j < 2; ++j){
+			if(NULL == held[j]){ continue; }
+			stats->layer_modes += sizeof(LayerModes) + sizeof(std::complex<double>)*(
+				2*n + (NULL != held[j]->kp ? 4*n*n : 0) + (NULL != held[j]->phi ? 4*n*n : 0) + n*n + 4*n*n
+				);
+		}
+		if(NULL == L->modes){ continue; }
+		if(L->pattern.nshapes > 0){ ++npatterned; }
+	}
+	if(npatterned > 0){
+		stats->fft_grids = Simulation_GetFFTGridSize(S);
+	}
+	for(const FieldCache *f = S->field_cache; NULL != f; f = f->next){
+		stats->field_cache += sizeof(FieldCache) + sizeof(std::complex<double>)*(4*f->n*f->n + (S->options.use_jones_vector_basis ? 2*f->n : 0));
+	}
+	stats->workspace = S->workspace->size;
+	if(S->workspace->high_water > stats->workspace){
+		stats->workspace = S->workspace->high_water;
+	}
+	Simulation_TotalMemoryStats(stats);
+	return 0;
+}
 
 int RS_Lattice_Reciprocate(const RS_real *Lr, RS_real *Lk){
 	RS_TRACE("> RS_Lattice_Reciprocate(Lr=%f,%f, %f,%f)\n", Lr[0], Lr[1], Lr[2], Lr[3]);
@@ -497,6 +1420,9 @@ RS_MaterialID RS_Simulation_SetMaterial(
 		M->type = 0;
 		M->eps.s[0] = 1;
 		M->eps.s[1] = 0;
+		M->dispersion = RS_MATERIAL_DISPERSION_NONE;
+		M->nterms = 0;
+		M->model = NULL;
 
 		S->n_materials++;
 		newmat = 1;
@@ -544,6 +1470,16 @@ RS_MaterialID RS_Simulation_SetMaterial(
 			M = NULL;
 			break;
 		}
+		if(NULL != M){
+			// An explicit epsilon replaces any dispersion model.
+			free(M->model);
+			M->model = NULL;
+			M->nterms = 0;
+			M->dispersion = RS_MATERIAL_DISPERSION_NONE;
+			if(!newmat){
+				Simulation_InvalidateMaterial(S, id);
+			}
+		}
 	}
 	RS_TRACE("< RS_Simulation_SetMaterial (returning id=%d)\n", id);
 	return id;
@@ -605,6 +1541,52 @@ int RS_Material_GetEpsilon(
 	return 0;
 }
 
+int RS_Material_SetDispersion(
+	RS_Simulation *S, RS_MaterialID id, int model, int nterms, const RS_real *params
+){
+	RS_TRACE("> RS_Material_SetDispersion(S=%p, M=%d, model=%d, nterms=%d, params=%p)\n",
+		S, id, model, nterms, params);
+	int ret = 0;
+	if(NULL == S){ ret = -1; }
+	else if(id < 0 || id >= S->n_materials || 0 != S->material[id].type){ ret = -2; }
+	else if(model < RS_MATERIAL_DISPERSION_NONE || model > RS_MATERIAL_DISPERSION_SELLMEIER){ ret = -3; }
+	else if(nterms < 0 || (RS_MATERIAL_DISPERSION_TABLE == model && nterms < 1)){ ret = -4; }
+	else if(RS_MATERIAL_DISPERSION_NONE != model && NULL == params){ ret = -5; }
+	else if(RS_MATERIAL_DISPERSION_TABLE == model){
+		for(int i = 1; i < nterms; ++i){
+			if(!(params[3*i] > params[3*(i-1)])){ ret = -5; }
+		}
+	}
+	if(0 != ret){
+		RS_TRACE("< RS_Material_SetDispersion (failed; ret = %d)\n", ret);
+		return ret;
+	}
+	RS_Material *M = &S->material[id];
+	double *p = NULL;
+	if(RS_MATERIAL_DISPERSION_NONE != model){
+		const int np = Dispersion_NumParams(model, nterms);
+		const int nm = (RS_MATERIAL_DISPERSION_TABLE == model ? 2*nterms : 0);
+		p = (double*)malloc(sizeof(double) * (np + nm));
+		if(NULL == p){
+			RS_TRACE("< RS_Material_SetDispersion (failed; allocation failed)\n");
+			return 1;
+		}
+		memcpy(p, params, sizeof(double) * np);
+		if(RS_MATERIAL_DISPERSION_TABLE == model && 0 != Dispersion_SplineMoments(nterms, p, p+np)){
+			free(p);
+			RS_TRACE("< RS_Material_SetDispersion (failed; allocation failed)\n");
+			return 1;
+		}
+	}
+	free(M->model);
+	M->model = p;
+	M->nterms = (NULL == p ? 0 : nterms);
+	M->dispersion = model;
+	Simulation_UpdateMaterialDispersion(S, id);
+	RS_TRACE("< RS_Material_SetDispersion\n");
+	return 0;
+}
+
 RS_LayerID RS_Simulation_SetLayer(
 	RS_Simulation *S, RS_LayerID id, const char *name, const RS_real *thickness,
 	RS_LayerID copy, RS_MaterialID material
@@ -652,6 +1634,7 @@ RS_LayerID RS_Simulation_SetLayer(
 		L->pattern.shapes = NULL;
 		L->pattern.parent = NULL;
 		L->modes = NULL;
+		L->prev_modes = NULL;
 	}else{
 		if(NULL != S->msg){
 			S->msg(S->msgdata, "RS_Simulation_SetLayer", RS_MSG_INFO, "Updating existing layer");
@@ -740,6 +1723,12 @@ int RS_Layer_ClearRegions(
 	return 0;
 }
 
+// Discards the containment tree of a layer pattern that is about to
+// change; the next Simulation_InitSolution rebuilds it.
+static void Layer_InvalidatePattern(RS_Layer *layer){
+	free(layer->pattern.parent);
+	layer->pattern.parent = NULL;
+}
 int RS_Layer_SetRegionHalfwidths(
 	RS_Simulation *S, RS_LayerID Lid, RS_MaterialID Mid,
 	int type, const RS_real *halfwidths,
@@ -794,6 +1783,7 @@ int RS_Layer_SetRegionHalfwidths(
 	Simulation_DestroySolution(S);
 	Simulation_InvalidateFieldCache(S);
 
+	Layer_InvalidatePattern(L);
 	int n = L->pattern.nshapes++;
 	L->pattern.shapes = (shape*)realloc(L->pattern.shapes, sizeof(shape)*L->pattern.nshapes);
 	if(NULL == L->pattern.shapes){ return 1; }
@@ -868,6 +1858,7 @@ int RS_Layer_SetRegionVertices(
 	Simulation_DestroySolution(S);
 	Simulation_InvalidateFieldCache(S);
 
+	Layer_InvalidatePattern(L);
 	int n = L->pattern.nshapes++;
 	L->pattern.shapes = (shape*)realloc(L->pattern.shapes, sizeof(shape)*L->pattern.nshapes);
 	if(NULL == L->pattern.shapes){ return 1; }
@@ -921,38 +1912,285 @@ int RS_Layer_IsCopy(RS_Simulation *S, RS_LayerID L){
 	return (S->layer[L].copy >= 0) ? 1 : 0;
 }
 
-void Simulation_DestroyLayerModes(RS_Layer *layer){
-	if(NULL != layer->modes){
-		if(NULL != layer->modes->q){ RS_free(layer->modes->q); }
-		layer->modes->q = NULL;
-		free(layer->modes);
-		layer->modes = NULL;
-	}
+// Number of parameters of a profile region at one depth: the center,
+// the angle, and the halfwidths or vertices.
+static int ProfileRegion_NumParams(const RS_ProfileRegion *R){
+	return 3 + (RS_REGION_TYPE_POLYGON == R->type ? 2*R->nv : 2);
 }
-void RS_Simulation_DestroyLayerModes(RS_Simulation *S, RS_LayerID id){
-	if(id < 0){
-		for(int i = 0; i < S->n_layers; ++i){
-			Simulation_DestroyLayerModes(&S->layer[i]);
+// Gathers the parameters of all regions at depth k into P. The angles
+// are scaled by w to compare them as arc lengths.
+static void Profile_GetParams(
+	int nregions, const RS_ProfileRegion *region, int k, double *P
+){
+	for(int r = 0; r < nregions; ++r){
+		const RS_ProfileRegion *R = &region[r];
+		const int ns = ProfileRegion_NumParams(R) - 3;
+		P[0] = (NULL == R->center ? 0 : R->center[2*k+0]);
+		P[1] = (NULL == R->center ? 0 : R->center[2*k+1]);
+		P[2] = (NULL == R->angle_frac ? 0 : R->angle_frac[k]);
+		for(int j = 0; j < ns; ++j){
+			P[3+j] = R->shape[ns*k+j];
 		}
-	}else if(id < S->n_layers){
-		Simulation_DestroyLayerModes(&S->layer[id]);
+		P += 3+ns;
 	}
 }
 
-int Simulation_RemoveLayerPatterns(RS_Simulation *S, RS_Layer *layer){
-	RS_TRACE("> Simulation_RemoveLayerPatterns(S=%p, layer=%p) [omega=%f]\n",
-		S, layer, S->omega[0]);
+int RS_Simulation_AddProfileLayers(
+	RS_Simulation *S, const char *name, RS_MaterialID background,
+	int nz, const RS_real *z, int nregions, const RS_ProfileRegion *region,
+	RS_real tol, RS_LayerID *first, int *nlayers
+){
+	RS_TRACE("> RS_Simulation_AddProfileLayers(S=%p, name=%p (%s), background=%d, nz=%d, z=%p, nregions=%d, region=%p, tol=%g)\n",
+		S, name, (NULL != name ? name : ""), background, nz, z, nregions, region, tol);
 	int ret = 0;
 	if(NULL == S){ ret = -1; }
-	if(NULL == layer){ ret = -2; }
+	else if(background < 0 || background >= S->n_materials){ ret = -3; }
+	if(nz < 2){ ret = -4; }
+	else if(NULL == z){ ret = -5; }
+	else{
+		for(int k = 1; k < nz; ++k){
+			if(!(z[k] > z[k-1])){ ret = -5; }
+		}
+	}
+	if(nregions < 0){ ret = -6; }
+	else if(nregions > 0 && NULL == region){ ret = -7; }
+	else if(0 == ret){
+		const int lattice1d = (0 == S->Lr[1] && 0 == S->Lr[2] && 0 == S->Lr[3]);
+		for(int r = 0; r < nregions; ++r){
+			const RS_ProfileRegion *R = &region[r];
+			if(R->material < 0 || R->material >= S->n_materials || NULL == R->shape ||
+				(RS_REGION_TYPE_POLYGON == R->type && R->nv < 3) ||
+				(RS_REGION_TYPE_POLYGON != R->type && (R->type < RS_REGION_TYPE_INTERVAL || R->type > RS_REGION_TYPE_CIRCLE)) ||
+				(lattice1d && RS_REGION_TYPE_INTERVAL != R->type)
+			){
+				ret = -7;
+			}
+		}
+	}
+	if(!(tol > 0)){ ret = -8; }
 	if(0 != ret){
-		RS_TRACE("< Simulation_RemoveLayerPatterns (failed; ret = %d) [omega=%f]\n", ret, S->omega[0]);
+		RS_TRACE("< RS_Simulation_AddProfileLayers (failed; ret = %d)\n", ret);
 		return ret;
 	}
 
-	Simulation_DestroySolution(S);
-
-	layer->pattern.nshapes = 0;
+	int np = 0;
+	for(int r = 0; r < nregions; ++r){
+		np += ProfileRegion_NumParams(&region[r]);
+	}
+	// P holds the parameters at each depth, then the weights, the range
+	// of the current slice and the parameters of every slice made.
+	int nslices_alloc = nz;
+	double *P = (double*)malloc(sizeof(double) * np*(nz + 3));
+	double *slice = (double*)malloc(sizeof(double) * np*nslices_alloc);
+	RS_LayerID *slice_layer = (RS_LayerID*)malloc(sizeof(RS_LayerID) * nslices_alloc);
+	char *slice_name = (char*)malloc(NULL != name ? strlen(name) + 16 : 1);
+	if(NULL == P || NULL == slice || NULL == slice_layer || NULL == slice_name){
+		free(slice_name);
+		free(slice_layer);
+		free(slice);
+		free(P);
+		RS_TRACE("< RS_Simulation_AddProfileLayers (failed; allocation failed)\n");
+		return 1;
+	}
+	double *w = P + np*nz;
+	double *lo = w + np;
+	double *hi = lo + np;
+	for(int k = 0; k < nz; ++k){
+		Profile_GetParams(nregions, region, k, &P[np*k]);
+	}
+	// Angles count as the arc length they move the farthest point of the
+	// region by.
+	for(int r = 0, j0 = 0; r < nregions; ++r){
+		const int ns = ProfileRegion_NumParams(&region[r]) - 3;
+		double size = 0;
+		for(int k = 0; k < nz; ++k){
+			const double *s = &P[np*k + j0+3];
+			if(RS_REGION_TYPE_POLYGON == region[r].type){
+				for(int i = 0; i < region[r].nv; ++i){
+					size = std::max(size, hypot(s[2*i+0], s[2*i+1]));
+				}
+			}else if(RS_REGION_TYPE_INTERVAL == region[r].type || RS_REGION_TYPE_CIRCLE == region[r].type){
+				size = std::max(size, fabs(s[0]));
+			}else{
+				size = std::max(size, hypot(s[0], s[1]));
+			}
+		}
+		w[j0+0] = 1;
+		w[j0+1] = 1;
+		w[j0+2] = 2*M_PI*size;
+		for(int j = 0; j < ns; ++j){
+			w[j0+3+j] = 1;
+		}
+		// Unused second halfwidths do not count.
+		if(RS_REGION_TYPE_INTERVAL == region[r].type || RS_REGION_TYPE_CIRCLE == region[r].type){
+			w[j0+4] = 0;
+		}
+		j0 += 3+ns;
+	}
+
+	// Each slice extends from za as far as every parameter stays within a
+	// range of 2*tol, and takes the middle of the ranges. The parameters
+	// are linear over each segment [z[k],z[k+1]].
+	const double zmin = 1e-12*(z[nz-1] - z[0]);
+	int nslices = 0;
+	int k = 0;
+	double za = z[0];
+	memcpy(lo, &P[0], sizeof(double) * np);
+	memcpy(hi, &P[0], sizeof(double) * np);
+	while(0 == ret && k < nz-1){
+		const double *P0 = &P[np*k];
+		const double *P1 = &P[np*(k+1)];
+		const double dz = z[k+1] - z[k];
+		double zb = z[k+1];
+		for(int j = 0; j < np; ++j){
+			const double slope = (P1[j] - P0[j]) / dz;
+			if(0 == w[j] || 0 == slope){ continue; }
+			const double bound = (slope > 0 ? lo[j] + 2*tol/w[j] : hi[j] - 2*tol/w[j]);
+			zb = std::min(zb, z[k] + (bound - P0[j]) / slope);
+		}
+		// If the ranges carried over from the earlier segments are already
+		// used up, the slice ends where this segment starts.
+		const bool stalled = (za < z[k] && zb < z[k] + zmin);
+		if(stalled){
+			zb = z[k];
+		}
+		// A sliver left by rounding is not worth a layer, nor is a slice
+		// that a tolerance below rounding error would make empty.
+		const bool whole = !stalled && (zb >= z[k+1] - zmin || zb < za + zmin);
+		if(whole){
+			zb = z[k+1];
+			for(int j = 0; j < np; ++j){
+				lo[j] = std::min(lo[j], P1[j]);
+				hi[j] = std::max(hi[j], P1[j]);
+			}
+			++k;
+			if(k < nz-1){ continue; }
+		}else if(!stalled){
+			for(int j = 0; j < np; ++j){
+				const double p = P0[j] + (P1[j] - P0[j]) * (zb - z[k]) / dz;
+				lo[j] = std::min(lo[j], p);
+				hi[j] = std::max(hi[j], p);
+			}
+		}
+
+		// Make the slice [za,zb], as a copy of an equal earlier slice if
+		// there is one.
+		if(nslices >= nslices_alloc){
+			nslices_alloc *= 2;
+			double *slice2 = (double*)realloc(slice, sizeof(double) * np*nslices_alloc);
+			RS_LayerID *slice_layer2 = (RS_LayerID*)realloc(slice_layer, sizeof(RS_LayerID) * nslices_alloc);
+			if(NULL != slice2){ slice = slice2; }
+			if(NULL != slice_layer2){ slice_layer = slice_layer2; }
+			if(NULL == slice2 || NULL == slice_layer2){
+				ret = 1;
+				break;
+			}
+		}
+		double *Ps = &slice[np*nslices];
+		for(int j = 0; j < np; ++j){
+			Ps[j] = 0.5*(lo[j] + hi[j]);
+		}
+		int copy = -1;
+		for(int i = 0; i < nslices && copy < 0; ++i){
+			if(0 == memcmp(&slice[np*i], Ps, sizeof(double) * np)){
+				copy = slice_layer[i];
+			}
+		}
+		if(NULL != name){
+			sprintf(slice_name, "%s.%d", name, nslices);
+		}
+		const double thickness = zb - za;
+		const RS_LayerID id = RS_Simulation_SetLayer(
+			S, -1, (NULL != name ? slice_name : NULL), &thickness, copy, background
+		);
+		slice_layer[nslices++] = id;
+		for(int r = 0; r < nregions && copy < 0 && 0 == ret; ++r){
+			const RS_ProfileRegion *R = &region[r];
+			if(RS_REGION_TYPE_POLYGON == R->type){
+				ret = RS_Layer_SetRegionVertices(S, id, R->material, R->type, R->nv, &Ps[3], &Ps[0], &Ps[2]);
+			}else{
+				ret = RS_Layer_SetRegionHalfwidths(S, id, R->material, R->type, &Ps[3], &Ps[0], &Ps[2]);
+			}
+			Ps += ProfileRegion_NumParams(R);
+		}
+
+		za = zb;
+		if(!whole){
+			const double p = (zb - z[k]) / dz;
+			for(int j = 0; j < np; ++j){
+				lo[j] = hi[j] = P0[j] + (P1[j] - P0[j]) * p;
+			}
+		}else{
+			memcpy(lo, &P[np*k], sizeof(double) * np);
+			memcpy(hi, &P[np*k], sizeof(double) * np);
+		}
+	}
+	RS_VERB(1, "Sliced profile %s into %d layers\n", (NULL != name ? name : ""), nslices);
+	if(NULL != first){ *first = (nslices > 0 ? slice_layer[0] : -1); }
+	if(NULL != nlayers){ *nlayers = nslices; }
+	free(slice_name);
+	free(slice_layer);
+	free(slice);
+	free(P);
+	RS_TRACE("< RS_Simulation_AddProfileLayers (ret = %d)\n", ret);
+	return ret;
+}
+
+static void LayerModes_Destroy(LayerModes *modes){
+	if(NULL != modes){
+		if(NULL != modes->map){
+			munmap(modes->map, modes->map_size);
+		}else if(NULL != modes->q && !modes->mapped){
+			RS_free(modes->q);
+		}
+		modes->q = NULL;
+		free(modes);
+	}
+}
+void Simulation_DestroyLayerModes(RS_Layer *layer){
+	LayerModes_Destroy(layer->modes);
+	layer->modes = NULL;
+}
+void Simulation_RetireLayerModes(RS_Simulation *S){
+	for(int i = 0; i < S->n_layers; ++i){
+		RS_Layer *L = &S->layer[i];
+		const LayerModes *Lmodes = L->modes;
+		// Only complete eigensystems of patterned layers are worth
+		// refining; modes in a restart file do not outlive it.
+		if(S->options.mode_continuation && NULL != Lmodes && L->pattern.nshapes > 0 &&
+			NULL != Lmodes->phi && Lmodes->nmodes == 2*S->n_G && !Lmodes->mapped
+		){
+			LayerModes_Destroy(L->prev_modes);
+			L->prev_modes = L->modes;
+			L->modes = NULL;
+		}
+		Simulation_DestroyLayerModes(L);
+	}
+}
+void RS_Simulation_DestroyLayerModes(RS_Simulation *S, RS_LayerID id){
+	if(id < 0){
+		for(int i = 0; i < S->n_layers; ++i){
+			Simulation_DestroyLayerModes(&S->layer[i]);
+		}
+	}else if(id < S->n_layers){
+		Simulation_DestroyLayerModes(&S->layer[id]);
+	}
+}
+
+int Simulation_RemoveLayerPatterns(RS_Simulation *S, RS_Layer *layer){
+	RS_TRACE("> Simulation_RemoveLayerPatterns(S=%p, layer=%p) [omega=%f]\n",
+		S, layer, S->omega[0]);
+	int ret = 0;
+	if(NULL == S){ ret = -1; }
+	if(NULL == layer){ ret = -2; }
+	if(0 != ret){
+		RS_TRACE("< Simulation_RemoveLayerPatterns (failed; ret = %d) [omega=%f]\n", ret, S->omega[0]);
+		return ret;
+	}
+
+	Simulation_DestroySolution(S);
+
+	layer->pattern.nshapes = 0;
 	if(NULL != layer->pattern.shapes){
 		free(layer->pattern.shapes);
 		layer->pattern.shapes = NULL;
@@ -996,6 +2234,11 @@ int Simulation_SetNumG(RS_Simulation *S, int n){
 
 	Simulation_DestroySolution(S);
 	Simulation_InvalidateFieldCache(S);
+	for(int i = 0; i < S->n_layers; ++i){
+		Simulation_DestroyLayerModes(&S->layer[i]);
+		LayerModes_Destroy(S->layer[i].prev_modes);
+		S->layer[i].prev_modes = NULL;
+	}
 
 	S->n_G = n;
 	S->G = (int*)RS_realloc(S->G, sizeof(int)*2*S->n_G);
@@ -1065,6 +2308,7 @@ int Simulation_AddLayerPatternCircle(
 	Simulation_DestroySolution(S);
 	Simulation_InvalidateFieldCache(S);
 
+	Layer_InvalidatePattern(layer);
 	int n = layer->pattern.nshapes++;
 	layer->pattern.shapes = (shape*)realloc(layer->pattern.shapes, sizeof(shape)*layer->pattern.nshapes);
 	if(NULL == layer->pattern.shapes){ return 1; }
@@ -1107,6 +2351,7 @@ int Simulation_AddLayerPatternEllipse(
 	Simulation_DestroySolution(S);
 	Simulation_InvalidateFieldCache(S);
 
+	Layer_InvalidatePattern(layer);
 	int n = layer->pattern.nshapes++;
 	layer->pattern.shapes = (shape*)realloc(layer->pattern.shapes, sizeof(shape)*layer->pattern.nshapes);
 	if(NULL == layer->pattern.shapes){ return 1; }
@@ -1152,6 +2397,7 @@ int Simulation_AddLayerPatternRectangle(
 	Simulation_DestroySolution(S);
 	Simulation_InvalidateFieldCache(S);
 
+	Layer_InvalidatePattern(layer);
 	int n = layer->pattern.nshapes++;
 	layer->pattern.shapes = (shape*)realloc(layer->pattern.shapes, sizeof(shape)*layer->pattern.nshapes);
 	if(NULL == layer->pattern.shapes){ return 1; }
@@ -1198,6 +2444,7 @@ int Simulation_AddLayerPatternPolygon(
 	Simulation_DestroySolution(S);
 	Simulation_InvalidateFieldCache(S);
 
+	Layer_InvalidatePattern(layer);
 	int n = layer->pattern.nshapes++;
 	layer->pattern.shapes = (shape*)realloc(layer->pattern.shapes, sizeof(shape)*layer->pattern.nshapes);
 	if(NULL == layer->pattern.shapes){ return 3; }
@@ -1290,15 +2537,18 @@ int Simulation_InitSolution(RS_Simulation *S){
 				}
 			}
 		}
-		// Initialize the layer pattern
-		if(NULL != L->pattern.parent){
+		// Initialize the layer pattern, unless its containment tree is
+		// still valid from a previous solution.
+		if(NULL == L->pattern.parent || L->pattern.nshapes < 1){
 			free(L->pattern.parent);
-		}
-		L->pattern.parent = (int*)malloc(sizeof(int)*L->pattern.nshapes);
-		int error = Pattern_GetContainmentTree(&L->pattern);
-		if(0 != error){
-			RS_TRACE("< Simulation_InitSolution (failed; Pattern_GetContainmentTree returned %d for layer %s) [omega=%f]\n", error, L->name, S->omega[0]);
-			return error;
+			L->pattern.parent = (int*)malloc(sizeof(int)*L->pattern.nshapes);
+			int error = Pattern_GetContainmentTree(&L->pattern);
+			if(0 != error){
+				RS_TRACE("< Simulation_InitSolution (failed; Pattern_GetContainmentTree returned %d for layer %s) [omega=%f]\n", error, L->name, S->omega[0]);
+				free(L->pattern.parent);
+				L->pattern.parent = NULL;
+				return error;
+			}
 		}
 	}
 	if(S->n_layers < 1){
@@ -1330,6 +2580,35 @@ int Simulation_InitSolution(RS_Simulation *S){
 		return 1;
 	}
 	memset(S->solution->solved, 0, sizeof(int) * S->n_layers);
+	S->solution->solve_workspace = 0;
+
+	// Pick the solve strategy; the memory planner takes the fastest one
+	// whose estimated total fits within the budget.
+	S->solution->strategy = Simulation_GetSolveStrategy(S);
+	if(S->options.use_memory_planner && 0 != S->options.memory_budget){
+		int strategy;
+		for(strategy = RS_SOLVE_STRATEGY_ALL; strategy < RS_SOLVE_STRATEGY_LESS_MEMORY; ++strategy){
+			if(RS_SOLVE_STRATEGY_SCRATCH == strategy && NULL == S->options.scratch_directory){ continue; }
+			RS_MemoryStats est;
+			RS_Simulation_EstimateMemory(S, strategy, &est);
+			if(est.total <= S->options.memory_budget){ break; }
+		}
+		S->solution->strategy = strategy;
+		RS_VERB(1, "Memory planner chose solve strategy %d\n", strategy);
+	}
+
+	// Size the workspace arena for the largest set of temporaries live at
+	// once: either a layer eigensolve, or an interior solve with its
+	// layer property arrays. Anything beyond this seen previously is
+	// accounted for by the high water mark.
+	{
+		size_t size = Simulation_GetWorkspaceSize(S);
+		if(S->workspace->high_water > size){
+			size = S->workspace->high_water;
+		}
+		numalloc_arena_reserve(S->workspace, size);
+		RS_VERB(1, "Workspace arena size: %lu bytes (high water %lu)\n", (unsigned long)S->workspace->size, (unsigned long)S->workspace->high_water);
+	}
 
 	RS_TRACE("I  Simulation_InitSolution G: (%d) [omega=%f]\n", S->n_G, S->omega[0]);
 
@@ -1416,6 +2695,34 @@ int RS_Simulation_SolveLayer(RS_Simulation *S, RS_LayerID layer){
 	return ret;
 }
 
+int RS_Simulation_GetLayerModeError(RS_Simulation *S, RS_LayerID layer, RS_real *residual, RS_real *truncation){
+	RS_TRACE("> RS_Simulation_GetLayerModeError(S=%p, layer=%d) [omega=%f]\n", S, layer, (NULL != S ? S->omega[0] : 0));
+	if(NULL == S){ return -1; }
+	if(layer < 0 || layer >= S->n_layers){ return -2; }
+	if(NULL == S->solution){
+		int error = Simulation_InitSolution(S);
+		if(0 != error){
+			RS_TRACE("< RS_Simulation_GetLayerModeError (failed; Simulation_InitSolution returned %d) [omega=%f]\n", error, S->omega[0]);
+			return error;
+		}
+	}
+	const RS_Layer *L = &S->layer[layer];
+	RS_Layer *Lsrc = (L->copy >= 0 ? &S->layer[L->copy] : &S->layer[layer]);
+	if(NULL == Lsrc->modes){
+		Simulation_ComputeLayerModes(S, Lsrc, &Lsrc->modes);
+	}
+	const LayerModes *Lmodes = Lsrc->modes;
+	const bool partial = (Lmodes->nmodes < 2*S->n_G);
+	if(NULL != residual){
+		*residual = Lmodes->mode_residual;
+	}
+	if(NULL != truncation){
+		*truncation = (partial ? exp(-Lmodes->q_cutoff.imag() * L->thickness) : 0);
+	}
+	RS_TRACE("< RS_Simulation_GetLayerModeError [omega=%f]\n", S->omega[0]);
+	return 0;
+}
+
 int Simulation_ComputeLayerSolution(RS_Simulation *S, RS_Layer *L, LayerModes **layer_modes, std::complex<double> **layer_solution){
 	RS_TRACE("> Simulation_ComputeLayerSolution(S=%p, L=%p (%s), layer_modes=%p (%p), LayerSolution=%p (%p)) [omega=%f]\n",
 		S, L, (NULL != L && NULL != L->name ? L->name : ""), layer_modes, (NULL != layer_modes ? *layer_modes : NULL), layer_solution, (NULL != layer_solution ? *layer_solution : NULL), S->omega[0]);
@@ -1462,11 +2769,36 @@ int Simulation_ComputeLayerSolution(RS_Simulation *S, RS_Layer *L, LayerModes **
 		return -1;
 	}
 
+	if(1 == S->exc.type && NULL == S->exc.layer){
+		RS_TRACE("< Simulation_ComputeLayerSolution (failed; no dipole layer) [omega=%f]\n", S->omega[0]);
+		return 13;
+	}
+
 	// Make arrays of q, kp, and phi
-	double *lthick = (double*)RS_malloc(sizeof(double)*S->n_layers);
-	int *lepstype = (int*)RS_malloc(sizeof(int)*S->n_layers);
-	const std::complex<double> **lq   = (const std::complex<double> **)RS_malloc(sizeof(const std::complex<double> *)*S->n_layers*4);
-	if(NULL == lthick || NULL == lq){
+	double *lthick = (double*)Simulation_WorkspaceAlloc(S, sizeof(double)*S->n_layers);
+	int *lepstype = (int*)Simulation_WorkspaceAlloc(S, sizeof(int)*S->n_layers);
+	const std::complex<double> **lq   = (const std::complex<double> **)Simulation_WorkspaceAlloc(S, sizeof(const std::complex<double> *)*S->n_layers*4);
+	// Workspace for SolveInterior and SolveBoundary, shared by all of their uses below
+	const size_t lwork_interior = 2*n4*n4 + 2*n2 + n4*(n4+1);
+	std::complex<double> *work_interior = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>)*lwork_interior);
+	size_t *iwork_interior = (size_t*)Simulation_WorkspaceAlloc(S, sizeof(size_t)*n4);
+	// Workspace of the excitation below: the incident amplitudes and a copy
+	// of phi for a planewave, or the dipole source terms
+	size_t lwork_exc = n4 + n4*n4 + n2*n2;
+	if(0 == S->exc.type || 2 == S->exc.type){
+		const int ind = (0 == S->exc.type && 0 != S->exc.sub.planewave.backwards ? S->n_layers-1 : 0);
+		const RS_Layer *SL = &S->layer[ind];
+		if(SL->copy >= 0){ SL = &S->layer[SL->copy]; }
+		lwork_exc = (0 == S->exc.type ? n2 : n4) + (NULL == SL->modes->phi ? 0 : n2*n2);
+	}
+	std::complex<double> *work_exc = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>)*lwork_exc);
+	if(NULL == lthick || NULL == lepstype || NULL == lq || NULL == work_interior || NULL == iwork_interior || NULL == work_exc){
+		Simulation_WorkspaceFree(S, work_exc);
+		Simulation_WorkspaceFree(S, iwork_interior);
+		Simulation_WorkspaceFree(S, work_interior);
+		Simulation_WorkspaceFree(S, lq);
+		Simulation_WorkspaceFree(S, lepstype);
+		Simulation_WorkspaceFree(S, lthick);
 		RS_TRACE("< Simulation_ComputeLayerSolution (failed; could not allocate work arrays) [omega=%f]\n", S->omega[0]);
 		return 1;
 	}
@@ -1487,14 +2819,14 @@ int Simulation_ComputeLayerSolution(RS_Simulation *S, RS_Layer *L, LayerModes **
 	}
 
 	// Compose the RCWA solution
+	const int symmetries = Simulation_GetStackSymmetries(S);
 	int error = 0;
 	if(0 == S->exc.type){
 		// Front incidence by planewave
 		const size_t order = S->exc.sub.planewave.order;
 		const bool inc_back = (0 != S->exc.sub.planewave.backwards);
 		const size_t ind_fb = (inc_back ? S->n_layers-1 : 0);
-		const size_t phicopy_size = (NULL == lphi[ind_fb] ? 0 : n2*n2);
-		std::complex<double> *ab0 = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>)*(n2+phicopy_size));
+		std::complex<double> *ab0 = work_exc;
 		std::complex<double> *phicopy = (NULL == lphi[ind_fb] ? NULL : ab0 + n2);
 		RNP::TBLAS::Fill(n2, 0., ab0,1);
 		if(order < n){
@@ -1510,7 +2842,26 @@ int Simulation_ComputeLayerSolution(RS_Simulation *S, RS_Layer *L, LayerModes **
 			RNP::LinearSolve<'N'>(n2,1, phicopy,n2, ab0,n2, NULL, NULL);
 		}
 
-		if(S->options.use_less_memory){
+		const bool boundary_layer = (0 == which_layer || S->n_layers-1 == which_layer);
+		if(S->options.use_boundary_only_solve && boundary_layer){
+			RS_TRACE("I  Calling SolveBoundary(layer_count=%d, n=%d) [omega=%f]\n", S->n_layers, S->n_G, S->omega[0]);
+			std::complex<double> *ab_first = sol->ab;
+			std::complex<double> *ab_last = &sol->ab[(S->n_layers-1)*n4];
+			error = SolveBoundary(
+				S->n_layers,
+				S->n_G,
+				S->kx, S->ky,
+				std::complex<double>(S->omega[0], S->omega[1]),
+				lthick, lq, lepsinv, lepstype, lkp, lphi,
+				inc_back ? NULL : ab0, // a0
+				inc_back ? ab0 : NULL, // bN
+				ab_first, ab_last,
+				work_interior, iwork_interior, lwork_interior, symmetries);
+			if(0 == error){
+				sol->solved[0] = 1;
+				sol->solved[S->n_layers-1] = 1;
+			}
+		}else if(RS_SOLVE_STRATEGY_LESS_MEMORY == sol->strategy || S->options.use_boundary_only_solve){
 			RS_TRACE("I  Calling SolveInterior(layer_count=%d, which_layer=%d, n=%d, lthick,lq,lkp,lphi={\n", S->n_layers, which_layer, S->n_G);
 			for(int i = 0; i < S->n_layers; ++i){
 				RS_TRACE("I    %f, %p (0,0=%f,%f), %p (0,0=%f,%f), %p (0,0=%f,%f)\n", lthick[i],
@@ -1528,7 +2879,8 @@ int Simulation_ComputeLayerSolution(RS_Simulation *S, RS_Layer *L, LayerModes **
 				lthick, lq, lepsinv, lepstype, lkp, lphi,
 				inc_back ? NULL : ab0, // length 2*n
 				inc_back ? ab0 : NULL, // bN
-				(*layer_solution));
+				(*layer_solution),
+				work_interior, iwork_interior, lwork_interior, symmetries);
 		}else{
 			// Solve all at once
 			std::complex<double> *pab = sol->ab;
@@ -1538,28 +2890,61 @@ int Simulation_ComputeLayerSolution(RS_Simulation *S, RS_Layer *L, LayerModes **
 			}else{
 				memcpy(&pab[S->n_layers*n4 - n2], ab0, sizeof(std::complex<double>) * n2);
 			}
-			const size_t lwork = 6*S->n_layers*n2*n2;
-			std::complex<double> *work = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>) * lwork);
-			size_t *iwork = (size_t*)RS_malloc(sizeof(size_t) * S->n_layers*n2);
-			SolveAll(
-				S->n_layers, S->n_G, S->kx, S->ky,
-				std::complex<double>(S->omega[0], S->omega[1]),
-				lthick, lq, lepsinv, lepstype, lkp, lphi,
-				pab,
-				work, iwork, lwork
-			);
-			RS_free(iwork);
-			RS_free(work);
+			if(RS_SOLVE_STRATEGY_ALL == sol->strategy){
+				const size_t lwork = 6*S->n_layers*n2*n2;
+				std::complex<double> *work = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>) * lwork);
+				size_t *iwork = (size_t*)RS_malloc(sizeof(size_t) * S->n_layers*n2);
+				SolveAll(
+					S->n_layers, S->n_G, S->kx, S->ky,
+					std::complex<double>(S->omega[0], S->omega[1]),
+					lthick, lq, lepsinv, lepstype, lkp, lphi,
+					pab,
+					work, iwork, lwork
+				);
+				RS_free(iwork);
+				RS_free(work);
+				sol->solve_workspace = Simulation_GetSolveWorkspaceSize(S, RS_SOLVE_STRATEGY_ALL);
+			}else{
+				// Two-pass solve; the per-layer store goes to a scratch file
+				// if it would not fit within the budget.
+				const size_t lwork_streaming = 2*n4*n4 + n4*(n4+1);
+				const size_t store_size = sizeof(std::complex<double>)*(n2*n2+n2)*S->n_layers;
+				std::complex<double> *store = NULL;
+				bool mapped = false;
+				if(RS_SOLVE_STRATEGY_SCRATCH == sol->strategy){
+					store = (std::complex<double>*)RS_scratch_map(S->options.scratch_directory, store_size);
+					mapped = (NULL != store);
+				}
+				if(NULL == store){
+					store = (std::complex<double>*)RS_malloc(store_size);
+				}
+				RS_VERB(1, "Using two-pass solver (%s per-layer storage)\n", mapped ? "file mapped" : "in-memory");
+				std::complex<double> *work = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>) * lwork_streaming);
+				size_t *iwork = (size_t*)RS_malloc(sizeof(size_t) * n4);
+				error = SolveAllStreaming(
+					S->n_layers, S->n_G, S->kx, S->ky,
+					std::complex<double>(S->omega[0], S->omega[1]),
+					lthick, lq, lepsinv, lepstype, lkp, lphi,
+					pab, store,
+					work, iwork, lwork_streaming
+				);
+				RS_free(iwork);
+				RS_free(work);
+				if(mapped){
+					RS_scratch_unmap(store, store_size);
+				}else{
+					RS_free(store);
+				}
+				sol->solve_workspace = Simulation_GetSolveWorkspaceSize(S, mapped ? RS_SOLVE_STRATEGY_SCRATCH : RS_SOLVE_STRATEGY_STREAMING);
+			}
 			for(size_t i = 0; i < S->n_layers; ++i){
 				sol->solved[i] = 1;
 			}
 		}
-		RS_free(ab0);
 	}else if(2 == S->exc.type){
 		Excitation_Exterior *ext = &(S->exc.sub.exterior);
 		// Front incidence by planewave
-		size_t phicopy_size = (NULL == lphi[0] ? 0 : n2*n2);
-		std::complex<double> *a0 = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>)*(n4+phicopy_size));
+		std::complex<double> *a0 = work_exc;
 		std::complex<double> *bN = a0 + n2;
 		RNP::TBLAS::Fill(n4, 0., a0,1);
 		for(size_t i = 0; i < ext->n; ++i){
@@ -1600,15 +2985,14 @@ int Simulation_ComputeLayerSolution(RS_Simulation *S, RS_Layer *L, LayerModes **
 			lthick, lq, lepsinv, lepstype, lkp, lphi,
 			a0, // length 2*n
 			bN, // bN
-			(*layer_solution));
-		RS_free(a0);
+			(*layer_solution),
+			work_interior, iwork_interior, lwork_interior, symmetries);
 	}else if(1 == S->exc.type){
 		RS_Layer *l[2];
 		l[0] = S->exc.layer;
 		const int li = (l[0] - &S->layer[0]);
-		if(NULL == l[0]){ return 13; }
 		l[1] = l[0]+1;
-		std::complex<double> *ab = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>)*(n4+n4*n4+n2*n2));
+		std::complex<double> *ab = work_exc;
 		std::complex<double> *work4 = ab + n4;
 		std::complex<double> *work2 = work4 + n4*n4;
 		std::complex<double> J0[3] = {
@@ -1730,7 +3114,8 @@ int Simulation_ComputeLayerSolution(RS_Simulation *S, RS_Layer *L, LayerModes **
 				lthick, lq, lepsinv, lepstype, lkp, lphi,
 				NULL, // length 2*n
 				&ab[n2], // bN
-				(*layer_solution));
+				(*layer_solution),
+				work_interior, iwork_interior, lwork_interior, symmetries);
 		}else{
 			error = SolveInterior(
 				S->n_layers-li, which_layer-li,
@@ -1740,17 +3125,20 @@ int Simulation_ComputeLayerSolution(RS_Simulation *S, RS_Layer *L, LayerModes **
 				lthick+li, lq+li, lepsinv+li, lepstype+li, lkp+li, lphi+li,
 				&ab[0], // length 2*n
 				NULL, // bN
-				(*layer_solution));
+				(*layer_solution),
+				work_interior, iwork_interior, lwork_interior, symmetries);
 		}
-		RS_free(ab);
 	}
 	sol->solved[which_layer] = 1;
 
 	RS_TRACE("I  ab[0] = %f,%f [omega=%f]\n", (*layer_solution)[0].real(), (*layer_solution)[0].imag(), S->omega[0]);
 
-	RS_free(lq);
-	RS_free(lepstype);
-	RS_free(lthick);
+	Simulation_WorkspaceFree(S, work_exc);
+	Simulation_WorkspaceFree(S, iwork_interior);
+	Simulation_WorkspaceFree(S, work_interior);
+	Simulation_WorkspaceFree(S, lq);
+	Simulation_WorkspaceFree(S, lepstype);
+	Simulation_WorkspaceFree(S, lthick);
 
 	if(0 != error){
 		RS_TRACE("< Simulation_ComputeLayerSolution (failed; SolveInterior returned %d) [omega=%f]\n", error, S->omega[0]);
@@ -1769,6 +3157,499 @@ double Simulation_GetUnitCellSize(const RS_Simulation *S){
 	}
 }
 
+// Persistent layer mode cache. Each entry is a file in the cache
+// directory named by a 128-bit hash of the inputs of a layer eigensolve:
+// the sizes, omega, kx, ky, and the Fourier coupling matrices, which in
+// turn capture the pattern, materials, lattice, G list and FMM options.
+// The requested partial mode count is part of the key. An entry holds,
+// in native byte order:
+//   ModeCacheHeader, padded to MODECACHE_HEADER bytes
+//   q, kp, phi, Epsilon_inv, Epsilon2 laid out as in LayerModes
+//   omega[2], kx[n], ky[n]
+// The inputs are stored too and compared on lookup, so that a hash
+// collision can only cause a miss. Entries are written to a temporary
+// file and renamed into place, so readers in other processes only ever
+// see complete entries, and are never modified afterwards. The file
+// modification time records the last use for eviction. A temporary
+// file left by a process that died while writing it is removed by the
+// next scan of the directory once it is MODECACHE_STALE seconds old.
+#define MODECACHE_MAGIC "RCWAMODE"
+#define MODECACHE_VERSION 2
+#define MODECACHE_HEADER 128
+#define MODECACHE_STALE 3600
+
+struct ModeCacheHeader{
+	char magic[8];
+	uint32_t version;
+	int32_t n;
+	int32_t epstype;
+	int32_t partial_mode_count; // as requested in the options
+	uint64_t kp_size, phi_size;
+	uint64_t key[2];
+	int32_t nmodes; // as in LayerModes
+	int32_t reserved;
+	double mode_residual;
+	double q_cutoff[2];
+};
+
+static void ModeCache_SetHeader(ModeCacheHeader *h, size_t n, int epstype, int partial_mode_count, size_t kp_size, size_t phi_size, const uint64_t key[2]){
+	memset(h, 0, sizeof(ModeCacheHeader));
+	memcpy(h->magic, MODECACHE_MAGIC, 8);
+	h->version = MODECACHE_VERSION;
+	h->n = n;
+	h->epstype = epstype;
+	h->partial_mode_count = partial_mode_count;
+	h->kp_size = kp_size;
+	h->phi_size = phi_size;
+	if(NULL != key){
+		h->key[0] = key[0];
+		h->key[1] = key[1];
+	}
+}
+
+static void ModeCache_Hash(uint64_t h[2], const void *data, size_t len){
+	const unsigned char *p = (const unsigned char*)data;
+	size_t i = 0;
+	for(; i+8 <= len; i += 8){
+		uint64_t w;
+		memcpy(&w, p+i, 8);
+		h[0] = (h[0] ^ w) * 0x100000001b3ULL;
+		h[0] ^= h[0] >> 32;
+		h[1] = (h[1] + w) * 0x9e3779b97f4a7c15ULL;
+		h[1] ^= h[1] >> 29;
+	}
+	for(; i < len; ++i){
+		h[0] = (h[0] ^ p[i]) * 0x100000001b3ULL;
+		h[1] = (h[1] + p[i]) * 0x9e3779b97f4a7c15ULL;
+	}
+}
+
+// Computes the cache key of the eigenproblem of a layer whose epsilon
+// matrices have been filled in.
+static void Simulation_ModeCacheKey(const RS_Simulation *S, const LayerModes *pB, size_t kp_size, size_t phi_size, uint64_t key[2]){
+	const size_t n = S->n_G;
+	ModeCacheHeader info;
+	ModeCache_SetHeader(&info, n, pB->epstype, S->options.partial_mode_count, kp_size, phi_size, NULL);
+	key[0] = 0xcbf29ce484222325ULL;
+	key[1] = 0x6a09e667f3bcc909ULL;
+	ModeCache_Hash(key, &info, sizeof(ModeCacheHeader));
+	ModeCache_Hash(key, S->omega, sizeof(double) * 2);
+	ModeCache_Hash(key, S->kx, sizeof(double) * 2*n);
+	ModeCache_Hash(key, pB->Epsilon_inv, sizeof(std::complex<double>) * n*n);
+	ModeCache_Hash(key, pB->Epsilon2, sizeof(std::complex<double>) * 4*n*n);
+}
+
+// Returns a malloc'ed path of the cache entry with the given key,
+// followed by the given suffix.
+static char* ModeCache_Path(const char *dir, const uint64_t key[2], const char *suffix){
+	const size_t len = strlen(dir) + 48 + strlen(suffix);
+	char *path = (char*)malloc(len);
+	if(NULL == path){ return NULL; }
+	snprintf(path, len, "%s/%016llx%016llx.modes%s", dir,
+		(unsigned long long)key[0], (unsigned long long)key[1], suffix);
+	return path;
+}
+
+static size_t ModeCache_EntrySize(size_t n, size_t kp_size, size_t phi_size){
+	return MODECACHE_HEADER
+		+ sizeof(std::complex<double>) * (2*n + kp_size + phi_size + 5*n*n)
+		+ sizeof(double) * (2 + 2*n);
+}
+
+// Looks up the eigenproblem of pB in the mode cache. On a hit, the
+// arrays of pB are replaced by ones in a private mapping of the entry,
+// and 1 is returned.
+static int Simulation_ModeCacheLookup(RS_Simulation *S, LayerModes *pB, size_t kp_size, size_t phi_size, const uint64_t key[2]){
+	const size_t n = S->n_G;
+	char *path = ModeCache_Path(S->options.mode_cache_directory, key, "");
+	if(NULL == path){ return 0; }
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if(fd < 0){ return 0; }
+
+	const size_t size = ModeCache_EntrySize(n, kp_size, phi_size);
+	struct stat st;
+	void *map = NULL;
+	if(0 == fstat(fd, &st) && (size_t)st.st_size == size){
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if(MAP_FAILED == map){ map = NULL; }
+	}
+	if(NULL != map){
+		// Mark the entry as recently used.
+		futimens(fd, NULL);
+	}
+	close(fd);
+	if(NULL == map){ return 0; }
+
+	const ModeCacheHeader *h = (const ModeCacheHeader*)map;
+	std::complex<double> *q = (std::complex<double>*)((char*)map + MODECACHE_HEADER);
+	std::complex<double> *Epsilon_inv = q + 2*n + kp_size + phi_size;
+	std::complex<double> *Epsilon2 = Epsilon_inv + n*n;
+	const double *inputs = (const double*)(Epsilon2 + 4*n*n);
+	if(
+		0 != memcmp(h->magic, MODECACHE_MAGIC, 8) || MODECACHE_VERSION != h->version ||
+		(int32_t)n != h->n || pB->epstype != h->epstype ||
+		S->options.partial_mode_count != h->partial_mode_count ||
+		kp_size != h->kp_size || phi_size != h->phi_size ||
+		0 != memcmp(inputs, S->omega, sizeof(double) * 2) ||
+		0 != memcmp(inputs+2, S->kx, sizeof(double) * 2*n) ||
+		0 != memcmp(Epsilon_inv, pB->Epsilon_inv, sizeof(std::complex<double>) * n*n) ||
+		0 != memcmp(Epsilon2, pB->Epsilon2, sizeof(std::complex<double>) * 4*n*n)
+	){
+		munmap(map, size);
+		return 0;
+	}
+
+	RS_free(pB->q);
+	pB->q = q;
+	pB->kp = (0 != kp_size ? q + 2*n : NULL);
+	pB->phi = (0 != phi_size ? q + 2*n + kp_size : NULL);
+	pB->Epsilon_inv = Epsilon_inv;
+	pB->Epsilon2 = Epsilon2;
+	pB->map = map;
+	pB->map_size = size;
+	pB->nmodes = h->nmodes;
+	pB->mode_residual = h->mode_residual;
+	pB->q_cutoff = std::complex<double>(h->q_cutoff[0], h->q_cutoff[1]);
+	return 1;
+}
+
+struct ModeCacheEntry{
+	char *name;
+	struct timespec mtime;
+	size_t size;
+	bool operator<(const ModeCacheEntry &e) const{
+		if(mtime.tv_sec != e.mtime.tv_sec){ return mtime.tv_sec < e.mtime.tv_sec; }
+		return mtime.tv_nsec < e.mtime.tv_nsec;
+	}
+};
+
+// Removes the least recently used entries of the mode cache directory
+// until it occupies at most limit bytes, or none if limit is zero, and
+// any stale temporary files. Entries removed while mapped by some process
+// remain valid for that process until unmapped.
+static void ModeCache_Evict(const char *dir, size_t limit){
+	DIR *d = opendir(dir);
+	if(NULL == d){ return; }
+	const size_t dirlen = strlen(dir);
+	const time_t now = time(NULL);
+	size_t nentries = 0, nalloc = 16, total = 0;
+	ModeCacheEntry *entries = (ModeCacheEntry*)malloc(sizeof(ModeCacheEntry) * nalloc);
+	struct dirent *de;
+	while(NULL != entries && NULL != (de = readdir(d))){
+		const size_t len = strlen(de->d_name);
+		// Temporary files are named as entries followed by ".XXXXXX".
+		const bool temp = (len >= 13 && 0 == strncmp(de->d_name + len-13, ".modes.", 7));
+		if(!temp && (len < 6 || 0 != strcmp(de->d_name + len-6, ".modes"))){ continue; }
+		char *path = (char*)malloc(dirlen + len + 2);
+		if(NULL == path){ continue; }
+		sprintf(path, "%s/%s", dir, de->d_name);
+		struct stat st;
+		if(0 != stat(path, &st)){
+			free(path);
+			continue;
+		}
+		if(temp){
+			// A younger one may still be being written by another process.
+			if(st.st_mtime + MODECACHE_STALE < now){
+				unlink(path);
+			}
+			free(path);
+			continue;
+		}
+		if(0 == limit){
+			free(path);
+			continue;
+		}
+		if(nentries >= nalloc){
+			nalloc *= 2;
+			ModeCacheEntry *p = (ModeCacheEntry*)realloc(entries, sizeof(ModeCacheEntry) * nalloc);
+			if(NULL == p){
+				free(path);
+				break;
+			}
+			entries = p;
+		}
+		entries[nentries].name = path;
+		entries[nentries].mtime = st.st_mtim;
+		entries[nentries].size = st.st_size;
+		total += st.st_size;
+		++nentries;
+	}
+	closedir(d);
+	if(NULL == entries){ return; }
+
+	std::sort(entries, entries + nentries);
+	for(size_t i = 0; i < nentries; ++i){
+		if(total > limit){
+			// Another process may have removed it already.
+			unlink(entries[i].name);
+			total -= entries[i].size;
+		}
+		free(entries[i].name);
+	}
+	free(entries);
+}
+
+// Stores the modes of pB in the mode cache. Failures are ignored; the
+// cache is only an optimization.
+static void Simulation_ModeCacheStore(const RS_Simulation *S, const LayerModes *pB, size_t kp_size, size_t phi_size, const uint64_t key[2]){
+	const char *dir = S->options.mode_cache_directory;
+	const size_t n = S->n_G;
+	char *tmppath = ModeCache_Path(dir, key, ".XXXXXX");
+	if(NULL == tmppath){ return; }
+	int fd = mkstemp(tmppath);
+	if(fd < 0){
+		free(tmppath);
+		return;
+	}
+
+	const size_t size = ModeCache_EntrySize(n, kp_size, phi_size);
+	char header[MODECACHE_HEADER] = {0};
+	ModeCacheHeader *h = (ModeCacheHeader*)header;
+	ModeCache_SetHeader(h, n, pB->epstype, S->options.partial_mode_count, kp_size, phi_size, key);
+	h->nmodes = pB->nmodes;
+	h->mode_residual = pB->mode_residual;
+	h->q_cutoff[0] = pB->q_cutoff.real();
+	h->q_cutoff[1] = pB->q_cutoff.imag();
+	const struct{ const void *p; size_t len; } parts[] = {
+		{ header, MODECACHE_HEADER },
+		{ pB->q, sizeof(std::complex<double>) * 2*n },
+		{ pB->kp, sizeof(std::complex<double>) * kp_size },
+		{ pB->phi, sizeof(std::complex<double>) * phi_size },
+		{ pB->Epsilon_inv, sizeof(std::complex<double>) * n*n },
+		{ pB->Epsilon2, sizeof(std::complex<double>) * 4*n*n },
+		{ S->omega, sizeof(double) * 2 },
+		{ S->kx, sizeof(double) * 2*n }
+	};
+	size_t written = 0;
+	for(size_t i = 0; i < sizeof(parts)/sizeof(parts[0]); ++i){
+		const char *p = (const char*)parts[i].p;
+		size_t len = parts[i].len;
+		while(len > 0){
+			ssize_t ret = write(fd, p, len);
+			if(ret <= 0){ break; }
+			p += ret;
+			len -= ret;
+			written += ret;
+		}
+	}
+	fchmod(fd, 0644);
+	const bool complete = (0 == close(fd) && written == size);
+	char *path = (complete ? ModeCache_Path(dir, key, "") : NULL);
+	if(NULL == path || 0 != rename(tmppath, path)){
+		// Never leave a partial entry behind.
+		unlink(tmppath);
+	}
+	free(path);
+	free(tmppath);
+
+	ModeCache_Evict(dir, S->options.mode_cache_size);
+}
+
+// Returns whether pattern b is pattern a translated by some shift, shape
+// by shape, and if so the shift. Centers agree to within tol after the
+// shift; everything else must be equal.
+static bool Pattern_IsTranslate(const Pattern *a, const Pattern *b, double tol, double shift[2]){
+	if(a->nshapes != b->nshapes || a->nshapes < 1){ return false; }
+	shift[0] = b->shapes[0].center[0] - a->shapes[0].center[0];
+	shift[1] = b->shapes[0].center[1] - a->shapes[0].center[1];
+	for(int i = 0; i < a->nshapes; ++i){
+		const shape *sa = &a->shapes[i];
+		const shape *sb = &b->shapes[i];
+		if(sa->type != sb->type || sa->tag != sb->tag || sa->angle != sb->angle){ return false; }
+		if(fabs(sb->center[0] - sa->center[0] - shift[0]) > tol){ return false; }
+		if(fabs(sb->center[1] - sa->center[1] - shift[1]) > tol){ return false; }
+		switch(sa->type){
+		case CIRCLE:
+			if(sa->vtab.circle.radius != sb->vtab.circle.radius){ return false; }
+			break;
+		case ELLIPSE:
+			if(sa->vtab.ellipse.halfwidth[0] != sb->vtab.ellipse.halfwidth[0]){ return false; }
+			if(sa->vtab.ellipse.halfwidth[1] != sb->vtab.ellipse.halfwidth[1]){ return false; }
+			break;
+		case RECTANGLE:
+			if(sa->vtab.rectangle.halfwidth[0] != sb->vtab.rectangle.halfwidth[0]){ return false; }
+			if(sa->vtab.rectangle.halfwidth[1] != sb->vtab.rectangle.halfwidth[1]){ return false; }
+			break;
+		case POLYGON:
+			if(sa->vtab.polygon.n_vertices != sb->vtab.polygon.n_vertices){ return false; }
+			if(0 != memcmp(sa->vtab.polygon.vertex, sb->vtab.polygon.vertex, sizeof(double) * 2*sa->vtab.polygon.n_vertices)){ return false; }
+			break;
+		}
+	}
+	return true;
+}
+
+// Looks for the modes of another layer whose pattern differs from that of
+// L only by a translation, from which those of L follow without an
+// eigensolve. Only the closed form Fourier coefficients are exactly
+// covariant under translation, so other formulations are excluded.
+static const LayerModes* Simulation_FindTranslatedModes(
+	const RS_Simulation *S, const RS_Layer *L, size_t kp_size, double shift[2]
+){
+	if(L->copy >= 0 || L->pattern.nshapes < 1 || S->options.use_experimental_fmm ||
+		S->options.use_discretized_epsilon || S->options.use_polarization_basis
+	){
+		return NULL;
+	}
+	const double tol = 1e-14 * sqrt(Simulation_GetUnitCellSize(S));
+	for(int i = 0; i < S->n_layers; ++i){
+		const RS_Layer *L2 = &S->layer[i];
+		if(L2 == L || L2->copy >= 0 || L2->material != L->material || NULL == L2->modes){ continue; }
+		const LayerModes *Lmodes = L2->modes;
+		if(EPSILON2_TYPE_FULL != Lmodes->epstype || NULL == Lmodes->phi || (NULL == Lmodes->kp) != (0 == kp_size)){ continue; }
+		if(Pattern_IsTranslate(&L2->pattern, &L->pattern, tol, shift)){
+			return Lmodes;
+		}
+	}
+	return NULL;
+}
+
+// Sets the modes B of a layer whose pattern is that of the layer with
+// modes A translated by shift. The Fourier coefficient at dG is then
+// multiplied by exp(-i 2pi dG.shift), so each n x n block of the coupling
+// matrices and kp is conjugated by D = diag(exp(-i 2pi G.shift)), the
+// eigenvalues are unchanged and phi becomes diag(D,D) phi.
+static int Simulation_TranslateLayerModes(
+	const RS_Simulation *S, const LayerModes *A, const double shift[2],
+	LayerModes *B, size_t kp_size
+){
+	const size_t n = S->n_G;
+	const size_t n2 = 2*n;
+	std::complex<double> *d = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * n);
+	if(NULL == d){ return 1; }
+	for(size_t i = 0; i < n; ++i){
+		const double f[2] = {
+			S->G[2*i+0] * S->Lk[0] + S->G[2*i+1] * S->Lk[2],
+			S->G[2*i+0] * S->Lk[1] + S->G[2*i+1] * S->Lk[3]
+		};
+		d[i] = std::polar(1., -2*M_PI*(f[0]*shift[0] + f[1]*shift[1]));
+	}
+	memcpy(B->q, A->q, sizeof(std::complex<double>) * n2);
+	for(size_t j = 0; j < n2; ++j){
+		const std::complex<double> dj = std::conj(d[j%n]);
+		for(size_t i = 0; i < n2; ++i){
+			B->Epsilon2[i+j*n2] = d[i%n] * A->Epsilon2[i+j*n2] * dj;
+			B->phi[i+j*n2] = d[i%n] * A->phi[i+j*n2];
+			if(0 != kp_size){
+				B->kp[i+j*n2] = d[i%n] * A->kp[i+j*n2] * dj;
+			}
+		}
+	}
+	for(size_t j = 0; j < n; ++j){
+		for(size_t i = 0; i < n; ++i){
+			B->Epsilon_inv[i+j*n] = d[i] * A->Epsilon_inv[i+j*n] * std::conj(d[j]);
+		}
+	}
+	B->nmodes = A->nmodes;
+	B->mode_residual = A->mode_residual;
+	B->q_cutoff = A->q_cutoff;
+	Simulation_WorkspaceFree(S, d);
+	return 0;
+}
+
+// Returns whether shape b is the image of shape a under the map
+// (x,y) -> (sx*x, sy*y), up to a lattice translation. Lengths agree to
+// within tol. In a 1D lattice only the extent along the lattice vector
+// matters.
+static bool Pattern_ShapeIsImage(
+	const RS_Simulation *S, const shape *a, const shape *b,
+	double sx, double sy, double tol
+){
+	if(a->type != b->type || a->tag != b->tag){ return false; }
+	const bool lattice1d = (0 == S->Lr[2] && 0 == S->Lr[3]);
+	const double d[2] = { sx*a->center[0] - b->center[0], sy*a->center[1] - b->center[1] };
+	for(int i = 0; i < (lattice1d ? 1 : 2); ++i){
+		const double t = S->Lk[2*i+0]*d[0] + S->Lk[2*i+1]*d[1];
+		const double len = hypot(S->Lr[2*i+0], S->Lr[2*i+1]);
+		if(fabs(t - floor(t + 0.5)) * len > tol){ return false; }
+	}
+	if(lattice1d){
+		return (RECTANGLE == a->type && fabs(a->vtab.rectangle.halfwidth[0] - b->vtab.rectangle.halfwidth[0]) <= tol);
+	}
+	// A mirror negates the angle; the two-fold rotation leaves the shapes
+	// other than polygons unchanged.
+	const double angle = (sx*sy < 0 ? -a->angle : a->angle);
+	const double dangle = remainder(angle - b->angle, M_PI);
+	switch(a->type){
+	case CIRCLE:
+		return fabs(a->vtab.circle.radius - b->vtab.circle.radius) <= tol;
+	case ELLIPSE:
+	case RECTANGLE:
+		{
+			const double *ha = (ELLIPSE == a->type ? a->vtab.ellipse.halfwidth : a->vtab.rectangle.halfwidth);
+			const double *hb = (ELLIPSE == b->type ? b->vtab.ellipse.halfwidth : b->vtab.rectangle.halfwidth);
+			const double scale = std::max(ha[0], ha[1]);
+			if(fabs(dangle) * scale <= tol){
+				return fabs(ha[0] - hb[0]) <= tol && fabs(ha[1] - hb[1]) <= tol;
+			}
+			if((0.5*M_PI - fabs(dangle)) * scale <= tol){
+				return fabs(ha[0] - hb[1]) <= tol && fabs(ha[1] - hb[0]) <= tol;
+			}
+			return false;
+		}
+	case POLYGON:
+		{
+			const int nv = a->vtab.polygon.n_vertices;
+			if(nv != b->vtab.polygon.n_vertices){ return false; }
+			const double ca = cos(a->angle), sa = sin(a->angle);
+			const double cb = cos(b->angle), sb = sin(b->angle);
+			for(int i = 0; i < nv; ++i){
+				const double *v = &a->vtab.polygon.vertex[2*i];
+				const double p[2] = { sx*(ca*v[0] - sa*v[1]), sy*(sa*v[0] + ca*v[1]) };
+				int j;
+				for(j = 0; j < nv; ++j){
+					const double *w = &b->vtab.polygon.vertex[2*j];
+					if(hypot(cb*w[0] - sb*w[1] - p[0], sb*w[0] + cb*w[1] - p[1]) <= tol){ break; }
+				}
+				if(nv == j){ return false; }
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+// Returns the symmetries of the pattern of L about the origin, as a
+// combination of the LAYER_SYMMETRY_* flags of rcwa.h. A symmetry holds
+// when every shape maps onto a shape of the same material. This is only
+// a screen for SolveLayerEigensystemSymmetric, which confirms it on the
+// layer operator.
+static int Simulation_GetLayerSymmetries(const RS_Simulation *S, const RS_Layer *L){
+	static const int flags[3] = { LAYER_SYMMETRY_MIRROR_X, LAYER_SYMMETRY_MIRROR_Y, LAYER_SYMMETRY_ROTATE };
+	static const double sign[3][2] = { { -1, 1 }, { 1, -1 }, { -1, -1 } };
+	const double tol = 1e-10 * sqrt(Simulation_GetUnitCellSize(S));
+	const Pattern *p = &L->pattern;
+	int symmetries = 0;
+	for(int d = 0; d < 3; ++d){
+		bool symmetric = true;
+		for(int i = 0; i < p->nshapes && symmetric; ++i){
+			int j;
+			for(j = 0; j < p->nshapes; ++j){
+				if(Pattern_ShapeIsImage(S, &p->shapes[i], &p->shapes[j], sign[d][0], sign[d][1], tol)){ break; }
+			}
+			symmetric = (j < p->nshapes);
+		}
+		if(symmetric){ symmetries |= flags[d]; }
+	}
+	return symmetries;
+}
+
+// Returns the symmetries shared by the patterns of all layers if the
+// symmetry adapted basis is in use, or 0. GetSMatrix composes the
+// S-matrix per symmetry sector when the modes of every layer decompose.
+static int Simulation_GetStackSymmetries(const RS_Simulation *S){
+	if(!S->options.use_symmetry_adapted_basis){ return 0; }
+	int symmetries = LAYER_SYMMETRY_MIRROR_X | LAYER_SYMMETRY_MIRROR_Y | LAYER_SYMMETRY_ROTATE;
+	for(int i = 0; i < S->n_layers && 0 != symmetries; ++i){
+		const RS_Layer *L = &S->layer[i];
+		if(L->copy >= 0){ L = &S->layer[L->copy]; }
+		symmetries &= Simulation_GetLayerSymmetries(S, L);
+	}
+	return symmetries;
+}
+
 int Simulation_ComputeLayerModes(RS_Simulation *S, RS_Layer *L, LayerModes **layer_modes){
 	RS_TRACE("> Simulation_ComputeLayerModes(S=%p, L=%p (%s), modes=%p (%p)) [omega=%f]\n", S, L, (NULL != L && NULL != L->name ? L->name : ""), layer_modes, (NULL != layer_modes ? *layer_modes : NULL), S->omega[0]);
 	if(NULL == S){
@@ -1810,7 +3691,7 @@ int Simulation_ComputeLayerModes(RS_Simulation *S, RS_Layer *L, LayerModes **lay
 			pB->epstype = EPSILON2_TYPE_BLKDIAG1_SCALAR;
 		}
 	}
-	if(S->options.use_less_memory){
+	if(S->options.use_less_memory || (NULL != S->solution && RS_SOLVE_STRATEGY_LESS_MEMORY == S->solution->strategy)){
 		kp_size = 0;
 	}
 
@@ -1830,6 +3711,22 @@ int Simulation_ComputeLayerModes(RS_Simulation *S, RS_Layer *L, LayerModes **lay
 	if(0 == kp_size){
 		pB->kp = NULL;
 	}
+	pB->mapped = 0;
+	pB->map = NULL;
+	pB->map_size = 0;
+	pB->nmodes = n2;
+	pB->mode_residual = 0;
+	pB->q_cutoff = 0;
+
+	{
+		double shift[2];
+		const LayerModes *Lmodes = Simulation_FindTranslatedModes(S, L, kp_size, shift);
+		if(NULL != Lmodes && 0 == Simulation_TranslateLayerModes(S, Lmodes, shift, pB, kp_size)){
+			RS_VERB(1, "Translating modes into layer: %s\n", NULL != L->name ? L->name : "");
+			RS_TRACE("< Simulation_ComputeLayerModes (translated) [omega=%f]\n", S->omega[0]);
+			return 0;
+		}
+	}
 
 	// Outline of the epsilon matrix generation code below:
 	//
@@ -1874,10 +3771,21 @@ int Simulation_ComputeLayerModes(RS_Simulation *S, RS_Layer *L, LayerModes **lay
 			RNP::TBLAS::SetMatrix<'A'>(n,n,0.,std::complex<double>(M->eps.abcde[2],M->eps.abcde[3]),&pB->Epsilon2[0+n*n2], n2);
 			RNP::TBLAS::SetMatrix<'A'>(n,n,0.,std::complex<double>(M->eps.abcde[6],M->eps.abcde[7]),&pB->Epsilon2[n+n*n2], n2);
 
-			RS_VERB(1, "Solving eigensystem of layer: %s\n", NULL != L->name ? L->name : "");
-			SolveLayerEigensystem(
-				std::complex<double>(S->omega[0],S->omega[1]), n, S->kx, S->ky,
-				pB->Epsilon_inv, pB->Epsilon2, pB->epstype, pB->q, pB->kp, pB->phi);
+			uint64_t key[2];
+			if(NULL != S->options.mode_cache_directory){
+				Simulation_ModeCacheKey(S, pB, kp_size, phi_size, key);
+			}
+			if(NULL != S->options.mode_cache_directory && Simulation_ModeCacheLookup(S, pB, kp_size, phi_size, key)){
+				RS_VERB(1, "Using cached modes of layer: %s\n", NULL != L->name ? L->name : "");
+			}else{
+				RS_VERB(1, "Solving eigensystem of layer: %s\n", NULL != L->name ? L->name : "");
+				SolveLayerEigensystem(
+					std::complex<double>(S->omega[0],S->omega[1]), n, S->kx, S->ky,
+					pB->Epsilon_inv, pB->Epsilon2, pB->epstype, pB->q, pB->kp, pB->phi);
+				if(NULL != S->options.mode_cache_directory){
+					Simulation_ModeCacheStore(S, pB, kp_size, phi_size, key);
+				}
+			}
 		}
 	}else{ // not a uniform layer
 		RS_VERB(1, "Generating epsilon matrix of layer: %s\n", NULL != L->name ? L->name : "");
@@ -1913,30 +3821,127 @@ int Simulation_ComputeLayerModes(RS_Simulation *S, RS_Layer *L, LayerModes **lay
 			}
 		}
 //std::cerr << pB->Epsilon2[0] << "\t" << pB->Epsilon2[1] << "\t" << pB->Epsilon_inv[0] << "\t" << pB->Epsilon_inv[1] << std::endl;
-		RS_VERB(1, "Solving eigensystem of layer: %s\n", NULL != L->name ? L->name : "");
-		{
-			size_t lwork = (size_t)-1;
-			double *rwork = (double*)RS_malloc(sizeof(double) * 4*n);
-			std::complex<double> *work = NULL;
-			std::complex<double> dum;
-			SolveLayerEigensystem(
-				std::complex<double>(S->omega[0],S->omega[1]), n,
-				S->kx, S->ky,
-				pB->Epsilon_inv, pB->Epsilon2, pB->epstype,
-				pB->q, pB->kp, pB->phi,
-				&dum, rwork, lwork
-			);
-			lwork = (int)(dum.real() + 0.5);
-			work = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>) * lwork);
-			SolveLayerEigensystem(
-				std::complex<double>(S->omega[0],S->omega[1]), n,
-				S->kx, S->ky,
-				pB->Epsilon_inv, pB->Epsilon2, pB->epstype,
-				pB->q, pB->kp, pB->phi,
-				work, rwork, lwork
-			);
-			RS_free(work);
-			RS_free(rwork);
+		uint64_t key[2];
+		if(NULL != S->options.mode_cache_directory){
+			Simulation_ModeCacheKey(S, pB, kp_size, phi_size, key);
+		}
+		if(NULL != S->options.mode_cache_directory && Simulation_ModeCacheLookup(S, pB, kp_size, phi_size, key)){
+			RS_VERB(1, "Using cached modes of layer: %s\n", NULL != L->name ? L->name : "");
+		}else{
+			int refined = -1;
+			if(S->options.mode_continuation && NULL != L->prev_modes && L->prev_modes->epstype == pB->epstype){
+				RS_VERB(1, "Refining modes of layer: %s\n", NULL != L->name ? L->name : "");
+				std::complex<double> *work = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * (12*nn + 2*n));
+				double residual;
+				if(NULL != work){
+					refined = RefineLayerEigensystem(
+						std::complex<double>(S->omega[0],S->omega[1]), n,
+						S->kx, S->ky,
+						pB->Epsilon_inv, pB->Epsilon2, pB->epstype,
+						L->prev_modes->phi,
+						pB->q, pB->kp, pB->phi, &residual,
+						work, 12*nn + 2*n
+					);
+				}
+				Simulation_WorkspaceFree(S, work);
+				if(0 != refined){
+					RS_VERB(1, "Mode refinement failed (%d); solving in full\n", refined);
+				}
+			}
+			int partial = refined;
+			if(0 != refined && S->options.partial_mode_count > 0 && 2*(size_t)S->options.partial_mode_count+18 <= (size_t)n2){
+				RS_VERB(1, "Solving for %d modes of layer: %s\n", S->options.partial_mode_count, NULL != L->name ? L->name : "");
+				std::complex<double> *work = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * (8*nn + 4*n));
+				double residual;
+				std::complex<double> q_cutoff;
+				size_t nmodes = S->options.partial_mode_count;
+				if(NULL != work){
+					partial = SolveLayerEigensystemPartial(
+						std::complex<double>(S->omega[0],S->omega[1]), n,
+						S->kx, S->ky,
+						pB->Epsilon_inv, pB->Epsilon2, pB->epstype,
+						&nmodes,
+						pB->q, pB->kp, pB->phi, &residual, &q_cutoff,
+						work, 8*nn + 4*n
+					);
+				}
+				Simulation_WorkspaceFree(S, work);
+				if(0 == partial){
+					pB->nmodes = (int)nmodes;
+					pB->mode_residual = residual;
+					pB->q_cutoff = q_cutoff;
+				}else{
+					RS_VERB(1, "Partial eigensolve failed (%d); solving in full\n", partial);
+				}
+			}
+			int symmetric = partial;
+			const int symmetries = (0 != partial && S->options.use_symmetry_adapted_basis ? Simulation_GetLayerSymmetries(S, L) : 0);
+			if(0 != symmetries){
+				size_t lwork = (size_t)-1;
+				size_t nblocks;
+				std::complex<double> dum;
+				SolveLayerEigensystemSymmetric(
+					std::complex<double>(S->omega[0],S->omega[1]), n,
+					S->kx, S->ky,
+					pB->Epsilon_inv, pB->Epsilon2, pB->epstype,
+					pB->q, pB->kp, pB->phi, symmetries, &nblocks,
+					&dum, lwork
+				);
+				lwork = (size_t)(dum.real() + 0.5);
+				std::complex<double> *work = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * lwork);
+				if(NULL != work){
+					symmetric = SolveLayerEigensystemSymmetric(
+						std::complex<double>(S->omega[0],S->omega[1]), n,
+						S->kx, S->ky,
+						pB->Epsilon_inv, pB->Epsilon2, pB->epstype,
+						pB->q, pB->kp, pB->phi, symmetries, &nblocks,
+						work, lwork
+					);
+				}
+				Simulation_WorkspaceFree(S, work);
+				if(0 == symmetric){
+					RS_VERB(1, "Solved eigensystem of layer %s in %d symmetry blocks\n", NULL != L->name ? L->name : "", (int)nblocks);
+				}else if(1 != symmetric){
+					RS_VERB(1, "Symmetry adapted eigensolve failed (%d); solving in full\n", symmetric);
+				}
+			}
+			if(0 != symmetric){
+				RS_VERB(1, "Solving eigensystem of layer: %s\n", NULL != L->name ? L->name : "");
+				size_t lwork = (size_t)-1;
+				double *rwork = (double*)Simulation_WorkspaceAlloc(S, sizeof(double) * 4*n);
+				std::complex<double> *work = NULL;
+				std::complex<double> dum;
+				if(NULL == rwork){
+					RS_TRACE("< Simulation_ComputeLayerModes (failed; could not allocate work arrays) [omega=%f]\n", S->omega[0]);
+					return 1;
+				}
+				SolveLayerEigensystem(
+					std::complex<double>(S->omega[0],S->omega[1]), n,
+					S->kx, S->ky,
+					pB->Epsilon_inv, pB->Epsilon2, pB->epstype,
+					pB->q, pB->kp, pB->phi,
+					&dum, rwork, lwork
+				);
+				lwork = (int)(dum.real() + 0.5);
+				work = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * lwork);
+				if(NULL == work){
+					Simulation_WorkspaceFree(S, rwork);
+					RS_TRACE("< Simulation_ComputeLayerModes (failed; could not allocate work arrays) [omega=%f]\n", S->omega[0]);
+					return 1;
+				}
+				SolveLayerEigensystem(
+					std::complex<double>(S->omega[0],S->omega[1]), n,
+					S->kx, S->ky,
+					pB->Epsilon_inv, pB->Epsilon2, pB->epstype,
+					pB->q, pB->kp, pB->phi,
+					work, rwork, lwork
+				);
+				Simulation_WorkspaceFree(S, work);
+				Simulation_WorkspaceFree(S, rwork);
+			}
+			if(NULL != S->options.mode_cache_directory){
+				Simulation_ModeCacheStore(S, pB, kp_size, phi_size, key);
+			}
 		}
 	}
 	RS_TRACE("I  q[0] = %f,%f [omega=%f]\n", pB->q[0].real(), pB->q[0].imag(), S->omega[0]);
@@ -1973,7 +3978,7 @@ int RS_Simulation_GetPowerFlux(RS_Simulation *S, RS_LayerID id, const double *of
 	const int n2 = 2*n;
 	const int n4 = 2*n2;
 
-	std::complex<double> *ab = (std::complex<double> *)RS_malloc(sizeof(std::complex<double>) * (n4+4*n2));
+	std::complex<double> *ab = (std::complex<double> *)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * (n4+4*n2));
 	if(NULL == ab){
 		RS_TRACE("< RS_Simulation_GetPowerFlux (failed; allocation failed) [omega=%f]\n", S->omega[0]);
 		return 1;
@@ -1990,7 +3995,7 @@ int RS_Simulation_GetPowerFlux(RS_Simulation *S, RS_LayerID id, const double *of
 	powers[2] = forw.imag();
 	powers[3] = back.imag();
 
-	RS_free(ab);
+	Simulation_WorkspaceFree(S, ab);
 	RS_TRACE("< RS_Simulation_GetPowerFlux returning %f, %f, %f, %f [omega=%f]\n", powers[0], powers[1], powers[2], powers[3], S->omega[0]);
 	return 0;
 }
@@ -2020,7 +4025,7 @@ int Simulation_GetPoyntingFluxByG(RS_Simulation *S, RS_Layer *layer, double offs
 	const int n2 = 2*n;
 	const int n4 = 2*n2;
 
-	std::complex<double> *ab = (std::complex<double> *)RS_malloc(sizeof(std::complex<double>) * (n2+n4+4*n2));
+	std::complex<double> *ab = (std::complex<double> *)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * (n2+n4+4*n2));
 	if(NULL == ab){
 		RS_TRACE("< Simulation_GetPoyntingFluxByG (failed; allocation failed) [omega=%f]\n", S->omega[0]);
 		return 1;
@@ -2040,19 +4045,142 @@ int Simulation_GetPoyntingFluxByG(RS_Simulation *S, RS_Layer *layer, double offs
 		powers[4*i+3] = back[i].imag();
 	}
 
-	RS_free(ab);
+	Simulation_WorkspaceFree(S, ab);
 	RS_TRACE("< Simulation_GetPoyntingFluxByG [omega=%f]\n", S->omega[0]);
 	return 0;
 }
 
-int Simulation_GetPropagationConstants(RS_Simulation *S, RS_Layer *L, double *q){
-	RS_TRACE("> Simulation_GetPropagationConstants(S=%p, layer=%p, q=%p) [omega=%f]\n",
-		S, L, q, S->omega[0]);
-	int ret = 0;
-	if(NULL == S){ ret = -1; }
-	if(NULL == L){ ret = -2; }
-	if(0 != ret){
-		RS_TRACE("< Simulation_GetPropagationConstants (failed; ret = %d) [omega=%f]\n", ret, S->omega[0]);
+struct FluxLayer{
+	const LayerModes *modes;
+	int layer; // index into S->layer
+	int index; // position in the output
+};
+static bool FluxLayer_Less(const FluxLayer &a, const FluxLayer &b){
+	if(a.modes != b.modes){ return a.modes < b.modes; }
+	return a.index < b.index;
+}
+
+int RS_Simulation_GetPowerFluxTable(RS_Simulation *S, int nlayers, const RS_LayerID *layers, const RS_real *offsets, RS_real *powers){
+	RS_TRACE("> RS_Simulation_GetPowerFluxTable(S=%p, nlayers=%d, layers=%p, offsets=%p, powers=%p)\n",
+		S, nlayers, layers, offsets, powers);
+	if(NULL == S){
+		RS_TRACE("< RS_Simulation_GetPowerFluxTable (failed; S == NULL)\n");
+		return -1;
+	}
+	if(NULL == layers){ nlayers = S->n_layers; }
+	if(nlayers < 0){
+		RS_TRACE("< RS_Simulation_GetPowerFluxTable (failed; nlayers < 0)\n");
+		return -2;
+	}
+	if(NULL != layers){
+		for(int i = 0; i < nlayers; ++i){
+			if(layers[i] < 0 || layers[i] >= S->n_layers){
+				RS_TRACE("< RS_Simulation_GetPowerFluxTable (failed; layer %d invalid)\n", i);
+				return -3;
+			}
+		}
+	}
+	if(NULL == powers){
+		RS_TRACE("< RS_Simulation_GetPowerFluxTable (failed; powers == NULL)\n");
+		return -5;
+	}
+	if(0 == nlayers){ return 0; }
+
+	const size_t n = S->n_G;
+	const size_t n2 = 2*n;
+	const size_t n4 = 2*n2;
+	const size_t nl = nlayers;
+
+	// Solve every requested layer first; this may not be done in parallel.
+	FluxLayer *fl = (FluxLayer*)Simulation_WorkspaceAlloc(S, sizeof(FluxLayer) * nl);
+	if(NULL == fl){
+		RS_TRACE("< RS_Simulation_GetPowerFluxTable (failed; allocation failed)\n");
+		return 1;
+	}
+	for(size_t i = 0; i < nl; ++i){
+		fl[i].layer = (NULL != layers ? layers[i] : (int)i);
+		fl[i].index = i;
+		LayerModes *Lmodes;
+		std::complex<double> *Lsoln;
+		int ret = Simulation_GetLayerSolution(S, &S->layer[fl[i].layer], &Lmodes, &Lsoln);
+		if(0 != ret){
+			Simulation_WorkspaceFree(S, fl);
+			RS_TRACE("< RS_Simulation_GetPowerFluxTable (failed; Simulation_GetLayerSolution returned %d)\n", ret);
+			return ret;
+		}
+		fl[i].modes = Lmodes;
+	}
+	// Group the layers sharing modes, so that each group needs a single
+	// set of products with phi and kp.
+	std::sort(fl, fl+nl, &FluxLayer_Less);
+	int ngroups = 0;
+	int *group = (int*)Simulation_WorkspaceAlloc(S, sizeof(int) * (nl+1));
+	std::complex<double> *ab = (std::complex<double>*)Simulation_WorkspaceAlloc(S,
+		sizeof(std::complex<double>) * (n4 + 4*n2 + n2) * nl
+	);
+	if(NULL == group || NULL == ab){
+		if(NULL != ab){ Simulation_WorkspaceFree(S, ab); }
+		if(NULL != group){ Simulation_WorkspaceFree(S, group); }
+		Simulation_WorkspaceFree(S, fl);
+		RS_TRACE("< RS_Simulation_GetPowerFluxTable (failed; allocation failed)\n");
+		return 1;
+	}
+	std::complex<double> *work = ab + n4*nl;
+	std::complex<double> *forw = work + 4*n2*nl;
+	std::complex<double> *back = forw + n*nl;
+	for(size_t i = 0; i < nl; ++i){
+		if(0 == i || fl[i].modes != fl[i-1].modes){
+			group[ngroups++] = i;
+		}
+		RS_Layer *L = &S->layer[fl[i].layer];
+		LayerModes *Lmodes;
+		std::complex<double> *Lsoln;
+		Simulation_GetLayerSolution(S, L, &Lmodes, &Lsoln);
+		const double off = (NULL != offsets ? offsets[fl[i].index] : 0);
+		memcpy(&ab[i*n4], Lsoln, sizeof(std::complex<double>) * n4);
+		TranslateAmplitudes(n, fl[i].modes->q, L->thickness, off, &ab[i*n4]);
+	}
+	group[ngroups] = nl;
+
+	const std::complex<double> omega(S->omega[0],S->omega[1]);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for(int g = 0; g < ngroups; ++g){
+		const size_t i0 = group[g];
+		const size_t m = group[g+1] - i0;
+		const LayerModes *Lmodes = fl[i0].modes;
+		GetZPoyntingFluxComponentsBatch(
+			n, S->kx, S->ky, omega, Lmodes->q, Lmodes->Epsilon_inv, Lmodes->epstype, Lmodes->kp, Lmodes->phi,
+			m, &ab[i0*n4], &forw[i0*n], &back[i0*n], &work[i0*4*n2]
+		);
+	}
+
+	for(size_t i = 0; i < nl; ++i){
+		RS_real *P = &powers[4*n*fl[i].index];
+		for(size_t j = 0; j < n; ++j){
+			P[4*j+0] = forw[i*n+j].real();
+			P[4*j+1] = back[i*n+j].real();
+			P[4*j+2] = forw[i*n+j].imag();
+			P[4*j+3] = back[i*n+j].imag();
+		}
+	}
+
+	Simulation_WorkspaceFree(S, ab);
+	Simulation_WorkspaceFree(S, group);
+	Simulation_WorkspaceFree(S, fl);
+	RS_TRACE("< RS_Simulation_GetPowerFluxTable\n");
+	return 0;
+}
+
+int Simulation_GetPropagationConstants(RS_Simulation *S, RS_Layer *L, double *q){
+	RS_TRACE("> Simulation_GetPropagationConstants(S=%p, layer=%p, q=%p) [omega=%f]\n",
+		S, L, q, S->omega[0]);
+	int ret = 0;
+	if(NULL == S){ ret = -1; }
+	if(NULL == L){ ret = -2; }
+	if(0 != ret){
+		RS_TRACE("< Simulation_GetPropagationConstants (failed; ret = %d) [omega=%f]\n", ret, S->omega[0]);
 		return ret;
 	}
 
@@ -2113,7 +4241,7 @@ int Simulation_GetAmplitudes(RS_Simulation *S, RS_Layer *layer, double offset, d
 	const int n2 = 2*n;
 	const int n4 = 2*n2;
 
-	std::complex<double> *ab = (std::complex<double> *)RS_malloc(sizeof(std::complex<double>) * n4);
+	std::complex<double> *ab = (std::complex<double> *)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * n4);
 	if(NULL == ab){
 		RS_TRACE("< Simulation_GetAmplitudes (failed; allocation failed) [omega=%f]\n", S->omega[0]);
 		return 1;
@@ -2135,7 +4263,7 @@ int Simulation_GetAmplitudes(RS_Simulation *S, RS_Layer *layer, double offset, d
 		}
 	}
 
-	RS_free(ab);
+	Simulation_WorkspaceFree(S, ab);
 	RS_TRACE("< Simulation_GetAmplitudes [omega=%f]\n", S->omega[0]);
 	return 0;
 }
@@ -2770,7 +4898,11 @@ int Simulation_OutputLayerPatternRealization(RS_Simulation *S, RS_Layer *layer,
 	FILE *f = fp;
 	if(NULL == fp){ f = stdout; }
 
-	double *values = (double*)RS_malloc(sizeof(double)*2*(layer->pattern.nshapes+1));
+	double *values = (double*)Simulation_WorkspaceAlloc(S, sizeof(double)*2*(layer->pattern.nshapes+1));
+	if(NULL == values){
+		RS_TRACE("< Simulation_OutputLayerPatternRealization (failed; allocation failed)\n");
+		return 1;
+	}
 	for(int i = -1; i < layer->pattern.nshapes; ++i){
 		const RS_Material *M;
 		if(-1 == i){
@@ -2819,7 +4951,7 @@ int Simulation_OutputLayerPatternRealization(RS_Simulation *S, RS_Layer *layer,
 		fprintf(f, "\n");
 	}
 
-	RS_free(values);
+	Simulation_WorkspaceFree(S, values);
 
 	RS_TRACE("< Simulation_OutputLayerPatternRealization\n");
 	return 0;
@@ -2869,7 +5001,7 @@ int Simulation_GetField(RS_Simulation *S, const double r[3], double fE[6], doubl
 		return ret;
 	}
 
-	std::complex<double> *ab = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>) * (n4+8*n2));
+	std::complex<double> *ab = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * (n4+8*n2));
 	if(NULL == ab){
 		RS_TRACE("< Simulation_GetField (failed; allocation failed)\n");
 		return 1;
@@ -2900,7 +5032,7 @@ int Simulation_GetField(RS_Simulation *S, const double r[3], double fE[6], doubl
 		fH[4] = hfield[1].imag();
 		fH[5] = hfield[2].imag();
 	}
-	RS_free(ab);
+	Simulation_WorkspaceFree(S, ab);
 
 	RS_TRACE("< Simulation_GetField\n");
 	return 0;
@@ -2951,7 +5083,7 @@ int Simulation_GetEField(RS_Simulation *S, const double r[3], std::complex<doubl
 		return ret;
 	}
 
-	std::complex<double> *ab = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>) * (n4+8*n2));
+	std::complex<double> *ab = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * (n4+8*n2));
 	if(NULL == ab){
 		RS_TRACE("< Simulation_GetField (failed; allocation failed)\n");
 		return 1;
@@ -2973,7 +5105,7 @@ int Simulation_GetEField(RS_Simulation *S, const double r[3], std::complex<doubl
 		efield[2] = fE[2];
 	}
 
-	RS_free(ab);
+	Simulation_WorkspaceFree(S, ab);
 
 	RS_TRACE("< Simulation_GetField\n");
 	return 0;
@@ -3024,7 +5156,7 @@ int Simulation_GetFieldPlane(RS_Simulation *S, int nxy[2], double zz, double *E,
 		return ret;
 	}
 
-	std::complex<double> *ab = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>) * (n4+8*n2));
+	std::complex<double> *ab = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * (n4+8*n2+12*nxy[0]*nxy[1]));
 	if(NULL == ab){
 		RS_TRACE("< Simulation_GetFieldPlane (failed; allocation failed)\n");
 		return 1;
@@ -3040,9 +5172,10 @@ int Simulation_GetFieldPlane(RS_Simulation *S, int nxy[2], double zz, double *E,
 		Lmodes->q, Lmodes->kp, Lmodes->phi, Lmodes->Epsilon_inv, Lmodes->epstype,
 		ab, snxy, NULL,
 		reinterpret_cast<std::complex<double>*>(E),
-		reinterpret_cast<std::complex<double>*>(H)
+		reinterpret_cast<std::complex<double>*>(H),
+		work
 	);
-	RS_free(ab);
+	Simulation_WorkspaceFree(S, ab);
 
 	RS_TRACE("< Simulation_GetFieldPlane\n");
 	return 0;
@@ -3093,7 +5226,7 @@ int Simulation_GetEFieldPlane(RS_Simulation *S, int nxy[2], double zz, double *E
 		return ret;
 	}
 
-	std::complex<double> *ab = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>) * (n4+8*n2));
+	std::complex<double> *ab = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * (n4+8*n2+12*nxy[0]*nxy[1]));
 	if(NULL == ab){
 		RS_TRACE("< Simulation_GetFieldPlane (failed; allocation failed)\n");
 		return 1;
@@ -3108,8 +5241,8 @@ int Simulation_GetEFieldPlane(RS_Simulation *S, int nxy[2], double zz, double *E
 		S->n_G, S->G, S->kx, S->ky, std::complex<double>(S->omega[0],S->omega[1]),
 		Lmodes->q, Lmodes->kp, Lmodes->phi, Lmodes->Epsilon_inv, Lmodes->epstype,
 		ab, snxy, NULL,
-		reinterpret_cast<std::complex<double>*>(E), solvetype);
-	RS_free(ab);
+		reinterpret_cast<std::complex<double>*>(E), solvetype, work);
+	Simulation_WorkspaceFree(S, ab);
 
 	RS_TRACE("< Simulation_GetFieldPlane\n");
 	return 0;
@@ -3151,7 +5284,11 @@ int Simulation_GetEpsilon(RS_Simulation *S, const double r[3], double eps[2]){
 
 	if(L->copy >= 0){ L = &S->layer[L->copy]; }
 
-	double *values = (double*)RS_malloc(sizeof(double)*2*(L->pattern.nshapes+1));
+	double *values = (double*)Simulation_WorkspaceAlloc(S, sizeof(double)*2*(L->pattern.nshapes+1));
+	if(NULL == values){
+		RS_TRACE("< Simulation_GetEpsilon (failed; allocation failed)\n");
+		return 1;
+	}
 	for(int i = -1; i < L->pattern.nshapes; ++i){
 		const RS_Material *M;
 		if(-1 == i){
@@ -3202,38 +5339,245 @@ int Simulation_GetEpsilon(RS_Simulation *S, const double r[3], double eps[2]){
 		eps[0] += ft[0]*ca - ft[1]*sa;
 		eps[1] += ft[0]*sa + ft[1]*ca;
 	}
-	RS_free(values);
+	Simulation_WorkspaceFree(S, values);
 
 	RS_TRACE("< Simulation_GetEpsilon\n");
 	return 0;
 }
 
-int Simulation_GetSMatrixDeterminant(RS_Simulation *S, double rmant[2], double *rbase, int *rexpo){
-	RS_TRACE("> Simulation_GetSMatrixDeterminant(S=%p, rmand=%p, rbase=%p, rexpo=%p)\n", S, rmant, rbase, rexpo);
-	if(NULL == S){ return -1; }
-	if(NULL == rmant){ return -2; }
-	if(NULL == rbase){ return -3; }
-	if(NULL == rexpo){ return -4; }
+int RS_Simulation_GetEpsilonGrid(RS_Simulation *S, const int nxy[2], const RS_real *xyz0, int which, RS_real *eps){
+	RS_TRACE("> RS_Simulation_GetEpsilonGrid(S=%p, nxy=%p (%d,%d), xyz0=%p, which=%d, eps=%p)\n",
+		S, nxy, (NULL == nxy ? 0 : nxy[0]), (NULL == nxy ? 0 : nxy[1]), xyz0, which, eps);
+	if(NULL == S){
+		RS_TRACE("< RS_Simulation_GetEpsilonGrid (failed; S == NULL)\n");
+		return -1;
+	}
+	if(NULL == nxy || nxy[0] < 1 || nxy[1] < 1){
+		RS_TRACE("< RS_Simulation_GetEpsilonGrid (failed; nxy invalid)\n");
+		return -2;
+	}
+	if(NULL == xyz0){
+		RS_TRACE("< RS_Simulation_GetEpsilonGrid (failed; xyz0 == NULL)\n");
+		return -3;
+	}
+	if(RS_EPSILON_FOURIER != which && RS_EPSILON_GEOMETRIC != which){
+		RS_TRACE("< RS_Simulation_GetEpsilonGrid (failed; which invalid)\n");
+		return -4;
+	}
+	if(NULL == eps){
+		RS_TRACE("< RS_Simulation_GetEpsilonGrid (failed; eps == NULL)\n");
+		return -5;
+	}
+	if(NULL == S->solution){
+		int error = Simulation_InitSolution(S);
+		if(0 != error){
+			RS_TRACE("< RS_Simulation_GetEpsilonGrid (failed; Simulation_InitSolution returned %d)\n", error);
+			return error;
+		}
+	}
 
-	const size_t n4 = 4*S->n_G;
-	std::complex<double> *M = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>)*n4*n4);
-	int ret = Simulation_GetSMatrix(S, 0, -1, M);
+	const RS_Layer *L = NULL;
+	{
+		double z = 0;
+		int i;
+		for(i = 0; i < S->n_layers && xyz0[2] > z+S->layer[i].thickness; ++i){
+			z += S->layer[i].thickness;
+		}
+		if(i >= S->n_layers){ i = S->n_layers-1; }
+		L = &(S->layer[i]);
+	}
+	if(L->copy >= 0){ L = &S->layer[L->copy]; }
+
+	const size_t nx = nxy[0];
+	const size_t ny = nxy[1];
+	const size_t N = nx*ny;
+
+	double *values = (double*)Simulation_WorkspaceAlloc(S, sizeof(double)*2*(L->pattern.nshapes+1));
+	if(NULL == values){
+		RS_TRACE("< RS_Simulation_GetEpsilonGrid (failed; allocation failed)\n");
+		return 1;
+	}
+	for(int i = -1; i < L->pattern.nshapes; ++i){
+		const RS_Material *M;
+		if(-1 == i){
+			M = &S->material[L->material];
+		}else{
+			M = &(S->material[L->pattern.shapes[i].tag]);
+		}
+		if(0 == M->type){
+			values[2*(i+1)+0] = M->eps.s[0];
+			values[2*(i+1)+1] = M->eps.s[1];
+		}else{
+			values[2*(i+1)+0] = M->eps.abcde[8];
+			values[2*(i+1)+1] = M->eps.abcde[9];
+		}
+	}
+
+	const int ndim = (0 == S->Lr[2] && 0 == S->Lr[3]) ? 1 : 2;
+
+	if(RS_EPSILON_GEOMETRIC == which){
+		// Sample the pattern itself at each grid point, folded back into
+		// the unit cell centered on the origin.
+		for(size_t j = 0; j < ny; ++j){
+			for(size_t i = 0; i < nx; ++i){
+				const double u0 = (double)i/(double)nx, v0 = (double)j/(double)ny;
+				double r[2] = {
+					xyz0[0] + S->Lr[0]*u0 + S->Lr[2]*v0,
+					xyz0[1] + S->Lr[1]*u0 + S->Lr[3]*v0
+				};
+				double u = S->Lk[0]*r[0] + S->Lk[1]*r[1];
+				double v = S->Lk[2]*r[0] + S->Lk[3]*r[1];
+				u -= floor(u + 0.5);
+				v -= floor(v + 0.5);
+				r[0] = S->Lr[0]*u + S->Lr[2]*v;
+				r[1] = S->Lr[1]*u + S->Lr[3]*v;
+				int ishape = -1;
+				if(ndim > 1){
+					// Shapes that cross the cell boundary reach the folded
+					// point from a neighboring cell, so the lattice translates
+					// of the point are tested too. Shapes are in order of
+					// decreasing area, so the innermost match has the largest
+					// index.
+					for(int a = -1; a <= 1; ++a){
+						for(int b = -1; b <= 1; ++b){
+							const double rt[2] = {
+								r[0] + a*S->Lr[0] + b*S->Lr[2],
+								r[1] + a*S->Lr[1] + b*S->Lr[3]
+							};
+							int k;
+							if(0 == Pattern_GetShape(&L->pattern, rt, &k, NULL) && k > ishape){
+								ishape = k;
+							}
+						}
+					}
+				}else{
+					// Intervals are stored as zero-height rectangles, which the
+					// point query never matches; test them along x directly.
+					for(int k = L->pattern.nshapes-1; k >= 0; --k){
+						const shape *sh = &L->pattern.shapes[k];
+						double du = S->Lk[0]*(r[0] - sh->center[0]);
+						du -= floor(du + 0.5);
+						if(fabs(S->Lr[0]*du*cos(sh->angle)) <= sh->vtab.rectangle.halfwidth[0]){
+							ishape = k;
+							break;
+						}
+					}
+				}
+				const double *val = &values[2*(ishape+1)];
+				eps[2*(i+j*nx)+0] = val[0];
+				eps[2*(i+j*nx)+1] = val[1];
+			}
+		}
+		Simulation_WorkspaceFree(S, values);
+		RS_TRACE("< RS_Simulation_GetEpsilonGrid\n");
+		return 0;
+	}
+
+	// Fourier series as seen by the simulation: place the (smoothed)
+	// Fourier coefficients on the grid, aliasing orders beyond its extent,
+	// and synthesize the plane with a single inverse FFT.
+	std::complex<double> *from = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>)*2*N);
+	if(NULL == from){
+		Simulation_WorkspaceFree(S, values);
+		RS_TRACE("< RS_Simulation_GetEpsilonGrid (failed; allocation failed)\n");
+		return 1;
+	}
+	std::complex<double> *to = from + N;
+	int inxy_rev[2] = { (int)ny, (int)nx };
+	fft_plan plan = fft_plan_dft_2d(inxy_rev, from, to, 1);
+	RNP::TBLAS::Fill(N, 0., from, 1);
+
+	double mp1 = 0;
+	int pwr = S->options.lanczos_smoothing_power;
+	if(S->options.use_Lanczos_smoothing){
+		mp1 = GetLanczosSmoothingOrder(S);
+		mp1 *= S->options.lanczos_smoothing_width;
+	}
+	const double unit_cell_size = Simulation_GetUnitCellSize(S);
+	for(int g = 0; g < S->n_G; ++g){
+		double f[2] = {
+			S->G[2*g+0] * S->Lk[0] + S->G[2*g+1] * S->Lk[2],
+			S->G[2*g+0] * S->Lk[1] + S->G[2*g+1] * S->Lk[3]
+		};
+
+		double ft[2];
+		Pattern_GetFourierTransform(&L->pattern, values, f, ndim, unit_cell_size, ft);
+		if(S->options.use_Lanczos_smoothing){
+			double sigma = GetLanczosSmoothingFactor(mp1, pwr, f);
+			ft[0] *= sigma;
+			ft[1] *= sigma;
+		}
+		const double theta = 2*M_PI*(f[0]*xyz0[0] + f[1]*xyz0[1]);
+		const int iu = S->G[2*g+0] % (int)nx;
+		const int iv = S->G[2*g+1] % (int)ny;
+		const size_t ii = (iu >= 0 ? iu : iu + nx);
+		const size_t jj = (iv >= 0 ? iv : iv + ny);
+		from[ii+jj*nx] += std::complex<double>(ft[0],ft[1]) * std::complex<double>(cos(theta),sin(theta));
+	}
+	fft_plan_exec(plan);
+	fft_plan_destroy(plan);
+	for(size_t k = 0; k < N; ++k){
+		eps[2*k+0] = to[k].real();
+		eps[2*k+1] = to[k].imag();
+	}
+	Simulation_WorkspaceFree(S, from);
+	Simulation_WorkspaceFree(S, values);
+
+	RS_TRACE("< RS_Simulation_GetEpsilonGrid\n");
+	return 0;
+}
+
+int RS_Simulation_GetEpsilon(RS_Simulation *S, int nxy[2], const RS_real *xyz0, RS_real *eps){
+	return RS_Simulation_GetEpsilonGrid(S, nxy, xyz0, RS_EPSILON_FOURIER, eps);
+}
+
+int RS_Simulation_GetSMatrixDeterminant(
+	RS_Simulation *S, const RS_real *k,
+	RS_real *rmant, RS_real *base, int *expo
+){
+	RS_TRACE("> RS_Simulation_GetSMatrixDeterminant(S=%p, k=%p, rmant=%p, base=%p, expo=%p)\n", S, k, rmant, base, expo);
+	int ret = 0;
+	if(NULL == S){ ret = -1; }
+	if(NULL != k && NULL != S && !(S->omega[0] > 0)){ ret = -2; }
+	if(NULL == rmant){ ret = -3; }
+	if(NULL == base){ ret = -4; }
+	if(NULL == expo){ ret = -5; }
 	if(0 != ret){
-		RS_TRACE("< Simulation_GetSMatrixDeterminant (failed; Simulation_GetSMatrix returned %d)\n", ret);
+		RS_TRACE("< RS_Simulation_GetSMatrixDeterminant (failed; ret = %d)\n", ret);
 		return ret;
 	}
-	std::complex<double> mant;
-	double base;
-	int expo;
-	RNP::TLASupport::Determinant(n4, M, n4, &mant, &base, &expo, NULL);
-	RS_free(M);
+	if(NULL != k){
+		// S->k is relative to the real part of omega.
+		const double k_new[2] = { 2*M_PI*k[0] / S->omega[0], 2*M_PI*k[1] / S->omega[0] };
+		if(k_new[0] != S->k[0] || k_new[1] != S->k[1]){
+			Simulation_RetireLayerModes(S);
+			Simulation_DestroySolution(S);
+			Simulation_InvalidateFieldCache(S);
+			S->k[0] = k_new[0];
+			S->k[1] = k_new[1];
+		}
+	}
 
+	const size_t n4 = 4*S->n_G;
+	std::complex<double> *M = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>)*n4*n4);
+	if(NULL == M){
+		RS_TRACE("< RS_Simulation_GetSMatrixDeterminant (failed; allocation failed)\n");
+		return 1;
+	}
+	std::complex<double> logdet;
+	ret = Simulation_GetSMatrix(S, 0, -1, M, &logdet);
+	Simulation_WorkspaceFree(S, M);
+	if(0 != ret){
+		RS_TRACE("< RS_Simulation_GetSMatrixDeterminant (failed; Simulation_GetSMatrix returned %d)\n", ret);
+		return ret;
+	}
+	*base = 2;
+	*expo = (int)floor(logdet.real() / M_LN2);
+	const std::complex<double> mant = std::exp(std::complex<double>(logdet.real() - *expo * M_LN2, logdet.imag()));
 	rmant[0] = mant.real();
 	rmant[1] = mant.imag();
-	*rbase = base;
-	*rexpo = expo;
 
-	RS_TRACE("< Simulation_GetSMatrixDeterminant\n");
+	RS_TRACE("< RS_Simulation_GetSMatrixDeterminant\n");
 	return 0;
 }
 
@@ -3265,7 +5609,7 @@ int Simulation_GetStressTensorIntegral(RS_Simulation *S, RS_Layer *layer, double
 	const int n2 = 2*n;
 	const int n4 = 2*n2;
 
-	std::complex<double> *ab = (std::complex<double> *)RS_malloc(sizeof(std::complex<double>) * (n4+8*n2));
+	std::complex<double> *ab = (std::complex<double> *)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * (n4+8*n2));
 	if(NULL == ab){
 		RS_TRACE("< Simulation_GetStressTensorIntegral (failed; allocation failed)\n");
 		return 1;
@@ -3287,7 +5631,7 @@ int Simulation_GetStressTensorIntegral(RS_Simulation *S, RS_Layer *layer, double
 	Tint[4] = integral[1].imag();
 	Tint[5] = integral[2].imag();
 
-	RS_free(ab);
+	Simulation_WorkspaceFree(S, ab);
 
 	RS_TRACE("< Simulation_GetStressTensorIntegral\n");
 	return 0;
@@ -3322,7 +5666,7 @@ int Simulation_GetLayerVolumeIntegral(RS_Simulation *S, RS_Layer *layer, char wh
 	const int n2 = 2*n;
 	const int n4 = 2*n2;
 
-	std::complex<double> *work = (std::complex<double> *)RS_malloc(sizeof(std::complex<double>) * (n4*n4));
+	std::complex<double> *work = (std::complex<double> *)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * (n4*n4));
 	if(NULL == work){
 		RS_TRACE("< Simulation_GetLayerVolumeIntegral (failed; allocation failed)\n");
 		return 1;
@@ -3334,7 +5678,7 @@ int Simulation_GetLayerVolumeIntegral(RS_Simulation *S, RS_Layer *layer, char wh
 		std::complex<double>(S->omega[0],S->omega[1]),
 		layer->thickness, Lmodes->q, Lmodes->kp, Lmodes->phi, Lmodes->Epsilon_inv, Lmodes->Epsilon2, Lmodes->epstype, Lsoln, &zintegral, work);
 
-	RS_free(work);
+	Simulation_WorkspaceFree(S, work);
 
 	integral[0] = zintegral.real();
 	integral[1] = zintegral.imag();
@@ -3370,7 +5714,7 @@ int Simulation_GetLayerZIntegral(RS_Simulation *S, RS_Layer *layer, const double
 	const int n2 = 2*n;
 	const int n4 = 2*n2;
 
-	std::complex<double> *work = (std::complex<double> *)RS_malloc(sizeof(std::complex<double>) * (12*n4));
+	std::complex<double> *work = (std::complex<double> *)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * (12*n4));
 	if(NULL == work){
 		RS_TRACE("< Simulation_GetLayerZIntegral (failed; allocation failed)\n");
 		return 1;
@@ -3381,7 +5725,7 @@ int Simulation_GetLayerZIntegral(RS_Simulation *S, RS_Layer *layer, const double
 		std::complex<double>(S->omega[0],S->omega[1]),
 		layer->thickness, r, Lmodes->q, Lmodes->kp, Lmodes->phi, Lmodes->Epsilon_inv, Lmodes->Epsilon2, Lmodes->epstype, Lsoln, integral, work);
 
-	RS_free(work);
+	Simulation_WorkspaceFree(S, work);
 
 
 	RS_TRACE("< Simulation_GetLayerZIntegral\n");
@@ -3597,8 +5941,8 @@ void Simulation_CopyExcitation(const RS_Simulation *from, RS_Simulation *to){
 	RS_TRACE("< Simulation_CopyExcitation\n");
 }
 
-int Simulation_GetSMatrix(RS_Simulation *S, int from, int to, std::complex<double> *M){
-	RS_TRACE("> Simulation_GetSMatrix(S=%p, from=%d, to=%d)\n", S, from, to);
+int Simulation_GetSMatrix(RS_Simulation *S, int from, int to, std::complex<double> *M, std::complex<double> *logdet){
+	RS_TRACE("> Simulation_GetSMatrix(S=%p, from=%d, to=%d, logdet=%p)\n", S, from, to, logdet);
 
 	if(-1 != to && to < from){ return -3; }
 
@@ -3621,9 +5965,24 @@ int Simulation_GetSMatrix(RS_Simulation *S, int from, int to, std::complex<doubl
 	}
 
 	// Make arrays of q, kp, and phi
-	double *lthick = (double*)RS_malloc(sizeof(double)*S->n_layers);
-	int *lepstype = (int*)RS_malloc(sizeof(int)*S->n_layers);
-	const std::complex<double> **lq   = (const std::complex<double> **)RS_malloc(sizeof(const std::complex<double> *)*S->n_layers*4);
+	double *lthick = (double*)Simulation_WorkspaceAlloc(S, sizeof(double)*S->n_layers);
+	int *lepstype = (int*)Simulation_WorkspaceAlloc(S, sizeof(int)*S->n_layers);
+	const std::complex<double> **lq   = (const std::complex<double> **)Simulation_WorkspaceAlloc(S, sizeof(const std::complex<double> *)*S->n_layers*4);
+	// The composition workspace comes from the arena, so that repeated
+	// calls (as in band solving) do not allocate.
+	const size_t n4 = 4*S->n_G;
+	const size_t lwork = n4*(n4+1);
+	std::complex<double> *work = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>)*lwork);
+	size_t *iwork = (size_t*)Simulation_WorkspaceAlloc(S, sizeof(size_t)*n4);
+	if(NULL == lthick || NULL == lepstype || NULL == lq || NULL == work || NULL == iwork){
+		Simulation_WorkspaceFree(S, iwork);
+		Simulation_WorkspaceFree(S, work);
+		Simulation_WorkspaceFree(S, lq);
+		Simulation_WorkspaceFree(S, lepstype);
+		Simulation_WorkspaceFree(S, lthick);
+		RS_TRACE("< Simulation_GetSMatrix (failed; allocation failed)\n");
+		return 1;
+	}
 	const std::complex<double> **lepsinv  = lq  + S->n_layers;
 	const std::complex<double> **lkp  = lepsinv  + S->n_layers;
 	const std::complex<double> **lphi = lkp + S->n_layers;
@@ -3640,11 +5999,13 @@ int Simulation_GetSMatrix(RS_Simulation *S, int from, int to, std::complex<doubl
 		}
 	}
 
-	GetSMatrix(S->n_layers, S->n_G, S->kx, S->ky, std::complex<double>(S->omega[0], S->omega[1]), lthick, lq, lepsinv, lepstype, lkp, lphi, M);
+	GetSMatrix(S->n_layers, S->n_G, S->kx, S->ky, std::complex<double>(S->omega[0], S->omega[1]), lthick, lq, lepsinv, lepstype, lkp, lphi, M, work, iwork, lwork, logdet, Simulation_GetStackSymmetries(S));
+	Simulation_WorkspaceFree(S, iwork);
+	Simulation_WorkspaceFree(S, work);
 
-	RS_free(lq);
-	RS_free(lepstype);
-	RS_free(lthick);
+	Simulation_WorkspaceFree(S, lq);
+	Simulation_WorkspaceFree(S, lepstype);
+	Simulation_WorkspaceFree(S, lthick);
 
 	RS_TRACE("< Simulation_GetSMatrix\n");
 	return 0;
@@ -3726,7 +6087,7 @@ int RS_Simulation_ExcitationPlanewave(
 	RS_real k_new[2] = { root_eps * kn[0], root_eps * kn[1] };
 
 	if(k_new[0] != S->k[0] || k_new[1] != S->k[1]){
-		RS_Simulation_DestroyLayerModes(S, -1);
+		Simulation_RetireLayerModes(S);
 		S->k[0] = k_new[0];
 		S->k[1] = k_new[1];
 	}
@@ -3806,7 +6167,7 @@ int RS_Simulation_GetFieldPlane(RS_Simulation *S, const int nxy[2], const RS_rea
 		return ret;
 	}
 
-	std::complex<double> *ab = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>) * (n4+8*n2));
+	std::complex<double> *ab = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>) * (n4+8*n2+12*nxy[0]*nxy[1]));
 	if(NULL == ab){
 		RS_TRACE("< RS_Simulation_GetFieldPlane (failed; allocation failed)\n");
 		return 1;
@@ -3823,10 +6184,899 @@ int RS_Simulation_GetFieldPlane(RS_Simulation *S, const int nxy[2], const RS_rea
 		Lmodes->q, Lmodes->kp, Lmodes->phi, Lmodes->Epsilon_inv, Lmodes->epstype,
 		ab, snxy, xy0,
 		reinterpret_cast<std::complex<double>*>(E),
-		reinterpret_cast<std::complex<double>*>(H)
+		reinterpret_cast<std::complex<double>*>(H),
+		work
 	);
-	RS_free(ab);
+	Simulation_WorkspaceFree(S, ab);
 
 	RS_TRACE("< RS_Simulation_GetFieldPlane\n");
 	return 0;
-}
\ No newline at end of file
+}
+
+int RS_Simulation_GetFieldVolume(RS_Simulation *S, const int nxy[2], int nz, const RS_real *z, RS_real *E, RS_real *H){
+	RS_TRACE("> RS_Simulation_GetFieldVolume(S=%p, nxy=%p (%d,%d), nz=%d, z=%p, E=%p, H=%p)\n",
+		S, nxy, (NULL == nxy ? 0 : nxy[0]), (NULL == nxy ? 0 : nxy[1]), nz, z, E, H);
+	if(NULL == S){
+		RS_TRACE("< RS_Simulation_GetFieldVolume (failed; S == NULL)\n");
+		return -1;
+	}
+	if(NULL == nxy || nxy[0] < 1 || nxy[1] < 1){
+		RS_TRACE("< RS_Simulation_GetFieldVolume (failed; nxy invalid)\n");
+		return -2;
+	}
+	if(nz < 0){
+		RS_TRACE("< RS_Simulation_GetFieldVolume (failed; nz < 0)\n");
+		return -3;
+	}
+	if(NULL == z){
+		RS_TRACE("< RS_Simulation_GetFieldVolume (failed; z == NULL)\n");
+		return -4;
+	}
+	if(NULL == E && NULL == H){
+		RS_TRACE("< RS_Simulation_GetFieldVolume (early exit; E and H both NULL)\n");
+		return 0;
+	}
+	if(S->n_layers < 1){
+		RS_TRACE("< RS_Simulation_GetFieldVolume (failed; no layers found)\n");
+		return 14;
+	}
+
+	const size_t N = (size_t)nxy[0] * (size_t)nxy[1];
+	const size_t snxy[2] = { (size_t)nxy[0], (size_t)nxy[1] };
+	int *slice_layer = (int*)Simulation_WorkspaceAlloc(S, sizeof(int) * nz + sizeof(double) * nz + 2*sizeof(std::complex<double>*) * nz);
+	if(NULL == slice_layer){
+		RS_TRACE("< RS_Simulation_GetFieldVolume (failed; allocation failed)\n");
+		return 1;
+	}
+	double *slice_dz = (double*)(slice_layer + nz);
+	std::complex<double> **eslice = (std::complex<double>**)(slice_dz + nz);
+	std::complex<double> **hslice = eslice + nz;
+	for(int k = 0; k < nz; ++k){
+		double zl = 0;
+		int i;
+		for(i = 0; i < S->n_layers && z[k] > zl+S->layer[i].thickness; ++i){
+			zl += S->layer[i].thickness;
+			if(i+1 == S->n_layers){ break; }
+		}
+		slice_layer[k] = i;
+	}
+
+	// Gather the slices of each layer in turn; each layer is solved once
+	// and its slices share one set of FFT plans.
+	int ret = 0;
+	for(int i = 0; i < S->n_layers; ++i){
+		RS_Layer *L = &(S->layer[i]);
+		size_t m = 0;
+		double zl = 0;
+		for(int j = 0; j < i; ++j){ zl += S->layer[j].thickness; }
+		for(int k = 0; k < nz; ++k){
+			if(i != slice_layer[k]){ continue; }
+			slice_dz[m] = z[k] - zl;
+			eslice[m] = (NULL != E ? reinterpret_cast<std::complex<double>*>(E) + 3*N*k : NULL);
+			hslice[m] = (NULL != H ? reinterpret_cast<std::complex<double>*>(H) + 3*N*k : NULL);
+			++m;
+		}
+		if(0 == m){ continue; }
+
+		LayerModes *Lmodes;
+		std::complex<double> *Lsoln;
+		ret = Simulation_GetLayerSolution(S, L, &Lmodes, &Lsoln);
+		if(0 != ret){
+			RS_TRACE("< RS_Simulation_GetFieldVolume (failed; Simulation_GetLayerSolution returned %d)\n", ret);
+			break;
+		}
+		RS_VERB(1, "Computing %d field slices in layer: %s\n", (int)m, NULL != L->name ? L->name : "");
+		GetFieldOnGridSlices(
+			S->n_G, S->G, S->kx, S->ky, std::complex<double>(S->omega[0],S->omega[1]),
+			Lmodes->q, Lmodes->kp, Lmodes->phi, Lmodes->Epsilon_inv, Lmodes->epstype,
+			L->thickness, Lsoln, snxy,
+			m, slice_dz,
+			(NULL != E ? eslice : NULL), (NULL != H ? hslice : NULL),
+			0
+		);
+	}
+	Simulation_WorkspaceFree(S, slice_layer);
+
+	RS_TRACE("< RS_Simulation_GetFieldVolume\n");
+	return ret;
+}
+
+int RS_Simulation_GetFieldVolumeFile(RS_Simulation *S, const int nxy[2], int nz, const RS_real *z, const char *filename){
+	if(NULL == S){ return -1; }
+	if(NULL == nxy || nxy[0] < 1 || nxy[1] < 1){ return -2; }
+	if(nz < 0){ return -3; }
+	if(NULL == z){ return -4; }
+	if(NULL == filename){ return -5; }
+
+	const size_t len = sizeof(RS_real) * 6 * (size_t)nxy[0] * (size_t)nxy[1] * (size_t)nz;
+	int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0){
+		if(NULL != S->msg){
+			S->msg(S->msgdata, "RS_Simulation_GetFieldVolumeFile", RS_MSG_ERROR, "Could not open output file");
+		}
+		return 1;
+	}
+	void *map = NULL;
+	if(0 == ftruncate(fd, (off_t)(2*len)) && len > 0){
+		map = mmap(NULL, 2*len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(MAP_FAILED == map){ map = NULL; }
+	}
+	close(fd);
+	if(NULL == map){
+		return (0 == len ? 0 : 1);
+	}
+	RS_real *E = (RS_real*)map;
+	int ret = RS_Simulation_GetFieldVolume(S, nxy, nz, z, E, E + len/sizeof(RS_real));
+	munmap(map, 2*len);
+	return ret;
+}
+
+struct FieldPoint{
+	int layer;
+	double dz; // offset within the layer
+	size_t index;
+};
+static bool FieldPoint_Less(const FieldPoint &a, const FieldPoint &b){
+	if(a.layer != b.layer){ return a.layer < b.layer; }
+	return a.dz < b.dz;
+}
+
+int RS_Simulation_GetFieldPoints(RS_Simulation *S, int npts, const RS_real *xyz, RS_real *E, RS_real *H){
+	RS_TRACE("> RS_Simulation_GetFieldPoints(S=%p, npts=%d, xyz=%p, E=%p, H=%p)\n", S, npts, xyz, E, H);
+	if(NULL == S){
+		RS_TRACE("< RS_Simulation_GetFieldPoints (failed; S == NULL)\n");
+		return -1;
+	}
+	if(npts < 0){
+		RS_TRACE("< RS_Simulation_GetFieldPoints (failed; npts < 0)\n");
+		return -2;
+	}
+	if(NULL == xyz){
+		RS_TRACE("< RS_Simulation_GetFieldPoints (failed; xyz == NULL)\n");
+		return -3;
+	}
+	if(NULL == E && NULL == H){
+		RS_TRACE("< RS_Simulation_GetFieldPoints (early exit; E and H both NULL)\n");
+		return 0;
+	}
+	if(S->n_layers < 1){
+		RS_TRACE("< RS_Simulation_GetFieldPoints (failed; no layers found)\n");
+		return 14;
+	}
+	if(0 == npts){ return 0; }
+
+	const size_t n = S->n_G;
+	const size_t n2 = 2*n;
+	const size_t n4 = 2*n2;
+	const size_t np = npts;
+
+	// Locate each point and sort so that points in the same plane of the
+	// same layer are contiguous.
+	FieldPoint *pts = (FieldPoint*)Simulation_WorkspaceAlloc(S, sizeof(FieldPoint) * np);
+	if(NULL == pts){
+		RS_TRACE("< RS_Simulation_GetFieldPoints (failed; allocation failed)\n");
+		return 1;
+	}
+	for(size_t p = 0; p < np; ++p){
+		const double zp = xyz[3*p+2];
+		double dz = zp;
+		double z = 0;
+		int i;
+		for(i = 0; i < S->n_layers && zp > z+S->layer[i].thickness; ++i){
+			z += S->layer[i].thickness;
+			if(i+1 == S->n_layers){ break; }
+			dz -= S->layer[i].thickness;
+		}
+		pts[p].layer = i;
+		pts[p].dz = dz;
+		pts[p].index = p;
+	}
+	std::sort(pts, pts+np, &FieldPoint_Less);
+
+	// The orders are the same for every plane, so one plan serves all.
+	nufft_plan plan = NULL;
+	if(S->options.field_point_tolerance > 0){
+		plan = nufft2_plan_create(n, S->G, 6, S->options.field_point_tolerance);
+		if(NULL == plan){
+			Simulation_WorkspaceFree(S, pts);
+			RS_TRACE("< RS_Simulation_GetFieldPoints (failed; allocation failed)\n");
+			return 1;
+		}
+	}
+
+	const size_t lwork = 8*n2 + 6*n + (NULL != plan ? 7*np : FIELD_POINTS_BLOCK*(n+6));
+	std::complex<double> *ab = (std::complex<double>*)Simulation_WorkspaceAlloc(S,
+		sizeof(std::complex<double>) * (n4 + lwork + 6*np) + sizeof(double) * 2*np
+	);
+	if(NULL == ab){
+		nufft2_plan_destroy(plan);
+		Simulation_WorkspaceFree(S, pts);
+		RS_TRACE("< RS_Simulation_GetFieldPoints (failed; allocation failed)\n");
+		return 1;
+	}
+	std::complex<double> *work = ab + n4;
+	std::complex<double> *efield = work + lwork;
+	std::complex<double> *hfield = efield + 3*np;
+	double *r = (double*)(hfield + 3*np);
+
+	int ret = 0;
+	for(size_t p0 = 0; p0 < np; ){
+		size_t p1 = p0+1;
+		while(p1 < np && pts[p1].layer == pts[p0].layer && pts[p1].dz == pts[p0].dz){ ++p1; }
+		const size_t m = p1 - p0;
+
+		RS_Layer *L = &(S->layer[pts[p0].layer]);
+		LayerModes *Lmodes;
+		std::complex<double> *Lsoln;
+		ret = Simulation_GetLayerSolution(S, L, &Lmodes, &Lsoln);
+		if(0 != ret){
+			RS_TRACE("< RS_Simulation_GetFieldPoints (failed; Simulation_GetLayerSolution returned %d)\n", ret);
+			break;
+		}
+		RNP::TBLAS::Copy(n4, Lsoln,1, ab,1);
+		TranslateAmplitudes(S->n_G, Lmodes->q, L->thickness, pts[p0].dz, ab);
+		for(size_t j = 0; j < m; ++j){
+			r[2*j+0] = xyz[3*pts[p0+j].index+0];
+			r[2*j+1] = xyz[3*pts[p0+j].index+1];
+		}
+		if(NULL != plan){
+			GetFieldAtPointsNUFFT(
+				S->n_G, S->G, S->kx, S->ky, std::complex<double>(S->omega[0],S->omega[1]),
+				Lmodes->q, Lmodes->kp, Lmodes->phi, Lmodes->Epsilon_inv, Lmodes->epstype,
+				ab, S->Lk, plan, m, r,
+				(NULL != E ? efield : NULL), (NULL != H ? hfield : NULL),
+				work
+			);
+		}else{
+			GetFieldAtPoints(
+				S->n_G, S->kx, S->ky, std::complex<double>(S->omega[0],S->omega[1]),
+				Lmodes->q, Lmodes->kp, Lmodes->phi, Lmodes->Epsilon_inv, Lmodes->epstype,
+				ab, m, r,
+				(NULL != E ? efield : NULL), (NULL != H ? hfield : NULL),
+				work
+			);
+		}
+		for(size_t j = 0; j < m; ++j){
+			const size_t ip = pts[p0+j].index;
+			for(size_t c = 0; c < 3; ++c){
+				if(NULL != E){
+					E[6*ip+2*c+0] = efield[3*j+c].real();
+					E[6*ip+2*c+1] = efield[3*j+c].imag();
+				}
+				if(NULL != H){
+					H[6*ip+2*c+0] = hfield[3*j+c].real();
+					H[6*ip+2*c+1] = hfield[3*j+c].imag();
+				}
+			}
+		}
+		p0 = p1;
+	}
+	Simulation_WorkspaceFree(S, ab);
+	Simulation_WorkspaceFree(S, pts);
+	nufft2_plan_destroy(plan);
+
+	RS_TRACE("< RS_Simulation_GetFieldPoints\n");
+	return ret;
+}
+
+// Fills value with the observable of a convergence run (see
+// RS_Simulation_ConvergeNumG), and nvalues with the number of values.
+static int Simulation_GetConvergenceObservable(RS_Simulation *S, const RS_ConvergenceObservable *obs, double *value, int *nvalues){
+	int ret = 0;
+	if(RS_CONVERGE_POWER_FLUX == obs->type){
+		double power[4];
+		ret = RS_Simulation_GetPowerFlux(S, obs->layer, &obs->offset, power);
+		value[0] = power[0];
+		value[1] = power[1];
+		*nvalues = 2;
+	}else if(RS_CONVERGE_ORDER_FLUX == obs->type){
+		int g;
+		for(g = 0; g < S->n_G; ++g){
+			if(obs->order[0] == S->G[2*g+0] && obs->order[1] == S->G[2*g+1]){ break; }
+		}
+		if(g >= S->n_G){ return -2; }
+		double *power = (double*)Simulation_WorkspaceAlloc(S, sizeof(double) * 4*S->n_G);
+		if(NULL == power){ return 1; }
+		ret = Simulation_GetPoyntingFluxByG(S, &S->layer[obs->layer], obs->offset, power);
+		value[0] = power[4*g+0];
+		value[1] = power[4*g+1];
+		Simulation_WorkspaceFree(S, power);
+		*nvalues = 2;
+	}else{
+		ret = Simulation_GetField(S, obs->xyz, &value[0], &value[6]);
+		*nvalues = 12;
+	}
+	return ret;
+}
+
+// Embeds the eigenvector basis of a layer, solved with the n0 vectors
+// G0, into the current G list as a starting point for its refinement.
+// Orders new to the list get unit vectors. Returns NULL if an old order
+// is not in the new list.
+static LayerModes* LayerModes_Embed(const RS_Simulation *S, int n0, const int *G0, const LayerModes *modes0){
+	const size_t n = S->n_G;
+	const size_t n2 = 2*n;
+	const size_t m2 = 2*n0;
+	int *pos = (int*)malloc(sizeof(int) * n0);
+	if(NULL == pos){ return NULL; }
+	for(int j = 0; j < n0; ++j){
+		pos[j] = -1;
+		for(size_t i = 0; i < n; ++i){
+			if(G0[2*j+0] == S->G[2*i+0] && G0[2*j+1] == S->G[2*i+1]){
+				pos[j] = (int)i;
+				break;
+			}
+		}
+		if(pos[j] < 0){
+			free(pos);
+			return NULL;
+		}
+	}
+	LayerModes *modes = (LayerModes*)malloc(sizeof(LayerModes));
+	std::complex<double> *q = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>) * (n2 + n2*n2));
+	if(NULL == modes || NULL == q){
+		free(modes);
+		RS_free(q);
+		free(pos);
+		return NULL;
+	}
+	modes->q = q;
+	modes->kp = NULL;
+	modes->phi = q + n2;
+	modes->Epsilon2 = NULL;
+	modes->Epsilon_inv = NULL;
+	modes->epstype = modes0->epstype;
+	modes->mapped = 0;
+	modes->map = NULL;
+	modes->map_size = 0;
+	modes->nmodes = n2;
+	modes->mode_residual = 0;
+	modes->q_cutoff = 0;
+
+	std::complex<double> *phi = modes->phi;
+	RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,1., phi,n2);
+	for(int j = 0; j < n0; ++j){
+		// The identity columns of old orders are replaced by their modes.
+		phi[pos[j]+pos[j]*n2] = 0;
+		phi[(n+pos[j])+(n+pos[j])*n2] = 0;
+	}
+	for(size_t j = 0; j < m2; ++j){
+		const size_t c = (j < (size_t)n0 ? pos[j] : n+pos[j-n0]);
+		for(size_t i = 0; i < m2; ++i){
+			const size_t r = (i < (size_t)n0 ? pos[i] : n+pos[i-n0]);
+			phi[r+c*n2] = modes0->phi[i+j*m2];
+		}
+	}
+	free(pos);
+	return modes;
+}
+
+int RS_Simulation_ConvergeNumG(
+	RS_Simulation *S, const RS_ConvergenceObservable *obs,
+	int nG_max, RS_real growth, RS_real tol,
+	int max_steps, RS_ConvergenceStep *history, int *nsteps
+){
+	RS_TRACE("> RS_Simulation_ConvergeNumG(S=%p, obs=%p, nG_max=%d, growth=%f, tol=%g, max_steps=%d, history=%p, nsteps=%p)\n",
+		S, obs, nG_max, growth, tol, max_steps, history, nsteps);
+	int ret = 0;
+	if(NULL == S){ ret = -1; }
+	else if(NULL == obs || obs->type < RS_CONVERGE_POWER_FLUX || obs->type > RS_CONVERGE_FIELD){ ret = -2; }
+	else if(RS_CONVERGE_FIELD != obs->type && (obs->layer < 0 || obs->layer >= S->n_layers)){ ret = -2; }
+	if(nG_max < 1){ ret = -3; }
+	if(!(growth > 1)){ ret = -4; }
+	if(!(tol >= 0)){ ret = -5; }
+	if(max_steps < 1){ ret = -6; }
+	if(NULL == history){ ret = -7; }
+	if(NULL == nsteps){ ret = -8; }
+	if(0 != ret){
+		RS_TRACE("< RS_Simulation_ConvergeNumG (failed; ret = %d)\n", ret);
+		return ret;
+	}
+	*nsteps = 0;
+
+	LayerModes **kept = (LayerModes**)calloc(S->n_layers, sizeof(LayerModes*));
+	int *G0 = (int*)malloc(sizeof(int) * 2*nG_max);
+	if(NULL == kept || NULL == G0){
+		free(kept);
+		free(G0);
+		RS_TRACE("< RS_Simulation_ConvergeNumG (failed; allocation failed)\n");
+		return 1;
+	}
+	// The pattern Fourier coefficients and the containment trees outlive
+	// the solutions of each level.
+	FourierCache *ft_cache = NULL;
+	if(NULL == S->ft_cache){
+		S->ft_cache = ft_cache = FourierCache_New(S->n_layers);
+	}
+
+	int nvalues = 0;
+	for(int step = 0; step < max_steps; ++step){
+		if(step > 0){
+			const int n0 = S->n_G;
+			if(n0 >= nG_max){ break; }
+			memcpy(G0, S->G, sizeof(int) * 2*n0);
+			for(int i = 0; i < S->n_layers; ++i){
+				RS_Layer *L = &S->layer[i];
+				LayerModes_Destroy(kept[i]);
+				kept[i] = NULL;
+				if(S->options.mode_continuation && L->pattern.nshapes > 0 &&
+					NULL != L->modes && NULL != L->modes->phi &&
+					L->modes->nmodes == 2*n0 && !L->modes->mapped
+				){
+					kept[i] = L->modes;
+					L->modes = NULL;
+				}
+			}
+			// Grow along the G selection order; some counts round down to
+			// the previous level, so step up until the list grows.
+			int target = (int)ceil(n0 * growth);
+			if(target > nG_max){ target = nG_max; }
+			Simulation_SetNumG(S, target);
+			while(S->n_G <= n0 && target < nG_max){
+				Simulation_SetNumG(S, ++target);
+			}
+			if(S->n_G <= n0){ break; }
+			for(int i = 0; i < S->n_layers; ++i){
+				if(NULL != kept[i]){
+					S->layer[i].prev_modes = LayerModes_Embed(S, n0, G0, kept[i]);
+				}
+			}
+		}
+
+		RS_ConvergenceStep *h = &history[step];
+		h->n_G = S->n_G;
+		memset(h->value, 0, sizeof(h->value));
+		ret = Simulation_GetConvergenceObservable(S, obs, h->value, &nvalues);
+		if(0 != ret){ break; }
+		++(*nsteps);
+		h->change = -1;
+		if(step > 0){
+			double vmax = 0, dmax = 0;
+			for(int k = 0; k < nvalues; ++k){
+				vmax = std::max(vmax, fabs(h->value[k]));
+				dmax = std::max(dmax, fabs(h->value[k] - history[step-1].value[k]));
+			}
+			h->change = (vmax > 0 ? dmax / vmax : dmax);
+		}
+		RS_VERB(1, "Convergence level %d: %d G-vectors, change %g\n", step, S->n_G, h->change);
+		if(step > 0 && h->change <= tol){ break; }
+	}
+
+	for(int i = 0; i < S->n_layers; ++i){
+		LayerModes_Destroy(kept[i]);
+	}
+	if(NULL != ft_cache){
+		FourierCache_Destroy(ft_cache);
+		S->ft_cache = NULL;
+	}
+	free(G0);
+	free(kept);
+
+	RS_TRACE("< RS_Simulation_ConvergeNumG (ret = %d)\n", ret);
+	return ret;
+}
+
+// Contracts the sensitivities Ceps and Cinv of a patterned layer (see
+// GetLayerAdjointSensitivity) to the Fourier coefficients of the pattern
+// at each difference of G vectors, as formed by FMMGetEpsilon_ClosedForm.
+// WE receives the weights of the coefficients of epsilon, and for a 1D
+// lattice WT those of 1/epsilon, on the grid covering ext. work is of
+// length 3*n_G^2.
+static void Simulation_GetGradientWeights(
+	const RS_Simulation *S, const LayerModes *Lmodes,
+	const std::complex<double> *Ceps, const std::complex<double> *Cinv,
+	const int ext[2], std::complex<double> *WE, std::complex<double> *WT,
+	std::complex<double> *work
+){
+	const int n = S->n_G;
+	const int n2 = 2*n;
+	const int *G = S->G;
+	const bool is1d = (0 == S->Lr[2] && 0 == S->Lr[3]);
+	const size_t w = 2*ext[0]+1;
+	const size_t ngrid = w*(2*ext[1]+1);
+	std::complex<double> *Z = work;
+	std::complex<double> *t = Z + n*n;
+	std::complex<double> *ZT = t + n*n;
+
+	// Epsilon_inv = inv(Epsilon), so its changes enter as
+	// -Epsilon_inv dEpsilon Epsilon_inv. In 1D the lower diagonal block of
+	// Epsilon2 is inv(T), with T the Toeplitz matrix of 1/epsilon.
+	RNP::TBLAS::MultMM<'N','N'>(n,n,n, std::complex<double>(1.),Cinv,n, Lmodes->Epsilon_inv,n, std::complex<double>(0.), t,n);
+	RNP::TBLAS::MultMM<'N','N'>(n,n,n, std::complex<double>(-1.),Lmodes->Epsilon_inv,n, t,n, std::complex<double>(0.), Z,n);
+	for(int j = 0; j < n; ++j){
+		for(int i = 0; i < n; ++i){
+			Z[i+j*n] += Ceps[i+j*n2];
+			if(!is1d){
+				Z[i+j*n] += Ceps[(n+i)+(n+j)*n2];
+			}
+		}
+	}
+	for(size_t k = 0; k < ngrid; ++k){
+		WE[k] = 0;
+	}
+	if(is1d){
+		const std::complex<double> *E = &Lmodes->Epsilon2[n+n*n2];
+		RNP::TBLAS::MultMM<'N','N'>(n,n,n, std::complex<double>(1.),&Ceps[n+n*n2],n2, E,n2, std::complex<double>(0.), t,n);
+		RNP::TBLAS::MultMM<'N','N'>(n,n,n, std::complex<double>(-1.),E,n2, t,n, std::complex<double>(0.), ZT,n);
+		for(size_t k = 0; k < ngrid; ++k){
+			WT[k] = 0;
+		}
+	}
+
+	double mp1 = 0;
+	const int pwr = S->options.lanczos_smoothing_power;
+	if(S->options.use_Lanczos_smoothing){
+		mp1 = GetLanczosSmoothingOrder(S) * S->options.lanczos_smoothing_width;
+	}
+	for(int j = 0; j < n; ++j){
+		for(int i = 0; i < n; ++i){
+			const int dG[2] = {G[2*i+0]-G[2*j+0],G[2*i+1]-G[2*j+1]};
+			double f[2] = {
+				dG[0] * S->Lk[0] + dG[1] * S->Lk[2],
+				dG[0] * S->Lk[1] + dG[1] * S->Lk[3]
+			};
+			double sigma = 1;
+			if(S->options.use_Lanczos_smoothing){
+				sigma = GetLanczosSmoothingFactor(mp1, pwr, f);
+			}
+			const size_t k = (dG[0]+ext[0]) + (size_t)(dG[1]+ext[1])*w;
+			WE[k] += sigma * Z[j+i*n];
+			if(is1d){
+				WT[k] += sigma * ZT[j+i*n];
+			}
+		}
+	}
+}
+
+int RS_Simulation_GetGradient(
+	RS_Simulation *S, const RS_GradientOutput *output,
+	int nparams, const RS_GradientParameter *param, RS_real *grad
+){
+	RS_TRACE("> RS_Simulation_GetGradient(S=%p, output=%p, nparams=%d, param=%p, grad=%p)\n",
+		S, output, nparams, param, grad);
+	int ret = 0;
+	if(NULL == S){ ret = -1; }
+	else if(NULL == output || output->type < RS_GRADIENT_FORWARD_FLUX || output->type > RS_GRADIENT_AMPLITUDE){ ret = -2; }
+	else if(S->n_layers < 1 || (0 != output->layer && S->n_layers-1 != output->layer)){ ret = -2; }
+	if(nparams < 0){ ret = -3; }
+	if(nparams > 0 && NULL == param){ ret = -4; }
+	if(nparams > 0 && NULL == grad){ ret = -5; }
+	for(int p = 0; 0 == ret && p < nparams; ++p){
+		const RS_GradientParameter *P = &param[p];
+		if(RS_GRADIENT_THICKNESS == P->type || RS_GRADIENT_SHAPE == P->type){
+			if(P->id < 0 || P->id >= S->n_layers){ ret = -4; }
+		}else if(RS_GRADIENT_EPSILON == P->type){
+			if(P->id < 0 || P->id >= S->n_materials){ ret = -4; }
+			if(0 != P->index && 1 != P->index){ ret = -4; }
+		}else{
+			ret = -4;
+		}
+	}
+	if(0 != ret){
+		RS_TRACE("< RS_Simulation_GetGradient (failed; ret = %d)\n", ret);
+		return ret;
+	}
+
+	const int nl = S->n_layers;
+	const int lo = output->layer;
+
+	// Only the interior layers are differentiated, so that the excitation
+	// and the observation layer are fixed.
+	int *owner = (int*)malloc(sizeof(int) * 2*nl);
+	if(NULL == owner){
+		RS_TRACE("< RS_Simulation_GetGradient (failed; allocation failed)\n");
+		return 1;
+	}
+	int *need = owner + nl;
+	for(int i = 0; i < nl; ++i){
+		owner[i] = (S->layer[i].copy >= 0 ? S->layer[i].copy : i);
+		need[i] = 0;
+	}
+	for(int p = 0; p < nparams; ++p){
+		const RS_GradientParameter *P = &param[p];
+		for(int i = 0; i < nl; ++i){
+			const RS_Layer *L = &S->layer[owner[i]];
+			bool uses;
+			if(RS_GRADIENT_THICKNESS == P->type){
+				uses = (i == P->id);
+			}else if(RS_GRADIENT_EPSILON == P->type){
+				uses = Layer_UsesMaterial(L, P->id);
+			}else{
+				uses = (owner[i] == owner[P->id]);
+			}
+			if(!uses){ continue; }
+			if(0 == i || nl-1 == i){ ret = 2; }
+			if(RS_GRADIENT_THICKNESS == P->type){ continue; }
+			need[owner[i]] = 1;
+			if(0 != S->material[L->material].type){ ret = 2; }
+			for(int k = 0; k < L->pattern.nshapes; ++k){
+				if(0 != S->material[L->pattern.shapes[k].tag].type){ ret = 2; }
+			}
+			if(L->pattern.nshapes > 0 && (
+				S->options.use_experimental_fmm ||
+				S->options.use_discretized_epsilon ||
+				S->options.use_polarization_basis
+			)){ ret = 2; }
+		}
+	}
+	if(0 != ret){
+		free(owner);
+		RS_TRACE("< RS_Simulation_GetGradient (failed; unsupported parameter)\n");
+		return ret;
+	}
+
+	// The forward solution in every layer
+	LayerModes **lmodes = (LayerModes**)malloc(sizeof(LayerModes*) * nl);
+	const std::complex<double> **lab = (const std::complex<double> **)malloc(sizeof(const std::complex<double> *) * nl);
+	if(NULL == lmodes || NULL == lab){
+		free(lab); free(lmodes); free(owner);
+		RS_TRACE("< RS_Simulation_GetGradient (failed; allocation failed)\n");
+		return 1;
+	}
+	for(int i = 0; i < nl; ++i){
+		std::complex<double> *Lsoln;
+		ret = Simulation_GetLayerSolution(S, &S->layer[i], &lmodes[i], &Lsoln);
+		if(0 != ret){
+			free(lab); free(lmodes); free(owner);
+			RS_TRACE("< RS_Simulation_GetGradient (failed; Simulation_GetLayerSolution returned %d)\n", ret);
+			return ret;
+		}
+		lab[i] = Lsoln;
+	}
+
+	const int n = S->n_G;
+	const int n2 = 2*n;
+	const int n4 = 2*n2;
+	const size_t n22 = (size_t)n2*n2;
+	const std::complex<double> omega(S->omega[0], S->omega[1]);
+	const int ndim = (0 == S->Lr[2] && 0 == S->Lr[3]) ? 1 : 2;
+	if(RS_GRADIENT_AMPLITUDE == output->type && (output->index < 0 || output->index >= n4)){ ret = -2; }
+	for(int p = 0; p < nparams; ++p){
+		if(RS_GRADIENT_SHAPE == param[p].type){
+			const RS_Layer *L = &S->layer[owner[param[p].id]];
+			if(param[p].region < 0 || param[p].region >= L->pattern.nshapes){ ret = -4; }
+		}
+	}
+	if(0 != ret){
+		free(lab); free(lmodes); free(owner);
+		RS_TRACE("< RS_Simulation_GetGradient (failed; ret = %d)\n", ret);
+		return ret;
+	}
+
+	int ext[2] = { 0, 0 };
+	for(int i = 0; i < n; ++i){
+		for(int d = 0; d < 2; ++d){
+			if(2*abs(S->G[2*i+d]) > ext[d]){ ext[d] = 2*abs(S->G[2*i+d]); }
+		}
+	}
+	const size_t ngrid = (size_t)(2*ext[0]+1)*(2*ext[1]+1);
+
+	// Sizes of the adjoint modes, and of the sensitivities of the layers
+	// that are needed
+	size_t adj_size = 0, sens_size = 0;
+	for(int i = 0; i < nl; ++i){
+		if(owner[i] != i){ continue; }
+		adj_size += n22 + (NULL == lmodes[i]->phi ? 0 : n22);
+		if(need[i]){
+			sens_size += n22 + (size_t)n*n;
+			if(S->layer[i].pattern.nshapes > 0){ sens_size += 2*ngrid; }
+		}
+	}
+	const bool all = (RS_SOLVE_STRATEGY_ALL == S->solution->strategy);
+	const size_t lwork_solve = (all ? 6*nl*n22 : 2*(size_t)n4*n4 + (size_t)n4*(n4+1));
+	const size_t lwork = std::max(lwork_solve, 5*n22);
+	const size_t store_size = (all ? 0 : (n22+n2)*nl);
+
+	const std::complex<double> **lq = (const std::complex<double> **)malloc(sizeof(const std::complex<double> *) * 4*nl);
+	double *lthick = (double*)malloc(sizeof(double) * nl);
+	int *lepstype = (int*)malloc(sizeof(int) * nl);
+	size_t *iwork = (size_t*)RS_malloc(sizeof(size_t) * (all ? nl*n2 : n4));
+	std::complex<double> *adj = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>) * (
+		adj_size + sens_size + nl*n4 + 2*n4 + nl + lwork + store_size
+	));
+	if(NULL == lq || NULL == lthick || NULL == lepstype || NULL == iwork || NULL == adj){
+		RS_free(adj); RS_free(iwork); free(lepstype); free(lthick); free(lq);
+		free(lab); free(lmodes); free(owner);
+		RS_TRACE("< RS_Simulation_GetGradient (failed; allocation failed)\n");
+		return 1;
+	}
+	const std::complex<double> **lepsinv = lq + nl;
+	const std::complex<double> **lkp = lepsinv + nl;
+	const std::complex<double> **lphi = lkp + nl;
+	std::complex<double> *sens = adj + adj_size;
+	std::complex<double> *ab_adj = sens + sens_size;
+	std::complex<double> *h = ab_adj + nl*n4;
+	std::complex<double> *t = h + n4;
+	std::complex<double> *dthick = t + n4;
+	std::complex<double> *work = dthick + nl;
+	std::complex<double> *store = work + lwork;
+
+	// Modes of the adjoint layers; copies share those of their owner.
+	{
+		std::complex<double> *p = adj;
+		for(int i = 0; i < nl && 0 == ret; ++i){
+			const RS_Layer *L = &S->layer[i];
+			const LayerModes *M = lmodes[i];
+			lthick[i] = L->thickness;
+			lq[i] = M->q;
+			lepsinv[i] = M->Epsilon_inv;
+			lepstype[i] = M->epstype;
+			if(owner[i] != i){ continue; }
+			std::complex<double> *kp_adj = p; p += n22;
+			std::complex<double> *phi_adj = NULL;
+			if(NULL != M->phi){ phi_adj = p; p += n22; }
+			if(0 != GetAdjointLayerModes(n, S->kx, S->ky, omega, M->q, M->Epsilon_inv, M->epstype, M->kp, M->phi, kp_adj, phi_adj, work)){
+				ret = 2;
+			}
+			lkp[i] = kp_adj;
+			lphi[i] = phi_adj;
+		}
+		for(int i = 0; i < nl; ++i){
+			lkp[i] = lkp[owner[i]];
+			lphi[i] = lphi[owner[i]];
+		}
+	}
+
+	// The output as a linear function h^T w of the mode amplitudes w in
+	// the observation layer; for a flux, that of its first variation.
+	if(0 == ret){
+		const LayerModes *M = lmodes[lo];
+		if(RS_GRADIENT_AMPLITUDE == output->type){
+			RNP::TBLAS::Fill(n4, 0., h,1);
+			h[output->index] = 1;
+		}else{
+			memcpy(t, lab[lo], sizeof(std::complex<double>) * n4);
+			TranslateAmplitudes(n, M->q, S->layer[lo].thickness, output->offset, t);
+			const bool forward = (RS_GRADIENT_FORWARD_FLUX == output->type);
+			GetZPoyntingFluxGradient(n, S->kx, S->ky, omega, M->q, M->Epsilon_inv, M->epstype, M->kp, M->phi, t,
+				forward ? h : NULL, forward ? NULL : h, work);
+		}
+
+		// The adjoint excitation enters the observation layer from the
+		// outside, in place of the waves leaving the structure there.
+		const std::complex<double> I(0.,1.);
+		RNP::TBLAS::Fill(nl*n4, 0., ab_adj,1);
+		for(int i = 0; i < n2; ++i){
+			if(0 == lo){
+				ab_adj[i] = std::exp(-I*M->q[i]*output->offset) * h[n2+i];
+			}else{
+				ab_adj[nl*n4-n2+i] = -std::exp(I*M->q[i]*(output->offset - S->layer[lo].thickness)) * h[i];
+			}
+		}
+		if(all){
+			ret = SolveAll(nl, n, S->kx, S->ky, omega, lthick, lq, lepsinv, lepstype, lkp, lphi, ab_adj, work, iwork, lwork);
+		}else{
+			ret = SolveAllStreaming(nl, n, S->kx, S->ky, omega, lthick, lq, lepsinv, lepstype, lkp, lphi, ab_adj, store, work, iwork, lwork);
+		}
+	}
+
+	// Sensitivities of each interior layer, summed over copies
+	std::complex<double> **Ceps = (std::complex<double>**)malloc(sizeof(std::complex<double>*) * 3*nl);
+	if(NULL == Ceps){ ret = 1; }
+	if(0 == ret){
+		std::complex<double> **Cinv = Ceps + nl;
+		std::complex<double> **W = Cinv + nl;
+		std::complex<double> *p = sens;
+		for(int i = 0; i < nl; ++i){
+			Ceps[i] = Cinv[i] = W[i] = NULL;
+			if(owner[i] == i && need[i]){
+				Ceps[i] = p; p += n22;
+				Cinv[i] = p; p += (size_t)n*n;
+				if(S->layer[i].pattern.nshapes > 0){ W[i] = p; p += 2*ngrid; }
+			}
+		}
+		if(sens_size > 0){
+			RNP::TBLAS::Fill(sens_size, 0., sens,1);
+		}
+		for(int i = 1; i+1 < nl; ++i){
+			const LayerModes *M = lmodes[i];
+			const int o = owner[i];
+			GetLayerAdjointSensitivity(n, S->kx, S->ky, omega, S->layer[i].thickness,
+				M->q, M->Epsilon_inv, M->epstype, M->kp, M->phi,
+				lab[i], &ab_adj[i*n4], &dthick[i], Ceps[o], Cinv[o], work);
+		}
+		for(int i = 0; i < nl; ++i){
+			if(NULL != W[i]){
+				Simulation_GetGradientWeights(S, lmodes[i], Ceps[i], Cinv[i], ext, W[i], W[i]+ngrid, work);
+			}
+		}
+
+		const double unit_cell_size = Simulation_GetUnitCellSize(S);
+		for(int p = 0; p < nparams && 0 == ret; ++p){
+			const RS_GradientParameter *P = &param[p];
+			std::complex<double> dL = 0;
+			if(RS_GRADIENT_THICKNESS == P->type){
+				dL = dthick[P->id];
+			}else{
+				const int o0 = (RS_GRADIENT_SHAPE == P->type ? owner[P->id] : 0);
+				const int o1 = (RS_GRADIENT_SHAPE == P->type ? o0+1 : nl);
+				for(int o = o0; o < o1; ++o){
+					if(NULL == Ceps[o]){ continue; }
+					const RS_Layer *L = &S->layer[o];
+					if(RS_GRADIENT_EPSILON == P->type && !Layer_UsesMaterial(L, P->id)){ continue; }
+					const RS_Material *Mp = &S->material[P->id];
+					const std::complex<double> eps(Mp->eps.s[0], Mp->eps.s[1]);
+					if(0 == L->pattern.nshapes){
+						std::complex<double> trE = 0, trI = 0;
+						for(int i = 0; i < n2; ++i){ trE += Ceps[o][i+i*n2]; }
+						for(int i = 0; i < n; ++i){ trI += Cinv[o][i+i*n]; }
+						dL += trE - trI/(eps*eps);
+						continue;
+					}
+					// Values of the regions whose Fourier transforms give the
+					// derivatives of those of epsilon and 1/epsilon.
+					const int nv = 2*(L->pattern.nshapes+1);
+					double *values = (double*)malloc(sizeof(double) * 2*nv);
+					if(NULL == values){ ret = 1; break; }
+					double *ivalues = values + nv;
+					for(int k = -1; k < L->pattern.nshapes; ++k){
+						const int m = (k < 0 ? L->material : L->pattern.shapes[k].tag);
+						const std::complex<double> e(S->material[m].eps.s[0], S->material[m].eps.s[1]);
+						std::complex<double> v, iv;
+						if(RS_GRADIENT_EPSILON == P->type){
+							v = (m == P->id ? 1. : 0.);
+							iv = (m == P->id ? -1./(e*e) : 0.);
+						}else{
+							v = e;
+							iv = 1./e;
+						}
+						values[2*(k+1)+0] = v.real();
+						values[2*(k+1)+1] = v.imag();
+						ivalues[2*(k+1)+0] = iv.real();
+						ivalues[2*(k+1)+1] = iv.imag();
+					}
+					const std::complex<double> *WE = W[o];
+					const std::complex<double> *WT = W[o] + ngrid;
+					for(int v = -ext[1]; v <= ext[1] && 0 == ret; ++v){
+						for(int u = -ext[0]; u <= ext[0]; ++u){
+							const size_t k = (u+ext[0]) + (size_t)(v+ext[1])*(2*ext[0]+1);
+							if(0. == WE[k] && (2 == ndim || 0. == WT[k])){ continue; }
+							const double f[2] = {
+								u * S->Lk[0] + v * S->Lk[2],
+								u * S->Lk[1] + v * S->Lk[3]
+							};
+							double ft[2], ift[2] = { 0, 0 };
+							if(RS_GRADIENT_EPSILON == P->type){
+								Pattern_GetFourierTransform(&L->pattern, values, f, ndim, unit_cell_size, ft);
+								if(1 == ndim){
+									Pattern_GetFourierTransform(&L->pattern, ivalues, f, ndim, unit_cell_size, ift);
+								}
+							}else{
+								if(0 != Pattern_GetFourierTransformDerivative(&L->pattern, values, P->region, P->index, f, ndim, unit_cell_size, ft)){
+									ret = -4;
+									break;
+								}
+								if(1 == ndim){
+									Pattern_GetFourierTransformDerivative(&L->pattern, ivalues, P->region, P->index, f, ndim, unit_cell_size, ift);
+								}
+							}
+							dL += WE[k] * std::complex<double>(ft[0], ft[1]);
+							if(1 == ndim){
+								dL += WT[k] * std::complex<double>(ift[0], ift[1]);
+							}
+						}
+					}
+					free(values);
+				}
+				if(RS_GRADIENT_SHAPE == P->type && 2 == P->index){
+					dL *= 2*M_PI; // angle_frac
+				}
+				if(RS_GRADIENT_EPSILON == P->type && 1 == P->index){
+					dL *= std::complex<double>(0.,1.);
+				}
+			}
+			if(RS_GRADIENT_AMPLITUDE == output->type){
+				grad[2*p+0] = dL.real();
+				grad[2*p+1] = dL.imag();
+			}else{
+				grad[p] = dL.real();
+			}
+		}
+	}
+
+	free(Ceps);
+	RS_free(adj); RS_free(iwork); free(lepstype); free(lthick); free(lq);
+	free(lab); free(lmodes); free(owner);
+	RS_TRACE("< RS_Simulation_GetGradient\n");
+	return ret;
+}
@@ -0,0 +1,249 @@
+#include "RS.h"
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <complex>
+#include <algorithm>
+#include "fmm/fmm.h"
+
+// The bands are the zeros of D(f) = 1/det(S11), whose log is accumulated
+// while the S-matrix is composed. D itself over- and underflows easily,
+// so the secant iteration is written in terms of ratios of D, which are
+// exponentials of differences of the logs.
+
+// Maximum number of secant steps spent on one band.
+#define BANDS_MAX_ITERATIONS 40
+// Minimum number of samples of the local scan around each tracked band.
+#define BANDS_TRACK_POINTS 9
+
+// Sets the frequency f and the Bloch wavevector 2*pi*kB of T, and returns
+// log det(S11) in L. S->k is relative to the real part of omega = 2*pi*f.
+static int Bands_LogDet(
+	RS_Simulation *T, const double kB[2], const std::complex<double> &f,
+	std::complex<double> *M, std::complex<double> *L
+){
+	const RS_real freq[2] = { f.real(), f.imag() };
+	RS_Simulation_SetFrequency(T, freq);
+	T->k[0] = kB[0] / f.real();
+	T->k[1] = kB[1] / f.real();
+	return Simulation_GetSMatrix(T, 0, -1, M, L);
+}
+
+// Refines a zero of D by the secant method started from f0 and f0+h.
+// Returns 0 and the zero in f on convergence to within ftol, -1 if the
+// iteration fails, or a solution error code.
+static int Bands_Refine(
+	RS_Simulation *T, const double kB[2], std::complex<double> *M,
+	std::complex<double> f0, std::complex<double> h, double ftol,
+	std::complex<double> *f
+){
+	std::complex<double> L0, L1;
+	int ret = Bands_LogDet(T, kB, f0, M, &L0);
+	if(0 != ret){ return ret; }
+	std::complex<double> f1 = f0 + h;
+	for(int it = 0; it < BANDS_MAX_ITERATIONS; ++it){
+		ret = Bands_LogDet(T, kB, f1, M, &L1);
+		if(0 != ret){ return ret; }
+		// f2 = f1 - D1 (f1-f0)/(D1-D0), with D0/D1 = exp(L1-L0)
+		const std::complex<double> den = 1. - std::exp(L1 - L0);
+		const std::complex<double> f2 = f1 - (f1 - f0) / den;
+		if(!std::isfinite(f2.real()) || !std::isfinite(f2.imag()) || !(f2.real() > 0)){
+			return -1;
+		}
+		f0 = f1; L0 = L1;
+		f1 = f2;
+		if(std::abs(f1 - f0) < ftol){
+			*f = f1;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// A band at one k point, with its change from the previous point that
+// is used to extrapolate the starting guess at the next.
+struct Bands_Zero{
+	std::complex<double> f, df;
+};
+
+static bool Bands_FreqLess(const Bands_Zero &a, const Bands_Zero &b){
+	return a.f.real() < b.f.real();
+}
+
+// Sorts the n zeros in z by real part, drops those outside the range and
+// merges those that coincide to within ftol. Returns the number left.
+static int Bands_Collect(int n, Bands_Zero *z, const RS_real *range, double ftol){
+	std::sort(z, z+n, Bands_FreqLess);
+	int m = 0;
+	for(int i = 0; i < n; ++i){
+		if(z[i].f.real() < range[0] || z[i].f.real() > range[1]){ continue; }
+		if(m > 0 && std::abs(z[i].f - z[m-1].f) < 10*ftol){ continue; }
+		z[m++] = z[i];
+	}
+	return m;
+}
+
+// Samples log|det(S11)| at the npts real frequencies f0 + i*step, and
+// refines from each sample that lies above the chord of its neighbors;
+// a local maximum can be hidden by the slope of the background between
+// samples. The zeros found are appended to z, with n updated. v must be
+// of length npts. Returns a solution error code.
+static int Bands_Scan(
+	RS_Simulation *T, const double kB[2], std::complex<double> *M,
+	double f0, double step, int npts, double ftol,
+	double *v, Bands_Zero *z, int *n
+){
+	int ret = 0;
+	for(int i = 0; i < npts && 0 == ret; ++i){
+		std::complex<double> L;
+		ret = Bands_LogDet(T, kB, f0 + i*step, M, &L);
+		v[i] = L.real();
+	}
+	for(int i = 1; i+1 < npts && 0 == ret; ++i){
+		if(!(2*v[i] > v[i-1] + v[i+1])){ continue; }
+		int info = Bands_Refine(T, kB, M, f0 + i*step, 0.5*step, ftol, &z[*n].f);
+		if(0 == info){
+			z[*n].df = 0;
+			++(*n);
+		}else if(info > 0){ ret = info; }
+	}
+	return ret;
+}
+
+int RS_Simulation_SolveBands(
+	RS_Simulation *S, int nk, const RS_real *k,
+	const RS_real *freq_range, int nscan, int scan_every, RS_real tol,
+	int maxbands, int *nbands, RS_real *freq
+){
+	RS_TRACE("> RS_Simulation_SolveBands(S=%p, nk=%d, k=%p, freq_range=%p, nscan=%d, scan_every=%d, tol=%g, maxbands=%d, nbands=%p, freq=%p)\n",
+		S, nk, k, freq_range, nscan, scan_every, tol, maxbands, nbands, freq);
+	int ret = 0;
+	if(NULL == S || S->n_layers < 1){ ret = -1; }
+	if(nk < 1){ ret = -2; }
+	if(NULL == k){ ret = -3; }
+	if(NULL == freq_range || !(freq_range[0] > 0) || !(freq_range[0] < freq_range[1])){ ret = -4; }
+	if(nscan < 3){ ret = -5; }
+	if(scan_every < 1){ ret = -6; }
+	if(!(tol > 0) || !(tol < 1)){ ret = -7; }
+	if(maxbands < 1){ ret = -8; }
+	if(NULL == nbands){ ret = -9; }
+	if(NULL == freq){ ret = -10; }
+	if(0 != ret){
+		RS_TRACE("< RS_Simulation_SolveBands (failed; ret = %d)\n", ret);
+		return ret;
+	}
+
+	const size_t n4 = 4*S->n_G;
+	const double width = freq_range[1] - freq_range[0];
+	const double ftol = tol * width;
+	const double df = width / (nscan-1);
+	const int nruns = (nk + scan_every - 1) / scan_every;
+	// A local scan has at most nscan+BANDS_TRACK_POINTS samples.
+	const int nv = nscan + BANDS_TRACK_POINTS;
+	const int nz = nscan + maxbands*nv;
+	int *status = (int*)malloc(sizeof(int) * nruns);
+	if(NULL == status){
+		RS_TRACE("< RS_Simulation_SolveBands (failed; allocation failed)\n");
+		return 1;
+	}
+	for(int j = 0; j < nk; ++j){
+		nbands[j] = 0;
+	}
+
+	// Each run works on its own copy of S, which keeps the pattern Fourier
+	// coefficients and the composition workspace from point to point. The
+	// FFT plans the FMM backends make for it are serialized in fft_iface.
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for(int r = 0; r < nruns; ++r){
+		const int j0 = r*scan_every;
+		const int j1 = std::min(j0 + scan_every, nk);
+		RS_Simulation *T = RS_Simulation_Clone(S);
+		std::complex<double> *M = (std::complex<double>*)malloc(sizeof(std::complex<double>) * n4*n4);
+		Bands_Zero *z = (Bands_Zero*)malloc(sizeof(Bands_Zero) * 2*nz);
+		double *v = (double*)malloc(sizeof(double) * nv);
+		if(NULL == T || NULL == M || NULL == z || NULL == v){
+			free(v);
+			free(z);
+			free(M);
+			if(NULL != T){ RS_Simulation_Destroy(T); }
+			status[r] = 1;
+			continue;
+		}
+		T->ft_cache = FourierCache_New(T->n_layers);
+		Bands_Zero *zprev = z + nz;
+		int nprev = 0;
+		int rret = 0;
+		for(int j = j0; j < j1 && 0 == rret; ++j){
+			const double kB[2] = { k[2*j+0], k[2*j+1] };
+			int n = 0;
+			if(j == j0){
+				rret = Bands_Scan(T, kB, M, freq_range[0], df, nscan, ftol, v, z, &n);
+			}else{
+				// Each band is searched for around its value extrapolated
+				// from the previous points. Below the light line the group
+				// velocity is less than c, so a band moves by less than
+				// the distance between the k points.
+				const double dk = hypot(k[2*j+0]-k[2*j-2], k[2*j+1]-k[2*j-1]);
+				const double w = std::min(std::max(dk, df), 0.5*width);
+				const double step = std::min(df, 2*w/(BANDS_TRACK_POINTS-1));
+				const int half = (int)ceil(w/step);
+				for(int b = 0; b < nprev && 0 == rret; ++b){
+					const double guess = (zprev[b].f + zprev[b].df).real();
+					const double f0 = std::max(guess - half*step, 0.5*freq_range[0]);
+					int n0 = n;
+					rret = Bands_Scan(T, kB, M, f0, step, 2*half+1, ftol, v, z, &n);
+					// Zeros closer to the guess of another band are left to
+					// the scan of that band, so each is tracked from its own.
+					for(int i = n0; i < n; ++i){
+						const double d = fabs(z[i].f.real() - guess);
+						bool own = true;
+						for(int c = 0; c < nprev && own; ++c){
+							own = !(fabs(z[i].f.real() - (zprev[c].f + zprev[c].df).real()) < d);
+						}
+						if(own){
+							z[n0].f = z[i].f;
+							z[n0].df = z[i].f - zprev[b].f;
+							++n0;
+						}
+					}
+					n = n0;
+				}
+			}
+			n = Bands_Collect(n, z, freq_range, ftol);
+			if(n > maxbands){
+				n = maxbands;
+				nbands[j] = -n; // marks the truncation until all runs are done
+			}else{
+				nbands[j] = n;
+			}
+			for(int b = 0; b < n; ++b){
+				freq[2*(maxbands*j+b)+0] = z[b].f.real();
+				freq[2*(maxbands*j+b)+1] = z[b].f.imag();
+				zprev[b] = z[b];
+			}
+			nprev = n;
+		}
+		status[r] = rret;
+		FourierCache_Destroy(T->ft_cache);
+		T->ft_cache = NULL;
+		RS_Simulation_Destroy(T);
+		free(v);
+		free(z);
+		free(M);
+	}
+
+	for(int r = 0; r < nruns && 0 == ret; ++r){
+		ret = status[r];
+	}
+	free(status);
+	for(int j = 0; j < nk; ++j){
+		if(nbands[j] < 0){
+			nbands[j] = -nbands[j];
+			if(0 == ret){ ret = 3; }
+		}
+	}
+	RS_TRACE("< RS_Simulation_SolveBands\n");
+	return ret;
+}
@@ -0,0 +1,218 @@
+#include "RS.h"
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <complex>
+#include <stdint.h>
+#include <TBLAS.h>
+#include <Eigensystems.h>
+#include "mkl.h"
+
+// Resonances are the poles of the S-matrix S(f) in complex frequency.
+// Away from them S is analytic inside the contour, so for a probe
+// matrix V the moments
+//   A_p = 1/(2 pi i) \oint z^p S(f) V df,  z = (f-c)/rho,
+// only pick up the residues, which are of rank one at simple poles.
+// A_0 = U W^H V and A_1 = U Z W^H V for the outgoing amplitudes U and
+// the pole locations Z, which are recovered from the SVD of A_0 as in
+// Beyn's method. The moments are approximated by the trapezoid rule
+// on the ellipse f(t) = c + a cos(t) + i b sin(t).
+
+// Fills the m x l probe matrix with a fixed pseudorandom sequence so that
+// repeated searches give the same results.
+static void Resonance_MakeProbes(size_t m, size_t l, std::complex<double> *V){
+	uint64_t state = 0x9E3779B97F4A7C15ull;
+	for(size_t i = 0; i < m*l; ++i){
+		double x[2];
+		for(int j = 0; j < 2; ++j){
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			x[j] = (double)(state >> 11) / 9007199254740992. - 0.5;
+		}
+		V[i] = std::complex<double>(x[0], x[1]);
+	}
+}
+
+// Computes Y = S(f) V at the complex frequency f on a copy of S, so that
+// nodes can be evaluated concurrently. S->k is relative to the real part
+// of the frequency, and is rescaled to keep the Bloch wavevector kB.
+static int Resonance_EvalNode(
+	const RS_Simulation *S, const double kB[2], const double f[2],
+	size_t l, const std::complex<double> *V, std::complex<double> *Y
+){
+	const size_t n4 = 4*S->n_G;
+	RS_Simulation *T = RS_Simulation_Clone(S);
+	std::complex<double> *M = (std::complex<double>*)malloc(sizeof(std::complex<double>) * n4*n4);
+	int ret = 1;
+	if(NULL != T && NULL != M){
+		RS_Simulation_SetFrequency(T, f);
+		T->k[0] = kB[0] / T->omega[0];
+		T->k[1] = kB[1] / T->omega[0];
+		ret = Simulation_GetSMatrix(T, 0, -1, M);
+	}
+	if(0 == ret){
+		RNP::TBLAS::MultMM<'N','N'>(n4,l,n4, 1.,M,n4, V,n4, 0.,Y,n4);
+	}
+	free(M);
+	if(NULL != T){ RS_Simulation_Destroy(T); }
+	return ret;
+}
+
+int RS_Simulation_FindResonances(
+	RS_Simulation *S, const RS_real *center, const RS_real *semiaxes,
+	int nnodes, int nprobe, RS_real tol,
+	int *nres, RS_real *freq, RS_real *vectors
+){
+	RS_TRACE("> RS_Simulation_FindResonances(S=%p, center=%p, semiaxes=%p, nnodes=%d, nprobe=%d, tol=%g, nres=%p, freq=%p, vectors=%p)\n",
+		S, center, semiaxes, nnodes, nprobe, tol, nres, freq, vectors);
+	int ret = 0;
+	if(NULL == S || S->n_layers < 1){ ret = -1; }
+	else{
+		// The S-matrix is only meromorphic in frequency if the modes of
+		// the exterior layers are known in closed form.
+		const int ext[2] = { 0, S->n_layers-1 };
+		for(int i = 0; i < 2; ++i){
+			const RS_Layer *L = &S->layer[ext[i]];
+			if(L->copy >= 0){ L = &S->layer[L->copy]; }
+			if(L->pattern.nshapes > 0){ ret = -1; }
+		}
+	}
+	if(NULL == center){ ret = -2; }
+	if(NULL == semiaxes || !(semiaxes[0] > 0) || !(semiaxes[1] > 0) ||
+		(NULL != center && !(center[0] - semiaxes[0] > 0))
+	){ ret = -3; }
+	if(nnodes < 4){ ret = -4; }
+	if(nprobe < 1 || (NULL != S && nprobe > 4*S->n_G)){ ret = -5; }
+	if(!(tol > 0) || !(tol < 1)){ ret = -6; }
+	if(NULL == nres){ ret = -7; }
+	if(NULL == freq){ ret = -8; }
+	if(0 != ret){
+		RS_TRACE("< RS_Simulation_FindResonances (failed; ret = %d)\n", ret);
+		return ret;
+	}
+	*nres = 0;
+
+	const size_t n4 = 4*S->n_G;
+	const size_t l = nprobe;
+	const size_t N = nnodes;
+	const std::complex<double> c(center[0], center[1]);
+	const double a = semiaxes[0], b = semiaxes[1];
+	const double rho = (a > b ? a : b);
+	const double kB[2] = { S->k[0]*S->omega[0], S->k[1]*S->omega[0] };
+
+	// Only the probed columns S(f_k) V of each node are kept.
+	const size_t lY = N*n4*l;
+	std::complex<double> *V = (std::complex<double>*)malloc(sizeof(std::complex<double>) * (n4*l + lY + 2*n4*l));
+	int *status = (int*)malloc(sizeof(int) * N);
+	if(NULL == V || NULL == status){
+		free(status);
+		free(V);
+		RS_TRACE("< RS_Simulation_FindResonances (failed; allocation failed)\n");
+		return 1;
+	}
+	std::complex<double> *Y = V + n4*l;
+	std::complex<double> *A0 = Y + lY;
+	std::complex<double> *A1 = A0 + n4*l;
+	Resonance_MakeProbes(n4, l, V);
+
+	// The nodes are solved concurrently on their own clones; the FFT plans
+	// the FMM backends make for them are serialized in fft_iface.
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for(int k = 0; k < nnodes; ++k){
+		const double t = 2*M_PI*k/(double)N;
+		const double f[2] = { center[0] + a*cos(t), center[1] + b*sin(t) };
+		status[k] = Resonance_EvalNode(S, kB, f, l, V, &Y[k*n4*l]);
+	}
+	for(size_t k = 0; k < N && 0 == ret; ++k){
+		ret = status[k];
+	}
+	free(status);
+	if(0 != ret){
+		free(V);
+		RS_TRACE("< RS_Simulation_FindResonances (failed; S-matrix evaluation returned %d)\n", ret);
+		return ret;
+	}
+
+	// The trapezoid rule weight of node k is f'(t_k)/(i N rho), in the
+	// scaled variable z. Singular values are compared to the size of the
+	// samples, since the moments vanish up to rounding without poles.
+	RNP::TBLAS::Fill(2*n4*l, 0., A0, 1);
+	double scale = 0;
+	for(size_t k = 0; k < N; ++k){
+		const double yk = RNP::TBLAS::Norm2(n4*l, &Y[k*n4*l], 1);
+		if(yk > scale){ scale = yk; }
+	}
+	for(size_t k = 0; k < N; ++k){
+		const double t = 2*M_PI*k/(double)N;
+		const std::complex<double> z(a*cos(t)/rho, b*sin(t)/rho);
+		const std::complex<double> w = std::complex<double>(b*cos(t), a*sin(t)) / (N*rho);
+		RNP::TBLAS::Axpy(n4*l, w, &Y[k*n4*l],1, A0,1);
+		RNP::TBLAS::Axpy(n4*l, w*z, &Y[k*n4*l],1, A1,1);
+	}
+
+	// A0 = U0 Sigma W0^H, truncated to the singular values above tol
+	// relative to the samples.
+	std::complex<double> *U0 = (std::complex<double>*)malloc(sizeof(std::complex<double>) * (n4*l + 4*l*l + 3*l));
+	double *sigma = (double*)malloc(sizeof(double) * (l + l + 2*l));
+	if(NULL == U0 || NULL == sigma){
+		free(sigma);
+		free(U0);
+		free(V);
+		RS_TRACE("< RS_Simulation_FindResonances (failed; allocation failed)\n");
+		return 1;
+	}
+	std::complex<double> *W0H = U0 + n4*l;
+	std::complex<double> *B = W0H + l*l;
+	std::complex<double> *T = B + l*l;
+	std::complex<double> *s = T + l*l;
+	std::complex<double> *lambda = s + l*l;
+	std::complex<double> *work = lambda + l;
+	double *superb = sigma + l;
+	double *rwork = superb + l;
+	int info = LAPACKE_zgesvd(LAPACK_COL_MAJOR, 'S', 'S', n4, l, (MKL_Complex16*)A0, n4, sigma, (MKL_Complex16*)U0, n4, (MKL_Complex16*)W0H, l, superb);
+	size_t r = 0;
+	if(0 == info){
+		while(r < l && sigma[r] > tol*scale){ ++r; }
+	}else{
+		ret = 2;
+	}
+
+	int nfound = 0;
+	if(r > 0){
+		// B = U0^H A1 W0 Sigma^-1 has the scaled poles as eigenvalues.
+		RNP::TBLAS::MultMM<'C','N'>(r,l,n4, 1.,U0,n4, A1,n4, 0.,T,r);
+		RNP::TBLAS::MultMM<'N','C'>(r,r,l, 1.,T,r, W0H,l, 0.,B,r);
+		for(size_t j = 0; j < r; ++j){
+			RNP::TBLAS::Scale(r, 1./sigma[j], &B[0+j*r], 1);
+		}
+		info = RNP::Eigensystem(r, B, r, lambda, NULL, 1, s, r, work, rwork, 2*r);
+		if(0 != info){ ret = 2; }
+		for(size_t j = 0; j < r && 0 == info; ++j){
+			const std::complex<double> df = rho*lambda[j];
+			const double e = (df.real()/a)*(df.real()/a) + (df.imag()/b)*(df.imag()/b);
+			if(!(e < 1)){ continue; }
+			freq[2*nfound+0] = (c + df).real();
+			freq[2*nfound+1] = (c + df).imag();
+			if(NULL != vectors){
+				std::complex<double> *u = (std::complex<double>*)&vectors[2*n4*nfound];
+				RNP::TBLAS::MultMV<'N'>(n4,r, 1.,U0,n4, &s[0+j*r],1, 0.,u,1);
+				const double unorm = RNP::TBLAS::Norm2(n4, u, 1);
+				RNP::TBLAS::Scale(n4, 1./unorm, u, 1);
+			}
+			++nfound;
+		}
+	}
+	*nres = nfound;
+	// When every probe direction is used, there may be more poles in
+	// the contour than could be resolved.
+	if(0 == ret && r == l){ ret = 3; }
+
+	free(sigma);
+	free(U0);
+	free(V);
+	RS_TRACE("< RS_Simulation_FindResonances\n");
+	return ret;
+}
@@ -0,0 +1,397 @@
+#include "RS.h"
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// File layout, all in native byte order:
+//   StoreHeader
+//   StoreAxis[naxes]
+//   StoreColumn[ncolumns]
+//   double axis values[sum of axis lengths]
+//   int32_t layer ids[nlayers], char layer names[nlayers][STORE_NAME_LEN]
+//   int32_t G[2*n_G]
+//   (page aligned) uint8_t status[nrecords]
+//   (page aligned) each column, nrecords*width doubles
+// The magic is written last when creating, so a file whose creation
+// did not finish is never accepted by RS_Store_Open.
+
+#define STORE_MAGIC "RSSTORE"
+#define STORE_VERSION 1
+#define STORE_NAME_LEN 64
+#define STORE_ALIGN 4096
+
+struct StoreHeader{
+	char magic[8];
+	uint32_t version;
+	uint32_t naxes;
+	uint32_t nlayers;
+	uint32_t n_G;
+	uint32_t ncolumns;
+	uint32_t reserved;
+	uint64_t nrecords;
+	uint64_t status_offset;
+	uint64_t file_size;
+	double Lr[4];
+};
+struct StoreAxis{
+	char name[STORE_NAME_LEN];
+	uint64_t length;
+	uint64_t values_offset; // in doubles from the start of the values
+};
+struct StoreColumn{
+	int32_t kind;
+	int32_t reserved;
+	uint64_t width;
+	uint64_t offset;
+};
+
+struct RS_Store_{
+	void *map;
+	size_t size;
+	int writable;
+	StoreHeader *hdr;
+	StoreAxis *axes;
+	StoreColumn *columns;
+	int32_t *layer_ids;
+	char *layer_names;
+	int32_t *G;
+	double *values;
+	uint8_t *status;
+};
+
+static uint64_t store_align(uint64_t x){
+	return (x + STORE_ALIGN-1) / STORE_ALIGN * STORE_ALIGN;
+}
+
+// Sets up the pointers into the mapping from the header.
+static void store_bind(RS_Store *store){
+	char *base = (char*)store->map;
+	StoreHeader *hdr = (StoreHeader*)base;
+	store->hdr = hdr;
+	store->axes = (StoreAxis*)(base + sizeof(StoreHeader));
+	store->columns = (StoreColumn*)(store->axes + hdr->naxes);
+	store->values = (double*)(store->columns + hdr->ncolumns);
+	uint64_t nvalues = 0;
+	for(uint32_t i = 0; i < hdr->naxes; ++i){
+		nvalues += store->axes[i].length;
+	}
+	store->layer_ids = (int32_t*)(store->values + nvalues);
+	store->layer_names = (char*)(store->layer_ids + hdr->nlayers);
+	store->G = (int32_t*)(store->layer_names + STORE_NAME_LEN*hdr->nlayers);
+	store->status = (uint8_t*)(base + hdr->status_offset);
+}
+
+static uint64_t store_column_width(int kind, uint64_t nlayers, uint64_t n_G){
+	switch(kind){
+	case RS_STORE_FREQUENCY:  return 2;
+	case RS_STORE_POWER_FLUX: return 4*nlayers;
+	case RS_STORE_FLUX_TABLE: return 4*n_G*nlayers;
+	case RS_STORE_WAVES:      return 2*11*n_G*nlayers;
+	default: return 0;
+	}
+}
+
+RS_Store* RS_Store_Create(
+	const char *filename, const RS_Simulation *S,
+	int naxes, const char *const *axis_names, const int *axis_len,
+	const RS_real *axis_values,
+	int nlayers, const RS_LayerID *layers,
+	int ncolumns, const int *columns
+){
+	RS_TRACE("> RS_Store_Create(filename=%s, S=%p, naxes=%d, nlayers=%d, ncolumns=%d)\n",
+		(NULL != filename ? filename : ""), S, naxes, nlayers, ncolumns);
+	if(NULL == filename || NULL == S){ return NULL; }
+	if(naxes < 0 || (naxes > 0 && (NULL == axis_len || NULL == axis_values))){ return NULL; }
+	if(nlayers < 0 || (nlayers > 0 && NULL == layers)){ return NULL; }
+	if(ncolumns < 1 || NULL == columns){ return NULL; }
+
+	uint64_t nrecords = 1;
+	uint64_t nvalues = 0;
+	for(int i = 0; i < naxes; ++i){
+		if(axis_len[i] < 1){ return NULL; }
+		nrecords *= axis_len[i];
+		nvalues += axis_len[i];
+	}
+	for(int i = 0; i < nlayers; ++i){
+		if(layers[i] < 0 || layers[i] >= S->n_layers){ return NULL; }
+	}
+	for(int i = 0; i < ncolumns; ++i){
+		if(0 == store_column_width(columns[i], nlayers, S->n_G)){ return NULL; }
+	}
+
+	const uint64_t header_size =
+		sizeof(StoreHeader) + sizeof(StoreAxis)*naxes + sizeof(StoreColumn)*ncolumns +
+		(sizeof(int32_t) + STORE_NAME_LEN)*nlayers + sizeof(int32_t)*2*S->n_G +
+		sizeof(double)*nvalues;
+	const uint64_t status_offset = store_align(header_size);
+	uint64_t size = store_align(status_offset + nrecords);
+	uint64_t *offsets = (uint64_t*)malloc(sizeof(uint64_t) * ncolumns);
+	if(NULL == offsets){ return NULL; }
+	for(int i = 0; i < ncolumns; ++i){
+		offsets[i] = size;
+		size = store_align(size + sizeof(double) * nrecords * store_column_width(columns[i], nlayers, S->n_G));
+	}
+
+	RS_Store *store = (RS_Store*)malloc(sizeof(RS_Store));
+	int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(NULL == store || fd < 0){
+		if(fd >= 0){ close(fd); }
+		free(store);
+		free(offsets);
+		RS_TRACE("< RS_Store_Create (failed; could not open file)\n");
+		return NULL;
+	}
+	store->map = NULL;
+	if(0 == ftruncate(fd, (off_t)size)){
+		store->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(MAP_FAILED == store->map){ store->map = NULL; }
+	}
+	close(fd);
+	if(NULL == store->map){
+		free(store);
+		free(offsets);
+		RS_TRACE("< RS_Store_Create (failed; could not map file)\n");
+		return NULL;
+	}
+	store->size = size;
+	store->writable = 1;
+
+	// The file is freshly truncated, so everything starts out zero,
+	// including the status of every record.
+	StoreHeader *hdr = (StoreHeader*)store->map;
+	hdr->version = STORE_VERSION;
+	hdr->naxes = naxes;
+	hdr->nlayers = nlayers;
+	hdr->n_G = S->n_G;
+	hdr->ncolumns = ncolumns;
+	hdr->nrecords = nrecords;
+	hdr->status_offset = status_offset;
+	hdr->file_size = size;
+	memcpy(hdr->Lr, S->Lr, sizeof(double) * 4);
+	StoreAxis *axes = (StoreAxis*)(hdr + 1);
+	uint64_t voff = 0;
+	for(int i = 0; i < naxes; ++i){
+		if(NULL != axis_names && NULL != axis_names[i]){
+			strncpy(axes[i].name, axis_names[i], STORE_NAME_LEN-1);
+		}
+		axes[i].length = axis_len[i];
+		axes[i].values_offset = voff;
+		voff += axis_len[i];
+	}
+	store_bind(store);
+
+	memcpy(store->values, axis_values, sizeof(double) * nvalues);
+	for(int i = 0; i < ncolumns; ++i){
+		store->columns[i].kind = columns[i];
+		store->columns[i].width = store_column_width(columns[i], nlayers, S->n_G);
+		store->columns[i].offset = offsets[i];
+	}
+	for(int i = 0; i < nlayers; ++i){
+		store->layer_ids[i] = layers[i];
+		const char *name = S->layer[layers[i]].name;
+		if(NULL != name){
+			strncpy(&store->layer_names[STORE_NAME_LEN*i], name, STORE_NAME_LEN-1);
+		}
+	}
+	for(int i = 0; i < 2*S->n_G; ++i){
+		store->G[i] = S->G[i];
+	}
+	free(offsets);
+
+	msync(store->map, status_offset, MS_SYNC);
+	memcpy(hdr->magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+	msync(store->map, sizeof(StoreHeader), MS_SYNC);
+
+	RS_TRACE("< RS_Store_Create\n");
+	return store;
+}
+
+RS_Store* RS_Store_Open(const char *filename, int writable){
+	RS_TRACE("> RS_Store_Open(filename=%s, writable=%d)\n", (NULL != filename ? filename : ""), writable);
+	if(NULL == filename){ return NULL; }
+	int fd = open(filename, writable ? O_RDWR : O_RDONLY);
+	if(fd < 0){
+		RS_TRACE("< RS_Store_Open (failed; could not open file)\n");
+		return NULL;
+	}
+	struct stat st;
+	void *map = NULL;
+	if(0 == fstat(fd, &st) && (size_t)st.st_size >= sizeof(StoreHeader)){
+		map = mmap(NULL, st.st_size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+		if(MAP_FAILED == map){ map = NULL; }
+	}
+	close(fd);
+	if(NULL == map){
+		RS_TRACE("< RS_Store_Open (failed; could not map file)\n");
+		return NULL;
+	}
+	const StoreHeader *hdr = (const StoreHeader*)map;
+	if(0 != memcmp(hdr->magic, STORE_MAGIC, sizeof(STORE_MAGIC)) ||
+		STORE_VERSION != hdr->version || hdr->file_size != (uint64_t)st.st_size
+	){
+		munmap(map, st.st_size);
+		RS_TRACE("< RS_Store_Open (failed; not a complete store)\n");
+		return NULL;
+	}
+	RS_Store *store = (RS_Store*)malloc(sizeof(RS_Store));
+	if(NULL == store){
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	store->map = map;
+	store->size = st.st_size;
+	store->writable = writable;
+	store_bind(store);
+	RS_TRACE("< RS_Store_Open\n");
+	return store;
+}
+
+void RS_Store_Close(RS_Store *store){
+	if(NULL == store){ return; }
+	if(store->writable){
+		msync(store->map, store->size, MS_SYNC);
+	}
+	munmap(store->map, store->size);
+	free(store);
+}
+
+// Flushes the bytes [offset, offset+len) of the mapping to disk, widened
+// to whole pages as msync requires. Returns 0 on success.
+static int store_sync_range(const RS_Store *store, size_t offset, size_t len){
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t begin = offset - offset % page;
+	return msync((char*)store->map + begin, offset + len - begin, MS_SYNC);
+}
+
+int RS_Store_WriteRecord(RS_Store *store, RS_Simulation *S, size_t r){
+	RS_TRACE("> RS_Store_WriteRecord(store=%p, S=%p, r=%u)\n", store, S, (unsigned)r);
+	if(NULL == store || !store->writable){ return -1; }
+	if(NULL == S){ return -2; }
+	if(r >= store->hdr->nrecords){ return -3; }
+	const StoreHeader *hdr = store->hdr;
+	if((uint64_t)S->n_G != hdr->n_G){ return -2; }
+	for(int i = 0; i < 2*S->n_G; ++i){
+		if(S->G[i] != store->G[i]){ return -2; }
+	}
+	for(uint32_t i = 0; i < hdr->nlayers; ++i){
+		if(store->layer_ids[i] >= S->n_layers){ return -2; }
+	}
+
+	// The status reaches disk after the data it covers, so that a record
+	// read back after a system crash is never complete with stale data.
+	// Rewriting a complete record clears its status on disk first.
+	const size_t status_pos = (const char*)&store->status[r] - (const char*)store->map;
+	if(0 != __atomic_exchange_n(&store->status[r], 0, __ATOMIC_ACQ_REL)){
+		if(0 != store_sync_range(store, status_pos, 1)){ return 2; }
+	}
+	const size_t n = hdr->n_G;
+	const size_t nl = hdr->nlayers;
+	int ret = 0;
+	for(uint32_t c = 0; c < hdr->ncolumns && 0 == ret; ++c){
+		const StoreColumn *col = &store->columns[c];
+		RS_real *data = (RS_real*)((char*)store->map + col->offset) + r*col->width;
+		switch(col->kind){
+		case RS_STORE_FREQUENCY:
+			ret = RS_Simulation_GetFrequency(S, data);
+			break;
+		case RS_STORE_POWER_FLUX:
+			for(size_t i = 0; i < nl && 0 == ret; ++i){
+				ret = RS_Simulation_GetPowerFlux(S, store->layer_ids[i], NULL, &data[4*i]);
+			}
+			break;
+		case RS_STORE_FLUX_TABLE:
+			if(nl > 0){
+				ret = RS_Simulation_GetPowerFluxTable(S, nl, (const RS_LayerID*)store->layer_ids, NULL, data);
+			}
+			break;
+		case RS_STORE_WAVES:
+			for(size_t i = 0; i < nl && 0 == ret; ++i){
+				ret = RS_Simulation_GetWaves(S, store->layer_ids[i], &data[2*11*n*i]);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	for(uint32_t c = 0; c < hdr->ncolumns && 0 == ret; ++c){
+		const StoreColumn *col = &store->columns[c];
+		const size_t len = sizeof(RS_real) * col->width;
+		if(0 != store_sync_range(store, col->offset + r*len, len)){ ret = 2; }
+	}
+	if(0 == ret){
+		__atomic_store_n(&store->status[r], 1, __ATOMIC_RELEASE);
+		if(0 != store_sync_range(store, status_pos, 1)){ ret = 2; }
+	}
+	RS_TRACE("< RS_Store_WriteRecord (ret = %d)\n", ret);
+	return ret;
+}
+
+int RS_Store_Sync(RS_Store *store){
+	if(NULL == store){ return -1; }
+	if(!store->writable){ return 0; }
+	return (0 == msync(store->map, store->size, MS_SYNC)) ? 0 : 1;
+}
+
+int RS_Store_GetInfo(const RS_Store *store, RS_StoreInfo *info){
+	if(NULL == store){ return -1; }
+	if(NULL == info){ return -2; }
+	info->nrecords = store->hdr->nrecords;
+	info->naxes = store->hdr->naxes;
+	info->nlayers = store->hdr->nlayers;
+	info->n_G = store->hdr->n_G;
+	info->ncolumns = store->hdr->ncolumns;
+	return 0;
+}
+
+int RS_Store_GetAxis(
+	const RS_Store *store, int i,
+	const char **name, int *length, const RS_real **values
+){
+	if(NULL == store){ return -1; }
+	if(i < 0 || (uint32_t)i >= store->hdr->naxes){ return -2; }
+	const StoreAxis *axis = &store->axes[i];
+	if(NULL != name){ *name = axis->name; }
+	if(NULL != length){ *length = (int)axis->length; }
+	if(NULL != values){ *values = &store->values[axis->values_offset]; }
+	return 0;
+}
+
+int RS_Store_GetLayer(
+	const RS_Store *store, int i, RS_LayerID *id, const char **name
+){
+	if(NULL == store){ return -1; }
+	if(i < 0 || (uint32_t)i >= store->hdr->nlayers){ return -2; }
+	if(NULL != id){ *id = store->layer_ids[i]; }
+	if(NULL != name){ *name = &store->layer_names[STORE_NAME_LEN*i]; }
+	return 0;
+}
+
+int RS_Store_GetBases(const RS_Store *store, const int **G){
+	if(NULL == store){ return -1; }
+	if(NULL == G){ return -2; }
+	*G = (const int*)store->G;
+	return 0;
+}
+
+int RS_Store_GetColumn(
+	const RS_Store *store, int i,
+	int *kind, size_t *width, const RS_real **data
+){
+	if(NULL == store){ return -1; }
+	if(i < 0 || (uint32_t)i >= store->hdr->ncolumns){ return -2; }
+	const StoreColumn *col = &store->columns[i];
+	if(NULL != kind){ *kind = col->kind; }
+	if(NULL != width){ *width = col->width; }
+	if(NULL != data){ *data = (const RS_real*)((const char*)store->map + col->offset); }
+	return 0;
+}
+
+int RS_Store_IsRecordComplete(const RS_Store *store, size_t r){
+	if(NULL == store){ return -1; }
+	if(r >= store->hdr->nrecords){ return -2; }
+	return (1 == __atomic_load_n(&store->status[r], __ATOMIC_ACQUIRE)) ? 1 : 0;
+}
@@ -0,0 +1,425 @@
+#include "RS.h"
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <complex>
+#include <algorithm>
+#include "fmm/fmm.h"
+#include "mkl.h"
+
+// The samples are kept in the order they were taken until the sweep is
+// done, and then sorted by frequency. The interpolant is the barycentric
+// form r(f) = sum_j w_j F_j/(f-f_j) / sum_j w_j/(f-f_j) over the
+// support samples j.
+struct RS_Sweep_{
+	int nvalues; // complex values per sample
+	int nsamples, nalloc;
+	double *freq; // nsamples
+	std::complex<double> *F; // nvalues per sample
+	int nsupport;
+	int *support; // indices of the support samples
+	std::complex<double> *weight; // nsupport barycentric weights
+	double error;
+};
+
+// Number of interior test points per interval between samples at which
+// successive interpolants are compared.
+#define SWEEP_TEST_POINTS 7
+
+static void Sweep_Destroy(RS_Sweep *sw){
+	if(NULL == sw){ return; }
+	free(sw->freq);
+	free(sw->F);
+	free(sw->support);
+	free(sw->weight);
+	free(sw);
+}
+
+// Evaluates an interpolant with the given support and weights at f.
+static void Sweep_Eval(
+	const RS_Sweep *sw, int nsupport, const int *support, const std::complex<double> *weight,
+	double f, std::complex<double> *r
+){
+	const int K = sw->nvalues;
+	for(int s = 0; s < nsupport; ++s){
+		if(f == sw->freq[support[s]]){
+			memcpy(r, &sw->F[(size_t)support[s]*K], sizeof(std::complex<double>) * K);
+			return;
+		}
+	}
+	std::complex<double> den = 0;
+	for(int k = 0; k < K; ++k){ r[k] = 0; }
+	for(int s = 0; s < nsupport; ++s){
+		const std::complex<double> c = weight[s] / (f - sw->freq[support[s]]);
+		const std::complex<double> *Fs = &sw->F[(size_t)support[s]*K];
+		den += c;
+		for(int k = 0; k < K; ++k){
+			r[k] += c*Fs[k];
+		}
+	}
+	for(int k = 0; k < K; ++k){
+		r[k] /= den;
+	}
+}
+
+// Fits the set-valued AAA interpolant to the samples: support samples
+// are added greedily where the residual is largest, and the weights
+// minimize the linearized residual of all values at the other samples,
+// until the largest residual is within tol of the largest sample. The
+// support of the previous fit is kept, so that each new sample usually
+// adds only a few support points. The values are first compressed by a
+// truncated SVD to the components that matter at this tolerance, which
+// changes the residual norms by much less than tol. Returns 0, 1 on
+// allocation failure, or the LAPACK info.
+static int Sweep_Fit(RS_Sweep *sw, double tol){
+	const int N = sw->nsamples;
+	const int K = sw->nvalues;
+	const int nsv = (K > N ? N : K);
+	const double *Z = sw->freq;
+
+	// F^T = U S V^H, so the rows of G = (S V^H)^T are the rows of F
+	// up to an isometry.
+	std::complex<double> *A = (std::complex<double>*)malloc(sizeof(std::complex<double>) * ((size_t)N*K + (size_t)nsv*N));
+	double *sigma = (double*)malloc(sizeof(double) * (nsv + 4*N + 2));
+	if(NULL == A || NULL == sigma){
+		free(sigma);
+		free(A);
+		return 1;
+	}
+	std::complex<double> *VT = A + (size_t)N*K;
+	memcpy(A, sw->F, sizeof(std::complex<double>) * (size_t)N*K);
+	int info = LAPACKE_zgesvd(LAPACK_COL_MAJOR, 'N', 'S', K, N, (MKL_Complex16*)A, K, sigma, NULL, 1, (MKL_Complex16*)VT, nsv, sigma + nsv);
+	if(0 != info){
+		free(sigma);
+		free(A);
+		return info;
+	}
+	int r = nsv;
+	{
+		double tail = 0;
+		while(r > 1 && tail + sigma[r-1]*sigma[r-1] <= 1e-2*tol*tol*sigma[0]*sigma[0]){
+			tail += sigma[r-1]*sigma[r-1];
+			--r;
+		}
+	}
+
+	const int mmax = N-1;
+	const size_t lC = (size_t)N*r*mmax;
+	std::complex<double> *G = (std::complex<double>*)malloc(sizeof(std::complex<double>) * (N*r + lC + (size_t)mmax*mmax + N*r));
+	char *in_support = (char*)calloc(N, 1);
+	if(NULL == G || NULL == in_support){
+		free(in_support);
+		free(G);
+		free(sigma);
+		free(A);
+		return 1;
+	}
+	for(int c = 0; c < r; ++c){
+		for(int i = 0; i < N; ++i){
+			G[i+c*N] = sigma[c] * VT[c+(size_t)i*nsv];
+		}
+	}
+	std::complex<double> *C = G + N*r;
+	std::complex<double> *W = C + lC;
+	std::complex<double> *R = W + (size_t)mmax*mmax; // N x r current approximant
+	double *res = sigma + nsv;
+	double *superb = res + N;
+
+	// Start from the mean of the samples, or from the previous support.
+	double gscale = 0;
+	for(int i = 0; i < N; ++i){
+		double t = 0;
+		for(int c = 0; c < r; ++c){ t += std::norm(G[i+c*N]); }
+		gscale = std::max(gscale, sqrt(t));
+	}
+	for(int c = 0; c < r; ++c){
+		std::complex<double> mean = 0;
+		for(int i = 0; i < N; ++i){ mean += G[i+c*N]; }
+		mean /= (double)N;
+		for(int i = 0; i < N; ++i){ R[i+c*N] = mean; }
+	}
+	int m = (sw->nsupport < mmax ? sw->nsupport : mmax);
+	for(int s = 0; s < m; ++s){
+		in_support[sw->support[s]] = 1;
+	}
+
+	int ret = 0;
+	while(1){
+		if(m > 0){
+			// Loewner matrix, one block of rows per component
+			const int rows = (N-m)*r;
+			for(int s = 0; s < m; ++s){
+				const int js = sw->support[s];
+				size_t row = (size_t)s*rows;
+				for(int c = 0; c < r; ++c){
+					for(int i = 0; i < N; ++i){
+						if(in_support[i]){ continue; }
+						C[row++] = (G[i+c*N] - G[js+c*N]) / (Z[i] - Z[js]);
+					}
+				}
+			}
+			info = LAPACKE_zgesvd(LAPACK_COL_MAJOR, 'N', 'A', rows, m, (MKL_Complex16*)C, rows, res, NULL, 1, (MKL_Complex16*)W, m, superb);
+			if(0 != info){
+				ret = info;
+				break;
+			}
+			for(int s = 0; s < m; ++s){
+				sw->weight[s] = std::conj(W[(m-1)+s*m]);
+			}
+
+			for(int i = 0; i < N; ++i){
+				if(in_support[i]){
+					for(int c = 0; c < r; ++c){ R[i+c*N] = G[i+c*N]; }
+					continue;
+				}
+				std::complex<double> den = 0;
+				for(int c = 0; c < r; ++c){ R[i+c*N] = 0; }
+				for(int s = 0; s < m; ++s){
+					const int js = sw->support[s];
+					const std::complex<double> cs = sw->weight[s] / (Z[i] - Z[js]);
+					den += cs;
+					for(int c = 0; c < r; ++c){ R[i+c*N] += cs*G[js+c*N]; }
+				}
+				for(int c = 0; c < r; ++c){ R[i+c*N] /= den; }
+			}
+		}
+
+		int jmax = -1;
+		double rmax = -1;
+		for(int i = 0; i < N; ++i){
+			if(in_support[i]){ continue; }
+			double t = 0;
+			for(int c = 0; c < r; ++c){ t += std::norm(G[i+c*N] - R[i+c*N]); }
+			t = sqrt(t);
+			if(t > rmax){ rmax = t; jmax = i; }
+		}
+		if(m >= mmax || (m > 0 && rmax <= tol*gscale)){ break; }
+		in_support[jmax] = 1;
+		sw->support[m++] = jmax;
+	}
+	sw->nsupport = m;
+
+	free(in_support);
+	free(G);
+	free(sigma);
+	free(A);
+	return ret;
+}
+
+// Solves at frequency f and appends the amplitudes of the layer.
+static int Sweep_Sample(RS_Sweep *sw, RS_Simulation *S, RS_Layer *L, double f){
+	const RS_real freq[2] = { f, 0 };
+	RS_Simulation_SetFrequency(S, freq);
+	const int i = sw->nsamples;
+	double *Fi = (double*)&sw->F[(size_t)i*sw->nvalues];
+	int ret = Simulation_GetAmplitudes(S, L, 0, Fi, Fi + sw->nvalues);
+	if(0 == ret){
+		sw->freq[i] = f;
+		sw->nsamples++;
+	}
+	return ret;
+}
+
+// Orders sample indices by frequency.
+struct SweepFreqOrder{
+	const double *freq;
+	bool operator()(int a, int b) const{
+		return freq[a] < freq[b];
+	}
+};
+
+int RS_Simulation_SweepAdaptive(
+	RS_Simulation *S, RS_LayerID layer, const RS_real *freq,
+	int ninit, int max_samples, RS_real tol, RS_Sweep **sweep
+){
+	RS_TRACE("> RS_Simulation_SweepAdaptive(S=%p, layer=%d, freq=%p, ninit=%d, max_samples=%d, tol=%g, sweep=%p)\n",
+		S, layer, freq, ninit, max_samples, tol, sweep);
+	int ret = 0;
+	if(NULL == S){ ret = -1; }
+	else if(layer < 0 || layer >= S->n_layers){ ret = -2; }
+	else{
+		const RS_Layer *Lp = &S->layer[layer];
+		if(Lp->copy >= 0){ Lp = &S->layer[Lp->copy]; }
+		// The mode basis of a patterned layer is not continuous in frequency.
+		if(Lp->pattern.nshapes > 0){ ret = -2; }
+	}
+	if(NULL == freq || !(freq[0] < freq[1]) || !(freq[0] > 0)){ ret = -3; }
+	if(ninit < 3){ ret = -4; }
+	if(max_samples < ninit){ ret = -5; }
+	if(!(tol > 0)){ ret = -6; }
+	if(NULL == sweep){ ret = -7; }
+	if(0 != ret){
+		RS_TRACE("< RS_Simulation_SweepAdaptive (failed; ret = %d)\n", ret);
+		return ret;
+	}
+	*sweep = NULL;
+
+	RS_Layer *L = &S->layer[layer];
+	const int K = 4*S->n_G;
+	RS_Sweep *sw = (RS_Sweep*)calloc(1, sizeof(RS_Sweep));
+	if(NULL == sw){ return 1; }
+	sw->nvalues = K;
+	sw->nalloc = max_samples;
+	sw->freq = (double*)malloc(sizeof(double) * max_samples);
+	sw->F = (std::complex<double>*)malloc(sizeof(std::complex<double>) * (size_t)max_samples*K);
+	sw->support = (int*)malloc(sizeof(int) * max_samples);
+	sw->weight = (std::complex<double>*)malloc(sizeof(std::complex<double>) * max_samples);
+	int *order = (int*)malloc(sizeof(int) * max_samples);
+	int *support0 = (int*)malloc(sizeof(int) * max_samples);
+	std::complex<double> *weight0 = (std::complex<double>*)malloc(sizeof(std::complex<double>) * (max_samples + 2*K));
+	if(NULL == sw->freq || NULL == sw->F || NULL == sw->support || NULL == sw->weight ||
+		NULL == order || NULL == support0 || NULL == weight0
+	){
+		free(weight0);
+		free(support0);
+		free(order);
+		Sweep_Destroy(sw);
+		RS_TRACE("< RS_Simulation_SweepAdaptive (failed; allocation failed)\n");
+		return 1;
+	}
+	std::complex<double> *r0 = weight0 + max_samples;
+	std::complex<double> *r1 = r0 + K;
+	RS_real freq0[2];
+	RS_Simulation_GetFrequency(S, freq0);
+	// Pattern Fourier coefficients are kept across the samples; only those
+	// of layers using dispersive materials are recomputed.
+	FourierCache *ft_cache = NULL;
+	if(NULL == S->ft_cache){
+		S->ft_cache = ft_cache = FourierCache_New(S->n_layers);
+	}
+
+	// Equally spaced starting samples, the middle one last so that the
+	// first comparison is made against an interpolant that skipped it.
+	const double fmid = freq[0] + (freq[1]-freq[0])*((ninit-1)/2)/(double)(ninit-1);
+	for(int i = 0; i < ninit && 0 == ret; ++i){
+		if(i == (ninit-1)/2){ continue; }
+		ret = Sweep_Sample(sw, S, L, freq[0] + (freq[1]-freq[0])*i/(double)(ninit-1));
+	}
+	const double fit_tol = std::max(1e-3*tol, 1e-13);
+	if(0 == ret){ ret = Sweep_Fit(sw, fit_tol); }
+	if(0 == ret){ ret = Sweep_Sample(sw, S, L, fmid); }
+
+	// The estimate tends to be optimistic, so it must be within tol for
+	// two samples in a row.
+	int nconverged = 0;
+	sw->error = -1;
+	while(0 == ret){
+		// Compare the interpolants with and without the latest sample at
+		// points between the samples, and sample next where they differ
+		// most.
+		const int nsupport0 = sw->nsupport;
+		memcpy(support0, sw->support, sizeof(int) * nsupport0);
+		memcpy(weight0, sw->weight, sizeof(std::complex<double>) * nsupport0);
+		ret = Sweep_Fit(sw, fit_tol);
+		if(0 != ret){ break; }
+
+		const int N = sw->nsamples;
+		for(int i = 0; i < N; ++i){ order[i] = i; }
+		SweepFreqOrder cmp = { sw->freq };
+		std::sort(order, order+N, cmp);
+		double scale = 0;
+		for(int i = 0; i < N; ++i){
+			double t = 0;
+			for(int k = 0; k < K; ++k){ t += std::norm(sw->F[(size_t)i*K+k]); }
+			scale = std::max(scale, sqrt(t));
+		}
+		double dmax = -1, fnext = 0;
+		for(int i = 0; i+1 < N; ++i){
+			const double fa = sw->freq[order[i]], fb = sw->freq[order[i+1]];
+			for(int t = 1; t <= SWEEP_TEST_POINTS; ++t){
+				const double f = fa + (fb-fa)*t/(double)(SWEEP_TEST_POINTS+1);
+				Sweep_Eval(sw, nsupport0, support0, weight0, f, r0);
+				Sweep_Eval(sw, sw->nsupport, sw->support, sw->weight, f, r1);
+				double d = 0;
+				for(int k = 0; k < K; ++k){ d += std::norm(r1[k] - r0[k]); }
+				d = sqrt(d);
+				if(!(d <= dmax)){ dmax = d; fnext = f; }
+			}
+		}
+		sw->error = (scale > 0 ? dmax/scale : dmax);
+		RS_VERB(1, "Adaptive sweep: %d samples, %d support points, error estimate %g\n", N, sw->nsupport, sw->error);
+		nconverged = (sw->error <= tol ? nconverged+1 : 0);
+		if(nconverged >= 2 || N >= max_samples){ break; }
+		ret = Sweep_Sample(sw, S, L, fnext);
+	}
+	RS_Simulation_SetFrequency(S, freq0);
+	if(NULL != ft_cache){
+		FourierCache_Destroy(ft_cache);
+		S->ft_cache = NULL;
+	}
+
+	if(0 == ret){
+		// Sort the samples by frequency.
+		const int N = sw->nsamples;
+		double *freq_sorted = (double*)malloc(sizeof(double) * N);
+		std::complex<double> *F_sorted = (std::complex<double>*)malloc(sizeof(std::complex<double>) * (size_t)N*K);
+		if(NULL == freq_sorted || NULL == F_sorted){
+			free(F_sorted);
+			free(freq_sorted);
+			ret = 1;
+		}else{
+			for(int i = 0; i < N; ++i){ order[i] = i; }
+			SweepFreqOrder cmp = { sw->freq };
+			std::sort(order, order+N, cmp);
+			for(int i = 0; i < N; ++i){
+				freq_sorted[i] = sw->freq[order[i]];
+				memcpy(&F_sorted[(size_t)i*K], &sw->F[(size_t)order[i]*K], sizeof(std::complex<double>) * K);
+				support0[order[i]] = i;
+			}
+			for(int s = 0; s < sw->nsupport; ++s){
+				sw->support[s] = support0[sw->support[s]];
+			}
+			free(sw->freq);
+			free(sw->F);
+			sw->freq = freq_sorted;
+			sw->F = F_sorted;
+		}
+	}
+	free(weight0);
+	free(support0);
+	free(order);
+	if(0 != ret){
+		Sweep_Destroy(sw);
+		RS_TRACE("< RS_Simulation_SweepAdaptive (failed; ret = %d)\n", ret);
+		return ret;
+	}
+	*sweep = sw;
+	RS_TRACE("< RS_Simulation_SweepAdaptive\n");
+	return 0;
+}
+
+int RS_Sweep_GetInfo(const RS_Sweep *sweep, RS_SweepInfo *info){
+	if(NULL == sweep){ return -1; }
+	if(NULL == info){ return -2; }
+	info->nsamples = sweep->nsamples;
+	info->nvalues = sweep->nvalues;
+	info->nsupport = sweep->nsupport;
+	info->error = sweep->error;
+	return 0;
+}
+
+int RS_Sweep_GetSamples(const RS_Sweep *sweep, const RS_real **freq, const RS_real **values){
+	if(NULL == sweep){ return -1; }
+	if(NULL != freq){ *freq = sweep->freq; }
+	if(NULL != values){ *values = (const RS_real*)sweep->F; }
+	return sweep->nsamples;
+}
+
+int RS_Sweep_Evaluate(const RS_Sweep *sweep, int nfreq, const RS_real *freq, RS_real *values){
+	if(NULL == sweep){ return -1; }
+	if(nfreq < 0){ return -2; }
+	if(NULL == freq){ return -3; }
+	if(NULL == values){ return -4; }
+	const size_t K = sweep->nvalues;
+	for(int i = 0; i < nfreq; ++i){
+		Sweep_Eval(
+			sweep, sweep->nsupport, sweep->support, sweep->weight,
+			freq[i], (std::complex<double>*)&values[2*K*i]
+		);
+	}
+	return 0;
+}
+
+void RS_Sweep_Destroy(RS_Sweep *sweep){
+	Sweep_Destroy(sweep);
+}
@@ -43,6 +43,11 @@ fft_plan fft_plan_dft_2d(
 	pthread_mutex_lock(&mutex);
 # endif
 	fftw_plan p;
+	// FFTW planning is not thread-safe, and layers of cloned simulations
+	// are solved concurrently; only fftw_execute may run in parallel.
+#ifdef _OPENMP
+#pragma omp critical(fft_plan)
+#endif
 	p = fftw_plan_dft(2, n, (fftw_complex*)in, (fftw_complex*)out, sign, FFTW_ESTIMATE);
 # ifdef HAVE_LIBPTHREAD
 	pthread_mutex_unlock(&mutex);
@@ -63,6 +68,9 @@ void fft_plan_destroy(fft_plan plan){
 # ifdef HAVE_LIBPTHREAD
 	pthread_mutex_lock(&mutex);
 # endif
+#ifdef _OPENMP
+#pragma omp critical(fft_plan)
+#endif
 	fftw_destroy_plan(plan->plan);
 # ifdef HAVE_LIBPTHREAD
 	pthread_mutex_unlock(&mutex);
@@ -44,14 +44,19 @@ int FMMGetEpsilon_FFT(const RS_Simulation *S, const RS_Layer *L, const int n, st
 	// The grid needs to hold 5 matrix elements: xx,xy,yx,yy,zz
 	// We actually make 5 different grids to facilitate the fft routines
 
-	std::complex<double> *work = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>)*(6*ng2));
+	std::complex<double> *work = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>)*(6*ng2));
 	std::complex<double>*fxx = work;
 	std::complex<double>*fxy = fxx + ng2;
 	std::complex<double>*fyx = fxy + ng2;
 	std::complex<double>*fyy = fyx + ng2;
 	std::complex<double>*fzz = fyy + ng2;
 	std::complex<double>*Fto = fzz + ng2;
-	double *discval = (double*)RS_malloc(sizeof(double)*(L->pattern.nshapes+1));
+	double *discval = (double*)Simulation_WorkspaceAlloc(S, sizeof(double)*(L->pattern.nshapes+1));
+	if(NULL == work || NULL == discval){
+		Simulation_WorkspaceFree(S, discval);
+		Simulation_WorkspaceFree(S, work);
+		return 1;
+	}
 
 	fft_plan plans[5];
 	for(int i = 0; i <= 4; ++i){
@@ -206,7 +211,7 @@ fzz[si1+si0*ngrid[1]].real(), fzz[si1+si0*ngrid[1]].imag()
 	}
 	//free(fftcfg);
 
-	RS_free(discval);
-	RS_free(work);
+	Simulation_WorkspaceFree(S, discval);
+	Simulation_WorkspaceFree(S, work);
 	return 0;
 }
@@ -75,8 +75,9 @@ int FMMGetEpsilon_PolBasisJones(const RS_Simulation *S, const RS_Layer *L, const
 	const double unit_cell_size = Simulation_GetUnitCellSize(S);
 	const int *G = S->G;
 	const int ndim = (0 == S->Lr[2] && 0 == S->Lr[3]) ? 1 : 2;
-	double *ivalues = (double*)RS_malloc(sizeof(double)*(2+10)*(L->pattern.nshapes+1));
+	double *ivalues = (double*)Simulation_WorkspaceAlloc(S, sizeof(double)*(2+10)*(L->pattern.nshapes+1));
 	double *values = ivalues + 2*(L->pattern.nshapes+1);
+	if(NULL == ivalues){ return 1; }
 
 	// Get all the dielectric tensors
 	//bool have_tensor = false;
@@ -121,7 +122,7 @@ int FMMGetEpsilon_PolBasisJones(const RS_Simulation *S, const RS_Layer *L, const
 		}
 		const int ng2 = ngrid[0]*ngrid[1];
 
-		work = (std::complex<double>*)RS_malloc(
+		work = (std::complex<double>*)Simulation_WorkspaceAlloc(S, 
 			sizeof(std::complex<double>)*(5*nn + 4*ng2) +
 			sizeof(size_t)*(2*n));
 		P = work;
@@ -135,7 +136,13 @@ int FMMGetEpsilon_PolBasisJones(const RS_Simulation *S, const RS_Layer *L, const
 		const double ing2 = 1./(double)ng2;
 		int ii[2];
 
-		double *vfield = (double*)RS_malloc(sizeof(double)*2*ng2);
+		double *vfield = (double*)Simulation_WorkspaceAlloc(S, sizeof(double)*2*ng2);
+		if(NULL == work || NULL == vfield){
+			Simulation_WorkspaceFree(S, vfield);
+			Simulation_WorkspaceFree(S, work);
+			Simulation_WorkspaceFree(S, ivalues);
+			return 1;
+		}
 		if(0 == S->Lr[2] && 0 == S->Lr[3]){ // 1D, generate the trivial field
 			double nv[2] = {-S->Lr[1], S->Lr[0]};
 			double nva = hypot(nv[0],nv[1]);
@@ -153,9 +160,9 @@ int FMMGetEpsilon_PolBasisJones(const RS_Simulation *S, const RS_Layer *L, const
 
 			if(0 != error){
 				RS_TRACE("< Simulation_ComputeLayerBands (failed; Pattern_GenerateFlowField returned %d) [omega=%f]\n", error, S->omega[0]);
-				if(NULL != vfield){ RS_free(vfield); }
-				if(NULL != work){ RS_free(work); }
-				if(NULL != ivalues){ RS_free(ivalues); }
+				if(NULL != vfield){ Simulation_WorkspaceFree(S, vfield); }
+				if(NULL != work){ Simulation_WorkspaceFree(S, work); }
+				if(NULL != ivalues){ Simulation_WorkspaceFree(S, ivalues); }
 				return error;
 			}
 		}
@@ -295,7 +302,7 @@ int FMMGetEpsilon_PolBasisJones(const RS_Simulation *S, const RS_Layer *L, const
 		}
 
 		fft_plan_destroy(plan);
-		if(NULL != vfield){ RS_free(vfield); }
+		if(NULL != vfield){ Simulation_WorkspaceFree(S, vfield); }
 
 		// do LU decomposition on P
 		RNP::TLASupport::LUDecomposition(n2,n2, P,n2, ipiv);
@@ -305,7 +312,11 @@ int FMMGetEpsilon_PolBasisJones(const RS_Simulation *S, const RS_Layer *L, const
 	}else{
 		// P contains the cached version
 		//work = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>)*2*nn);
-		work = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>)*nn);
+		work = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>)*nn);
+		if(NULL == work){
+			Simulation_WorkspaceFree(S, ivalues);
+			return 1;
+		}
 		Eta = work;
 		ipiv = (size_t*)(P + 4*nn);
 	}
@@ -341,9 +352,9 @@ int FMMGetEpsilon_PolBasisJones(const RS_Simulation *S, const RS_Layer *L, const
 	RNP::TLASupport::ApplyPermutations<'L','N'>(n2,n2, Epsilon2,n2, ipiv);
 	RNP::TLASupport::ApplyPermutations<'R','I'>(n2,n2, Epsilon2,n2, ipiv);
 
-	if(NULL != work){ RS_free(work); }
+	if(NULL != work){ Simulation_WorkspaceFree(S, work); }
 
-	RS_free(ivalues);
+	Simulation_WorkspaceFree(S, ivalues);
 
 	return 0;
 }
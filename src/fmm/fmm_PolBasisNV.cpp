@@ -24,8 +24,9 @@ int FMMGetEpsilon_PolBasisNV(const RS_Simulation *S, const RS_Layer *L, const in
 	const double unit_cell_size = Simulation_GetUnitCellSize(S);
 	const int *G = S->G;
 	const int ndim = (0 == S->Lr[2] && 0 == S->Lr[3]) ? 1 : 2;
-	double *ivalues = (double*)RS_malloc(sizeof(double)*(2+10)*(L->pattern.nshapes+1));
+	double *ivalues = (double*)Simulation_WorkspaceAlloc(S, sizeof(double)*(2+10)*(L->pattern.nshapes+1));
 	double *values = ivalues + 2*(L->pattern.nshapes+1);
+	if(NULL == ivalues){ return 1; }
 
 	// Get all the dielectric tensors
 	//bool have_tensor = false;
@@ -76,7 +77,7 @@ int FMMGetEpsilon_PolBasisNV(const RS_Simulation *S, const RS_Layer *L, const in
 		}
 		const int ng2 = ngrid[0]*ngrid[1];
 
-		work = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>)*(6*nn + 4*ng2));
+		work = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>)*(6*nn + 4*ng2));
 		mDelta = work;
 		Eta = mDelta + nn;
 		P = Eta + nn;
@@ -88,7 +89,13 @@ int FMMGetEpsilon_PolBasisNV(const RS_Simulation *S, const RS_Layer *L, const in
 		const double ing2 = 1./(double)ng2;
 		int ii[2];
 
-		double *vfield = (double*)RS_malloc(sizeof(double)*2*ng2);
+		double *vfield = (double*)Simulation_WorkspaceAlloc(S, sizeof(double)*2*ng2);
+		if(NULL == work || NULL == vfield){
+			Simulation_WorkspaceFree(S, vfield);
+			Simulation_WorkspaceFree(S, work);
+			Simulation_WorkspaceFree(S, ivalues);
+			return 1;
+		}
 		if(0 == S->Lr[2] && 0 == S->Lr[3]){ // 1D, generate the trivial field
 			double nv[2] = {-S->Lr[1], S->Lr[0]};
 			double nva = hypot(nv[0],nv[1]);
@@ -122,9 +129,9 @@ int FMMGetEpsilon_PolBasisNV(const RS_Simulation *S, const RS_Layer *L, const in
 
 			if(0 != error){
 				RS_TRACE("< Simulation_ComputeLayerBands (failed; Pattern_GenerateFlowField returned %d) [omega=%f]\n", error, S->omega[0]);
-				if(NULL != vfield){ RS_free(vfield); }
-				if(NULL != work){ RS_free(work); }
-				if(NULL != ivalues){ RS_free(ivalues); }
+				if(NULL != vfield){ Simulation_WorkspaceFree(S, vfield); }
+				if(NULL != work){ Simulation_WorkspaceFree(S, work); }
+				if(NULL != ivalues){ Simulation_WorkspaceFree(S, ivalues); }
 				return error;
 			}
 		}
@@ -185,13 +192,17 @@ int FMMGetEpsilon_PolBasisNV(const RS_Simulation *S, const RS_Layer *L, const in
 		}
 		fft_plan_destroy(plan);
 		//free(fftcfg);
-		if(NULL != vfield){ RS_free(vfield); }
+		if(NULL != vfield){ Simulation_WorkspaceFree(S, vfield); }
 		// Add to cache
 		Simulation_AddFieldToCache((RS_Simulation*)S, L, S->n_G, P, 4*nn);
 	}else{
 		// P contains the cached version
 		// We still need temporary space to compute -Delta
-		work = (std::complex<double>*)RS_malloc(sizeof(std::complex<double>)*2*nn);
+		work = (std::complex<double>*)Simulation_WorkspaceAlloc(S, sizeof(std::complex<double>)*2*nn);
+		if(NULL == work){
+			Simulation_WorkspaceFree(S, ivalues);
+			return 1;
+		}
 		mDelta = work;
 		Eta = mDelta + nn;
 	}
@@ -227,9 +238,9 @@ int FMMGetEpsilon_PolBasisNV(const RS_Simulation *S, const RS_Layer *L, const in
 		int Ecol = (w&2 ? n : 0);
 		RNP::TBLAS::MultMM<'N','N'>(n,n,n, std::complex<double>(1.),mDelta,n, &P[Erow+Ecol*n2],n2, std::complex<double>(1.),&Epsilon2[Erow+Ecol*n2],n2);
 	}
-	if(NULL != work){ RS_free(work); }
+	if(NULL != work){ Simulation_WorkspaceFree(S, work); }
 
-	RS_free(ivalues);
+	Simulation_WorkspaceFree(S, ivalues);
 
 	return 0;
 }
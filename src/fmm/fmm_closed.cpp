@@ -4,13 +4,105 @@
 #include "RNP/LinearSolve.h"
 #include "fmm.h"
 #include <limits>
+#include <cstdlib>
+
+struct FourierTable{
+	int ext[2]; // covers dG in [-ext[0],ext[0]] x [-ext[1],ext[1]]
+	std::complex<double> *ft; // {epsilon, 1/epsilon} per dG; NaN if not yet evaluated
+};
+struct FourierCache{
+	int nlayers;
+	FourierTable *table; // one per layer
+};
+
+FourierCache* FourierCache_New(int nlayers){
+	FourierCache *cache = (FourierCache*)malloc(sizeof(FourierCache));
+	if(NULL == cache){ return NULL; }
+	cache->nlayers = nlayers;
+	cache->table = (FourierTable*)calloc(nlayers > 0 ? nlayers : 1, sizeof(FourierTable));
+	if(NULL == cache->table){
+		free(cache);
+		return NULL;
+	}
+	return cache;
+}
+void FourierCache_Destroy(FourierCache *cache){
+	if(NULL == cache){ return; }
+	for(int i = 0; i < cache->nlayers; ++i){
+		free(cache->table[i].ft);
+	}
+	free(cache->table);
+	free(cache);
+}
+void FourierCache_Invalidate(FourierCache *cache, int layer){
+	if(NULL == cache || layer < 0 || layer >= cache->nlayers){ return; }
+	free(cache->table[layer].ft);
+	cache->table[layer].ft = NULL;
+	cache->table[layer].ext[0] = 0;
+	cache->table[layer].ext[1] = 0;
+}
+
+// Grows the table to cover dG up to ext, keeping the entries that have
+// already been evaluated. Returns 1 on allocation failure.
+static int FourierTable_Reserve(FourierTable *t, const int ext[2]){
+	if(NULL != t->ft && ext[0] <= t->ext[0] && ext[1] <= t->ext[1]){ return 0; }
+	const int e[2] = {
+		(ext[0] > t->ext[0] ? ext[0] : t->ext[0]),
+		(ext[1] > t->ext[1] ? ext[1] : t->ext[1])
+	};
+	const size_t w = 2*e[0]+1;
+	const size_t size = w*(2*e[1]+1);
+	std::complex<double> *ft = (std::complex<double>*)malloc(sizeof(std::complex<double>) * 2*size);
+	if(NULL == ft){ return 1; }
+	for(size_t k = 0; k < 2*size; ++k){
+		ft[k] = std::numeric_limits<double>::quiet_NaN();
+	}
+	if(NULL != t->ft){
+		const size_t w0 = 2*t->ext[0]+1;
+		for(int v = -t->ext[1]; v <= t->ext[1]; ++v){
+			for(int u = -t->ext[0]; u <= t->ext[0]; ++u){
+				const size_t k0 = (u+t->ext[0]) + (v+t->ext[1])*w0;
+				const size_t k = (u+e[0]) + (v+e[1])*w;
+				ft[2*k+0] = t->ft[2*k0+0];
+				ft[2*k+1] = t->ft[2*k0+1];
+			}
+		}
+		free(t->ft);
+	}
+	t->ft = ft;
+	t->ext[0] = e[0];
+	t->ext[1] = e[1];
+	return 0;
+}
+
+// Returns the Fourier coefficient at dG (frequency f) of the pattern
+// with the given values, which are those of epsilon (which = 0) or of
+// 1/epsilon (which = 1). With a table, each dG is evaluated only once.
+static std::complex<double> FourierTable_Get(
+	FourierTable *t, int which, const int dG[2], const double f[2],
+	const RS_Layer *L, const double *values, int ndim, double unit_cell_size
+){
+	std::complex<double> *entry = NULL;
+	if(NULL != t){
+		const size_t k = (dG[0]+t->ext[0]) + (size_t)(dG[1]+t->ext[1])*(2*t->ext[0]+1);
+		entry = &t->ft[2*k+which];
+		if(!std::isnan(entry->real())){ return *entry; }
+	}
+	double ft[2];
+	Pattern_GetFourierTransform(&L->pattern, values, f, ndim, unit_cell_size, ft);
+	if(NULL != entry){
+		*entry = std::complex<double>(ft[0],ft[1]);
+	}
+	return std::complex<double>(ft[0],ft[1]);
+}
 
 int FMMGetEpsilon_ClosedForm(const RS_Simulation *S, const RS_Layer *L, const int n, std::complex<double> *Epsilon2, std::complex<double> *Epsilon_inv){
 	const int n2 = 2*n;
 	const int *G = S->G;
 	const int ndim = (0 == S->Lr[2] && 0 == S->Lr[3]) ? 1 : 2;
-	double *ivalues = (double*)RS_malloc(sizeof(double)*(2+10)*(L->pattern.nshapes+1));
+	double *ivalues = (double*)Simulation_WorkspaceAlloc(S, sizeof(double)*(2+10)*(L->pattern.nshapes+1));
 	double *values = ivalues + 2*(L->pattern.nshapes+1);
+	if(NULL == ivalues){ return 1; }
 
 	RS_TRACE("I  Closed-form epsilon\n");
 
@@ -47,6 +139,27 @@ int FMMGetEpsilon_ClosedForm(const RS_Simulation *S, const RS_Layer *L, const in
 	const double unit_cell_size = Simulation_GetUnitCellSize(S);
 
 	if(!have_tensor){
+		// Evaluate each distinct difference of G vectors once. The table is
+		// kept in S->ft_cache if there is one, and otherwise is only used if
+		// it is no larger than the matrix.
+		int ext[2] = { 0, 0 };
+		for(int i = 0; i < n; ++i){
+			for(int d = 0; d < 2; ++d){
+				if(2*abs(G[2*i+d]) > ext[d]){ ext[d] = 2*abs(G[2*i+d]); }
+			}
+		}
+		FourierTable local = { { 0, 0 }, NULL };
+		FourierTable *table = NULL;
+		const ptrdiff_t ilayer = L - S->layer;
+		if(NULL != S->ft_cache && 0 <= ilayer && ilayer < S->ft_cache->nlayers){
+			table = &S->ft_cache->table[ilayer];
+		}else if((size_t)(2*ext[0]+1)*(size_t)(2*ext[1]+1) <= (size_t)n*(size_t)n){
+			table = &local;
+		}
+		if(NULL != table && 0 != FourierTable_Reserve(table, ext)){
+			table = NULL;
+		}
+
 		// Make Epsilon
 		for(int j = 0; j < n; ++j){
 			for(int i = 0; i < n; ++i){
@@ -55,12 +168,9 @@ int FMMGetEpsilon_ClosedForm(const RS_Simulation *S, const RS_Layer *L, const in
 					dG[0] * S->Lk[0] + dG[1] * S->Lk[2],
 					dG[0] * S->Lk[1] + dG[1] * S->Lk[3]
 					};
-				double ft[2];
-				Pattern_GetFourierTransform(&L->pattern, values, f, ndim, unit_cell_size, ft);
+				std::complex<double> ft = FourierTable_Get(table, 0, dG, f, L, values, ndim, unit_cell_size);
 				if(S->options.use_Lanczos_smoothing){
-					double sigma = GetLanczosSmoothingFactor(mp1, pwr, f);
-					ft[0] *= sigma;
-					ft[1] *= sigma;
+					ft *= GetLanczosSmoothingFactor(mp1, pwr, f);
 				}
 				/*
 				if(abs(dG[0]) > 1 || abs(dG[1]) > 1){
@@ -73,7 +183,7 @@ int FMMGetEpsilon_ClosedForm(const RS_Simulation *S, const RS_Layer *L, const in
 					if(0 != ftx || 0 != fty)
 					std::cerr << G[2*i+0]-G[2*j+0] << "\t" << G[2*i+1]-G[2*j+1] << "\t" << ftx << "\t" << fty << std::endl;
 				}*/
-				Epsilon2[i+j*n2] = std::complex<double>(ft[0],ft[1]);
+				Epsilon2[i+j*n2] = ft;
 			}
 		}
 		RS_TRACE("I  Epsilon(0,0) = %f,%f [omega=%f]\n", Epsilon2[0].real(), Epsilon2[0].imag(), S->omega[0]);
@@ -87,14 +197,11 @@ int FMMGetEpsilon_ClosedForm(const RS_Simulation *S, const RS_Layer *L, const in
 							dG[0] * S->Lk[0] + dG[1] * S->Lk[2],
 							dG[0] * S->Lk[1] + dG[1] * S->Lk[3]
 						};
-						double ft[2];
-						Pattern_GetFourierTransform(&L->pattern, ivalues, f, ndim, unit_cell_size, ft);
+						std::complex<double> ft = FourierTable_Get(table, 1, dG, f, L, ivalues, ndim, unit_cell_size);
 						if(S->options.use_Lanczos_smoothing){
-							double sigma = GetLanczosSmoothingFactor(mp1, pwr, f);
-							ft[0] *= sigma;
-							ft[1] *= sigma;
+							ft *= GetLanczosSmoothingFactor(mp1, pwr, f);
 						}
-						Epsilon_inv[i+j*n] = std::complex<double>(ft[0],ft[1]);
+						Epsilon_inv[i+j*n] = ft;
 					}
 				}
 				RNP::TBLAS::SetMatrix<'A'>(n,n, 0.,1., &Epsilon2[n+n*n2],n2);
@@ -120,20 +227,18 @@ int FMMGetEpsilon_ClosedForm(const RS_Simulation *S, const RS_Layer *L, const in
 						dG[0] * S->Lk[0] + dG[1] * S->Lk[2],
 						dG[0] * S->Lk[1] + dG[1] * S->Lk[3]
 					};
-					double ft[2];
-					Pattern_GetFourierTransform(&L->pattern, ivalues, f, ndim, unit_cell_size, ft);
+					std::complex<double> ft = FourierTable_Get(table, 1, dG, f, L, ivalues, ndim, unit_cell_size);
 					if(S->options.use_Lanczos_smoothing){
-						double sigma = GetLanczosSmoothingFactor(mp1, pwr, f);
-						ft[0] *= sigma;
-						ft[1] *= sigma;
+						ft *= GetLanczosSmoothingFactor(mp1, pwr, f);
 					}
-					Epsilon_inv[i+j*n] = std::complex<double>(ft[0],ft[1]);
+					Epsilon_inv[i+j*n] = ft;
 				}
 			}
 		}
 		RNP::TBLAS::SetMatrix<'A'>(n,n, 0.,0., &Epsilon2[n+0*n2],n2);
 		RNP::TBLAS::SetMatrix<'A'>(n,n, 0.,0., &Epsilon2[0+n*n2],n2);
 		// Epsilon2 has Epsilon's on its diagonal
+		free(local.ft);
 	}else{ // have tensor dielectric
 		const int ldv = 2*(1+L->pattern.nshapes);
 		for(int i = -1; i < L->pattern.nshapes; ++i){
@@ -228,7 +333,7 @@ int FMMGetEpsilon_ClosedForm(const RS_Simulation *S, const RS_Layer *L, const in
 		}
 	}
 
-	RS_free(ivalues);
+	Simulation_WorkspaceFree(S, ivalues);
 
 	return 0;
 }
@@ -10,8 +10,9 @@ int FMMGetEpsilon_Experimental(const RS_Simulation *S, const RS_Layer *L, const
 	const int n2 = 2*n;
 	const int *G = S->G;
 	const int ndim = (0 == S->Lr[2] && 0 == S->Lr[3]) ? 1 : 2;
-	double *ivalues = (double*)RS_malloc(sizeof(double)*(2+10)*(L->pattern.nshapes+1));
+	double *ivalues = (double*)Simulation_WorkspaceAlloc(S, sizeof(double)*(2+10)*(L->pattern.nshapes+1));
 	double *values = ivalues + 2*(L->pattern.nshapes+1);
+	if(NULL == ivalues){ return 1; }
 
 	RS_TRACE("I  Experimental epsilon\n");
 
@@ -151,7 +152,7 @@ int FMMGetEpsilon_Experimental(const RS_Simulation *S, const RS_Layer *L, const
 		}
 	}
 
-	RS_free(ivalues);
+	Simulation_WorkspaceFree(S, ivalues);
 
 	return 0;
 }
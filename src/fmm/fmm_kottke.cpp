@@ -55,7 +55,12 @@ int FMMGetEpsilon_Kottke(const RS_Simulation *S, const RS_Layer *L, const int n,
 	std::complex<double>*fzz = fyy + ng2;
 	std::complex<double>*Fto = fzz + ng2;
 //memset(work, 0, sizeof(std::complex<double>) * 6*ng2);
-	double *discval = (double*)RS_malloc(sizeof(double)*(L->pattern.nshapes+1));
+	double *discval = (double*)Simulation_WorkspaceAlloc(S, sizeof(double)*(L->pattern.nshapes+1));
+	if(NULL == work || NULL == discval){
+		Simulation_WorkspaceFree(S, discval);
+		if(NULL != work){ fft_free(work); }
+		return 1;
+	}
 
 	fft_plan plans[5];
 	for(int i = 0; i <= 4; ++i){
@@ -274,7 +279,7 @@ fzz[si1+si0*ngrid[1]].real(), fzz[si1+si0*ngrid[1]].imag()
 		fft_plan_destroy(plans[i]);
 	}
 
-	RS_free(discval);
+	Simulation_WorkspaceFree(S, discval);
 	//RS_free(work);
 	fft_free(work);
 
@@ -0,0 +1,218 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include "nufft.h"
+#include "fft_iface.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define NUFFT_MAX_WIDTH 16
+
+struct tag_nufft_plan{
+	size_t nk, ntrans;
+	int m[2]; // oversampled grid size per dimension
+	int w[2]; // kernel width per dimension; 1 if the dimension is absent
+	double beta;
+	size_t *index; // grid location of each coefficient
+	double *corr; // deconvolution factor of each coefficient
+	std::complex<double> *from, *to; // ntrans grids each
+	fft_plan *plans;
+};
+
+// Exponential of semicircle kernel, supported on [-1,1].
+static double nufft_kernel(double beta, double z){
+	if(z < -1 || z > 1){ return 0; }
+	return exp(beta*(sqrt(1-z*z)-1));
+}
+
+// Gauss-Legendre nodes and weights on [-1,1].
+static void gauss_legendre(int n, double *x, double *w){
+	for(int i = 0; i < (n+1)/2; ++i){
+		double z = cos(M_PI*(i+0.75)/(n+0.5));
+		double dp = 1;
+		for(int iter = 0; iter < 100; ++iter){
+			double p0 = 1, p1 = 0;
+			for(int j = 1; j <= n; ++j){
+				const double p2 = p1;
+				p1 = p0;
+				p0 = ((2*j-1)*z*p1 - (j-1)*p2)/j;
+			}
+			dp = n*(z*p0-p1)/(z*z-1);
+			const double dz = p0/dp;
+			z -= dz;
+			if(fabs(dz) < 1e-15){ break; }
+		}
+		x[i] = -z; x[n-1-i] = z;
+		w[i] = w[n-1-i] = 2/((1-z*z)*dp*dp);
+	}
+}
+
+// Fourier transform of the kernel at order k on a grid of m points,
+// scaled so that the interpolated sum reproduces the series.
+static double nufft_correction(int k, int m, int w, double beta, int nq, const double *x, const double *wq){
+	// Integrate over z = sin(t) so that the integrand is smooth at the ends.
+	double sum = 0;
+	for(int i = 0; i < nq; ++i){
+		const double t = 0.5*M_PI*x[i];
+		const double z = sin(t);
+		sum += wq[i] * nufft_kernel(beta, z) * cos(t) * cos(M_PI*k*w*z/m);
+	}
+	sum *= 0.5*M_PI;
+	return 2. / (w * sum);
+}
+
+nufft_plan nufft2_plan_create(size_t nk, const int *k, size_t ntrans, double tol){
+	nufft_plan plan = (nufft_plan)malloc(sizeof(tag_nufft_plan));
+	if(NULL == plan){ return NULL; }
+	memset(plan, 0, sizeof(tag_nufft_plan));
+	plan->nk = nk;
+	plan->ntrans = ntrans;
+
+	int w = NUFFT_MAX_WIDTH;
+	if(tol > 0 && tol < 1){
+		w = (int)ceil(-log10(tol)) + 1;
+	}
+	if(w < 2){ w = 2; }
+	if(w > NUFFT_MAX_WIDTH){ w = NUFFT_MAX_WIDTH; }
+	plan->beta = 2.30 * w;
+
+	int kmax[2] = { 0, 0 };
+	for(size_t i = 0; i < nk; ++i){
+		for(int d = 0; d < 2; ++d){
+			const int a = abs(k[2*i+d]);
+			if(a > kmax[d]){ kmax[d] = a; }
+		}
+	}
+	for(int d = 0; d < 2; ++d){
+		if(0 == kmax[d]){
+			plan->m[d] = 1;
+			plan->w[d] = 1;
+		}else{
+			// Twofold oversampling of the range of orders.
+			int m = 2*(2*kmax[d]+1);
+			if(m < 2*w){ m = 2*w; }
+			plan->m[d] = fft_next_fast_size(m);
+			plan->w[d] = w;
+		}
+	}
+	const size_t M = (size_t)plan->m[0] * (size_t)plan->m[1];
+
+	plan->index = (size_t*)malloc(sizeof(size_t) * nk);
+	plan->corr = (double*)malloc(sizeof(double) * nk);
+	plan->from = fft_alloc_complex(2*ntrans*M);
+	plan->plans = (fft_plan*)calloc(ntrans, sizeof(fft_plan));
+	if(NULL == plan->index || NULL == plan->corr || NULL == plan->from || NULL == plan->plans){
+		nufft2_plan_destroy(plan);
+		return NULL;
+	}
+	plan->to = plan->from + ntrans*M;
+
+	const int nq = 3*w + 30;
+	double *xq = (double*)malloc(sizeof(double) * 2*nq);
+	if(NULL == xq){
+		nufft2_plan_destroy(plan);
+		return NULL;
+	}
+	double *wq = xq + nq;
+	gauss_legendre(nq, xq, wq);
+	for(size_t i = 0; i < nk; ++i){
+		double corr = 1;
+		size_t idx[2];
+		for(int d = 0; d < 2; ++d){
+			const int m = plan->m[d];
+			const int kd = k[2*i+d];
+			idx[d] = (kd >= 0 ? kd : kd + m);
+			if(plan->w[d] > 1){
+				corr *= nufft_correction(kd, m, plan->w[d], plan->beta, nq, xq, wq);
+			}
+		}
+		plan->index[i] = idx[0] + idx[1]*plan->m[0];
+		plan->corr[i] = corr;
+	}
+	free(xq);
+
+	int inxy_rev[2] = { plan->m[1], plan->m[0] };
+	for(size_t t = 0; t < ntrans; ++t){
+		plan->plans[t] = fft_plan_dft_2d(inxy_rev, plan->from + t*M, plan->to + t*M, 1);
+	}
+	return plan;
+}
+
+void nufft2_exec(
+	nufft_plan plan,
+	const std::complex<double> *c,
+	size_t npts, const double *uv,
+	std::complex<double> *f
+){
+	const size_t nk = plan->nk;
+	const size_t ntrans = plan->ntrans;
+	const int m0 = plan->m[0], m1 = plan->m[1];
+	const int w0 = plan->w[0], w1 = plan->w[1];
+	const size_t M = (size_t)m0 * (size_t)m1;
+
+	memset(plan->from, 0, sizeof(std::complex<double>) * ntrans*M);
+	for(size_t t = 0; t < ntrans; ++t){
+		std::complex<double> *g = plan->from + t*M;
+		for(size_t i = 0; i < nk; ++i){
+			g[plan->index[i]] = c[i+t*nk] * plan->corr[i];
+		}
+		fft_plan_exec(plan->plans[t]);
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for(long j = 0; j < (long)npts; ++j){
+		double kx[NUFFT_MAX_WIDTH], ky[NUFFT_MAX_WIDTH];
+		int ix[NUFFT_MAX_WIDTH], iy[NUFFT_MAX_WIDTH];
+		const int w[2] = { w0, w1 };
+		const int m[2] = { m0, m1 };
+		double *kw[2] = { kx, ky };
+		int *ki[2] = { ix, iy };
+		for(int d = 0; d < 2; ++d){
+			if(1 == w[d]){
+				kw[d][0] = 1;
+				ki[d][0] = 0;
+				continue;
+			}
+			const double u = uv[2*j+d] - floor(uv[2*j+d]);
+			const double x = u * m[d];
+			const int i0 = (int)ceil(x - 0.5*w[d]);
+			for(int s = 0; s < w[d]; ++s){
+				int i = i0 + s;
+				kw[d][s] = nufft_kernel(plan->beta, (i - x) / (0.5*w[d]));
+				i %= m[d];
+				if(i < 0){ i += m[d]; }
+				ki[d][s] = i;
+			}
+		}
+		for(size_t t = 0; t < ntrans; ++t){
+			const std::complex<double> *g = plan->to + t*M;
+			std::complex<double> sum(0.);
+			for(int sy = 0; sy < w1; ++sy){
+				std::complex<double> row(0.);
+				for(int sx = 0; sx < w0; ++sx){
+					row += kx[sx] * g[ix[sx] + (size_t)iy[sy]*m0];
+				}
+				sum += ky[sy] * row;
+			}
+			f[j+t*npts] = sum;
+		}
+	}
+}
+
+void nufft2_plan_destroy(nufft_plan plan){
+	if(NULL == plan){ return; }
+	if(NULL != plan->plans){
+		for(size_t t = 0; t < plan->ntrans; ++t){
+			fft_plan_destroy(plan->plans[t]);
+		}
+		free(plan->plans);
+	}
+	if(NULL != plan->from){ fft_free(plan->from); }
+	free(plan->corr);
+	free(plan->index);
+	free(plan);
+}
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <numalloc.h>
 
 #ifdef _WIN32
 # include <malloc.h>
@@ -58,3 +59,90 @@ void free_aligned(void *ptr){
 	}
 #endif
 }
+
+
+/* Each block is preceded by a header occupying one alignment unit. */
+typedef struct numalloc_arena_header_{
+	size_t prev_top; /* offset of the previous topmost header, or -1 */
+	size_t size;     /* requested size; used for overflow accounting */
+	int freed;
+	int in_arena;
+} numalloc_arena_header;
+
+static size_t numalloc_arena_header_size(const numalloc_arena *arena){
+	size_t h = sizeof(numalloc_arena_header);
+	return (h + arena->alignment-1) & ~(arena->alignment-1);
+}
+
+void numalloc_arena_init(numalloc_arena *arena, size_t alignment){
+	arena->base = NULL;
+	arena->size = 0;
+	arena->used = 0;
+	arena->top = (size_t)-1;
+	arena->overflow = 0;
+	arena->high_water = 0;
+	arena->alignment = alignment;
+}
+
+int numalloc_arena_reserve(numalloc_arena *arena, size_t size){
+	char *base;
+	if(size <= arena->size || 0 != arena->used){ return 0; }
+	base = (char*)malloc_aligned(size, arena->alignment);
+	if(NULL == base){ return 1; }
+	free_aligned(arena->base);
+	arena->base = base;
+	arena->size = size;
+	return 0;
+}
+
+void *numalloc_arena_alloc(numalloc_arena *arena, size_t size){
+	const size_t hsize = numalloc_arena_header_size(arena);
+	const size_t asize = (size + arena->alignment-1) & ~(arena->alignment-1);
+	numalloc_arena_header *h;
+	if(NULL != arena->base && arena->used + hsize + asize <= arena->size){
+		h = (numalloc_arena_header*)(arena->base + arena->used);
+		h->prev_top = arena->top;
+		h->in_arena = 1;
+		arena->top = arena->used;
+		arena->used += hsize + asize;
+	}else{
+		h = (numalloc_arena_header*)malloc_aligned(hsize + size, arena->alignment);
+		if(NULL == h){ return NULL; }
+		h->prev_top = (size_t)-1;
+		h->in_arena = 0;
+		arena->overflow += hsize + asize;
+	}
+	h->size = size;
+	h->freed = 0;
+	if(arena->used + arena->overflow > arena->high_water){
+		arena->high_water = arena->used + arena->overflow;
+	}
+	return (char*)h + hsize;
+}
+
+void numalloc_arena_free(numalloc_arena *arena, void *ptr){
+	const size_t hsize = numalloc_arena_header_size(arena);
+	numalloc_arena_header *h;
+	if(NULL == ptr){ return; }
+	h = (numalloc_arena_header*)((char*)ptr - hsize);
+	if(!h->in_arena){
+		arena->overflow -= hsize + ((h->size + arena->alignment-1) & ~(arena->alignment-1));
+		free_aligned(h);
+		return;
+	}
+	h->freed = 1;
+	while((size_t)-1 != arena->top){
+		h = (numalloc_arena_header*)(arena->base + arena->top);
+		if(!h->freed){ break; }
+		arena->used = arena->top;
+		arena->top = h->prev_top;
+	}
+}
+
+void numalloc_arena_destroy(numalloc_arena *arena){
+	free_aligned(arena->base);
+	arena->base = NULL;
+	arena->size = 0;
+	arena->used = 0;
+	arena->top = (size_t)-1;
+}
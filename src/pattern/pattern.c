@@ -81,6 +81,85 @@ double Jinc(double x){
 		return 2.0*cu*(p1*cos(t2)-q1*sin(t2))/x;
 	}
 }
+/* Returns J_0(2*pi*x) */
+static double BesselJ0(double x){
+	static const double a0[] = {
+		-0.0703125,
+		 0.1121520996093750,
+		-0.5725014209747314,
+		 6.074042001273483,
+		-1.100171402692467e2,
+		 3.038090510922384e3,
+		-1.188384262567832e5,
+		 6.252951493434797e6,
+		-4.259392165047669e8,
+		 3.646840080706556e10,
+		-3.833534661393944e12,
+		 4.854014686852901e14,
+		-7.286857349377656e16,
+		 1.279721941975975e19};
+	static const double b0[] = {
+		 0.0732421875,
+		-0.2271080017089844,
+		 1.727727502584457,
+		-2.438052969955606e1,
+		 5.513358961220206e2,
+		-1.825775547429318e4,
+		 8.328593040162893e5,
+		-5.006958953198893e7,
+		 3.836255180230433e9,
+		-3.649010818849833e11,
+		 4.218971570284096e13,
+		-5.827244631566907e15,
+		 9.476288099260110e17,
+		-1.792162323051699e20};
+	x = fabs(2*M_PI*x);
+	if(x <= 12.0){
+		double x2 = x*x;
+		double j0 = 1.0;
+		double r = 1.0;
+		int k;
+		for(k=1;k<=30;k++){
+			r *= -0.25*x2/(k*k);
+			j0 += r;
+			if (fabs(r) < fabs(j0)*1e-15) break;
+		}
+		return j0;
+	}else{
+		double cu = sqrt(M_2_PI/x);
+		double t0 = x-0.25*M_PI;
+		double p0 = 1.0;
+		double q0 = -0.125/x;
+		int k;
+		int kz;
+		if (x >= 50.0) kz = 8;
+		else if (x >= 35.0) kz = 10;
+		else kz = 12;
+		for(k=0;k<kz;k++){
+			p0 += a0[k]*pow(x,-2*k-2);
+			q0 += b0[k]*pow(x,-2*k-3);
+		}
+		return cu*(p0*cos(t0)-q0*sin(t0));
+	}
+}
+/* Returns Jinc'(x)/x, which is finite at x = 0 */
+static double JincDerivative(double x){
+	const double x2 = 4*M_PI*M_PI*x*x;
+	double j2; /* J_2(2*pi*x)/(2*pi*x)^2 */
+	if(x2 <= 144.0){
+		double r = 0.125;
+		int k;
+		j2 = r;
+		for(k=1;k<=30;k++){
+			r *= -0.25*x2/(k*(k+2));
+			j2 += r;
+			if (fabs(r) < fabs(j2)*1e-15) break;
+		}
+	}else{
+		j2 = (Jinc(x) - BesselJ0(x)) / x2;
+	}
+	return -8*M_PI*M_PI*j2;
+}
 static double my_j0(double x){ /* spherical bessel of first kind, order 0 */
 	if(fabs(x) < 1e-9){
 		x = 1.-x*x/6.;
@@ -92,6 +171,23 @@ static double my_j0(double x){ /* spherical bessel of first kind, order 0 */
 double Sinc(double x){
 	return my_j0(M_PI*x);
 }
+/* Returns the derivative of Sinc */
+static double SincDerivative(double x){
+	const double y = M_PI*x;
+	if(fabs(y) < 1){
+		double p = y/6; /* y^(2m-1)/(2m+1)! */
+		double d = 0;
+		int m;
+		for(m=1;m<=30;m++){
+			double r = 2*m*p;
+			d += (m & 1) ? -r : r;
+			if (fabs(r) < fabs(d)*1e-16) break;
+			p *= y*y/((2*m+2)*(2*m+3));
+		}
+		return M_PI*d;
+	}
+	return (cos(y) - Sinc(x)) / x;
+}
 static double shape_area(const shape *s){
 	switch(s->type){
 	case CIRCLE:
@@ -864,6 +960,100 @@ int Pattern_GetShape(
 	return pattern_get_shape(p->nshapes, p->shapes, p->parent, x, shape_index, n);
 }
 
+/* Sets t to the Fourier transform of the indicator function of shape s at
+ * 2*pi*k_, as in pattern_get_fourier_transform but without the
+ * normalization by the unit cell size.
+ */
+static void shape_get_fourier_transform(const shape *s, const double k_[2], int ndim, double t[2]){
+	const int DC = (0 == k_[0] && 0 == k_[1]) ? 1 : 0;
+	double k[2];
+	double phase_angle = -2*M_PI*(k_[0]*s->center[0] + k_[1]*s->center[1]); /* phase = exp(i*phase_angle); */
+	double z[2] = {0,0};
+	double area;
+
+	const double ca = cos(s->angle);
+	const double sa = sin(s->angle);
+	k[0] = k_[0] * ca + k_[1] * sa;
+	k[1] = k_[0] *-sa + k_[1] * ca;
+
+	/* Each shape should set z to be the Fourier component, but without dval, and without area. */
+	switch(s->type){
+	case CIRCLE:
+		area = M_PI*s->vtab.circle.radius*s->vtab.circle.radius;
+		z[0] =Jinc(s->vtab.circle.radius*hypot(k[0],k[1]));
+		break;
+	case ELLIPSE:
+		area = M_PI*s->vtab.ellipse.halfwidth[0]*s->vtab.ellipse.halfwidth[1];
+		if(s->vtab.ellipse.halfwidth[0] >= s->vtab.ellipse.halfwidth[1]){
+			double r = s->vtab.ellipse.halfwidth[1] /  s->vtab.ellipse.halfwidth[0] * k[1];
+			z[0] = Jinc(s->vtab.ellipse.halfwidth[0]*hypot(k[0],r));
+		}else{
+			double r = s->vtab.ellipse.halfwidth[0] /  s->vtab.ellipse.halfwidth[1] * k[0];
+			z[0] =Jinc(s->vtab.ellipse.halfwidth[1]*hypot(r,k[1]));
+		}
+		break;
+	case RECTANGLE:
+		if(1 == ndim){
+			area = 2*s->vtab.rectangle.halfwidth[0];
+			z[0] = Sinc(2*k[0]*s->vtab.rectangle.halfwidth[0]);
+		}else{
+			area = 4*s->vtab.rectangle.halfwidth[0]*s->vtab.rectangle.halfwidth[1];
+			z[0] = Sinc(2*k[0]*s->vtab.rectangle.halfwidth[0])*Sinc(2*k[1]*s->vtab.rectangle.halfwidth[1]);
+		}
+		break;
+	case POLYGON:
+		{
+			area = polygon_area(s->vtab.polygon.n_vertices, s->vtab.polygon.vertex);
+			if(DC){
+				z[0] = 1;
+				z[1] = 0;
+			}else{
+				/* For k != 0,
+				 * S(k) = i/|k|^2 * Sum_{i=0,n-1} z.((v_{i+1}-v_{i}) x k) j0(k.(v_{i+1}-v_{i})/2) e^{ik.(v_{i+1}+v_{i})/2}
+				 */
+				int p,q;
+				double num, pa;
+				double rc[2], u[2];
+				for(p=s->vtab.polygon.n_vertices-1,q=0; q < s->vtab.polygon.n_vertices; p = q++){
+					u[0] = s->vtab.polygon.vertex[2*q+0]-s->vtab.polygon.vertex[2*p+0];
+					u[1] = s->vtab.polygon.vertex[2*q+1]-s->vtab.polygon.vertex[2*p+1];
+					rc[0] = 0.5*(s->vtab.polygon.vertex[2*q+0]+s->vtab.polygon.vertex[2*p+0]);
+					rc[1] = 0.5*(s->vtab.polygon.vertex[2*q+1]+s->vtab.polygon.vertex[2*p+1]);
+
+					num = (u[0]*k[1]-u[1]*k[0]) * Sinc(k[0]*u[0]+k[1]*u[1]);
+					pa = -2*M_PI*(k[0]*rc[0]+k[1]*rc[1]);
+
+					// Multiplication by i means we mess up the order here
+					z[0] += num * sin(pa);
+					z[1] -= num * cos(pa);
+				}
+				// Our k lacks a 2pi factor
+				//z[0] /= 2*M_PI*(k[0]*k[0]+k[1]*k[1])*area;
+				//z[1] /= 2*M_PI*(k[0]*k[0]+k[1]*k[1])*area;
+				area = 1;
+				z[0] /= 2*M_PI*(k[0]*k[0]+k[1]*k[1]);
+				z[1] /= 2*M_PI*(k[0]*k[0]+k[1]*k[1]);
+			}
+		}
+		break;
+	default:
+		area = 0;
+		break;
+	}
+	{
+		double cpa = cos(phase_angle);
+		double spa = sin(phase_angle);
+		t[0] = area; t[1] = area;
+		if(DC){
+			t[0] *= cpa;
+			t[1] *= spa;
+		}else{
+			t[0] *= ( z[0]*cpa-z[1]*spa );
+			t[1] *= ( z[1]*cpa+z[0]*spa );
+		}
+	}
+}
+
 /* returns 0 on success
  * returns -n if n-th argument is invalid
  */
@@ -880,7 +1070,6 @@ int pattern_get_fourier_transform(
 	int i;
 	const int DC = (0 == k_[0] && 0 == k_[1]) ? 1 : 0;
 	double inv_size;
-	double k[2];
 	
 	if(nshapes < 0){ return -1; }
 	if(nshapes > 0 && NULL == shapes){ return -2; }
@@ -917,109 +1106,246 @@ int pattern_get_fourier_transform(
 		const shape *s = &shapes[i];
 
 		double dval[2] = {value[2*(i+1)+0]-value[2*(parent[i]+1)+0], value[2*(i+1)+1]-value[2*(parent[i]+1)+1]};
+		double t[2];
 
-		double phase_angle = -2*M_PI*(k_[0]*s->center[0] + k_[1]*s->center[1]); /* phase = exp(i*phase_angle); */
-		double z[2] = {0,0};
-		double area;
+		shape_get_fourier_transform(s, k_, ndim, t);
+		f[0] += inv_size*(t[0]*dval[0]-t[1]*dval[1]);
+		f[1] += inv_size*(t[0]*dval[1]+t[1]*dval[0]);
+	}
+	return 0;
+}
+int Pattern_GetFourierTransform(
+	const Pattern *p,
+	const double *value,
+	const double k[2],
+	int ndim,
+	double unit_cell_size,
+	double f[2]
+){
+	return pattern_get_fourier_transform(p->nshapes, p->shapes, p->parent, value, k, ndim, unit_cell_size, f);
+}
 
-		const double ca = cos(s->angle);
-		const double sa = sin(s->angle);
-		k[0] = k_[0] * ca + k_[1] * sa;
-		k[1] = k_[0] *-sa + k_[1] * ca;
+/* Sets K0 and K1 to the integrals over t in [0,1] of exp(i*beta*t) and
+ * t*exp(i*beta*t).
+ */
+static void polygon_edge_integrals(double beta, double K0[2], double K1[2]){
+	if(fabs(beta) < 1){
+		/* K_m = Sum_n (i*beta)^n / (n! (n+m+1)) */
+		double c = 1;
+		int n;
+		K0[0] = 0; K0[1] = 0;
+		K1[0] = 0; K1[1] = 0;
+		for(n = 0; n < 30; ++n){
+			const double c0 = c/(n+1), c1 = c/(n+2);
+			switch(n & 3){
+			case 0: K0[0] += c0; K1[0] += c1; break;
+			case 1: K0[1] += c0; K1[1] += c1; break;
+			case 2: K0[0] -= c0; K1[0] -= c1; break;
+			default: K0[1] -= c0; K1[1] -= c1; break;
+			}
+			if(fabs(c) < 1e-17){ break; }
+			c *= beta/(n+1);
+		}
+	}else{
+		const double cb = cos(beta), sb = sin(beta);
+		double d[2];
+		K0[0] = sb/beta;
+		K0[1] = (1-cb)/beta;
+		d[0] = cb - K0[0];
+		d[1] = sb - K0[1];
+		K1[0] = d[1]/beta;
+		K1[1] = -d[0]/beta;
+	}
+}
 
-		/* Each shape should set z to be the Fourier component, but without dval, and without area. */
-		switch(s->type){
-		case CIRCLE:
-			area = M_PI*s->vtab.circle.radius*s->vtab.circle.radius;
-			z[0] =Jinc(s->vtab.circle.radius*hypot(k[0],k[1]));
-			break;
-		case ELLIPSE:
-			area = M_PI*s->vtab.ellipse.halfwidth[0]*s->vtab.ellipse.halfwidth[1];
-			if(s->vtab.ellipse.halfwidth[0] >= s->vtab.ellipse.halfwidth[1]){
-				double r = s->vtab.ellipse.halfwidth[1] /  s->vtab.ellipse.halfwidth[0] * k[1];
-				z[0] = Jinc(s->vtab.ellipse.halfwidth[0]*hypot(k[0],r));
-			}else{
-				double r = s->vtab.ellipse.halfwidth[0] /  s->vtab.ellipse.halfwidth[1] * k[0];
-				z[0] =Jinc(s->vtab.ellipse.halfwidth[1]*hypot(r,k[1]));
+/* Sets dZ to the derivative of the untranslated, unrotated transform of
+ * a polygon at 2*pi*k with respect to the x (dZ[0], dZ[1]) and y (dZ[2],
+ * dZ[3]) coordinates of vertex q. Moving the vertex sweeps the two
+ * adjacent edges, with a weight that falls linearly to the other ends.
+ */
+static void polygon_vertex_derivative(const shape *s, int q, const double k[2], double dZ[4]){
+	const int n = s->vtab.polygon.n_vertices;
+	const double *v = s->vtab.polygon.vertex;
+	const int p = (q+n-1)%n, r = (q+1)%n;
+	const double u1[2] = { v[2*q+0]-v[2*p+0], v[2*q+1]-v[2*p+1] };
+	const double u2[2] = { v[2*r+0]-v[2*q+0], v[2*r+1]-v[2*q+1] };
+	double K0[2], K1[2], w[2], e1[2], e2[2], pa;
+
+	/* Edge from p to q, weight t */
+	polygon_edge_integrals(-2*M_PI*(k[0]*u1[0]+k[1]*u1[1]), K0, K1);
+	pa = -2*M_PI*(k[0]*v[2*p+0]+k[1]*v[2*p+1]);
+	e1[0] = cos(pa)*K1[0] - sin(pa)*K1[1];
+	e1[1] = cos(pa)*K1[1] + sin(pa)*K1[0];
+
+	/* Edge from q to r, weight 1-t */
+	polygon_edge_integrals(-2*M_PI*(k[0]*u2[0]+k[1]*u2[1]), K0, K1);
+	pa = -2*M_PI*(k[0]*v[2*q+0]+k[1]*v[2*q+1]);
+	w[0] = K0[0]-K1[0];
+	w[1] = K0[1]-K1[1];
+	e2[0] = cos(pa)*w[0] - sin(pa)*w[1];
+	e2[1] = cos(pa)*w[1] + sin(pa)*w[0];
+
+	/* The outward normal times the edge length is (u[1],-u[0]) */
+	dZ[0] =  u1[1]*e1[0] + u2[1]*e2[0];
+	dZ[1] =  u1[1]*e1[1] + u2[1]*e2[1];
+	dZ[2] = -u1[0]*e1[0] - u2[0]*e2[0];
+	dZ[3] = -u1[0]*e1[1] - u2[0]*e2[1];
+}
+
+/* Sets dt to the derivative of the transform returned by
+ * shape_get_fourier_transform with respect to parameter param of the
+ * shape (see pattern_get_fourier_transform_derivative). Returns 1 if
+ * the shape has no such parameter.
+ */
+static int shape_get_fourier_transform_derivative(const shape *s, int param, const double k_[2], int ndim, double dt[2]){
+	const double phase_angle = -2*M_PI*(k_[0]*s->center[0] + k_[1]*s->center[1]);
+	const double ca = cos(s->angle);
+	const double sa = sin(s->angle);
+	double k[2];
+	double dz[2] = {0,0};
+
+	if(param < 2){
+		double t[2];
+		const double w = 2*M_PI*k_[param];
+		shape_get_fourier_transform(s, k_, ndim, t);
+		dt[0] = w*t[1];
+		dt[1] = -w*t[0];
+		return 0;
+	}
+
+	k[0] = k_[0] * ca + k_[1] * sa;
+	k[1] = k_[0] *-sa + k_[1] * ca;
+
+	/* Rotating the shape by the angle turns k by (k[1],-k[0]) */
+	switch(s->type){
+	case CIRCLE:
+		{
+			const double R = s->vtab.circle.radius;
+			const double rho2 = k[0]*k[0]+k[1]*k[1];
+			if(3 == param){
+				dz[0] = 2*M_PI*R*Jinc(R*sqrt(rho2)) + M_PI*R*R*R*rho2*JincDerivative(R*sqrt(rho2));
+			}else if(2 != param){
+				return 1;
 			}
-			break;
-		case RECTANGLE:
-			if(1 == ndim){
-				area = 2*s->vtab.rectangle.halfwidth[0];
-				z[0] = Sinc(2*k[0]*s->vtab.rectangle.halfwidth[0]);
+		}
+		break;
+	case ELLIPSE:
+		{
+			const double a = s->vtab.ellipse.halfwidth[0];
+			const double b = s->vtab.ellipse.halfwidth[1];
+			const double r = hypot(a*k[0], b*k[1]);
+			const double Jd = JincDerivative(r);
+			if(2 == param){
+				dz[0] = M_PI*a*b*Jd*k[0]*k[1]*(a*a-b*b);
+			}else if(3 == param){
+				dz[0] = M_PI*b*Jinc(r) + M_PI*a*a*b*k[0]*k[0]*Jd;
+			}else if(4 == param){
+				dz[0] = M_PI*a*Jinc(r) + M_PI*a*b*b*k[1]*k[1]*Jd;
 			}else{
-				area = 4*s->vtab.rectangle.halfwidth[0]*s->vtab.rectangle.halfwidth[1];
-				z[0] = Sinc(2*k[0]*s->vtab.rectangle.halfwidth[0])*Sinc(2*k[1]*s->vtab.rectangle.halfwidth[1]);
+				return 1;
 			}
-			break;
-		case POLYGON:
-			{
-				area = polygon_area(s->vtab.polygon.n_vertices, s->vtab.polygon.vertex);
-				if(DC){
-					z[0] = 1;
-					z[1] = 0;
-				}else{
-					/* For k != 0,
-					 * S(k) = i/|k|^2 * Sum_{i=0,n-1} z.((v_{i+1}-v_{i}) x k) j0(k.(v_{i+1}-v_{i})/2) e^{ik.(v_{i+1}+v_{i})/2}
-					 */
-					int p,q;
-					double num, pa;
-					double rc[2], u[2];
-					for(p=s->vtab.polygon.n_vertices-1,q=0; q < s->vtab.polygon.n_vertices; p = q++){
-						u[0] = s->vtab.polygon.vertex[2*q+0]-s->vtab.polygon.vertex[2*p+0];
-						u[1] = s->vtab.polygon.vertex[2*q+1]-s->vtab.polygon.vertex[2*p+1];
-						rc[0] = 0.5*(s->vtab.polygon.vertex[2*q+0]+s->vtab.polygon.vertex[2*p+0]);
-						rc[1] = 0.5*(s->vtab.polygon.vertex[2*q+1]+s->vtab.polygon.vertex[2*p+1]);
-
-						num = (u[0]*k[1]-u[1]*k[0]) * Sinc(k[0]*u[0]+k[1]*u[1]);
-						pa = -2*M_PI*(k[0]*rc[0]+k[1]*rc[1]);
-
-						// Multiplication by i means we mess up the order here
-						z[0] += num * sin(pa);
-						z[1] -= num * cos(pa);
-					}
-					// Our k lacks a 2pi factor
-					//z[0] /= 2*M_PI*(k[0]*k[0]+k[1]*k[1])*area;
-					//z[1] /= 2*M_PI*(k[0]*k[0]+k[1]*k[1])*area;
-					area = 1;
-					z[0] /= 2*M_PI*(k[0]*k[0]+k[1]*k[1]);
-					z[1] /= 2*M_PI*(k[0]*k[0]+k[1]*k[1]);
+		}
+		break;
+	case RECTANGLE:
+		{
+			const double a = s->vtab.rectangle.halfwidth[0];
+			const double b = s->vtab.rectangle.halfwidth[1];
+			const double gx = 2*a*Sinc(2*k[0]*a);
+			const double gy = (1 == ndim ? 1 : 2*b*Sinc(2*k[1]*b));
+			if(2 == param){
+				dz[0] = 4*a*a*SincDerivative(2*k[0]*a)*gy*k[1];
+				if(2 == ndim){
+					dz[0] -= gx*4*b*b*SincDerivative(2*k[1]*b)*k[0];
 				}
+			}else if(3 == param){
+				dz[0] = 2*cos(2*M_PI*k[0]*a)*gy;
+			}else if(4 == param && 2 == ndim){
+				dz[0] = gx*2*cos(2*M_PI*k[1]*b);
+			}else{
+				return 1;
 			}
-			break;
-		default:
-			area = 0;
-			break;
 		}
-		//f += dval*z*phase/area;
-		//f += dval*(z[0]+i*z[1])*(cos(phase_angle)+i*sin(phase_angle)) / area;
-		//f += dval*( z[0]*cos-z[1]*sin + i*(z[1]*cos+z[0]*sin) ) / area;
+		break;
+	case POLYGON:
 		{
-			double cpa = cos(phase_angle);
-			double spa = sin(phase_angle);
-			double t[2] = {area, area};
-			if(DC){
-				t[0] *= cpa;
-				t[1] *= spa;
+			const int n = s->vtab.polygon.n_vertices;
+			const double *v = s->vtab.polygon.vertex;
+			double dZ[4];
+			int q;
+			if(2 == param){
+				for(q = 0; q < n; ++q){
+					polygon_vertex_derivative(s, q, k, dZ);
+					dz[0] += -v[2*q+1]*dZ[0] + v[2*q+0]*dZ[2];
+					dz[1] += -v[2*q+1]*dZ[1] + v[2*q+0]*dZ[3];
+				}
+			}else if(param - 3 < 2*n){
+				polygon_vertex_derivative(s, (param-3)/2, k, dZ);
+				dz[0] = dZ[2*((param-3)%2)+0];
+				dz[1] = dZ[2*((param-3)%2)+1];
 			}else{
-				t[0] *= ( z[0]*cpa-z[1]*spa );
-				t[1] *= ( z[1]*cpa+z[0]*spa );
+				return 1;
 			}
-			f[0] += inv_size*(t[0]*dval[0]-t[1]*dval[1]);
-			f[1] += inv_size*(t[0]*dval[1]+t[1]*dval[0]);
 		}
+		break;
+	default:
+		return 1;
 	}
+	dt[0] = dz[0]*cos(phase_angle) - dz[1]*sin(phase_angle);
+	dt[1] = dz[1]*cos(phase_angle) + dz[0]*sin(phase_angle);
 	return 0;
 }
-int Pattern_GetFourierTransform(
+
+int pattern_get_fourier_transform_derivative(
+	int nshapes,
+	const shape *shapes,
+	const int *parent,
+	const double *value,
+	int ishape,
+	int param,
+	const double k_[2],
+	int ndim,
+	double unit_cell_size,
+	double f[2]
+){
+	const shape *s;
+	double dval[2], dt[2];
+
+	if(nshapes < 0){ return -1; }
+	if(nshapes > 0 && NULL == shapes){ return -2; }
+	if(NULL == parent){ return -3; }
+	if(NULL == value){ return -4; }
+	if(ishape < 0 || ishape >= nshapes){ return -5; }
+	if(param < 0){ return -6; }
+	if(NULL == k_){ return -7; }
+	if(ndim < 1 || ndim > 2){ return -8; }
+	if(unit_cell_size <= 0){ return -9; }
+	if(NULL == f){ return -10; }
+	s = &shapes[ishape];
+	if(1 == ndim){
+		if(k_[1] != 0){ return -7; }
+		if(RECTANGLE != s->type){ return -5; }
+	}
+
+	if(0 != shape_get_fourier_transform_derivative(s, param, k_, ndim, dt)){
+		return -6;
+	}
+	dval[0] = value[2*(ishape+1)+0]-value[2*(parent[ishape]+1)+0];
+	dval[1] = value[2*(ishape+1)+1]-value[2*(parent[ishape]+1)+1];
+	f[0] = (dt[0]*dval[0]-dt[1]*dval[1]) / unit_cell_size;
+	f[1] = (dt[0]*dval[1]+dt[1]*dval[0]) / unit_cell_size;
+	return 0;
+}
+int Pattern_GetFourierTransformDerivative(
 	const Pattern *p,
 	const double *value,
+	int ishape,
+	int param,
 	const double k[2],
 	int ndim,
 	double unit_cell_size,
 	double f[2]
 ){
-	return pattern_get_fourier_transform(p->nshapes, p->shapes, p->parent, value, k, ndim, unit_cell_size, f);
+	return pattern_get_fourier_transform_derivative(p->nshapes, p->shapes, p->parent, value, ishape, param, k, ndim, unit_cell_size, f);
 }
 
 int pattern_discretize_cell(
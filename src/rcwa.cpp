@@ -5,9 +5,12 @@
 #include <float.h>
 #include "rcwa.h"
 #include "fmm/fft_iface.h"
+#include "fmm/nufft.h"
 #include <TBLAS.h>
 #include <LinearSolve.h>
 #include <Eigensystems.h>
+#include <IRA.hpp>
+#include <algorithm>
 
 #ifdef DUMP_MATRICES
 # define RNP_OUTPUT_MATHEMATICA
@@ -22,6 +25,9 @@
 #include <iostream>
 #include <assert.h>
 #include "mkl.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 static void PrintMatrix(const char *name, size_t m, size_t n, const std::complex<double> *a, size_t lda);
 static inline void* rcwa_malloc(size_t size){
@@ -363,6 +369,261 @@ void MultKPMatrix(
 	}
 }
 
+// Forms the layer eigenoperator Epsilon2*kp - [kxkx, kxky; kykx, kyky]
+// in op (2n x 2n).
+static void MakeLayerOperator(
+	size_t n, const double *kx, const double *ky,
+	const std::complex<double> *Epsilon2, const std::complex<double> *kp,
+	std::complex<double> *op
+){
+	const size_t n2 = 2*n;
+	RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,0., op,n2);
+	RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, 1.,Epsilon2,n2, kp,n2, 0.,op,n2);
+
+	for(size_t i = 0; i < n; ++i){
+		op[i+i*n2] -= kx[i]*kx[i];
+	}
+	for(size_t i = 0; i < n; ++i){
+		op[i+n+i*n2] -= ky[i]*kx[i];
+	}
+	for(size_t i = 0; i < n; ++i){
+		op[i+(i+n)*n2] -= kx[i]*ky[i];
+	}
+	for(size_t i = 0; i < n; ++i){
+		op[i+n+(i+n)*n2] -= ky[i]*ky[i];
+	}
+}
+
+// Takes the square root of an eigenvalue q^2 of the layer eigenoperator,
+// choosing the branch of the propagation constant.
+static std::complex<double> LayerModeSqrt(const std::complex<double> &omega, const std::complex<double> &q2){
+	if(0 == omega.imag()){ // Not bandsolving
+		std::complex<double> q = std::sqrt(q2);
+		if(q.imag() < 0){
+			q = -q;
+		}
+		return q;
+	}else{ // performing some kind of bandsolving, need to choose the appropriate branch
+		if(q2.real() < 0){
+			// branch cut should be just below positive real axis
+			return std::complex<double>(0,1) * std::sqrt(-q2);
+		}else{
+			// branch cut should be just below negative real axis
+			// This is the default behavior for sqrt(std::complex)
+			return std::sqrt(q2);
+		}
+	}
+}
+
+// Eigenvalues from iterative solves carry more rounding error than those
+// of the dense solve. Drops the imaginary part of q^2 when it is at the
+// level of that error, so that the propagating modes of lossless layers
+// keep their direction; scale is the magnitude of the spectrum.
+static std::complex<double> RoundLayerEigenvalue(const std::complex<double> &q2, double scale){
+	if(std::abs(q2.imag()) <= 1e3*DBL_EPSILON*std::max(std::abs(q2), scale)){
+		return q2.real();
+	}
+	return q2;
+}
+
+// Returns nonzero if the imaginary parts of the n x n matrix a are at
+// the level of rounding error.
+static int LayerOperatorIsReal(size_t n, const std::complex<double> *a){
+	double re = 0, im = 0;
+	for(size_t i = 0; i < n*n; ++i){
+		re = std::max(re, std::abs(a[i].real()));
+		im = std::max(im, std::abs(a[i].imag()));
+	}
+	return im <= 8*DBL_EPSILON*re;
+}
+
+// Solves the eigensystem of a real operator stored in the complex n x n
+// matrix op, which is destroyed. The eigenvalues are returned in q and
+// the eigenvectors in phi, as for RNP::Eigensystem. rwork must be of
+// length 2n.
+static int SolveRealLayerEigensystem(
+	size_t n,
+	std::complex<double> *op,
+	std::complex<double> *q,
+	std::complex<double> *phi,
+	double *rwork
+){
+	// Pack the real parts into the first half of op, and place the
+	// eigenvectors in the second half.
+	double *a = (double*)op;
+	for(size_t i = 0; i < n*n; ++i){
+		a[i] = op[i].real();
+	}
+	double *vr = a + n*n;
+	double *wr = rwork;
+	double *wi = rwork + n;
+	int info = LAPACKE_dgeev(LAPACK_COL_MAJOR, 'N', 'V', n, a, n, wr, wi, NULL, 1, vr, n);
+	if(0 != info){ return info; }
+
+	// Complex conjugate pairs of eigenvalues are stored consecutively,
+	// with the real and imaginary parts of the first eigenvector in the
+	// corresponding pair of columns.
+	for(size_t j = 0; j < n; ++j){
+		q[j] = std::complex<double>(wr[j], wi[j]);
+		if(0 == wi[j]){
+			for(size_t i = 0; i < n; ++i){
+				phi[i+j*n] = vr[i+j*n];
+			}
+		}else{
+			q[j+1] = std::complex<double>(wr[j+1], wi[j+1]);
+			for(size_t i = 0; i < n; ++i){
+				phi[i+j*n] = std::complex<double>(vr[i+j*n], vr[i+(j+1)*n]);
+				phi[i+(j+1)*n] = std::conj(phi[i+j*n]);
+			}
+			++j;
+		}
+	}
+	return 0;
+}
+
+// Solves the eigensystem of the n x n layer operator op, which is
+// destroyed, in real arithmetic when it is real. work and lwork are as
+// for RNP::Eigensystem, and rwork must be of length 2n.
+static int SolveLayerOperatorEigensystem(
+	std::complex<double> omega,
+	size_t n,
+	std::complex<double> *op,
+	std::complex<double> *q,
+	std::complex<double> *phi,
+	std::complex<double> *work,
+	double *rwork,
+	size_t lwork
+){
+	if(0 == omega.imag() && LayerOperatorIsReal(n, op)){
+		return SolveRealLayerEigensystem(n, op, q, phi, rwork);
+	}
+	return RNP::Eigensystem(n, op, n, q, NULL, 1, phi, n, work, rwork, lwork);
+}
+
+// Returns nonzero if the layer is a lamellar (1D) grating in either
+// planar or conical mounting: ky is the same for all G and the
+// off-diagonal blocks of Epsilon2 are zero.
+static int LayerIsLamellar(size_t n, const double *ky, const std::complex<double> *Epsilon2, int epstype){
+	const size_t n2 = 2*n;
+	if(EPSILON2_TYPE_FULL != epstype){ return 0; }
+	for(size_t i = 1; i < n; ++i){
+		if(ky[0] != ky[i]){ return 0; }
+	}
+	for(size_t j = 0; j < n; ++j){
+		for(size_t i = 0; i < n; ++i){
+			if(0. != Epsilon2[(n+i)+j*n2] || 0. != Epsilon2[i+(n+j)*n2]){ return 0; }
+		}
+	}
+	return 1;
+}
+
+// Forms the diagonal block of kp for polarization pol (0 for hx, 1 for
+// hy) of a planar problem in the n x n matrix kpp. If kp is not NULL,
+// the block is copied from it.
+static void MakePlanarKPMatrix(
+	std::complex<double> omega,
+	size_t n, size_t pol,
+	const double *kx,
+	const std::complex<double> *Epsilon_inv,
+	int epstype,
+	const std::complex<double> *kp,
+	std::complex<double> *kpp,
+	const size_t ldkpp
+){
+	const size_t n2 = 2*n;
+	const std::complex<double> omega2 = omega*omega;
+	if(NULL != kp){
+		RNP::TBLAS::CopyMatrix<'A'>(n,n, &kp[pol*n+pol*n*n2],n2, kpp,ldkpp);
+	}else if(0 == pol){
+		RNP::TBLAS::SetMatrix<'A'>(n,n, 0.,omega2, kpp,ldkpp);
+	}else if(EPSILON2_TYPE_BLKDIAG1_SCALAR == epstype || EPSILON2_TYPE_BLKDIAG2_SCALAR == epstype){
+		RNP::TBLAS::SetMatrix<'A'>(n,n, 0.,0., kpp,ldkpp);
+		for(size_t i = 0; i < n; ++i){
+			kpp[i+i*ldkpp] = omega2 - kx[i]*Epsilon_inv[0]*kx[i];
+		}
+	}else{
+		for(size_t j = 0; j < n; ++j){
+			for(size_t i = 0; i < n; ++i){
+				kpp[i+j*ldkpp] = -kx[i]*Epsilon_inv[i+j*n]*kx[j];
+			}
+			kpp[j+j*ldkpp] += omega2;
+		}
+	}
+}
+
+// Solves the eigensystem of a lamellar layer (see LayerIsLamellar) as
+// two n x n problems. In planar mounting (ky = 0) the hx and hy modes
+// decouple; they are placed first and last, so that phi is block
+// diagonal. In conical mounting the same two problems are solved in the
+// frame rotated about x so that ky vanishes (Moharam and Grann): their
+// eigenvalues are shifted by -ky^2, the hy modes keep hx = 0, and the
+// hx modes acquire hy = -ky kx hx / (q^2 + ky^2). work must be of length
+// 4*n*n, and the rest is as for SolveLayerOperatorEigensystem. phi is
+// not touched unless the function succeeds, so it may hold kp on entry.
+static int SolveLamellarLayerEigensystem(
+	std::complex<double> omega,
+	size_t n,
+	const double *kx,
+	double ky,
+	const std::complex<double> *Epsilon_inv,
+	const std::complex<double> *Epsilon2,
+	std::complex<double> *q,
+	std::complex<double> *phi,
+	std::complex<double> *work,
+	std::complex<double> *eigenwork,
+	double *rwork,
+	size_t eigenlwork
+){
+	const size_t n2 = 2*n;
+	std::complex<double> *op[2] = { work, work + n*n };
+	std::complex<double> *V[2] = { work + 2*n*n, work + 3*n*n };
+
+	// The blocks of Epsilon2*kp - [kxkx, 0; 0, 0] at ky = 0
+	for(size_t pol = 0; pol < 2; ++pol){
+		const size_t off = pol*n;
+		MakePlanarKPMatrix(omega, n, pol, kx, Epsilon_inv, EPSILON2_TYPE_FULL, NULL, V[pol], n);
+		RNP::TBLAS::MultMM<'N','N'>(n,n,n, 1.,&Epsilon2[off+off*n2],n2, V[pol],n, 0.,op[pol],n);
+	}
+	for(size_t i = 0; i < n; ++i){
+		op[0][i+i*n] -= kx[i]*kx[i];
+	}
+
+	for(size_t pol = 0; pol < 2; ++pol){
+		int info = SolveLayerOperatorEigensystem(omega, n, op[pol], &q[pol*n], V[pol], eigenwork, rwork, eigenlwork);
+		if(0 != info){ return info; }
+	}
+
+	if(0 != ky){
+		// The hx modes are singular where q^2 + ky^2 vanishes.
+		double qmax = 0;
+		for(size_t j = 0; j < n; ++j){
+			if(std::abs(q[j]) > qmax){ qmax = std::abs(q[j]); }
+		}
+		for(size_t j = 0; j < n; ++j){
+			if(std::abs(q[j]) <= 64*DBL_EPSILON*qmax){ return 1; }
+		}
+	}
+
+	RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,0., phi,n2);
+	for(size_t pol = 0; pol < 2; ++pol){
+		const size_t off = pol*n;
+		RNP::TBLAS::CopyMatrix<'A'>(n,n, V[pol],n, &phi[off+off*n2],n2);
+	}
+	if(0 != ky){
+		for(size_t j = 0; j < n; ++j){
+			const std::complex<double> s = -ky / q[j];
+			for(size_t i = 0; i < n; ++i){
+				phi[(n+i)+j*n2] = s*kx[i]*V[0][i+j*n];
+			}
+		}
+		const double ky2 = ky*ky;
+		for(size_t i = 0; i < n2; ++i){
+			q[i] -= ky2;
+		}
+	}
+	return 0;
+}
+
 void SolveLayerEigensystem_uniform(
 	std::complex<double> omega,
 	size_t n,
@@ -461,24 +722,30 @@ void SolveLayerEigensystem(
 	size_t lwork
 ){
 	const size_t n2 = 2*n;
+#if defined(DUMP_MATRICES) && defined(DUMP_MATRICES_LARGE)
+	const size_t lsave = 2*n2*n2; // op_save and op_temp for the residual check
+#else
+	const size_t lsave = 0;
+#endif
 	if((size_t)-1 == lwork){
 		double dum;
 		RNP::Eigensystem(n2, NULL, n2, q, NULL, 1, phi, n2, work_, &dum, lwork);
-		work_[0] += n2*n2;
+		work_[0] += n2*n2 + lsave;
 		return;
 	}else if(0 == lwork){
-		lwork = n2*n2+2*n2;
+		lwork = n2*n2+2*n2+lsave;
 	}
 
 	std::complex<double> *work = work_;
 	size_t eigenlwork;
-	if(NULL == work_ || lwork < n2*n2+2*n2){
+	if(NULL == work_ || lwork < n2*n2+2*n2+lsave){
 		lwork = (size_t)-1;
-		RNP::Eigensystem(n2, NULL, n2, q, NULL, 1, phi, n2, q, NULL, lwork);
-		eigenlwork = (size_t)q[0].real();
-		work = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>)*(eigenlwork + n2*n2));
+		std::complex<double> dum;
+		RNP::Eigensystem(n2, NULL, n2, &dum, NULL, 1, phi, n2, &dum, NULL, lwork);
+		eigenlwork = (size_t)dum.real();
+		work = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>)*(eigenlwork + n2*n2 + lsave));
 	}else{
-		eigenlwork = lwork - n2*n2;
+		eigenlwork = lwork - n2*n2 - lsave;
 	}
 	std::complex<double> *op = work;
 	std::complex<double> *eigenwork = op + n2*n2;
@@ -527,22 +794,25 @@ void SolveLayerEigensystem(
 # endif
 #endif
 
-	// Make the eigenoperator Epsilon2*kp - [kxkx, kxky; kykx, kyky]
-	RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,0., op,n2);
-	RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, 1.,Epsilon2,n2, kp_use,n2, 0.,op,n2);
-
-	for(size_t i = 0; i < n; ++i){
-		op[i+i*n2] -= kx[i]*kx[i];
-	}
-	for(size_t i = 0; i < n; ++i){
-		op[i+n+i*n2] -= ky[i]*kx[i];
-	}
-	for(size_t i = 0; i < n; ++i){
-		op[i+(i+n)*n2] -= kx[i]*ky[i];
-	}
-	for(size_t i = 0; i < n; ++i){
-		op[i+n+(i+n)*n2] -= ky[i]*ky[i];
+	if(LayerIsLamellar(n, ky, Epsilon2, epstype) &&
+		0 == SolveLamellarLayerEigensystem(omega, n, kx, ky[0], Epsilon_inv, Epsilon2, q, phi, op, eigenwork, rwork, eigenlwork)
+	){
+		// Two half size problems suffice for a 1D grating; otherwise
+		// fall through to the full problem.
+		for(size_t i = 0; i < n2; ++i){
+			q[i] = LayerModeSqrt(omega, q[i]);
+		}
+		if(work != work_){
+			rcwa_free(work);
+		}
+		if(NULL == rwork_){
+			rcwa_free(rwork);
+		}
+		return;
 	}
+
+	// Make the eigenoperator Epsilon2*kp - [kxkx, kxky; kykx, kyky]
+	MakeLayerOperator(n, kx, ky, Epsilon2, kp_use, op);
 #ifdef DUMP_MATRICES
 	DUMP_STREAM << "op:" << std::endl;
 # ifdef DUMP_MATRICES_LARGE
@@ -555,12 +825,12 @@ void SolveLayerEigensystem(
 
 #ifdef DUMP_MATRICES
 # ifdef DUMP_MATRICES_LARGE
-	std::complex<double> *op_save = (std::complex<double> *)rcwa_malloc(sizeof(std::complex<double>) * 2*n2*n2);
+	std::complex<double> *op_save = eigenwork + eigenlwork;
 	std::complex<double> *op_temp = op_save + n2*n2;
 	RNP::TBLAS::CopyMatrix<'A'>(n2,n2, op,n2, op_save,n2);
 # endif
 #endif
-	int info = RNP::Eigensystem(n2, op, n2, q, NULL, 1, phi, n2, eigenwork, rwork, eigenlwork);
+	int info = SolveLayerOperatorEigensystem(omega, n2, op, q, phi, eigenwork, rwork, eigenlwork);
 	if(0 != info){
 		fprintf(stderr, "Layer eigensystem returned info = %d\n", info);
 	}
@@ -574,27 +844,12 @@ void SolveLayerEigensystem(
 	}
 	DUMP_STREAM << "eigensystem residual:" << std::endl;
 	RNP::IO::PrintMatrix(n2,n2,op_temp,n2, DUMP_STREAM) << std::endl << std::endl;
-	rcwa_free(op_save);
 # endif
 #endif
 
 	for(size_t i = 0; i < n2; ++i){
 		// Set the \hat{q} vector (diagonal matrix) while we're at it
-		if(0 == omega.imag()){ // Not bandsolving
-			q[i] = std::sqrt(q[i]);
-			if(q[i].imag() < 0){
-				q[i] = -q[i];
-			}
-		}else{ // performing some kind of bandsolving, need to choose the appropriate branch
-			if(q[i].real() < 0){
-				// branch cut should be just below positive real axis
-				q[i] = std::complex<double>(0,1) * std::sqrt(-q[i]);
-			}else{
-				// branch cut should be just below negative real axis
-				// This is the default behavior for sqrt(std::complex)
-				q[i] = std::sqrt(q[i]);
-			}
-		}
+		q[i] = LayerModeSqrt(omega, q[i]);
 	}
 #ifdef DUMP_MATRICES
 	DUMP_STREAM << "q:" << std::endl;
@@ -607,7 +862,7 @@ void SolveLayerEigensystem(
 # endif
 #endif
 
-	if(NULL == work_ || lwork < n2*n2+2*n2){
+	if(work != work_){
 		rcwa_free(work);
 	}
 	if(NULL == rwork_){
@@ -615,290 +870,1488 @@ void SolveLayerEigensystem(
 	}
 }
 
+// Applies inv(op - shift), or its conjugate transpose when trans is
+// 'C', using the LU factorization of op - shift.
+class LayerShiftInvertSolver : public IRA::ComplexEigensystem{
+	const std::complex<double> *lu;
+	const size_t *ipiv;
+	char trans;
+public:
+	LayerShiftInvertSolver(
+		size_t n, size_t nwanted, size_t narnoldi, const std::complex<double> &shift,
+		const std::complex<double> *lu, const size_t *ipiv, char trans,
+		const IRA::ComplexEigensystem::Params &params
+	):	ComplexEigensystem(n, nwanted, narnoldi, true, shift, params, NULL),
+		lu(lu), ipiv(ipiv), trans(trans)
+	{
+	}
+	bool IsOpInPlace() const{ return true; }
+	void ApplyOp(size_t n, const std::complex<double> * /*x*/, std::complex<double> *y){
+		LAPACKE_zgetrs(LAPACK_COL_MAJOR, trans, n, 1, (const MKL_Complex16*)lu, n, (const int*)ipiv, (MKL_Complex16*)y, n);
+	}
+	bool IsBIdentity() const{ return true; }
+	bool IsBInPlace() const{ return true; }
+	void ApplyB(size_t /*n*/, const std::complex<double> * /*x*/, std::complex<double> * /*y*/){}
+	void GetShifts(size_t /*n*/, const std::complex<double> * /*s0*/, std::complex<double> * /*s*/) const{}
+	bool EigenvalueCompare(const std::complex<double> &a, const std::complex<double> &b) const{
+		return LargestMagnitude(a, b);
+	}
+};
+
+struct LayerModeOrder{
+	const std::complex<double> *q;
+	bool operator()(size_t a, size_t b) const{
+		return fabs(q[a].imag()) < fabs(q[b].imag());
+	}
+};
 
-void InitSMatrix(
+int SolveLayerEigensystemPartial(
+	std::complex<double> omega,
 	size_t n,
-	std::complex<double> *S // size (4*n)^2
+	const double *kx,
+	const double *ky,
+	const std::complex<double> *Epsilon_inv,
+	const std::complex<double> *Epsilon2,
+	int epstype,
+	size_t *nmodes_,
+	std::complex<double> *q,
+	std::complex<double> *kp,
+	std::complex<double> *phi,
+	double *residual,
+	std::complex<double> *q_cutoff,
+	std::complex<double> *work_,
+	size_t lwork
 ){
-	const size_t n4 = 4*n;
-	RNP::TBLAS::SetMatrix<'A'>(n4,n4, 0.,1., S, n4);
+	const size_t n2 = 2*n;
+	size_t nmodes = *nmodes_;
+	const size_t nwanted = nmodes+1;
+	// Number of Arnoldi vectors, as in rcwa_solver::Eigensystem.
+	const size_t narnoldi = 2*nwanted+16;
+	if(nmodes < 1 || narnoldi > n2){ return -8; }
+	if((size_t)-1 == lwork){
+		work_[0] = 2*n2*n2 + 2*n2;
+		return 0;
+	}
+
+	std::complex<double> *work = work_;
+	if(NULL == work_ || lwork < 2*n2*n2 + 2*n2){
+		work = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>) * (2*n2*n2 + 2*n2));
+	}
+	std::complex<double> *op = work;
+	std::complex<double> *lu = op + n2*n2;
+	std::complex<double> *tau = lu + n2*n2; // also the pivots
+	std::complex<double> *vwork = tau + n2;
+	size_t *ipiv = (size_t*)tau;
+
+	std::complex<double> *kp_use = (NULL != kp ? kp : phi);
+	MakeKPMatrix(omega, n, kx, ky, Epsilon_inv, epstype, NULL, kp_use, n2);
+	MakeLayerOperator(n, kx, ky, Epsilon2, kp_use, op);
+
+	// The least evanescent modes have the largest real q^2, bounded
+	// above by about omega^2 times the largest epsilon, which in turn is
+	// bounded by the largest row sum of Epsilon2. Shifting just beyond
+	// it makes them the eigenvalues of largest magnitude of the inverse.
+	double epsmax = 0;
+	for(size_t i = 0; i < n2; ++i){
+		double rowsum = 0;
+		for(size_t j = 0; j < n2; ++j){
+			rowsum += std::abs(Epsilon2[i+j*n2]);
+		}
+		if(rowsum > epsmax){ epsmax = rowsum; }
+	}
+	const std::complex<double> shift = 1.01 * omega*omega * epsmax;
+
+	RNP::TBLAS::CopyMatrix<'A'>(n2,n2, op,n2, lu,n2);
+	for(size_t i = 0; i < n2; ++i){
+		lu[i+i*n2] -= shift;
+	}
+	int info = LUFactor(n2, lu, n2, ipiv);
+	if(0 == info){
+		// Right eigenvectors of the kept modes go in the leading columns of
+		// phi, and the matching left eigenvectors in those of lu, which is
+		// no longer needed once both iterations are done.
+		IRA::ComplexEigensystem::Params params;
+		LayerShiftInvertSolver right(n2, nwanted, narnoldi, shift, lu, ipiv, 'N', params);
+		LayerShiftInvertSolver left(n2, nwanted, narnoldi, std::conj(shift), lu, ipiv, 'C', params);
+		if(right.GetConvergedCount() >= nwanted && left.GetConvergedCount() >= nwanted){
+			const std::complex<double> *rvals = right.GetEigenvalues();
+			const std::complex<double> *rvecs = right.GetEigenvectors();
+			const std::complex<double> *lvals = left.GetEigenvalues();
+			const std::complex<double> *lvecs = left.GetEigenvectors();
+			// Order the converged modes by decay, keeping the first nmodes;
+			// the next one bounds the decay of all the discarded modes.
+			std::complex<double> *qconv = vwork;
+			size_t *order = (size_t*)(vwork + nwanted);
+			for(size_t j = 0; j < nwanted; ++j){
+				qconv[j] = LayerModeSqrt(omega, RoundLayerEigenvalue(rvals[j], std::abs(shift)));
+				order[j] = j;
+			}
+			LayerModeOrder cmp = { qconv };
+			std::sort(order, order+nwanted, cmp);
+			// Do not split a degenerate set of modes, whose left and right
+			// eigenvectors would not pair up.
+			while(nmodes > 0 && std::abs(qconv[order[nmodes-1]] - qconv[order[nmodes]]) <= 1e-8 * std::abs(qconv[order[nmodes]])){
+				--nmodes;
+			}
+			*q_cutoff = qconv[order[nmodes]];
+			bool *used = (bool*)(order + nwanted);
+			for(size_t j = 0; j < nwanted; ++j){ used[j] = false; }
+			for(size_t j = 0; j < nmodes; ++j){
+				const size_t k = order[j];
+				q[j] = qconv[k];
+				RNP::TBLAS::Copy(n2, &rvecs[0+k*n2],1, &phi[0+j*n2],1);
+				const double vnorm = RNP::TBLAS::Norm2(n2, &phi[0+j*n2],1);
+				RNP::TBLAS::Scale(n2, 1./vnorm, &phi[0+j*n2],1);
+				// The left eigenvector whose eigenvalue is the conjugate.
+				size_t kl = nwanted;
+				for(size_t i = 0; i < nwanted; ++i){
+					if(used[i]){ continue; }
+					if(nwanted == kl || std::abs(std::conj(lvals[i]) - rvals[k]) < std::abs(std::conj(lvals[kl]) - rvals[k])){
+						kl = i;
+					}
+				}
+				used[kl] = true;
+				RNP::TBLAS::Copy(n2, &lvecs[0+kl*n2],1, &lu[0+j*n2],1);
+			}
+			if(0 == nmodes){ info = 1; }
+		}else{
+			info = 1;
+		}
+	}
+	if(0 != info){
+		if(work != work_){ rcwa_free(work); }
+		return info;
+	}
+
+	// Residuals of the computed modes, relative to the spectral scale.
+	*residual = 0;
+	for(size_t j = 0; j < nmodes; ++j){
+		const std::complex<double> q2 = q[j]*q[j];
+		RNP::TBLAS::MultMV<'N'>(n2,n2, 1.,op,n2, &phi[0+j*n2],1, 0.,vwork,1);
+		RNP::TBLAS::Axpy(n2, -q2, &phi[0+j*n2],1, vwork,1);
+		const double scale = std::max(std::abs(q2), std::abs(shift));
+		const double r = RNP::TBLAS::Norm2(n2, vwork,1) / scale;
+		if(r > *residual){ *residual = r; }
+	}
+
+	// The remaining right eigenvectors span the orthogonal complement of
+	// the computed left eigenvectors, an invariant subspace of op. Use an
+	// orthonormal basis of it, with the Rayleigh quotients of op as q^2,
+	// in place of the exact modes.
+	RNP::TLASupport::QRFactorization(n2, nmodes, lu, n2, tau, vwork);
+	RNP::TLASupport::GenerateOrthognalMatrixFromElementaryReflectors(n2, n2, nmodes, lu, n2, tau, vwork);
+	RNP::TBLAS::CopyMatrix<'A'>(n2,n2-nmodes, &lu[0+nmodes*n2],n2, &phi[0+nmodes*n2],n2);
+	const std::complex<double> one(1.), zero(0.);
+	cblas_zgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, n2, n2-nmodes, n2, (MKL_Complex16*)&one, (const MKL_Complex16*)op, n2, (const MKL_Complex16*)&phi[0+nmodes*n2], n2, (MKL_Complex16*)&zero, (MKL_Complex16*)lu, n2);
+	for(size_t j = nmodes; j < n2; ++j){
+		const std::complex<double> q2 = RNP::TBLAS::ConjugateDot(n2, &phi[0+j*n2],1, &lu[0+(j-nmodes)*n2],1);
+		q[j] = LayerModeSqrt(omega, q2);
+	}
+
+	*nmodes_ = nmodes;
+	if(work != work_){ rcwa_free(work); }
+	return 0;
 }
-void GetSMatrix(
-	size_t nlayers,
-	size_t n, // glist.n
-	const double *kx, const double *ky,
+
+int RefineLayerEigensystem(
 	std::complex<double> omega,
-	const double *thickness, // list of thicknesses
-	const std::complex<double> **q, // list of q vectors
-	const std::complex<double> **Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
-	int *epstype,
-	const std::complex<double> **kp,
-	const std::complex<double> **phi,
-	std::complex<double> *S, // size (4*n)^2
+	size_t n,
+	const double *kx,
+	const double *ky,
+	const std::complex<double> *Epsilon_inv,
+	const std::complex<double> *Epsilon2,
+	int epstype,
+	const std::complex<double> *phi0,
+	std::complex<double> *q,
+	std::complex<double> *kp,
+	std::complex<double> *phi,
+	double *residual,
 	std::complex<double> *work_,
-	size_t *iwork,
 	size_t lwork
 ){
-	if(0 == nlayers){ return; }
 	const size_t n2 = 2*n;
-	const size_t n4 = 2*n2;
-
+	// Newton converges quadratically from a good start, so a slow start
+	// means the old basis is too far off to be worth refining.
+	const int maxiter = 6;
+	const double tol = 1e-11;
+	if(NULL == phi0){ return -8; }
 	if((size_t)-1 == lwork){
-		work_[0] = n4*(n4+1);
-		return;
+		work_[0] = 3*n2*n2 + n2;
+		return 0;
 	}
+
 	std::complex<double> *work = work_;
-	if(NULL == work_ || lwork < n4*(n4+1)){
-		work = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>)*(n4*(n4+1)));
-	}
-	size_t *pivots = iwork;
-	if(NULL == iwork){
-		pivots = (size_t*)rcwa_malloc(sizeof(size_t)*n4);
+	if(NULL == work_ || lwork < 3*n2*n2 + n2){
+		work = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>) * (3*n2*n2 + n2));
 	}
+	std::complex<double> *op = work;
+	std::complex<double> *B = op + n2*n2;
+	std::complex<double> *lu = B + n2*n2;
+	size_t *ipiv = (size_t*)(lu + n2*n2);
 
-	RNP::TBLAS::SetMatrix<'A'>(n4,n4, 0.,1., S, n4);
+	std::complex<double> *kp_use = (NULL != kp ? kp : phi);
+	MakeKPMatrix(omega, n, kx, ky, Epsilon_inv, epstype, NULL, kp_use, n2);
+	MakeLayerOperator(n, kx, ky, Epsilon2, kp_use, op);
+	RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi0,n2, phi,n2);
+
+	const std::complex<double> one(1.), zero(0.);
+	int info = 1;
+	double scale = 0;
+	for(int iter = 0; iter <= maxiter; ++iter){
+		// B = inv(phi) op phi is diagonal once phi is an eigenbasis.
+		cblas_zgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, n2, n2, n2, (MKL_Complex16*)&one, (const MKL_Complex16*)op, n2, (const MKL_Complex16*)phi, n2, (MKL_Complex16*)&zero, (MKL_Complex16*)B, n2);
+		RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi,n2, lu,n2);
+		if(0 != LUFactor(n2, lu, n2, ipiv)){
+			info = 2;
+			break;
+		}
+		LUSolve(n2, n2, lu, n2, ipiv, B, n2);
 
-	std::complex<double> *t1 = work;
-	std::complex<double> *t2 = t1 + n2*n2;
-	std::complex<double> *in1 = t2 + n2*n2;
-	std::complex<double> *in2 = in1 + n2*n2;
-	std::complex<double> *d1 = in2 + n2*n2;
-	std::complex<double> *d2 = d1 + n2;
+		scale = 0;
+		for(size_t j = 0; j < n2; ++j){
+			if(std::abs(B[j+j*n2]) > scale){ scale = std::abs(B[j+j*n2]); }
+		}
+		*residual = 0;
+		for(size_t j = 0; j < n2; ++j){
+			double off = 0;
+			for(size_t i = 0; i < n2; ++i){
+				if(i != j){ off += std::norm(B[i+j*n2]); }
+			}
+			off = sqrt(off) / scale;
+			if(off > *residual){ *residual = off; }
+		}
+		if(*residual <= tol){
+			info = 0;
+			break;
+		}
+		if(maxiter == iter){ break; }
+
+		// First order correction phi <- phi (I + E), with E(i,j) =
+		// B(i,j) / (B(j,j) - B(i,i)). Modes within a degenerate set are
+		// left to mix freely; a large correction means the pairing of old
+		// and new modes has been lost.
+		bool paired = true;
+		for(size_t j = 0; j < n2 && paired; ++j){
+			for(size_t i = 0; i < n2; ++i){
+				if(i == j){
+					lu[i+j*n2] = 1.;
+					continue;
+				}
+				const std::complex<double> gap = B[j+j*n2] - B[i+i*n2];
+				if(std::abs(gap) <= 1e-8*scale){
+					lu[i+j*n2] = 0.;
+					continue;
+				}
+				lu[i+j*n2] = B[i+j*n2] / gap;
+				if(std::abs(lu[i+j*n2]) > 0.3){
+					paired = false;
+					break;
+				}
+			}
+		}
+		if(!paired){
+			info = 3;
+			break;
+		}
+		cblas_zgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, n2, n2, n2, (MKL_Complex16*)&one, (const MKL_Complex16*)phi, n2, (const MKL_Complex16*)lu, n2, (MKL_Complex16*)&zero, (MKL_Complex16*)B, n2);
+		for(size_t j = 0; j < n2; ++j){
+			const double vnorm = RNP::TBLAS::Norm2(n2, &B[0+j*n2],1);
+			for(size_t i = 0; i < n2; ++i){
+				phi[i+j*n2] = B[i+j*n2] / vnorm;
+			}
+		}
+	}
+	if(0 == info){
+		for(size_t j = 0; j < n2; ++j){
+			q[j] = LayerModeSqrt(omega, RoundLayerEigenvalue(B[j+j*n2], scale));
+		}
+	}
 
-	for(size_t l = 0; l < nlayers-1; ++l){
-		size_t lp1 = l+1;
-		if(lp1 >= nlayers){ lp1 = l; }
+	if(work != work_){ rcwa_free(work); }
+	return info;
+}
 
-		// Make the interface matrices
-		if((lp1 == l) || (q[l] == q[lp1] && ((NULL != kp[l] && kp[l] == kp[lp1]) || Epsilon_inv[l] == Epsilon_inv[lp1]) && phi[l] == phi[lp1])){
-			// This is a trivial interface, set to identity
-			RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,1., in1, n2);
-			RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,0., in2, n2);
-		}else{
-			// The interface matrix is the inverse of the mode-to-field matrix of layer l
-			// times the mode-to-field matrix of layer l+1 (lp1).
-			// The mode-to-field matrix is of the form
-			// [ B -B ] where A = phi
-			// [ A  A ] where B = kp*phi*inv(diag(q)) = G*A/q
-			// So we want
-			// 0.5 * [  iBl  iAl ] [ Blp1 -Blp1 ]
-			//       [ -iBl  iAl ] [ Alp1  Alp1 ]
-			// Multiplying out gives
-			// 0.5 * [ P+Q P-Q ] // where P = iAl*Alp1, and i in front means inverse
-			//       [ P-Q P+Q ] // where Q = iBl*Blp1
-			// Making P is easy, since A is a single matrix.
-			// Making Q is as follows:
-			// Q = iBl*Blp1
-			//   = ql*iAl*iGl * Gl*Alp1*iqlp1
-			// We will only store I11 and I21
-			/*
-			{
-				std::complex<double> *Ml = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>)*n4*n4);
-				std::complex<double> *Mlp1 = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>)*n4*n4);
+// Finds the permutation sigma of the G vectors that reverses the sign of
+// kx (if flipx) and of ky (if flipy). Returns nonzero if some G vector
+// has no image.
+static int LayerMirrorPermutation(
+	size_t n, const double *kx, const double *ky,
+	int flipx, int flipy, size_t *sigma
+){
+	double scale = 0;
+	for(size_t i = 0; i < n; ++i){
+		scale = std::max(scale, std::max(fabs(kx[i]), fabs(ky[i])));
+	}
+	const double tol = 1e-10*scale;
+	for(size_t i = 0; i < n; ++i){
+		const double x = (flipx ? -kx[i] : kx[i]);
+		const double y = (flipy ? -ky[i] : ky[i]);
+		size_t j;
+		for(j = 0; j < n; ++j){
+			if(fabs(kx[j]-x) <= tol && fabs(ky[j]-y) <= tol){ break; }
+		}
+		if(n == j){ return 1; }
+		sigma[i] = j;
+	}
+	return 0;
+}
 
-				RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,0., &Ml[0+0*n4],n4);
-				RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[l],n2, &Ml[n2+0*n4],n4);
-				RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[l],n2, &Ml[n2+n2*n4],n4);
-				RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[l],n2, &Ml[0+n2*n4],n4);
-				for(size_t i = 0; i < n2; ++i){
-					RNP::TBLAS::Scale(n2, 1./q[l][i], &Ml[0+(i+n2)*n4], 1);
+// The symmetry operations act on the in-plane magnetic field vectors
+// [hx; hy] of the layer operator as signed permutations, taking G to
+// sigma[G] with hy multiplied by hsign; this is -1 for mirrors, under
+// which the field is a pseudovector, and +1 for the two-fold rotation.
+static void LayerSymmetryImage(size_t n, const size_t *sigma, double hsign, size_t k, size_t *image, double *sign){
+	if(NULL == sigma){
+		*image = k;
+		*sign = 1;
+	}else if(k < n){
+		*image = sigma[k];
+		*sign = 1;
+	}else{
+		*image = n+sigma[k-n];
+		*sign = hsign;
+	}
+}
+
+// Returns nonzero if the 2n x 2n layer operator commutes with the
+// symmetry operation given by sigma and hsign, to rounding error.
+static int LayerOperatorIsInvariant(size_t n, const std::complex<double> *op, const size_t *sigma, double hsign){
+	const size_t n2 = 2*n;
+	double amax = 0, dmax = 0;
+	for(size_t c = 0; c < n2; ++c){
+		size_t pc; double sc;
+		LayerSymmetryImage(n, sigma, hsign, c, &pc, &sc);
+		for(size_t r = 0; r < n2; ++r){
+			size_t pr; double sr;
+			LayerSymmetryImage(n, sigma, hsign, r, &pr, &sr);
+			amax = std::max(amax, std::abs(op[r+c*n2]));
+			dmax = std::max(dmax, std::abs(sr*sc*op[pr+pc*n2] - op[r+c*n2]));
+		}
+	}
+	return dmax <= 64*DBL_EPSILON*amax;
+}
+
+// Returns nonzero if the symmetry operation given by sigma and hsign
+// takes the vector v of length 2n to chi*v, to within tol relative to
+// the largest entry of v.
+static int LayerVectorIsInvariant(size_t n, const std::complex<double> *v, const size_t *sigma, double hsign, double chi, double tol){
+	double amax = 0, dmax = 0;
+	for(size_t k = 0; k < 2*n; ++k){
+		size_t pk; double sk;
+		LayerSymmetryImage(n, sigma, hsign, k, &pk, &sk);
+		amax = std::max(amax, std::abs(v[k]));
+		dmax = std::max(dmax, std::abs(sk*v[k] - chi*v[pk]));
+	}
+	return dmax <= tol*amax;
+}
+
+// Returns the character, 1 or -1, of the vector v of length 2n under the
+// symmetry operation given by sigma and hsign, or 0 if v is not taken to
+// a multiple of itself.
+static int LayerVectorCharacter(size_t n, const std::complex<double> *v, const size_t *sigma, double hsign, double tol){
+	if(LayerVectorIsInvariant(n, v, sigma, hsign, 1., tol)){ return 1; }
+	if(LayerVectorIsInvariant(n, v, sigma, hsign, -1., tol)){ return -1; }
+	return 0;
+}
+
+// Builds the symmetry adapted basis for the ng elements g of a symmetry
+// group, stored in the order identity, g1, g2, g1*g2. Each unit vector
+// is projected onto the irreducible representations, keeping one vector
+// per orbit of the group and representation. Basis vector j has the
+// entries bcoef[4*j+e] in rows bidx[4*j+e], and those of representation
+// c are j = boff[c], ..., boff[c+1]-1. Returns the number of basis
+// vectors, which is 2n unless the group does not act consistently.
+static size_t LayerSymmetryBasis(
+	size_t n, size_t ng, size_t *const *g, const double *hsign,
+	size_t *bidx, double *bcoef, size_t *boff
+){
+	const size_t n2 = 2*n;
+	size_t nb = 0;
+	for(size_t c = 0; c < ng; ++c){
+		boff[c] = nb;
+		for(size_t k = 0; k < n2; ++k){
+			size_t image[4];
+			double sign[4];
+			bool rep = true;
+			for(size_t e = 0; e < ng; ++e){
+				LayerSymmetryImage(n, g[e], hsign[e], k, &image[e], &sign[e]);
+				if(image[e] < k){ rep = false; }
+			}
+			if(!rep){ continue; }
+			size_t *idx = &bidx[4*nb];
+			double *coef = &bcoef[4*nb];
+			size_t nent = 0;
+			for(size_t e = 0; e < ng; ++e){
+				// The character of element e is the product of those of
+				// the generators it contains.
+				const double chi = (1 == (c & e) || 2 == (c & e)) ? -1. : 1.;
+				size_t i;
+				for(i = 0; i < nent; ++i){
+					if(idx[i] == image[e]){ break; }
 				}
-				RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, 1.,kp[l],n2, &Ml[0+n2*n4],n4, 0.,&Ml[0+0*n4],n4);
-				RNP::TBLAS::CopyMatrix<'A'>(n2,n2, &Ml[0+0*n4],n4, &Ml[0+n2*n4],n4);
-				for(size_t i = 0; i < n2; ++i){
-					RNP::TBLAS::Scale(n2, -1., &Ml[0+(i+n2)*n4], 1);
+				if(nent == i){
+					idx[i] = image[e];
+					coef[i] = 0;
+					++nent;
+				}
+				coef[i] += chi*sign[e];
+			}
+			double norm = 0;
+			for(size_t i = 0; i < nent; ++i){
+				norm += coef[i]*coef[i];
+			}
+			if(norm < 0.5){ continue; }
+			norm = sqrt(norm);
+			for(size_t i = 0; i < 4; ++i){
+				if(i < nent){
+					coef[i] /= norm;
+				}else{
+					idx[i] = k;
+					coef[i] = 0;
 				}
+			}
+			++nb;
+		}
+	}
+	boff[ng] = nb;
+	return nb;
+}
 
-				RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,0., &Mlp1[0+0*n4],n4);
-				RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[lp1],n2, &Mlp1[n2+0*n4],n4);
-				RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[lp1],n2, &Mlp1[n2+n2*n4],n4);
-				RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[lp1],n2, &Mlp1[0+n2*n4],n4);
+int SolveLayerEigensystemSymmetric(
+	std::complex<double> omega,
+	size_t n,
+	const double *kx,
+	const double *ky,
+	const std::complex<double> *Epsilon_inv,
+	const std::complex<double> *Epsilon2,
+	int epstype,
+	std::complex<double> *q,
+	std::complex<double> *kp,
+	std::complex<double> *phi,
+	int symmetries,
+	size_t *nblocks,
+	std::complex<double> *work_,
+	size_t lwork
+){
+	const size_t n2 = 2*n;
+	*nblocks = 1;
+	size_t eigenlwork;
+	{
+		std::complex<double> dum;
+		RNP::Eigensystem(n2, NULL, n2, &dum, NULL, 1, NULL, n2, &dum, NULL, (size_t)-1);
+		eigenlwork = (size_t)dum.real();
+	}
+	// op, the block and its eigenvectors, the symmetry permutations and
+	// the basis, and the real workspace.
+	const size_t laux = 2*n + 5*n2;
+	const size_t lneed = 3*n2*n2 + eigenlwork + laux;
+	if((size_t)-1 == lwork){
+		work_[0] = lneed;
+		return 0;
+	}
+
+	std::complex<double> *work = work_;
+	if(NULL == work_ || lwork < lneed){
+		work = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>) * lneed);
+	}
+	std::complex<double> *op = work;
+	std::complex<double> *A = op + n2*n2;
+	std::complex<double> *V = A + n2*n2;
+	std::complex<double> *eigenwork = V + n2*n2;
+	size_t *sigma = (size_t*)(eigenwork + eigenlwork); // 3 permutations of length n
+	size_t *bidx = sigma + 3*n; // 4 entries per basis vector
+	double *bcoef = (double*)(bidx + 4*n2);
+	double *rwork = bcoef + 4*n2; // length 2*n2
+
+	// Of the symmetries allowed by the pattern, keep those that also map
+	// the k vectors onto themselves, in the order of the flags. Without
+	// any, the operator is not built at all.
+	size_t *cand[3] = { NULL, NULL, NULL };
+	int ncand = 0;
+	for(int d = 0; d < 3; ++d){
+		if(!(symmetries & (1 << d))){ continue; }
+		if(0 == LayerMirrorPermutation(n, kx, ky, 1 != d, 0 != d, sigma + d*n)){
+			cand[d] = sigma + d*n;
+			++ncand;
+		}
+	}
+	if(0 == ncand){
+		if(work != work_){ rcwa_free(work); }
+		return 1;
+	}
+
+	std::complex<double> *kp_use = (NULL != kp ? kp : phi);
+	MakeKPMatrix(omega, n, kx, ky, Epsilon_inv, epstype, NULL, kp_use, n2);
+	MakeLayerOperator(n, kx, ky, Epsilon2, kp_use, op);
+
+	// The group is generated by the mirrors x -> -x and y -> -y that the
+	// operator respects, or else by the two-fold rotation. Its elements
+	// are stored in the order identity, g1, g2, g1*g2.
+	size_t *g[4] = { NULL, NULL, NULL, NULL };
+	double hsign[4] = { 1, 1, 1, 1 };
+	size_t ng = 1;
+	for(int d = 0; d < 2; ++d){
+		if(NULL != cand[d] && LayerOperatorIsInvariant(n, op, cand[d], -1.)){
+			g[ng] = cand[d];
+			hsign[ng] = -1;
+			++ng;
+		}
+	}
+	if(3 == ng){
+		for(size_t i = 0; i < n; ++i){
+			sigma[2*n+i] = g[1][g[2][i]];
+		}
+		g[3] = sigma + 2*n;
+		hsign[3] = 1;
+		ng = 4;
+	}else if(1 == ng && NULL != cand[2] && LayerOperatorIsInvariant(n, op, cand[2], 1.)){
+		g[1] = cand[2];
+		ng = 2;
+	}
+	*nblocks = ng;
+	int info = 0;
+	if(1 == ng){
+		info = 1;
+	}else{
+		size_t boff[5];
+		const size_t nb = LayerSymmetryBasis(n, ng, g, hsign, bidx, bcoef, boff);
+		if(n2 != nb){
+			info = 2;
+		}
+
+		for(size_t c = 0; c < ng && 0 == info; ++c){
+			const size_t off = boff[c];
+			const size_t m = boff[c+1] - off;
+			if(0 == m){ continue; }
+			const size_t *idx = &bidx[4*off];
+			const double *coef = &bcoef[4*off];
+			std::complex<double> *slab = &phi[0+off*n2];
+
+			// A = U^T op U, with op U held in the columns of phi that the
+			// eigenvectors of this block will occupy.
+			for(size_t j = 0; j < m; ++j){
 				for(size_t i = 0; i < n2; ++i){
-					RNP::TBLAS::Scale(n2, 1./q[lp1][i], &Mlp1[0+(i+n2)*n4], 1);
+					std::complex<double> sum = 0;
+					for(size_t e = 0; e < 4; ++e){
+						sum += coef[4*j+e] * op[i+idx[4*j+e]*n2];
+					}
+					slab[i+j*n2] = sum;
 				}
-				RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, 1.,kp[lp1],n2, &Mlp1[0+n2*n4],n4, 0.,&Mlp1[0+0*n4],n4);
-				RNP::TBLAS::CopyMatrix<'A'>(n2,n2, &Mlp1[0+0*n4],n4, &Mlp1[0+n2*n4],n4);
-				for(size_t i = 0; i < n2; ++i){
-					RNP::TBLAS::Scale(n2, -1., &Mlp1[0+(i+n2)*n4], 1);
+			}
+			for(size_t j = 0; j < m; ++j){
+				for(size_t i = 0; i < m; ++i){
+					std::complex<double> sum = 0;
+					for(size_t e = 0; e < 4; ++e){
+						sum += coef[4*i+e] * slab[idx[4*i+e]+j*n2];
+					}
+					A[i+j*m] = sum;
+				}
+			}
+			info = SolveLayerOperatorEigensystem(omega, m, A, &q[off], V, eigenwork, rwork, eigenlwork);
+			if(0 != info){ break; }
+
+			// phi = U V
+			RNP::TBLAS::SetMatrix<'A'>(n2,m, 0.,0., slab,n2);
+			for(size_t j = 0; j < m; ++j){
+				for(size_t i = 0; i < m; ++i){
+					for(size_t e = 0; e < 4; ++e){
+						slab[idx[4*i+e]+j*n2] += coef[4*i+e] * V[i+j*m];
+					}
 				}
+			}
+			for(size_t j = 0; j < m; ++j){
+				q[off+j] = LayerModeSqrt(omega, q[off+j]);
+			}
+		}
+	}
 
-				//RNP::LinearSolve<'N'>(n4, n4, Ml, n4, Mlp1, n4, NULL, pivots);
+	if(work != work_){ rcwa_free(work); }
+	return info;
+}
+
+void InitSMatrix(
+	size_t n,
+	std::complex<double> *S // size (4*n)^2
+){
+	const size_t n4 = 4*n;
+	RNP::TBLAS::SetMatrix<'A'>(n4,n4, 0.,1., S, n4);
+}
+
+// Updates the S-matrix S (2m x 2m, leading dimension ldS) of a stack
+// by the interface matrices in1 = I11 = I22 and in2 = I12 = I21 (m x m)
+// and the phase factors d1 and d2 of the layers on either side. t1 and
+// t2 are m x m temporaries, and pivots is of length m. If logdet is not
+// NULL, the log of the determinant of the factored matrix is subtracted
+// from it.
+static void GetSMatrixUpdate(
+	size_t m,
+	const std::complex<double> *in1, const std::complex<double> *in2,
+	const std::complex<double> *d1, const std::complex<double> *d2,
+	std::complex<double> *S, size_t ldS,
+	std::complex<double> *t1, std::complex<double> *t2,
+	size_t *pivots,
+	std::complex<double> *logdet
+){
+	// Make S11
+	RNP::TBLAS::MultMM<'N','N'>(m,m,m, -1.,&S[0+m*ldS],ldS, in2,m, 0.,t1,m); // t1 = -S12 I21
+	for(size_t i = 0; i < m; ++i){ // t1 = -f_l S12 I21
+		RNP::TBLAS::Scale(m, d1[i], &t1[i+0*m], m);
+	}
+	RNP::TBLAS::Axpy(m*m, 1., in1,1, t1,1); // t1 = (I11 - f_l S12 I21)
+
+	RNP::TBLAS::SetMatrix<'A'>(m,m, 0.,1., t2,m);
+	int solve_info;
+	RNP::LinearSolve<'N'>(m, m, t1, m, t2, m, &solve_info, pivots); // t2 = (I11 - f_l S12 I21)^{-1}
+	if(NULL != logdet){
+		// S11 picks up f_l (I11 - f_l S12 I21)^{-1}, so its determinant
+		// is a product over the steps of the LU factors just formed.
+		for(size_t i = 0; i < m; ++i){
+			*logdet -= std::log(t1[i+i*m]);
+			if(pivots[i] != i){ *logdet -= std::complex<double>(0,M_PI); }
+		}
+	}
+
+	RNP::TBLAS::CopyMatrix<'A'>(m,m, &S[0+0*ldS],ldS, t1,m);
+	for(size_t i = 0; i < m; ++i){ // t1 = f_l S11
+		RNP::TBLAS::Scale(m, d1[i], &t1[i+0*m], m);
+	}
+	RNP::TBLAS::MultMM<'N','N'>(m,m,m, 1.,t2,m, t1,m, 0.,&S[0+0*ldS],ldS);
+	// S11 is done, and we need to hold on to t2 = (I11 - f_l S12 I21)^{-1}
+
+	RNP::TBLAS::MultMM<'N','N'>(m,m,m, 1.,&S[0+m*ldS],ldS, in1,m, 0.,t1,m); // t1 = S12 I22
+	for(size_t i = 0; i < m; ++i){ // t1 = f_l S12 I22
+		RNP::TBLAS::Scale(m, d1[i], &t1[i+0*m], m);
+	}
+	RNP::TBLAS::Axpy(m*m, -1., in2,1, t1,1); // t1 = f_l S12 I22 - I12
+	for(size_t i = 0; i < m; ++i){ // t1 = (f_l S12 I22 - I12) f_{l+1}
+		RNP::TBLAS::Scale(m, d2[i], &t1[0+i*m], 1);
+	}
+	RNP::TBLAS::MultMM<'N','N'>(m,m,m, 1.,t2,m, t1,m, 0.,&S[0+m*ldS],ldS);
+	// S12 done, and t2 can be reused
+
+	RNP::TBLAS::MultMM<'N','N'>(m,m,m, 1.,&S[m+m*ldS],ldS, in2,m, 0.,t1,m); // t1 = S22 I21
+	RNP::TBLAS::MultMM<'N','N'>(m,m,m, 1.,t1,m, &S[0+0*ldS],ldS, 1.,&S[m+0*ldS],ldS);
+	// S21 done, need to keep t1 = S22 I21
+
+	RNP::TBLAS::MultMM<'N','N'>(m,m,m, 1.,&S[m+m*ldS],ldS, in1,m, 0.,t2,m); // t2 = S22 I22
+	for(size_t i = 0; i < m; ++i){ // t2 = S22 I22 f_{l+1}
+		RNP::TBLAS::Scale(m, d2[i], &t2[0+i*m], 1);
+	}
+	RNP::TBLAS::CopyMatrix<'A'>(m,m, t2,m, &S[m+m*ldS],ldS);
+	RNP::TBLAS::MultMM<'N','N'>(m,m,m, 1.,t1,m, &S[0+m*ldS],ldS, 1.,&S[m+m*ldS],ldS);
+}
+
+// Appends layer lp1 to the S-matrix S of a stack ending in layer l.
+// The work array must be of length at least 4*n*(4*n+1), and pivots
+// of length 2*n.
+static void GetSMatrixStep(
+	size_t l, size_t lp1,
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const double *thickness, // list of thicknesses
+	const std::complex<double> **q, // list of q vectors
+	const std::complex<double> **Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	int *epstype,
+	const std::complex<double> **kp,
+	const std::complex<double> **phi,
+	std::complex<double> *S, // size (4*n)^2
+	std::complex<double> *work, // length 4*n*(4*n+1)
+	size_t *pivots, // length n2
+	std::complex<double> *logdet = NULL
+){
+	const size_t n2 = 2*n;
+	const size_t n4 = 2*n2;
+
+	std::complex<double> *t1 = work;
+	std::complex<double> *t2 = t1 + n2*n2;
+	std::complex<double> *in1 = t2 + n2*n2;
+	std::complex<double> *in2 = in1 + n2*n2;
+	std::complex<double> *d1 = in2 + n2*n2;
+	std::complex<double> *d2 = d1 + n2;
+
+	// Make the interface matrices
+	if((lp1 == l) || (q[l] == q[lp1] && ((NULL != kp[l] && kp[l] == kp[lp1]) || Epsilon_inv[l] == Epsilon_inv[lp1]) && phi[l] == phi[lp1])){
+		// This is a trivial interface, set to identity
+		RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,1., in1, n2);
+		RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,0., in2, n2);
+	}else{
+		// The interface matrix is the inverse of the mode-to-field matrix of layer l
+		// times the mode-to-field matrix of layer l+1 (lp1).
+		// The mode-to-field matrix is of the form
+		// [ B -B ] where A = phi
+		// [ A  A ] where B = kp*phi*inv(diag(q)) = G*A/q
+		// So we want
+		// 0.5 * [  iBl  iAl ] [ Blp1 -Blp1 ]
+		//       [ -iBl  iAl ] [ Alp1  Alp1 ]
+		// Multiplying out gives
+		// 0.5 * [ P+Q P-Q ] // where P = iAl*Alp1, and i in front means inverse
+		//       [ P-Q P+Q ] // where Q = iBl*Blp1
+		// Making P is easy, since A is a single matrix.
+		// Making Q is as follows:
+		// Q = iBl*Blp1
+		//   = ql*iAl*iGl * Gl*Alp1*iqlp1
+		// We will only store I11 and I21
+		/*
+		{
+			std::complex<double> *Ml = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>)*n4*n4);
+			std::complex<double> *Mlp1 = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>)*n4*n4);
+
+			RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,0., &Ml[0+0*n4],n4);
+			RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[l],n2, &Ml[n2+0*n4],n4);
+			RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[l],n2, &Ml[n2+n2*n4],n4);
+			RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[l],n2, &Ml[0+n2*n4],n4);
+			for(size_t i = 0; i < n2; ++i){
+				RNP::TBLAS::Scale(n2, 1./q[l][i], &Ml[0+(i+n2)*n4], 1);
+			}
+			RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, 1.,kp[l],n2, &Ml[0+n2*n4],n4, 0.,&Ml[0+0*n4],n4);
+			RNP::TBLAS::CopyMatrix<'A'>(n2,n2, &Ml[0+0*n4],n4, &Ml[0+n2*n4],n4);
+			for(size_t i = 0; i < n2; ++i){
+				RNP::TBLAS::Scale(n2, -1., &Ml[0+(i+n2)*n4], 1);
+			}
+
+			RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,0., &Mlp1[0+0*n4],n4);
+			RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[lp1],n2, &Mlp1[n2+0*n4],n4);
+			RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[lp1],n2, &Mlp1[n2+n2*n4],n4);
+			RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[lp1],n2, &Mlp1[0+n2*n4],n4);
+			for(size_t i = 0; i < n2; ++i){
+				RNP::TBLAS::Scale(n2, 1./q[lp1][i], &Mlp1[0+(i+n2)*n4], 1);
+			}
+			RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, 1.,kp[lp1],n2, &Mlp1[0+n2*n4],n4, 0.,&Mlp1[0+0*n4],n4);
+			RNP::TBLAS::CopyMatrix<'A'>(n2,n2, &Mlp1[0+0*n4],n4, &Mlp1[0+n2*n4],n4);
+			for(size_t i = 0; i < n2; ++i){
+				RNP::TBLAS::Scale(n2, -1., &Mlp1[0+(i+n2)*n4], 1);
+			}
+
+			//RNP::LinearSolve<'N'>(n4, n4, Ml, n4, Mlp1, n4, NULL, pivots);
 #ifdef DUMP_MATRICES
-			DUMP_STREAM << "M(" << l << ") = " << std::endl;
+		DUMP_STREAM << "M(" << l << ") = " << std::endl;
 # ifdef DUMP_MATRICES_LARGE
-			RNP::IO::PrintMatrix(n4,n4,Ml,n4, DUMP_STREAM) << std::endl << std::endl;
+		RNP::IO::PrintMatrix(n4,n4,Ml,n4, DUMP_STREAM) << std::endl << std::endl;
 # else
-			RNP::IO::PrintVector(n4,Ml,1, DUMP_STREAM) << std::endl << std::endl;
+		RNP::IO::PrintVector(n4,Ml,1, DUMP_STREAM) << std::endl << std::endl;
 # endif
-			DUMP_STREAM << "M(" << lp1 << ") = " << std::endl;
+		DUMP_STREAM << "M(" << lp1 << ") = " << std::endl;
 # ifdef DUMP_MATRICES_LARGE
-			RNP::IO::PrintMatrix(n4,n4,Mlp1,n4, DUMP_STREAM) << std::endl << std::endl;
+		RNP::IO::PrintMatrix(n4,n4,Mlp1,n4, DUMP_STREAM) << std::endl << std::endl;
 # else
-			RNP::IO::PrintVector(n4,Mlp1,1, DUMP_STREAM) << std::endl << std::endl;
+		RNP::IO::PrintVector(n4,Mlp1,1, DUMP_STREAM) << std::endl << std::endl;
 # endif
 #endif
 
-				rcwa_free(Mlp1);
-				rcwa_free(Ml);
-			}
-			*/
-			// Make Bl in t1
-			RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,0., t1,n2);
-			{
-				if(NULL == phi[l]){
-					if(NULL == kp[l]){
-						MakeKPMatrix(omega, n, kx, ky, Epsilon_inv[l], epstype[l], kp[l], t1,n2);
-					}else{
-						RNP::TBLAS::CopyMatrix<'A'>(n2,n2, kp[l],n2, t1,n2);
-					}
+			rcwa_free(Mlp1);
+			rcwa_free(Ml);
+		}
+		*/
+		// Make Bl in t1
+		RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,0., t1,n2);
+		{
+			if(NULL == phi[l]){
+				if(NULL == kp[l]){
+					MakeKPMatrix(omega, n, kx, ky, Epsilon_inv[l], epstype[l], kp[l], t1,n2);
 				}else{
-					MultKPMatrix("N", omega, n, kx, ky, Epsilon_inv[l], epstype[l], kp[l], n2, phi[l],n2, t1,n2);
+					RNP::TBLAS::CopyMatrix<'A'>(n2,n2, kp[l],n2, t1,n2);
 				}
-				//for(size_t i = 0; i < n2; ++i){
-				//	RNP::TBLAS::Scale(n2, 1./q[l][i], &t1[0+i*n2], 1);
-				//}
+			}else{
+				MultKPMatrix("N", omega, n, kx, ky, Epsilon_inv[l], epstype[l], kp[l], n2, phi[l],n2, t1,n2);
 			}
+			//for(size_t i = 0; i < n2; ++i){
+			//	RNP::TBLAS::Scale(n2, 1./q[l][i], &t1[0+i*n2], 1);
+			//}
+		}
 #ifdef DUMP_MATRICES
-			DUMP_STREAM << "Bl(" << l << ") = " << std::endl;
+		DUMP_STREAM << "Bl(" << l << ") = " << std::endl;
 # ifdef DUMP_MATRICES_LARGE
-			RNP::IO::PrintMatrix(n2,n2,t1,n2, DUMP_STREAM) << std::endl << std::endl;
+		RNP::IO::PrintMatrix(n2,n2,t1,n2, DUMP_STREAM) << std::endl << std::endl;
 # else
-			RNP::IO::PrintVector(n2,t1,1, DUMP_STREAM) << std::endl << std::endl;
+		RNP::IO::PrintVector(n2,t1,1, DUMP_STREAM) << std::endl << std::endl;
 # endif
 #endif
-			// Make Blp1 in in1
-			RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,0., in1,n2);
-			{
-				if(NULL == phi[lp1]){
-					if(NULL == kp[lp1]){
-						MakeKPMatrix(omega, n, kx, ky, Epsilon_inv[lp1], epstype[lp1], kp[lp1], in1,n2);
-					}else{
-						RNP::TBLAS::CopyMatrix<'A'>(n2,n2, kp[lp1],n2, in1,n2);
-					}
+		// Make Blp1 in in1
+		RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,0., in1,n2);
+		{
+			if(NULL == phi[lp1]){
+				if(NULL == kp[lp1]){
+					MakeKPMatrix(omega, n, kx, ky, Epsilon_inv[lp1], epstype[lp1], kp[lp1], in1,n2);
 				}else{
-					MultKPMatrix("N", omega, n, kx, ky, Epsilon_inv[lp1], epstype[lp1], kp[lp1], n2, phi[lp1],n2, in1,n2);
+					RNP::TBLAS::CopyMatrix<'A'>(n2,n2, kp[lp1],n2, in1,n2);
 				}
-				//for(size_t i = 0; i < n2; ++i){
-				//	RNP::TBLAS::Scale(n2, 1./q[lp1][i], &in1[0+i*n2], 1);
-				//}
+			}else{
+				MultKPMatrix("N", omega, n, kx, ky, Epsilon_inv[lp1], epstype[lp1], kp[lp1], n2, phi[lp1],n2, in1,n2);
 			}
+			//for(size_t i = 0; i < n2; ++i){
+			//	RNP::TBLAS::Scale(n2, 1./q[lp1][i], &in1[0+i*n2], 1);
+			//}
+		}
 #ifdef DUMP_MATRICES
-		DUMP_STREAM << "Bl(" << l+1 << ") = " << std::endl;
+	DUMP_STREAM << "Bl(" << l+1 << ") = " << std::endl;
 # ifdef DUMP_MATRICES_LARGE
-		RNP::IO::PrintMatrix(n2,n2,in1,n2, DUMP_STREAM) << std::endl << std::endl;
+	RNP::IO::PrintMatrix(n2,n2,in1,n2, DUMP_STREAM) << std::endl << std::endl;
 # else
-		RNP::IO::PrintVector(n2,in1,1, DUMP_STREAM) << std::endl << std::endl;
+	RNP::IO::PrintVector(n2,in1,1, DUMP_STREAM) << std::endl << std::endl;
 # endif
 #endif
-			int solve_info;
-			// Make Q in in1
-			//RNP::LinearSolve<'N'>(n2, n2, t1, n2, in1, n2, &solve_info, pivots);
-			SingularLinearSolve(n2,n2,n2, t1,n2, in1,n2, DBL_EPSILON);
-			// Now perform the diagonal scalings
+		int solve_info;
+		// Make Q in in1
+		//RNP::LinearSolve<'N'>(n2, n2, t1, n2, in1, n2, &solve_info, pivots);
+		SingularLinearSolve(n2,n2,n2, t1,n2, in1,n2, DBL_EPSILON);
+		// Now perform the diagonal scalings
+		for(size_t i = 0; i < n2; ++i){
+			RNP::TBLAS::Scale(n2, q[l][i], &in1[i+0*n2], n2);
+		}
+		{
+			double maxel = 0;
 			for(size_t i = 0; i < n2; ++i){
-				RNP::TBLAS::Scale(n2, q[l][i], &in1[i+0*n2], n2);
+				double el = std::abs(q[lp1][i]);
+				if(el > maxel){ maxel = el; }
 			}
-			{
-				double maxel = 0;
-				for(size_t i = 0; i < n2; ++i){
-					double el = std::abs(q[lp1][i]);
-					if(el > maxel){ maxel = el; }
-				}
-				for(size_t i = 0; i < n2; ++i){
-					double el = std::abs(q[lp1][i]);
-					if(el < DBL_EPSILON * maxel){
-						RNP::TBLAS::Scale(n2, 0., &in1[0+i*n2], 1);
-					}else{
-						RNP::TBLAS::Scale(n2, 1./q[lp1][i], &in1[0+i*n2], 1);
-					}
+			for(size_t i = 0; i < n2; ++i){
+				double el = std::abs(q[lp1][i]);
+				if(el < DBL_EPSILON * maxel){
+					RNP::TBLAS::Scale(n2, 0., &in1[0+i*n2], 1);
+				}else{
+					RNP::TBLAS::Scale(n2, 1./q[lp1][i], &in1[0+i*n2], 1);
 				}
 			}
+		}
 
-			// Make P in in2
-			if(NULL == phi[lp1]){
-				RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,1., in2,n2);
-			}else{
-				RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[lp1],n2, in2,n2);
-			}
-			if(NULL != phi[l]){
-				RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[l],n2, t1,n2);
-				RNP::LinearSolve<'N'>(n2, n2, t1, n2, in2, n2, &solve_info, pivots);
-			}
-
-			RNP::TBLAS::CopyMatrix<'A'>(n2,n2, in2,n2, t1,n2); // in2 = P, t1 = P, in1 = Q
-			RNP::TBLAS::Axpy(n2*n2, -1., in1,1, in2,1); // in2 = P-Q, t1 = P, in1 = Q
-			RNP::TBLAS::Axpy(n2*n2, 1., t1,1, in1,1); // in2 = P+Q, t1 = P, in1 = P+Q
-			RNP::TBLAS::Scale(n2*n2, 0.5, in1,1);
-			RNP::TBLAS::Scale(n2*n2, 0.5, in2,1);
+		// Make P in in2
+		if(NULL == phi[lp1]){
+			RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,1., in2,n2);
+		}else{
+			RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[lp1],n2, in2,n2);
+		}
+		if(NULL != phi[l]){
+			RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi[l],n2, t1,n2);
+			RNP::LinearSolve<'N'>(n2, n2, t1, n2, in2, n2, &solve_info, pivots);
 		}
+
+		RNP::TBLAS::CopyMatrix<'A'>(n2,n2, in2,n2, t1,n2); // in2 = P, t1 = P, in1 = Q
+		RNP::TBLAS::Axpy(n2*n2, -1., in1,1, in2,1); // in2 = P-Q, t1 = P, in1 = Q
+		RNP::TBLAS::Axpy(n2*n2, 1., t1,1, in1,1); // in2 = P+Q, t1 = P, in1 = P+Q
+		RNP::TBLAS::Scale(n2*n2, 0.5, in1,1);
+		RNP::TBLAS::Scale(n2*n2, 0.5, in2,1);
+	}
 #ifdef DUMP_MATRICES
-		DUMP_STREAM << "Interface1(" << l+1 << ") = " << std::endl;
+	DUMP_STREAM << "Interface1(" << l+1 << ") = " << std::endl;
 # ifdef DUMP_MATRICES_LARGE
-		RNP::IO::PrintMatrix(n2,n2,in1,n2, DUMP_STREAM) << std::endl << std::endl;
+	RNP::IO::PrintMatrix(n2,n2,in1,n2, DUMP_STREAM) << std::endl << std::endl;
 # else
-		RNP::IO::PrintVector(n2,in1,1, DUMP_STREAM) << std::endl << std::endl;
+	RNP::IO::PrintVector(n2,in1,1, DUMP_STREAM) << std::endl << std::endl;
 # endif
-		DUMP_STREAM << "Interface2(" << l+1 << ") = " << std::endl;
+	DUMP_STREAM << "Interface2(" << l+1 << ") = " << std::endl;
 # ifdef DUMP_MATRICES_LARGE
-		RNP::IO::PrintMatrix(n2,n2,in2,n2, DUMP_STREAM) << std::endl << std::endl;
+	RNP::IO::PrintMatrix(n2,n2,in2,n2, DUMP_STREAM) << std::endl << std::endl;
 # else
-		RNP::IO::PrintVector(n2,in2,1, DUMP_STREAM) << std::endl << std::endl;
+	RNP::IO::PrintVector(n2,in2,1, DUMP_STREAM) << std::endl << std::endl;
+# endif
+#endif
+
+	for(size_t i = 0; i < n2; ++i){
+		d1[i] = std::exp(q[l  ][i] * std::complex<double>(0,thickness[l  ]));
+		d2[i] = std::exp(q[lp1][i] * std::complex<double>(0,thickness[lp1]));
+	}
+
+	if(NULL != logdet){
+		for(size_t i = 0; i < n2; ++i){
+			*logdet += q[l][i] * std::complex<double>(0,thickness[l]);
+		}
+	}
+
+	GetSMatrixUpdate(n2, in1, in2, d1, d2, S, n4, t1, t2, pivots, logdet);
+
+#ifdef DUMP_MATRICES
+	DUMP_STREAM << "S(1," << l+2 << ") = " << std::endl;
+# ifdef DUMP_MATRICES_LARGE
+	RNP::IO::PrintMatrix(n4,n4,S,n4, DUMP_STREAM) << std::endl << std::endl;
+# else
+	RNP::IO::PrintVector(n4,S,1, DUMP_STREAM) << std::endl << std::endl;
 # endif
 #endif
+}
+
+// Returns nonzero if the hx and hy modes of all layers of a stack
+// decouple, with the modes of each polarization in their own diagonal
+// block of phi and kp (see SolveLamellarLayerEigensystem).
+static int LayersArePlanar(
+	size_t nlayers, size_t n, const double *ky,
+	const std::complex<double> **kp,
+	const std::complex<double> **phi
+){
+	const size_t n2 = 2*n;
+	for(size_t i = 0; i < n; ++i){
+		if(0 != ky[i]){ return 0; }
+	}
+	for(size_t l = 0; l < nlayers; ++l){
+		const std::complex<double> *a[2] = { kp[l], phi[l] };
+		for(size_t k = 0; k < 2; ++k){
+			if(NULL == a[k]){ continue; }
+			for(size_t j = 0; j < n; ++j){
+				for(size_t i = 0; i < n; ++i){
+					if(0. != a[k][(n+i)+j*n2] || 0. != a[k][i+(n+j)*n2]){ return 0; }
+				}
+			}
+		}
+	}
+	return 1;
+}
+
+// Same as GetSMatrixStep, for polarization pol of a planar stack (see
+// LayersArePlanar). S is the 2n x 2n S-matrix of that polarization, the
+// work array must be of length 4*n*n+2*n, and pivots of length n.
+static void GetSMatrixStepPlanar(
+	size_t l, size_t lp1,
+	size_t n, size_t pol,
+	const double *kx,
+	std::complex<double> omega,
+	const double *thickness,
+	const std::complex<double> **q,
+	const std::complex<double> **Epsilon_inv,
+	int *epstype,
+	const std::complex<double> **kp,
+	const std::complex<double> **phi,
+	std::complex<double> *S,
+	std::complex<double> *work,
+	size_t *pivots,
+	std::complex<double> *logdet
+){
+	const size_t n2 = 2*n;
+	const size_t off = pol*n;
+
+	std::complex<double> *t1 = work;
+	std::complex<double> *t2 = t1 + n*n;
+	std::complex<double> *in1 = t2 + n*n;
+	std::complex<double> *in2 = in1 + n*n;
+	std::complex<double> *d1 = in2 + n*n;
+	std::complex<double> *d2 = d1 + n;
+
+	if((lp1 == l) || (q[l] == q[lp1] && ((NULL != kp[l] && kp[l] == kp[lp1]) || Epsilon_inv[l] == Epsilon_inv[lp1]) && phi[l] == phi[lp1])){
+		RNP::TBLAS::SetMatrix<'A'>(n,n, 0.,1., in1, n);
+		RNP::TBLAS::SetMatrix<'A'>(n,n, 0.,0., in2, n);
+	}else{
+		// The same construction as in GetSMatrixStep, on the diagonal
+		// blocks of kp and phi. Make Bl in t1 and Blp1 in in1.
+		const size_t ll[2] = { l, lp1 };
+		std::complex<double> *B[2] = { t1, in1 };
+		for(size_t k = 0; k < 2; ++k){
+			const size_t m = ll[k];
+			if(NULL == phi[m]){
+				MakePlanarKPMatrix(omega, n, pol, kx, Epsilon_inv[m], epstype[m], kp[m], B[k],n);
+			}else{
+				MakePlanarKPMatrix(omega, n, pol, kx, Epsilon_inv[m], epstype[m], kp[m], t2,n);
+				RNP::TBLAS::MultMM<'N','N'>(n,n,n, 1.,t2,n, &phi[m][off+off*n2],n2, 0.,B[k],n);
+			}
+		}
+		int solve_info;
+		// Make Q in in1
+		SingularLinearSolve(n,n,n, t1,n, in1,n, DBL_EPSILON);
+		for(size_t i = 0; i < n; ++i){
+			RNP::TBLAS::Scale(n, q[l][off+i], &in1[i+0*n], n);
+		}
+		{
+			double maxel = 0;
+			for(size_t i = 0; i < n2; ++i){
+				double el = std::abs(q[lp1][i]);
+				if(el > maxel){ maxel = el; }
+			}
+			for(size_t i = 0; i < n; ++i){
+				double el = std::abs(q[lp1][off+i]);
+				if(el < DBL_EPSILON * maxel){
+					RNP::TBLAS::Scale(n, 0., &in1[0+i*n], 1);
+				}else{
+					RNP::TBLAS::Scale(n, 1./q[lp1][off+i], &in1[0+i*n], 1);
+				}
+			}
+		}
+
+		// Make P in in2
+		if(NULL == phi[lp1]){
+			RNP::TBLAS::SetMatrix<'A'>(n,n, 0.,1., in2,n);
+		}else{
+			RNP::TBLAS::CopyMatrix<'A'>(n,n, &phi[lp1][off+off*n2],n2, in2,n);
+		}
+		if(NULL != phi[l]){
+			RNP::TBLAS::CopyMatrix<'A'>(n,n, &phi[l][off+off*n2],n2, t1,n);
+			RNP::LinearSolve<'N'>(n, n, t1, n, in2, n, &solve_info, pivots);
+		}
+
+		RNP::TBLAS::CopyMatrix<'A'>(n,n, in2,n, t1,n);
+		RNP::TBLAS::Axpy(n*n, -1., in1,1, in2,1);
+		RNP::TBLAS::Axpy(n*n, 1., t1,1, in1,1);
+		RNP::TBLAS::Scale(n*n, 0.5, in1,1);
+		RNP::TBLAS::Scale(n*n, 0.5, in2,1);
+	}
+
+	for(size_t i = 0; i < n; ++i){
+		d1[i] = std::exp(q[l  ][off+i] * std::complex<double>(0,thickness[l  ]));
+		d2[i] = std::exp(q[lp1][off+i] * std::complex<double>(0,thickness[lp1]));
+	}
+
+	if(NULL != logdet){
+		for(size_t i = 0; i < n; ++i){
+			*logdet += q[l][off+i] * std::complex<double>(0,thickness[l]);
+		}
+	}
+
+	GetSMatrixUpdate(n, in1, in2, d1, d2, S, n2, t1, t2, pivots, logdet);
+}
+
+// Tolerance, relative to the largest entry, to which the modes of the
+// layers of a stack must lie in the symmetry sectors for the S-matrix
+// to be composed per sector.
+#define SMATRIX_SYMMETRY_TOL 1e-10
+
+// Returns nonzero if the modes of every layer of a stack lie in the
+// symmetry sectors of the operation given by sigma and hsign. Each
+// column of phi must be even or odd; uniform layers (phi = NULL) take
+// the sector basis vectors as their modes, which needs q to be the same
+// for symmetry related G vectors.
+static int LayersRespectSymmetry(
+	size_t nlayers, size_t n,
+	const size_t *sigma, double hsign,
+	const std::complex<double> **q,
+	const std::complex<double> **phi
+){
+	const size_t n2 = 2*n;
+	for(size_t l = 0; l < nlayers; ++l){
+		if(NULL == phi[l]){
+			for(size_t k = 0; k < n2; ++k){
+				size_t pk; double sk;
+				LayerSymmetryImage(n, sigma, hsign, k, &pk, &sk);
+				if(std::abs(q[l][pk] - q[l][k]) > SMATRIX_SYMMETRY_TOL*std::abs(q[l][k])){ return 0; }
+			}
+		}else{
+			for(size_t j = 0; j < n2; ++j){
+				if(0 == LayerVectorCharacter(n, &phi[l][0+j*n2], sigma, hsign, SMATRIX_SYMMETRY_TOL)){ return 0; }
+			}
+		}
+	}
+	return 1;
+}
+
+// Reduces the modes of layer l to the symmetry sectors of the basis
+// (bidx, bcoef, boff) of the ng group elements g (see GetSMatrixSymmetric).
+// The modes are sorted into the sectors, with mode giving the column of
+// phi of each and qs its q. The m x m blocks A = U^T phi and B = U^T kp phi
+// of the sectors, where U holds the basis vectors of the sector, are
+// stored one after the other. K and KX are 2n x 2n temporaries. Returns
+// nonzero if the modes or kp phi do not lie in the sectors.
+static int GetSMatrixSectorLayer(
+	size_t l, size_t n,
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> **q,
+	const std::complex<double> **Epsilon_inv,
+	int *epstype,
+	const std::complex<double> **kp,
+	const std::complex<double> **phi,
+	size_t ng, size_t *const *g, const double *hsign,
+	const size_t *bidx, const double *bcoef, const size_t *boff,
+	size_t *mode, std::complex<double> *qs,
+	std::complex<double> *A, std::complex<double> *B,
+	std::complex<double> *K, std::complex<double> *KX
+){
+	const size_t n2 = 2*n;
+	// Make kp times the modes in KX, ordered by sector
+	if(NULL == phi[l]){
+		MakeKPMatrix(omega, n, kx, ky, Epsilon_inv[l], epstype[l], kp[l], K,n2);
+		for(size_t j = 0; j < n2; ++j){
+			const size_t *idx = &bidx[4*j];
+			const double *coef = &bcoef[4*j];
+			qs[j] = q[l][idx[0]];
+			RNP::TBLAS::Fill(n2, 0., &KX[0+j*n2],1);
+			for(size_t e = 0; e < 4; ++e){
+				if(0 == coef[e]){ continue; }
+				if(std::abs(q[l][idx[e]] - qs[j]) > SMATRIX_SYMMETRY_TOL*std::abs(qs[j])){ return 1; }
+				RNP::TBLAS::Axpy(n2, coef[e], &K[0+idx[e]*n2],1, &KX[0+j*n2],1);
+			}
+		}
+	}else{
+		MultKPMatrix("N", omega, n, kx, ky, Epsilon_inv[l], epstype[l], kp[l], n2, phi[l],n2, K,n2);
+		size_t count[4] = { 0, 0, 0, 0 };
+		for(size_t j = 0; j < n2; ++j){
+			// The sector index has a bit set for each generator under
+			// which the mode is odd.
+			size_t c = 0;
+			for(size_t e = 1; e < ng; e <<= 1){
+				const int chi = LayerVectorCharacter(n, &phi[l][0+j*n2], g[e], hsign[e], SMATRIX_SYMMETRY_TOL);
+				if(0 == chi){ return 1; }
+				if(chi < 0){ c |= e; }
+			}
+			const size_t jj = boff[c] + count[c];
+			if(jj >= boff[c+1]){ return 1; }
+			++count[c];
+			mode[jj] = j;
+			qs[jj] = q[l][j];
+			RNP::TBLAS::Copy(n2, &K[0+j*n2],1, &KX[0+jj*n2],1);
+		}
+	}
+
+	size_t aoff = 0;
+	for(size_t c = 0; c < ng; ++c){
+		const size_t off = boff[c];
+		const size_t m = boff[c+1] - off;
+		for(size_t j = 0; j < m; ++j){
+			const std::complex<double> *v = &KX[0+(off+j)*n2];
+			for(size_t e = 1; e < ng; e <<= 1){
+				if(!LayerVectorIsInvariant(n, v, g[e], hsign[e], (c & e) ? -1. : 1., SMATRIX_SYMMETRY_TOL)){ return 1; }
+			}
+			for(size_t i = 0; i < m; ++i){
+				const size_t *idx = &bidx[4*(off+i)];
+				const double *coef = &bcoef[4*(off+i)];
+				std::complex<double> a = 0, b = 0;
+				for(size_t e = 0; e < 4; ++e){
+					if(NULL != phi[l]){
+						a += coef[e] * phi[l][idx[e]+mode[off+j]*n2];
+					}
+					b += coef[e] * v[idx[e]];
+				}
+				if(NULL == phi[l]){
+					a = (i == j ? 1. : 0.);
+				}
+				A[aoff+i+j*m] = a;
+				B[aoff+i+j*m] = b;
+			}
+		}
+		aoff += m*m;
+	}
+	return 0;
+}
+
+// Same as GetSMatrixStep, for one symmetry sector of size m, given the
+// blocks A and B and the q of the sector for layers l and lp1 (see
+// GetSMatrixSectorLayer), and the largest |q| of all modes of layer lp1.
+// S is the 2m x 2m S-matrix of the sector, the work array must be of
+// length 4*m*m+2*m, and pivots of length m.
+static void GetSMatrixStepSector(
+	size_t m, int trivial,
+	double thickness_l, double thickness_lp1,
+	const std::complex<double> *Al, const std::complex<double> *Bl, const std::complex<double> *ql,
+	const std::complex<double> *Alp1, const std::complex<double> *Blp1, const std::complex<double> *qlp1,
+	double qmax,
+	std::complex<double> *S,
+	std::complex<double> *work,
+	size_t *pivots,
+	std::complex<double> *logdet
+){
+	std::complex<double> *t1 = work;
+	std::complex<double> *t2 = t1 + m*m;
+	std::complex<double> *in1 = t2 + m*m;
+	std::complex<double> *in2 = in1 + m*m;
+	std::complex<double> *d1 = in2 + m*m;
+	std::complex<double> *d2 = d1 + m;
+
+	if(trivial){
+		RNP::TBLAS::SetMatrix<'A'>(m,m, 0.,1., in1, m);
+		RNP::TBLAS::SetMatrix<'A'>(m,m, 0.,0., in2, m);
+	}else{
+		// The same construction as in GetSMatrixStep, on the blocks of
+		// the sector. Make Q in in1.
+		int solve_info;
+		RNP::TBLAS::CopyMatrix<'A'>(m,m, Bl,m, t1,m);
+		RNP::TBLAS::CopyMatrix<'A'>(m,m, Blp1,m, in1,m);
+		SingularLinearSolve(m,m,m, t1,m, in1,m, DBL_EPSILON);
+		for(size_t i = 0; i < m; ++i){
+			RNP::TBLAS::Scale(m, ql[i], &in1[i+0*m], m);
+		}
+		for(size_t i = 0; i < m; ++i){
+			if(std::abs(qlp1[i]) < DBL_EPSILON * qmax){
+				RNP::TBLAS::Scale(m, 0., &in1[0+i*m], 1);
+			}else{
+				RNP::TBLAS::Scale(m, 1./qlp1[i], &in1[0+i*m], 1);
+			}
+		}
+
+		// Make P in in2
+		RNP::TBLAS::CopyMatrix<'A'>(m,m, Alp1,m, in2,m);
+		RNP::TBLAS::CopyMatrix<'A'>(m,m, Al,m, t1,m);
+		RNP::LinearSolve<'N'>(m, m, t1, m, in2, m, &solve_info, pivots);
+
+		RNP::TBLAS::CopyMatrix<'A'>(m,m, in2,m, t1,m);
+		RNP::TBLAS::Axpy(m*m, -1., in1,1, in2,1);
+		RNP::TBLAS::Axpy(m*m, 1., t1,1, in1,1);
+		RNP::TBLAS::Scale(m*m, 0.5, in1,1);
+		RNP::TBLAS::Scale(m*m, 0.5, in2,1);
+	}
+
+	for(size_t i = 0; i < m; ++i){
+		d1[i] = std::exp(ql  [i] * std::complex<double>(0,thickness_l  ));
+		d2[i] = std::exp(qlp1[i] * std::complex<double>(0,thickness_lp1));
+	}
+
+	if(NULL != logdet){
+		for(size_t i = 0; i < m; ++i){
+			*logdet += ql[i] * std::complex<double>(0,thickness_l);
+		}
+	}
+
+	GetSMatrixUpdate(m, in1, in2, d1, d2, S, 2*m, t1, t2, pivots, logdet);
+}
 
+// Composes the S-matrix of a stack whose layers share the symmetries
+// given by the LAYER_SYMMETRY_* flags. The group is chosen as in
+// SolveLayerEigensystemSymmetric, from the mirrors that the k vectors
+// and the modes of all layers respect, or else the two-fold rotation.
+// The interface matrices are then block diagonal in the modes sorted by
+// sector, and the S-matrix of each sector is composed separately and
+// scattered into S. Returns nonzero if the stack does not decompose or
+// workspace could not be allocated; S is then left unchanged, but logdet
+// may have been partially accumulated.
+static int GetSMatrixSymmetric(
+	size_t nlayers,
+	size_t n,
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const double *thickness,
+	const std::complex<double> **q,
+	const std::complex<double> **Epsilon_inv,
+	int *epstype,
+	const std::complex<double> **kp,
+	const std::complex<double> **phi,
+	int symmetries,
+	std::complex<double> *S,
+	std::complex<double> *logdet
+){
+	const size_t n2 = 2*n;
+	const size_t n4 = 2*n2;
+
+	// The symmetry permutations, the basis, and the sorted modes of the
+	// first layer and of the two sides of an interface.
+	const size_t liwork = 3*n + 4*n2 + 3*n2 + n2;
+	size_t *iwork = (size_t*)rcwa_malloc(sizeof(size_t)*liwork + sizeof(double)*4*n2);
+	if(NULL == iwork){ return 1; }
+	size_t *sigma = iwork;
+	size_t *bidx = sigma + 3*n;
+	size_t *mode0 = bidx + 4*n2;
+	size_t *mode[2] = { mode0 + n2, mode0 + 2*n2 };
+	size_t *pivots = mode0 + 3*n2;
+	double *bcoef = (double*)(iwork + liwork);
+
+	size_t *cand[3] = { NULL, NULL, NULL };
+	for(int d = 0; d < 3; ++d){
+		if(!(symmetries & (1 << d))){ continue; }
+		if(0 == LayerMirrorPermutation(n, kx, ky, 1 != d, 0 != d, sigma + d*n) &&
+			LayersRespectSymmetry(nlayers, n, sigma + d*n, 2 == d ? 1. : -1., q, phi)
+		){
+			cand[d] = sigma + d*n;
+		}
+	}
+	size_t *g[4] = { NULL, NULL, NULL, NULL };
+	double hsign[4] = { 1, 1, 1, 1 };
+	size_t ng = 1;
+	for(int d = 0; d < 2; ++d){
+		if(NULL != cand[d]){
+			g[ng] = cand[d];
+			hsign[ng] = -1;
+			++ng;
+		}
+	}
+	if(3 == ng){
+		for(size_t i = 0; i < n; ++i){
+			sigma[2*n+i] = g[1][g[2][i]];
+		}
+		g[3] = sigma + 2*n;
+		hsign[3] = 1;
+		ng = 4;
+	}else if(1 == ng && NULL != cand[2]){
+		g[1] = cand[2];
+		ng = 2;
+	}
+	size_t boff[5];
+	if(1 == ng || n2 != LayerSymmetryBasis(n, ng, g, hsign, bidx, bcoef, boff)){
+		rcwa_free(iwork);
+		return 1;
+	}
+
+	size_t msq = 0, mmax = 0;
+	for(size_t c = 0; c < ng; ++c){
+		const size_t m = boff[c+1] - boff[c];
+		msq += m*m;
+		mmax = std::max(mmax, m);
+	}
+	// K and KX, the q and blocks of both sides of an interface, the
+	// S-matrices of the sectors, and the workspace of a step.
+	const size_t lwork = 2*n2*n2 + 2*(n2 + 2*msq) + 4*msq + 4*mmax*mmax + 2*mmax;
+	std::complex<double> *work = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>)*lwork);
+	if(NULL == work){
+		rcwa_free(iwork);
+		return 1;
+	}
+	std::complex<double> *K = work;
+	std::complex<double> *KX = K + n2*n2;
+	std::complex<double> *qs[2], *A[2], *B[2];
+	qs[0] = KX + n2*n2;
+	A[0] = qs[0] + n2;
+	B[0] = A[0] + msq;
+	qs[1] = B[0] + msq;
+	A[1] = qs[1] + n2;
+	B[1] = A[1] + msq;
+	std::complex<double> *Ss = B[1] + msq;
+	std::complex<double> *swork = Ss + 4*msq;
+
+	int info = GetSMatrixSectorLayer(0, n, kx, ky, omega, q, Epsilon_inv, epstype, kp, phi,
+		ng, g, hsign, bidx, bcoef, boff, mode[0], qs[0], A[0], B[0], K, KX);
+	if(0 == info){
+		std::copy(mode[0], mode[0]+n2, mode0);
+		size_t soff = 0;
+		for(size_t c = 0; c < ng; ++c){
+			const size_t m = boff[c+1] - boff[c];
+			RNP::TBLAS::SetMatrix<'A'>(2*m,2*m, 0.,1., &Ss[soff], 2*m);
+			soff += 4*m*m;
+		}
+	}
+	for(size_t l = 0; l+1 < nlayers && 0 == info; ++l){
+		const size_t lp1 = l+1;
+		const size_t cur = l%2, nxt = lp1%2;
+		info = GetSMatrixSectorLayer(lp1, n, kx, ky, omega, q, Epsilon_inv, epstype, kp, phi,
+			ng, g, hsign, bidx, bcoef, boff, mode[nxt], qs[nxt], A[nxt], B[nxt], K, KX);
+		if(0 != info){ break; }
+		const int trivial = (q[l] == q[lp1] && ((NULL != kp[l] && kp[l] == kp[lp1]) || Epsilon_inv[l] == Epsilon_inv[lp1]) && phi[l] == phi[lp1]);
+		double qmax = 0;
 		for(size_t i = 0; i < n2; ++i){
-			d1[i] = std::exp(q[l  ][i] * std::complex<double>(0,thickness[l  ]));
-			d2[i] = std::exp(q[lp1][i] * std::complex<double>(0,thickness[lp1]));
+			qmax = std::max(qmax, std::abs(qs[nxt][i]));
+		}
+		size_t aoff = 0, soff = 0;
+		for(size_t c = 0; c < ng; ++c){
+			const size_t off = boff[c];
+			const size_t m = boff[c+1] - off;
+			if(0 == m){ continue; }
+			GetSMatrixStepSector(m, trivial, thickness[l], thickness[lp1],
+				&A[cur][aoff], &B[cur][aoff], &qs[cur][off],
+				&A[nxt][aoff], &B[nxt][aoff], &qs[nxt][off],
+				qmax, &Ss[soff], swork, pivots, logdet);
+			aoff += m*m;
+			soff += 4*m*m;
 		}
+	}
 
-		// Make S11
-		RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, -1.,&S[0+n2*n4],n4, in2,n2, 0.,t1,n2); // t1 = -S12 I21
-		for(size_t i = 0; i < n2; ++i){ // t1 = -f_l S12 I21
-			RNP::TBLAS::Scale(n2, d1[i], &t1[i+0*n2], n2);
+	if(0 == info){
+		// The rows of S11 and S12 and the columns of S12 and S22 are the
+		// modes of the last layer, the others those of the first. A sector
+		// mode is a column of phi, or a basis vector for uniform layers.
+		const size_t lN = nlayers-1;
+		const size_t *modeN = mode[lN%2];
+		RNP::TBLAS::SetMatrix<'A'>(n4,n4, 0.,0., S, n4);
+		size_t soff = 0;
+		for(size_t c = 0; c < ng; ++c){
+			const size_t off = boff[c];
+			const size_t m = boff[c+1] - off;
+			for(size_t j = 0; j < 2*m; ++j){
+				const size_t cl = (j < m ? 0 : lN);
+				const size_t cj = off + j%m;
+				size_t cidx[4]; double ccoef[4] = { 1, 0, 0, 0 };
+				for(size_t f = 0; f < 4; ++f){
+					if(NULL == phi[cl]){
+						cidx[f] = bidx[4*cj+f];
+						ccoef[f] = bcoef[4*cj+f];
+					}else{
+						cidx[f] = (0 == cl ? mode0 : modeN)[cj];
+					}
+					cidx[f] += (j < m ? 0 : n2);
+				}
+				for(size_t i = 0; i < 2*m; ++i){
+					const size_t rl = (i < m ? lN : 0);
+					const size_t ri = off + i%m;
+					const std::complex<double> s = Ss[soff+i+j*2*m];
+					for(size_t e = 0; e < 4; ++e){
+						size_t r; double rcoef;
+						if(NULL == phi[rl]){
+							r = bidx[4*ri+e];
+							rcoef = bcoef[4*ri+e];
+						}else{
+							if(e > 0){ break; }
+							r = (0 == rl ? mode0 : modeN)[ri];
+							rcoef = 1;
+						}
+						if(0 == rcoef){ continue; }
+						r += (i < m ? 0 : n2);
+						for(size_t f = 0; f < 4; ++f){
+							if(0 == ccoef[f]){ continue; }
+							S[r+cidx[f]*n4] += rcoef*ccoef[f]*s;
+						}
+					}
+				}
+			}
+			soff += 4*m*m;
 		}
-		RNP::TBLAS::Axpy(n2*n2, 1., in1,1, t1,1); // t1 = (I11 - f_l S12 I21)
+	}
+
+	rcwa_free(work);
+	rcwa_free(iwork);
+	return info;
+}
+
+void GetSMatrix(
+	size_t nlayers,
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const double *thickness, // list of thicknesses
+	const std::complex<double> **q, // list of q vectors
+	const std::complex<double> **Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	int *epstype,
+	const std::complex<double> **kp,
+	const std::complex<double> **phi,
+	std::complex<double> *S, // size (4*n)^2
+	std::complex<double> *work_,
+	size_t *iwork,
+	size_t lwork,
+	std::complex<double> *logdet,
+	int symmetries
+){
+	if(NULL != logdet){ *logdet = 0; }
+	if(0 == nlayers){ return; }
+	const size_t n2 = 2*n;
+	const size_t n4 = 2*n2;
 
-		RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,1., t2,n2);
-		int solve_info;
-		RNP::LinearSolve<'N'>(n2, n2, t1, n2, t2, n2, &solve_info, pivots); // t2 = (I11 - f_l S12 I21)^{-1}
+	if((size_t)-1 == lwork){
+		work_[0] = n4*(n4+1);
+		return;
+	}
+	std::complex<double> *work = work_;
+	if(NULL == work_ || lwork < n4*(n4+1)){
+		work = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>)*(n4*(n4+1)));
+	}
+	size_t *pivots = iwork;
+	if(NULL == iwork){
+		pivots = (size_t*)rcwa_malloc(sizeof(size_t)*n4);
+	}
 
-		RNP::TBLAS::CopyMatrix<'A'>(n2,n2, &S[0+0*n4],n4, t1,n2);
-		for(size_t i = 0; i < n2; ++i){ // t1 = f_l S11
-			RNP::TBLAS::Scale(n2, d1[i], &t1[i+0*n2], n2);
-		}
-		RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, 1.,t2,n2, t1,n2, 0.,&S[0+0*n4],n4);
-		// S11 is done, and we need to hold on to t2 = (I11 - f_l S12 I21)^{-1}
+	RNP::TBLAS::SetMatrix<'A'>(n4,n4, 0.,1., S, n4);
 
-		RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, 1.,&S[0+n2*n4],n4, in1,n2, 0.,t1,n2); // t1 = S12 I22
-		for(size_t i = 0; i < n2; ++i){ // t1 = f_l S12 I22
-			RNP::TBLAS::Scale(n2, d1[i], &t1[i+0*n2], n2);
-		}
-		RNP::TBLAS::Axpy(n2*n2, -1., in2,1, t1,1); // t1 = f_l S12 I22 - I12
-		for(size_t i = 0; i < n2; ++i){ // t1 = (f_l S12 I22 - I12) f_{l+1}
-			RNP::TBLAS::Scale(n2, d2[i], &t1[0+i*n2], 1);
+	if(LayersArePlanar(nlayers, n, ky, kp, phi)){
+		// The S-matrix of each polarization is formed separately, then
+		// scattered into the blocks of S that it occupies. The blocks
+		// coupling the two polarizations stay zero.
+		std::complex<double> *Sp = work + 4*n*n+2*n;
+		for(size_t pol = 0; pol < 2; ++pol){
+			RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,1., Sp, n2);
+			for(size_t l = 0; l+1 < nlayers; ++l){
+				GetSMatrixStepPlanar(l, l+1, n, pol, kx, omega,
+					thickness, q, Epsilon_inv, epstype, kp, phi,
+					Sp, work, pivots, logdet);
+			}
+			for(size_t j = 0; j < n2; ++j){
+				const size_t jj = (j < n ? pol*n+j : n2+pol*n+(j-n));
+				for(size_t i = 0; i < n2; ++i){
+					const size_t ii = (i < n ? pol*n+i : n2+pol*n+(i-n));
+					S[ii+jj*n4] = Sp[i+j*n2];
+				}
+			}
 		}
-		RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, 1.,t2,n2, t1,n2, 0.,&S[0+n2*n4],n4);
-		// S12 done, and t2 can be reused
-
-		RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, 1.,&S[n2+n2*n4],n4, in2,n2, 0.,t1,n2); // t1 = S22 I21
-		RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, 1.,t1,n2, &S[0+0*n4],n4, 1.,&S[n2+0*n4],n4);
-		// S21 done, need to keep t1 = S22 I21
-
-		RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, 1.,&S[n2+n2*n4],n4, in1,n2, 0.,t2,n2); // t2 = S22 I22
-		for(size_t i = 0; i < n2; ++i){ // t2 = S22 I22 f_{l+1}
-			RNP::TBLAS::Scale(n2, d2[i], &t2[0+i*n2], 1);
+	}else if(0 == symmetries || nlayers < 2 || 0 != GetSMatrixSymmetric(nlayers, n, kx, ky, omega,
+		thickness, q, Epsilon_inv, epstype, kp, phi, symmetries, S, logdet)
+	){
+		// The full basis is used unless every layer decomposes into the
+		// symmetry sectors.
+		if(NULL != logdet){ *logdet = 0; }
+		for(size_t l = 0; l < nlayers-1; ++l){
+			size_t lp1 = l+1;
+			if(lp1 >= nlayers){ lp1 = l; }
+			GetSMatrixStep(l, lp1, n, kx, ky, omega,
+				thickness, q, Epsilon_inv, epstype, kp, phi,
+				S, work, pivots, logdet);
 		}
-		RNP::TBLAS::CopyMatrix<'A'>(n2,n2, t2,n2, &S[n2+n2*n4],n4);
-		RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, 1.,t1,n2, &S[0+n2*n4],n4, 1.,&S[n2+n2*n4],n4);
-
-#ifdef DUMP_MATRICES
-		DUMP_STREAM << "S(1," << l+2 << ") = " << std::endl;
-# ifdef DUMP_MATRICES_LARGE
-		RNP::IO::PrintMatrix(n4,n4,S,n4, DUMP_STREAM) << std::endl << std::endl;
-# else
-		RNP::IO::PrintVector(n4,S,1, DUMP_STREAM) << std::endl << std::endl;
-# endif
-#endif
 	}
 	if(NULL == work_ || lwork < n4*(n4+1)){
 		rcwa_free(work);
@@ -1406,6 +2859,136 @@ printf("Could not allocate %d\n", (int)minwork); fflush(stdout);
 	return 0;
 }
 
+int SolveAllStreaming(
+	size_t nlayers,
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const double *thickness, // list of thicknesses
+	const std::complex<double> **q, // list of q vectors
+	const std::complex<double> **Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	int *epstype,
+	const std::complex<double> **kp,
+	const std::complex<double> **phi,
+	std::complex<double> *ab, // length 4*n*nlayers
+	std::complex<double> *store_, // length (n2^2+n2)*nlayers
+	std::complex<double> *work_, // length lwork
+	size_t *iwork, // length n4
+	size_t lwork // set to -1 for query into work[0], at least 2*n4^2 + n4*(n4+1)
+){
+	if(0 == nlayers){ return -1; }
+
+	const size_t n2 = 2*n;
+	const size_t n4 = 2*n2;
+	const size_t n22 = n2*n2;
+	const size_t lstore = n22+n2; // per layer
+	const size_t lwork_GetSMatrix = n4*(n4+1);
+	const size_t lwork_needed = 2*n4*n4 + lwork_GetSMatrix;
+
+	if((size_t)-1 == lwork){
+		work_[0] = lwork_needed;
+		return 0;
+	}
+	std::complex<double> *work = work_;
+	if(NULL == work_ || lwork < lwork_needed){
+		work = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>)*lwork_needed);
+	}
+	std::complex<double> *store = store_;
+	if(NULL == store_){
+		store = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>)*lstore*nlayers);
+	}
+	size_t *pivots = iwork;
+	if(NULL == iwork){
+		pivots = (size_t*)rcwa_malloc(sizeof(size_t)*n4);
+	}
+	if(NULL == work || NULL == store || NULL == pivots){
+		if(NULL != work && work != work_){ rcwa_free(work); }
+		if(NULL != store && store != store_){ rcwa_free(store); }
+		if(NULL != pivots && pivots != iwork){ rcwa_free(pivots); }
+		return 1;
+	}
+
+	std::complex<double> *S0l = work;
+	std::complex<double> *Sll = S0l + n4*n4;
+	std::complex<double> *work_GetSMatrix = Sll + n4*n4;
+	std::complex<double> *temp = work_GetSMatrix;
+	const std::complex<double> *a0 = &ab[0];
+
+	// Forward pass: accumulate S(0,l) one layer at a time, and keep only
+	// S12(0,l) and S11(0,l)*a0, since then a_l = S12(0,l) b_l + S11(0,l) a0.
+	RNP::TBLAS::SetMatrix<'A'>(n4,n4, 0.,1., S0l, n4);
+	for(size_t l = 0; l < nlayers; ++l){
+		std::complex<double> *S12 = &store[l*lstore];
+		std::complex<double> *v = S12 + n22;
+		RNP::TBLAS::CopyMatrix<'A'>(n2,n2, &S0l[0+n2*n4],n4, S12,n2);
+		RNP::TBLAS::MultMV<'N'>(n2, n2, std::complex<double>(1.0), &S0l[0+0*n4], n4,
+			a0, 1,
+			std::complex<double>(0.0), v, 1);
+		if(l+1 < nlayers){
+			GetSMatrixStep(l, l+1, n, kx, ky, omega,
+				thickness, q, Epsilon_inv, epstype, kp, phi,
+				S0l, work_GetSMatrix, pivots);
+		}
+	}
+
+	// Backward pass: b_{N-1} = bN is given. For each interface, the local
+	// S-matrix S(l,l+1) gives b_l = S21(l,l+1) a_l + S22(l,l+1) b_{l+1}, so
+	//   b_l = (1 - S21(l,l+1) S12(0,l))^{-1} (S21(l,l+1) S11(0,l) a0 + S22(l,l+1) b_{l+1})
+	{
+		const size_t l = nlayers-1;
+		const std::complex<double> *S12 = &store[l*lstore];
+		const std::complex<double> *v = S12 + n22;
+		std::complex<double> *al = &ab[l*n4];
+		RNP::TBLAS::Copy(n2, v,1, al,1);
+		RNP::TBLAS::MultMV<'N'>(n2, n2, std::complex<double>(1.0), S12, n2,
+			al+n2, 1,
+			std::complex<double>(1.0), al, 1);
+	}
+	for(size_t l = nlayers-1; l-- > 0; ){
+		const std::complex<double> *S12 = &store[l*lstore];
+		const std::complex<double> *v = S12 + n22;
+		std::complex<double> *al = &ab[l*n4];
+		std::complex<double> *bl = al + n2;
+		const std::complex<double> *blp1 = bl + n4;
+		int info;
+
+		GetSMatrix(2, n, kx, ky, omega,
+			thickness+l, q+l, Epsilon_inv+l, epstype+l, kp+l, phi+l,
+			Sll, work_GetSMatrix, pivots, lwork_GetSMatrix);
+
+		RNP::TBLAS::MultMV<'N'>(n2, n2, std::complex<double>(1.0), &Sll[n2+0*n4], n4,
+			v, 1,
+			std::complex<double>(0.0), bl, 1);
+		RNP::TBLAS::MultMV<'N'>(n2, n2, std::complex<double>(1.0), &Sll[n2+n2*n4], n4,
+			blp1, 1,
+			std::complex<double>(1.0), bl, 1);
+
+		RNP::TBLAS::MultMM<'N','N'>(n2, n2, n2, std::complex<double>(-1.0), &Sll[n2+0*n4], n4,
+			S12, n2,
+			std::complex<double>(0.0), temp, n2);
+		for(size_t i = 0; i < n2; ++i){
+			temp[i+i*n2] += 1.;
+		} // temp = (1 - S_21(l,l+1)S_12(0,l))
+		RNP::LinearSolve<'N'>(n2, 1, temp, n2, bl, n2, &info, pivots);
+
+		RNP::TBLAS::Copy(n2, v,1, al,1);
+		RNP::TBLAS::MultMV<'N'>(n2, n2, std::complex<double>(1.0), S12, n2,
+			bl, 1,
+			std::complex<double>(1.0), al, 1);
+	}
+
+	if(NULL == work_ || lwork < lwork_needed){
+		rcwa_free(work);
+	}
+	if(NULL == store_){
+		rcwa_free(store);
+	}
+	if(NULL == iwork){
+		rcwa_free(pivots);
+	}
+	return 0;
+}
+
 int SolveInterior(
 	size_t nlayers,
 	size_t which_layer,
@@ -1423,7 +3006,8 @@ int SolveInterior(
 	std::complex<double> *ab, // length 4*n
 	std::complex<double> *work_, // length lwork
 	size_t *iwork, // length n2
-	size_t lwork // set to -1 for query into work[0], at least 2*(4*n)^2 + 2*(2*n) + 4*n*(4*n+1)
+	size_t lwork, // set to -1 for query into work[0], at least 2*(4*n)^2 + 2*(2*n) + 4*n*(4*n+1)
+	int symmetries
 ){
 	if(0 == nlayers){ return-1; }
 	if(which_layer >= nlayers){ return -2; }
@@ -1460,10 +3044,10 @@ int SolveInterior(
 
 	GetSMatrix(which_layer+1, n, kx, ky, omega,
 		thickness, q, Epsilon_inv, epstype, kp, phi,
-		S0l, work_GetSMatrix, pivots, lwork_GetSMatrix);
+		S0l, work_GetSMatrix, pivots, lwork_GetSMatrix, NULL, symmetries);
 	GetSMatrix(nlayers-which_layer, n, kx, ky, omega,
 		thickness+which_layer, q+which_layer, Epsilon_inv+which_layer, epstype+which_layer, kp+which_layer, phi+which_layer,
-		SlN, work_GetSMatrix, pivots, lwork_GetSMatrix);
+		SlN, work_GetSMatrix, pivots, lwork_GetSMatrix, NULL, symmetries);
 
 #ifdef DUMP_MATRICES
 	if(NULL != a0){
@@ -1557,6 +3141,95 @@ int SolveInterior(
 }
 
 
+int SolveBoundary(
+	size_t nlayers,
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const double *thickness, // list of thicknesses
+	const std::complex<double> **q, // list of q vectors
+	const std::complex<double> **Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	int *epstype,
+	const std::complex<double> **kp,
+	const std::complex<double> **phi,
+	const std::complex<double> *a0, // length 2*n
+	const std::complex<double> *bN, // length 2*n
+	std::complex<double> *ab0, // length 4*n
+	std::complex<double> *abN, // length 4*n
+	std::complex<double> *work_, // length lwork
+	size_t *iwork, // length n4
+	size_t lwork, // set to -1 for query into work[0], at least (4*n)^2 + 4*n*(4*n+1)
+	int symmetries
+){
+	if(0 == nlayers){ return -1; }
+
+	const size_t n2 = 2*n;
+	const size_t n4 = 2*n2;
+	const size_t lwork_GetSMatrix = n4*(n4+1);
+	const size_t lwork_needed = n4*n4 + lwork_GetSMatrix;
+
+	if((size_t)-1 == lwork){
+		work_[0] = lwork_needed;
+		return 0;
+	}
+	std::complex<double> *work = work_;
+	if(NULL == work_ || lwork < lwork_needed){
+		work = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>)*lwork_needed);
+	}
+	size_t *pivots = iwork;
+	if(NULL == iwork){
+		pivots = (size_t*)rcwa_malloc(sizeof(size_t)*n4);
+	}
+
+	std::complex<double> *S0N = work;
+	std::complex<double> *work_GetSMatrix = S0N + n4*n4;
+
+	GetSMatrix(nlayers, n, kx, ky, omega,
+		thickness, q, Epsilon_inv, epstype, kp, phi,
+		S0N, work_GetSMatrix, pivots, lwork_GetSMatrix, NULL, symmetries);
+
+	// [ aN ] = [ S11 S12 ] [ a0 ]
+	// [ b0 ]   [ S21 S22 ] [ bN ]
+	if(NULL != ab0){
+		if(NULL != a0){
+			RNP::TBLAS::Copy(n2, a0,1, &ab0[0],1);
+			RNP::TBLAS::MultMV<'N'>(n2, n2, std::complex<double>(1.0), &S0N[n2+0*n4], n4,
+				a0, 1,
+				std::complex<double>(0.0), &ab0[n2], 1);
+		}else{
+			RNP::TBLAS::Fill(n4, 0., ab0, 1);
+		}
+		if(NULL != bN){
+			RNP::TBLAS::MultMV<'N'>(n2, n2, std::complex<double>(1.0), &S0N[n2+n2*n4], n4,
+				bN, 1,
+				std::complex<double>(1.0), &ab0[n2], 1);
+		}
+	}
+	if(NULL != abN){
+		if(NULL != bN){
+			RNP::TBLAS::Copy(n2, bN,1, &abN[n2],1);
+			RNP::TBLAS::MultMV<'N'>(n2, n2, std::complex<double>(1.0), &S0N[0+n2*n4], n4,
+				bN, 1,
+				std::complex<double>(0.0), &abN[0], 1);
+		}else{
+			RNP::TBLAS::Fill(n4, 0., abN, 1);
+		}
+		if(NULL != a0){
+			RNP::TBLAS::MultMV<'N'>(n2, n2, std::complex<double>(1.0), &S0N[0+0*n4], n4,
+				a0, 1,
+				std::complex<double>(1.0), &abN[0], 1);
+		}
+	}
+
+	if(NULL == work_ || lwork < lwork_needed){
+		rcwa_free(work);
+	}
+	if(NULL == iwork){
+		rcwa_free(pivots);
+	}
+	return 0;
+}
+
 
 void TranslateAmplitudes(
 	size_t n, // glist.n
@@ -1617,79 +3290,405 @@ void GetZPoyntingFlux(
 	}else{
 		RNP::TBLAS::MultMM<'C','N'>(n2,2,n2, std::complex<double>(1.),phi,n2, a2,n2, std::complex<double>(0.), a3,n2);
 	}
-
-	// At this point a3[n2] is alpha and b3[n2] is beta,
-	// ab[n2] is a and (ab+n2)[n2] is b
-
-	*forward  =  RNP::TBLAS::ConjugateDot(n2, ab     ,1, a3,1).real();
-	*backward = -RNP::TBLAS::ConjugateDot(n2, &ab[n2],1, b3,1).real();
-	std::complex<double> diff = 0.5*(RNP::TBLAS::ConjugateDot(n2, &ab[n2],1, a3,1) - RNP::TBLAS::ConjugateDot(n2, b3,1, ab,1));
-	*forward  += diff;
-	*backward += std::conj(diff);
+
+	// At this point a3[n2] is alpha and b3[n2] is beta,
+	// ab[n2] is a and (ab+n2)[n2] is b
+
+	*forward  =  RNP::TBLAS::ConjugateDot(n2, ab     ,1, a3,1).real();
+	*backward = -RNP::TBLAS::ConjugateDot(n2, &ab[n2],1, b3,1).real();
+	std::complex<double> diff = 0.5*(RNP::TBLAS::ConjugateDot(n2, &ab[n2],1, a3,1) - RNP::TBLAS::ConjugateDot(n2, b3,1, ab,1));
+	*forward  += diff;
+	*backward += std::conj(diff);
+
+	if(NULL == work){
+		rcwa_free(a2);
+	}
+}
+
+void GetZPoyntingFluxComponents(
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> *q, // length 2*glist.n
+	const std::complex<double> *Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	int epstype,
+	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
+	const std::complex<double> *phi, // size (2*glist.n)^2
+	const std::complex<double> *ab, // length 4*glist.n
+	std::complex<double> *forward,
+	std::complex<double> *backward,
+	std::complex<double> *work
+){
+	GetZPoyntingFluxComponentsBatch(
+		n, kx, ky, omega, q, Epsilon_inv, epstype, kp, phi,
+		1, ab, forward, backward, work
+	);
+}
+
+void GetZPoyntingFluxComponentsBatch(
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> *q, // length 2*glist.n
+	const std::complex<double> *Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	int epstype,
+	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
+	const std::complex<double> *phi, // size (2*glist.n)^2
+	size_t nab,
+	const std::complex<double> *ab, // size 4*glist.n x nab
+	std::complex<double> *forward, // size glist.n x nab
+	std::complex<double> *backward, // size glist.n x nab
+	std::complex<double> *work
+){
+	const size_t n2 = 2*n;
+	const size_t ncols = 2*nab;
+
+	// Each column of ab is a stacked pair (a,b), so ab is also the
+	// n2 x ncols matrix [a_1 b_1 a_2 b_2 ...], and all of the products
+	// below are done at once for every set of amplitudes.
+	std::complex<double> *a2 = work;
+	if(NULL == work){
+		a2 = (std::complex<double> *)rcwa_malloc(sizeof(std::complex<double>) * 2*n2*ncols);
+	}
+	std::complex<double> *a3 = a2 + n2*ncols;
+
+	memcpy(a2, ab, sizeof(std::complex<double>) * n2*ncols);
+	for(size_t j = 0; j < ncols; ++j){
+		for(size_t i = 0; i < n2; ++i){ a2[i+j*n2] /= (omega*q[i]); }
+	}
+	if(NULL == phi){
+		RNP::TBLAS::CopyMatrix<'A'>(n2,ncols, a2,n2, a3,n2);
+	}else{
+		RNP::TBLAS::MultMM<'N','N'>(n2,ncols,n2, std::complex<double>(1.),phi,n2, a2,n2, std::complex<double>(0.), a3,n2);
+	}
+	MultKPMatrix("N", omega, n, kx, ky, Epsilon_inv, epstype, kp, ncols, a3,n2, a2,n2);
+	// At this point, the columns of a2 alternate alpha_e and beta_e
+
+	if(NULL == phi){
+		RNP::TBLAS::CopyMatrix<'A'>(n2,ncols, ab,n2, a3,n2);
+	}else{
+		RNP::TBLAS::MultMM<'N','N'>(n2,ncols,n2, std::complex<double>(1.),phi,n2, ab,n2, std::complex<double>(0.), a3,n2);
+	}
+	// At this point, the columns of a3 alternate alpha_h and beta_h
+
+	for(size_t l = 0; l < nab; ++l){
+		const std::complex<double> *ae = &a2[(2*l+0)*n2];
+		const std::complex<double> *be = &a2[(2*l+1)*n2];
+		const std::complex<double> *ah = &a3[(2*l+0)*n2];
+		const std::complex<double> *bh = &a3[(2*l+1)*n2];
+		for(size_t i = 0; i < n; ++i){
+			std::complex<double> f = 0, b = 0;
+			for(size_t j = 0; j < n2; j+=n){
+				const size_t k = i+j;
+				f += std::real(std::conj(ae[k])*ah[k]);
+				b -= std::real(std::conj(be[k])*bh[k]);
+				std::complex<double> diff = 0.5*(std::conj(bh[k])*ae[k] - std::conj(be[k])*ah[k]);
+				f += diff;
+				b += std::conj(diff);
+			}
+			forward[i+l*n] = f;
+			backward[i+l*n] = b;
+		}
+	}
+
+	if(NULL == work){
+		rcwa_free(a2);
+	}
+}
+
+void GetZPoyntingFluxGradient(
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> *q, // length 2*glist.n
+	const std::complex<double> *Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	int epstype,
+	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
+	const std::complex<double> *phi, // size (2*glist.n)^2
+	const std::complex<double> *ab, // length 4*glist.n
+	std::complex<double> *gforward, // length 4*glist.n
+	std::complex<double> *gbackward, // length 4*glist.n
+	std::complex<double> *work
+){
+	const size_t n2 = 2*n;
+	const size_t n22 = n2*n2;
+
+	std::complex<double> *Y = work;
+	if(NULL == work){
+		Y = (std::complex<double> *)rcwa_malloc(sizeof(std::complex<double>) * (2*n22+4*n2));
+	}
+	std::complex<double> *t = Y + n22;
+	std::complex<double> *ya = t + n22;
+	std::complex<double> *yb = ya + n2;
+	std::complex<double> *yha = yb + n2;
+	std::complex<double> *yhb = yha + n2;
+
+	// GetZPoyntingFlux forms alpha = Y*a and beta = Y*b with
+	// Y = phi^H kp phi inv(omega q), and then
+	//   forward  = Re(a^H Y a) + Re(d),
+	//   backward = -Re(b^H Y b) + Re(d),
+	// with d = 0.5 b^H (Y - Y^H) a. Each is a real quadratic form
+	// Re(w^H X w) in w = [a;b], whose gradient is conj((X + X^H) w).
+	RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,0., t,n2);
+	for(size_t i = 0; i < n2; ++i){
+		if(NULL == phi){
+			t[i+i*n2] = 1./(omega*q[i]);
+		}else{
+			RNP::TBLAS::Axpy(n2, 1./(omega*q[i]), &phi[0+i*n2],1, &t[0+i*n2],1);
+		}
+	}
+	MultKPMatrix("N", omega, n, kx, ky, Epsilon_inv, epstype, kp, n2, t,n2, Y,n2);
+	if(NULL != phi){
+		RNP::TBLAS::CopyMatrix<'A'>(n2,n2, Y,n2, t,n2);
+		RNP::TBLAS::MultMM<'C','N'>(n2,n2,n2, std::complex<double>(1.),phi,n2, t,n2, std::complex<double>(0.), Y,n2);
+	}
+	RNP::TBLAS::MultMV<'N'>(n2,n2, std::complex<double>(1.),Y,n2, &ab[0] ,1, std::complex<double>(0.),ya,1);
+	RNP::TBLAS::MultMV<'N'>(n2,n2, std::complex<double>(1.),Y,n2, &ab[n2],1, std::complex<double>(0.),yb,1);
+	RNP::TBLAS::MultMV<'C'>(n2,n2, std::complex<double>(1.),Y,n2, &ab[0] ,1, std::complex<double>(0.),yha,1);
+	RNP::TBLAS::MultMV<'C'>(n2,n2, std::complex<double>(1.),Y,n2, &ab[n2],1, std::complex<double>(0.),yhb,1);
+
+	for(size_t i = 0; i < n2; ++i){
+		const std::complex<double> ha = 0.5*(ya[i] - yha[i]); // 0.5 (Y - Y^H) a
+		const std::complex<double> hb = 0.5*(yb[i] - yhb[i]); // 0.5 (Y - Y^H) b
+		if(NULL != gforward){
+			gforward[i]    = std::conj(ya[i] + yha[i] - hb);
+			gforward[i+n2] = std::conj(ha);
+		}
+		if(NULL != gbackward){
+			gbackward[i]    = std::conj(-hb);
+			gbackward[i+n2] = std::conj(ha - yb[i] - yhb[i]);
+		}
+	}
+
+	if(NULL == work){
+		rcwa_free(Y);
+	}
+}
+
+int GetAdjointLayerModes(
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> *q, // length 2*glist.n
+	const std::complex<double> *Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
+	int epstype,
+	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
+	const std::complex<double> *phi, // size (2*glist.n)^2
+	std::complex<double> *kp_adj, // size (2*glist.n)^2
+	std::complex<double> *phi_adj, // size (2*glist.n)^2
+	std::complex<double> *work
+){
+	const size_t n2 = 2*n;
+	const size_t n22 = n2*n2;
+
+	std::complex<double> *t = work;
+	if(NULL == work){
+		t = (std::complex<double> *)rcwa_malloc(sizeof(std::complex<double>) * 2*n22);
+	}
+	std::complex<double> *kpT = t + n22;
+
+	// The adjoint of du/dz = iMu, with u = [-ey;ex;hx;hy] and
+	//   M = [ 0                          kp/omega ]
+	//       [ omega (Epsilon2 - KK/kp)   0        ],
+	// swapped to have the same form, has kp_adj = omega^2 (Epsilon2 - KK/kp)^T
+	// and the same q, with the modes phi_adj = phi^-T. Using the layer
+	// eigenproblem (Epsilon2 kp - KK) phi = phi q^2, this is
+	//   kp_adj = omega^2 kp^-T phi^-T q^2 phi^T.
+	MakeKPMatrix(omega, n, kx, ky, Epsilon_inv, epstype, kp, t, n2);
+	for(size_t j = 0; j < n2; ++j){
+		for(size_t i = 0; i < n2; ++i){
+			kpT[j+i*n2] = t[i+j*n2];
+		}
+	}
+	int info = 0;
+	if(NULL == phi){
+		RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,0., kp_adj,n2);
+		for(size_t i = 0; i < n2; ++i){
+			kp_adj[i+i*n2] = q[i]*q[i];
+		}
+	}else{
+		for(size_t j = 0; j < n2; ++j){
+			for(size_t i = 0; i < n2; ++i){
+				t[j+i*n2] = phi[i+j*n2];
+			}
+		}
+		RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,1., phi_adj,n2);
+		RNP::LinearSolve<'N'>(n2,n2, t,n2, phi_adj,n2, &info, NULL);
+		if(0 != info){
+			if(NULL == work){ rcwa_free(t); }
+			return info;
+		}
+		for(size_t j = 0; j < n2; ++j){
+			for(size_t i = 0; i < n2; ++i){
+				t[i+j*n2] = q[i]*q[i]*phi[j+i*n2];
+			}
+		}
+		RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, std::complex<double>(1.),phi_adj,n2, t,n2, std::complex<double>(0.), kp_adj,n2);
+	}
+	RNP::LinearSolve<'N'>(n2,n2, kpT,n2, kp_adj,n2, &info, NULL);
+	RNP::TBLAS::Scale(n22, omega*omega, kp_adj, 1);
 
 	if(NULL == work){
-		rcwa_free(a2);
+		rcwa_free(t);
 	}
+	return info;
 }
 
-void GetZPoyntingFluxComponents(
+// Returns (e^x-1)/x.
+static std::complex<double> ExpDifferenceQuotient(const std::complex<double> &x){
+	if(std::abs(x) < 0.5){
+		std::complex<double> sum = 1, term = 1;
+		for(int k = 2; k < 20; ++k){
+			term *= x / double(k);
+			sum += term;
+		}
+		return sum;
+	}
+	return (std::exp(x) - 1.) / x;
+}
+
+int GetLayerAdjointSensitivity(
 	size_t n, // glist.n
 	const double *kx, const double *ky,
 	std::complex<double> omega,
+	double thickness,
 	const std::complex<double> *q, // length 2*glist.n
 	const std::complex<double> *Epsilon_inv, // size (glist.n)^2; inv of usual dielectric Fourier coupling matrix
 	int epstype,
 	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
 	const std::complex<double> *phi, // size (2*glist.n)^2
 	const std::complex<double> *ab, // length 4*glist.n
-	std::complex<double> *forward,
-	std::complex<double> *backward,
+	const std::complex<double> *ab_adj, // length 4*glist.n
+	std::complex<double> *dthickness,
+	std::complex<double> *Ceps, // size (2*glist.n)^2
+	std::complex<double> *Cinv, // size (glist.n)^2
 	std::complex<double> *work
 ){
 	const size_t n2 = 2*n;
+	const size_t n22 = n2*n2;
+	const std::complex<double> *a = ab, *b = ab + n2;
+	const std::complex<double> *aa = ab_adj, *ba = ab_adj + n2;
+	const std::complex<double> I(0.,1.);
+
+	// With u and the adjoint field ua as in GetAdjointLayerModes, the
+	// change of the output is the integral over the layer of
+	// (i/2) ua^T diag(1,-1) dM u. A change of thickness instead adds the
+	// integrand at the end of the layer, which only pairs the forward
+	// and backward modes.
+	if(NULL != dthickness){
+		std::complex<double> sum = 0;
+		for(size_t i = 0; i < n2; ++i){
+			sum += q[i] * std::exp(I*q[i]*thickness) * (aa[i]*b[i] - ba[i]*a[i]);
+		}
+		*dthickness = I*sum;
+	}
+	if(NULL == Ceps && NULL == Cinv){ return 0; }
 
-	std::complex<double> *a2 = work;
+	std::complex<double> *S1 = work;
 	if(NULL == work){
-		a2 = (std::complex<double> *)rcwa_malloc(sizeof(std::complex<double>) * 4*n2);
+		S1 = (std::complex<double> *)rcwa_malloc(sizeof(std::complex<double>) * 5*n22);
+	}
+	std::complex<double> *S2 = S1 + n22;
+	std::complex<double> *R = S2 + n22;
+	std::complex<double> *t = R + n22;
+	std::complex<double> *K = t + n22;
+
+	// Integrals over z of the products of the mode amplitudes,
+	//   S1 = int (a-b)(aa+ba)^T, S2 = int (a+b)(aa-ba)^T,
+	// where a(z) = e^{iqz} a and b(z) = e^{iq(d-z)} b. The cross terms
+	// are evaluated from the end at which the exponential is bounded.
+	for(size_t j = 0; j < n2; ++j){
+		for(size_t k = 0; k < n2; ++k){
+			const std::complex<double> psi = thickness * ExpDifferenceQuotient(I*(q[k]+q[j])*thickness);
+			std::complex<double> chi; // int e^{iq_j(d-z)+iq_k z}, symmetric in j and k
+			if(q[k].imag() >= q[j].imag()){
+				chi = std::exp(I*q[j]*thickness) * thickness * ExpDifferenceQuotient(I*(q[k]-q[j])*thickness);
+			}else{
+				chi = std::exp(I*q[k]*thickness) * thickness * ExpDifferenceQuotient(I*(q[j]-q[k])*thickness);
+			}
+			const std::complex<double> xaa = a[k]*aa[j]*psi;
+			const std::complex<double> xbb = b[k]*ba[j]*psi;
+			const std::complex<double> xab = a[k]*ba[j]*chi;
+			const std::complex<double> xba = b[k]*aa[j]*chi;
+			S1[k+j*n2] = xaa + xab - xba - xbb;
+			S2[k+j*n2] = xaa - xab + xba - xbb;
+		}
 	}
-	std::complex<double> *b2 = a2 + n2;
-	std::complex<double> *a3 = b2 + n2;
-	std::complex<double> *b3 = a3 + n2;
 
-	memcpy(a2, ab, sizeof(std::complex<double>) * 2*n2);
-	for(size_t i = 0; i < n2; ++i){ a2[i] /= (omega*q[i]); }
-	for(size_t i = 0; i < n2; ++i){ b2[i] /= (omega*q[i]); }
-	if(NULL == phi){
-		RNP::TBLAS::CopyMatrix<'A'>(n2,2, a2,n2, a3,n2);
-	}else{
-		RNP::TBLAS::MultMM<'N','N'>(n2,2,n2, std::complex<double>(1.),phi,n2, a2,n2, std::complex<double>(0.), a3,n2);
+	int info = 0;
+	MakeKPMatrix(omega, n, kx, ky, Epsilon_inv, epstype, kp, K, n2);
+	RNP::TBLAS::SetMatrix<'A'>(n2,n2, 0.,1., R,n2);
+	if(NULL != phi){
+		RNP::TBLAS::CopyMatrix<'A'>(n2,n2, phi,n2, t,n2);
+		RNP::LinearSolve<'N'>(n2,n2, t,n2, R,n2, &info, NULL);
+		if(0 != info){
+			if(NULL == work){ rcwa_free(S1); }
+			return info;
+		}
 	}
-	MultKPMatrix("N", omega, n, kx, ky, Epsilon_inv, epstype, kp, 2, a3,n2, a2,n2);
-	// At this point, a2[n2] contains alpha_e, b2[n2] contains beta_e
 
-	if(NULL == phi){
-		RNP::TBLAS::CopyMatrix<'A'>(n2,2, ab,n2, a3,n2);
-	}else{
-		RNP::TBLAS::MultMM<'N','N'>(n2,2,n2, std::complex<double>(1.),phi,n2, ab,n2, std::complex<double>(0.), a3,n2);
+	// H = phi inv(q) S1 inv(phi), in S1
+	for(size_t i = 0; i < n2; ++i){
+		RNP::TBLAS::Scale(n2, 1./q[i], &S1[i+0*n2], n2);
+	}
+	if(NULL != phi){
+		RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, std::complex<double>(1.),S1,n2, R,n2, std::complex<double>(0.), t,n2);
+		RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, std::complex<double>(1.),phi,n2, t,n2, std::complex<double>(0.), S1,n2);
 	}
-	// At this point, a3[n2] contains alpha_h, b3[n2] contains beta_h
 
-	for(size_t i = 0; i < n; ++i){
-		forward[i] = 0;
-		backward[i] = 0;
-		for(size_t j = 0; j < n2; j+=n){
-			const size_t k = i+j;
-			forward[i]  += std::real(std::conj(a2[k])*a3[k]);
-			backward[i] -= std::real(std::conj(b2[k])*b3[k]);
-			std::complex<double> diff = 0.5*(std::conj(b3[k])*a2[k] - std::conj(b2[k])*a3[k]);
-			forward[i]  += diff;
-			backward[i] += std::conj(diff);
+	// Ceps = -(i/2) kp H
+	if(NULL != Ceps){
+		RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, -0.5*I,K,n2, S1,n2, std::complex<double>(1.), Ceps,n2);
+	}
+	if(NULL == Cinv){
+		if(NULL == work){ rcwa_free(S1); }
+		return 0;
+	}
+
+	// The kp sensitivity is (i/2) (phi S2 q inv(phi) - H KK) inv(kp), in S2
+	for(size_t j = 0; j < n2; ++j){
+		RNP::TBLAS::Scale(n2, q[j], &S2[0+j*n2], 1);
+	}
+	if(NULL != phi){
+		RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, std::complex<double>(1.),S2,n2, R,n2, std::complex<double>(0.), t,n2);
+		RNP::TBLAS::MultMM<'N','N'>(n2,n2,n2, std::complex<double>(1.),phi,n2, t,n2, std::complex<double>(0.), S2,n2);
+	}
+	for(size_t j = 0; j < n; ++j){
+		for(size_t i = 0; i < n2; ++i){
+			const std::complex<double> hx = S1[i+(0+j)*n2];
+			const std::complex<double> hy = S1[i+(n+j)*n2];
+			S2[i+(0+j)*n2] -= (hx*kx[j] + hy*ky[j]) * kx[j];
+			S2[i+(n+j)*n2] -= (hx*kx[j] + hy*ky[j]) * ky[j];
+		}
+	}
+	// Right division by kp, through the transposed system
+	for(size_t j = 0; j < n2; ++j){
+		for(size_t i = 0; i < n2; ++i){
+			t[j+i*n2] = S2[i+j*n2];
+			R[j+i*n2] = K[i+j*n2];
+		}
+	}
+	RNP::LinearSolve<'N'>(n2,n2, R,n2, t,n2, &info, NULL);
+
+	// kp = omega^2 - [ky;-kx] Epsilon_inv [ky -kx], so that
+	// tr(dkp C) = -tr(dEpsilon_inv [ky -kx] C [ky;-kx]).
+	for(size_t j = 0; j < n; ++j){
+		for(size_t i = 0; i < n; ++i){
+			// t holds the transpose of C/(i/2)
+			const std::complex<double> c00 = t[(0+j)+(0+i)*n2];
+			const std::complex<double> c01 = t[(n+j)+(0+i)*n2];
+			const std::complex<double> c10 = t[(0+j)+(n+i)*n2];
+			const std::complex<double> c11 = t[(n+j)+(n+i)*n2];
+			const std::complex<double> ck =
+				ky[i]*c00*ky[j] - ky[i]*c01*kx[j] - kx[i]*c10*ky[j] + kx[i]*c11*kx[j];
+			Cinv[i+j*n] -= 0.5*I*ck;
 		}
 	}
 
 	if(NULL == work){
-		rcwa_free(a2);
+		rcwa_free(S1);
 	}
+	return info;
 }
 
 static void GetInPlaneFieldVector(
@@ -1926,32 +3925,206 @@ void GetEFieldAtPoint(
 	}
 }
 
+// Fills coef (n x 6, columns Ex,Ey,Ez,Hx,Hy,Hz) with the Fourier
+// coefficients of the fields in a plane. eh is length 8*n2. The E
+// columns are zero unless want_e is nonzero and epsilon_inv is given.
+static void GetFieldPointCoefficients(
+	size_t n, // glist.n
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> *q,
+	const std::complex<double> *kp,
+	const std::complex<double> *phi,
+	const std::complex<double> *epsilon_inv,
+	int epstype,
+	const std::complex<double> *ab,
+	int want_e,
+	std::complex<double> *eh,
+	std::complex<double> *coef
+){
+	const std::complex<double> z_zero(0.);
+	const std::complex<double> z_one(1.);
+	const size_t n2 = 2*n;
 
-void GetFieldOnGrid(
+	GetInPlaneFieldVector(n, kx, ky, omega, q, epsilon_inv, epstype, kp, phi, ab, eh);
+	const std::complex<double> *hx  = &eh[3*n2+0];
+	const std::complex<double> *hy  = &eh[3*n2+n];
+	const std::complex<double> *ney = &eh[4*n2+0];
+	const std::complex<double> *ex  = &eh[4*n2+n];
+
+	if(want_e && NULL != epsilon_inv){
+		for(size_t i = 0; i < n; ++i){
+			eh[i] = (ky[i]*hx[i] - kx[i]*hy[i]);
+		}
+		if(EPSILON2_TYPE_BLKDIAG1_SCALAR == epstype || EPSILON2_TYPE_BLKDIAG2_SCALAR == epstype){
+			RNP::TBLAS::Scale(n, epsilon_inv[0], eh,1);
+			RNP::TBLAS::Copy(n, eh,1, &eh[n], 1);
+		}else{
+			RNP::TBLAS::MultMV<'N'>(n,n, z_one,epsilon_inv,n, eh,1, z_zero,&eh[n],1);
+		}
+	}else{
+		RNP::TBLAS::Fill(n, z_zero, &eh[n],1);
+	}
+
+	for(size_t i = 0; i < n; ++i){
+		coef[i+0*n] = ex[i];
+		coef[i+1*n] = -ney[i];
+		coef[i+2*n] = eh[n+i] / omega;
+		coef[i+3*n] = hx[i];
+		coef[i+4*n] = hy[i];
+		coef[i+5*n] = (kx[i] * -ney[i] - ky[i] * ex[i]) / omega;
+	}
+}
+
+void GetFieldAtPoints(
 	size_t n, // glist.n
-	int *G,
 	const double *kx, const double *ky,
 	std::complex<double> omega,
 	const std::complex<double> *q, // length 2*glist.n
 	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
 	const std::complex<double> *phi, // size (2*glist.n)^2
-	const std::complex<double> *epsilon_inv, // size (glist.n)^2, non NULL for efield != NULL || kp == NULL
+	const std::complex<double> *epsilon_inv, // size (glist.n)^2, non NULL for efield != NULL
 	int epstype,
 	const std::complex<double> *ab, // length 4*glist.n
-	const size_t nxy[2], // number of points per lattice direction
-	const double *xy0,
-	std::complex<double> *efield,
-	std::complex<double> *hfield
+	size_t npts,
+	const double *r, // length 2*npts
+	std::complex<double> *efield, // length 3*npts
+	std::complex<double> *hfield, // length 3*npts
+	std::complex<double> *work // length 8*n2 + 6*n + FIELD_POINTS_BLOCK*(n+6)
+){
+	const std::complex<double> z_zero(0.);
+	const std::complex<double> z_one(1.);
+	const size_t n2 = 2*n;
+	const size_t nblock = FIELD_POINTS_BLOCK;
+
+	std::complex<double> *eh = work;
+	if(NULL == work){
+		eh = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>) * (8*n2 + 6*n + nblock*(n+6)));
+	}
+	std::complex<double> *coef = eh + 8*n2; // n x 6, columns Ex,Ey,Ez,Hx,Hy,Hz
+	std::complex<double> *phase = coef + 6*n; // nblock x n
+	std::complex<double> *fld = phase + nblock*n; // nblock x 6
+
+	// Fourier coefficients of the six field components; the field at a
+	// set of points is then the product of their phase matrix with these.
+	GetFieldPointCoefficients(
+		n, kx, ky, omega, q, kp, phi, epsilon_inv, epstype, ab,
+		NULL != efield, eh, coef
+	);
+
+	for(size_t p0 = 0; p0 < npts; p0 += nblock){
+		const size_t nb = (npts - p0 < nblock ? npts - p0 : nblock);
+		for(size_t i = 0; i < n; ++i){
+			for(size_t j = 0; j < nb; ++j){
+				const double theta = (kx[i]*r[2*(p0+j)+0] + ky[i]*r[2*(p0+j)+1]);
+				phase[j+i*nb] = std::complex<double>(cos(theta),sin(theta));
+			}
+		}
+		RNP::TBLAS::MultMM<'N','N'>(nb,6,n, z_one,phase,nb, coef,n, z_zero,fld,nb);
+		for(size_t j = 0; j < nb; ++j){
+			for(size_t c = 0; c < 3; ++c){
+				if(NULL != efield && NULL != epsilon_inv){
+					efield[3*(p0+j)+c] = fld[j+c*nb];
+				}
+				if(NULL != hfield){
+					hfield[3*(p0+j)+c] = fld[j+(3+c)*nb];
+				}
+			}
+		}
+	}
+
+	if(NULL == work){
+		rcwa_free(eh);
+	}
+}
+
+void GetFieldAtPointsNUFFT(
+	size_t n, // glist.n
+	const int *G,
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> *q, // length 2*glist.n
+	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
+	const std::complex<double> *phi, // size (2*glist.n)^2
+	const std::complex<double> *epsilon_inv, // size (glist.n)^2, non NULL for efield != NULL
+	int epstype,
+	const std::complex<double> *ab, // length 4*glist.n
+	const double Lk[4],
+	nufft_plan plan, // made for the orders G with 6 transforms
+	size_t npts,
+	const double *r, // length 2*npts
+	std::complex<double> *efield, // length 3*npts
+	std::complex<double> *hfield, // length 3*npts
+	std::complex<double> *work // length 8*n2 + 6*n + 7*npts
+){
+	const size_t n2 = 2*n;
+
+	std::complex<double> *eh = work;
+	if(NULL == work){
+		eh = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>) * (8*n2 + 6*n + 7*npts));
+	}
+	std::complex<double> *coef = eh + 8*n2; // n x 6, columns Ex,Ey,Ez,Hx,Hy,Hz
+	std::complex<double> *fld = coef + 6*n; // npts x 6
+	double *uv = (double*)(fld + 6*npts); // 2 x npts
+
+	GetFieldPointCoefficients(
+		n, kx, ky, omega, q, kp, phi, epsilon_inv, epstype, ab,
+		NULL != efield, eh, coef
+	);
+
+	// The G-dependent part of each plane wave phase is a lattice Fourier
+	// series in the lattice coordinates of the point; the Bloch phase of
+	// the zeroth order is common to all of them.
+	const double k0[2] = {
+		kx[0] - 2*M_PI*(Lk[0]*G[0] + Lk[2]*G[1]),
+		ky[0] - 2*M_PI*(Lk[1]*G[0] + Lk[3]*G[1])
+	};
+	for(size_t j = 0; j < npts; ++j){
+		uv[2*j+0] = Lk[0]*r[2*j+0] + Lk[1]*r[2*j+1];
+		uv[2*j+1] = Lk[2]*r[2*j+0] + Lk[3]*r[2*j+1];
+	}
+	nufft2_exec(plan, coef, npts, uv, fld);
+
+	for(size_t j = 0; j < npts; ++j){
+		const double theta = k0[0]*r[2*j+0] + k0[1]*r[2*j+1];
+		const std::complex<double> bloch(cos(theta),sin(theta));
+		for(size_t c = 0; c < 3; ++c){
+			if(NULL != efield && NULL != epsilon_inv){
+				efield[3*j+c] = bloch * fld[j+c*npts];
+			}
+			if(NULL != hfield){
+				hfield[3*j+c] = bloch * fld[j+(3+c)*npts];
+			}
+		}
+	}
+
+	if(NULL == work){
+		rcwa_free(eh);
+	}
+}
+
+// Fills the six Fourier grids from[] (each nxy[0]*nxy[1], zeroed here)
+// with the coefficients of Hx, Hy, Hz, Ex, Ey, Ez. eh is length 8*n2.
+static void GetFieldGridCoefficients(
+	size_t n, // glist.n
+	const int *G,
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> *q,
+	const std::complex<double> *kp,
+	const std::complex<double> *phi,
+	const std::complex<double> *epsilon_inv,
+	int epstype,
+	const std::complex<double> *ab,
+	const size_t nxy[2],
+	std::complex<double> *eh,
+	std::complex<double> *from[6]
 ){
 	const std::complex<double> z_zero(0.);
 	const std::complex<double> z_one(1.);
 	const size_t n2 = 2*n;
 	const size_t N = nxy[0]*nxy[1];
 	const int nxyoff[2] = { (int)(nxy[0]/2), (int)(nxy[1]/2) };
-	int inxy[2] = { (int)nxy[0], (int)nxy[1] };
-	int inxy_rev[2] = { (int)nxy[1], (int)nxy[0] };
-
-	std::complex<double> *eh = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>) * 8*n2);
 
 	GetInPlaneFieldVector(n, kx, ky, omega, q, epsilon_inv, epstype, kp, phi, ab, eh);
 	const std::complex<double> *hx  = &eh[3*n2+0];
@@ -1959,14 +4132,8 @@ void GetFieldOnGrid(
 	const std::complex<double> *ney = &eh[4*n2+0];
 	const std::complex<double> *ex  = &eh[4*n2+n];
 
-	std::complex<double> *from[6];
-	std::complex<double> *to[6];
-	fft_plan plan[6];
 	for(unsigned i = 0; i < 6; ++i){
-		from[i] = fft_alloc_complex(N);
-		to[i] = fft_alloc_complex(N);
 		memset(from[i], 0, sizeof(std::complex<double>) * N);
-		plan[i] = fft_plan_dft_2d(inxy_rev, from[i], to[i], 1);
 	}
 
 	for(size_t i = 0; i < n; ++i){
@@ -1996,6 +4163,52 @@ void GetFieldOnGrid(
 			from[5][ii+jj*nxy[0]] = eh[n+i] / omega;
 		}
 	}
+}
+
+void GetFieldOnGrid(
+	size_t n, // glist.n
+	int *G,
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> *q, // length 2*glist.n
+	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
+	const std::complex<double> *phi, // size (2*glist.n)^2
+	const std::complex<double> *epsilon_inv, // size (glist.n)^2, non NULL for efield != NULL || kp == NULL
+	int epstype,
+	const std::complex<double> *ab, // length 4*glist.n
+	const size_t nxy[2], // number of points per lattice direction
+	const double *xy0,
+	std::complex<double> *efield,
+	std::complex<double> *hfield,
+	std::complex<double> *work
+){
+	const size_t n2 = 2*n;
+	const size_t N = nxy[0]*nxy[1];
+	int inxy_rev[2] = { (int)nxy[1], (int)nxy[0] };
+
+	std::complex<double> *eh = work;
+	if(NULL == work){
+		eh = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>) * 8*n2);
+	}
+
+	std::complex<double> *from[6];
+	std::complex<double> *to[6];
+	fft_plan plan[6];
+	for(unsigned i = 0; i < 6; ++i){
+		if(NULL == work){
+			from[i] = fft_alloc_complex(N);
+			to[i] = fft_alloc_complex(N);
+		}else{
+			from[i] = eh + 8*n2 + 2*i*N;
+			to[i] = from[i] + N;
+		}
+		plan[i] = fft_plan_dft_2d(inxy_rev, from[i], to[i], 1);
+	}
+
+	GetFieldGridCoefficients(
+		n, G, kx, ky, omega, q, kp, phi, epsilon_inv, epstype, ab, nxy,
+		eh, from
+	);
 
 	for(unsigned i = 0; i < 6; ++i){
 		fft_plan_exec(plan[i]);
@@ -2014,10 +4227,104 @@ void GetFieldOnGrid(
 
 	for(unsigned i = 0; i < 6; ++i){
 		fft_plan_destroy(plan[i]);
-		fft_free(to[i]);
-		fft_free(from[i]);
+		if(NULL == work){
+			fft_free(to[i]);
+			fft_free(from[i]);
+		}
+	}
+	if(NULL == work){
+		rcwa_free(eh);
+	}
+}
+
+void GetFieldOnGridSlices(
+	size_t n, // glist.n
+	const int *G,
+	const double *kx, const double *ky,
+	std::complex<double> omega,
+	const std::complex<double> *q, // length 2*glist.n
+	const std::complex<double> *kp, // size (2*glist.n)^2 (k-parallel matrix)
+	const std::complex<double> *phi, // size (2*glist.n)^2
+	const std::complex<double> *epsilon_inv, // size (glist.n)^2
+	int epstype,
+	double thickness,
+	const std::complex<double> *ab, // length 4*glist.n
+	const size_t nxy[2], // number of points per lattice direction
+	size_t nz,
+	const double *dz, // length nz
+	std::complex<double> **efield, // nz pointers, or NULL
+	std::complex<double> **hfield, // nz pointers, or NULL
+	size_t nthreads
+){
+	const size_t n2 = 2*n;
+	const size_t n4 = 2*n2;
+	const size_t N = nxy[0]*nxy[1];
+	int inxy_rev[2] = { (int)nxy[1], (int)nxy[0] };
+
+	if(0 == nz){ return; }
+#ifdef _OPENMP
+	if(0 == nthreads){ nthreads = omp_get_max_threads(); }
+#else
+	nthreads = 1;
+#endif
+	if(nthreads < 1){ nthreads = 1; }
+	if(nthreads > nz){ nthreads = nz; }
+
+	// One set of buffers and plans per thread; plans are made up front
+	// since planning is not thread safe.
+	std::complex<double> *slice_work = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>) * (8*n2 + n4) * nthreads);
+	std::complex<double> **bufs = (std::complex<double>**)malloc(sizeof(std::complex<double>*) * 12 * nthreads);
+	fft_plan *plans = (fft_plan*)malloc(sizeof(fft_plan) * 6 * nthreads);
+	for(size_t t = 0; t < nthreads; ++t){
+		for(unsigned i = 0; i < 6; ++i){
+			bufs[12*t+i] = fft_alloc_complex(N);
+			bufs[12*t+6+i] = fft_alloc_complex(N);
+			plans[6*t+i] = fft_plan_dft_2d(inxy_rev, bufs[12*t+i], bufs[12*t+6+i], 1);
+		}
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+#endif
+	for(long k = 0; k < (long)nz; ++k){
+#ifdef _OPENMP
+		const size_t t = omp_get_thread_num();
+#else
+		const size_t t = 0;
+#endif
+		std::complex<double> *eh = slice_work + (8*n2 + n4)*t;
+		std::complex<double> *abk = eh + 8*n2;
+		std::complex<double> **from = &bufs[12*t];
+		std::complex<double> **to = &bufs[12*t+6];
+
+		RNP::TBLAS::Copy(n4, ab,1, abk,1);
+		TranslateAmplitudes(n, q, thickness, dz[k], abk);
+		GetFieldGridCoefficients(
+			n, G, kx, ky, omega, q, kp, phi, epsilon_inv, epstype, abk, nxy,
+			eh, from
+		);
+		for(unsigned i = 0; i < 6; ++i){
+			if((i < 3 && NULL == hfield) || (i >= 3 && NULL == efield)){ continue; }
+			fft_plan_exec(plans[6*t+i]);
+		}
+		for(size_t j = 0; j < N; ++j){
+			for(unsigned c = 0; c < 3; ++c){
+				if(NULL != hfield){ hfield[k][3*j+c] = to[c][j]; }
+				if(NULL != efield){ efield[k][3*j+c] = to[3+c][j]; }
+			}
+		}
+	}
+
+	for(size_t t = 0; t < nthreads; ++t){
+		for(unsigned i = 0; i < 6; ++i){
+			fft_plan_destroy(plans[6*t+i]);
+			fft_free(bufs[12*t+6+i]);
+			fft_free(bufs[12*t+i]);
+		}
 	}
-	rcwa_free(eh);
+	free(plans);
+	free(bufs);
+	rcwa_free(slice_work);
 }
 
 void GetEFieldOnGrid(
@@ -2034,7 +4341,8 @@ void GetEFieldOnGrid(
 	const size_t nxy[2], // number of points per lattice direction
 	const double *xy0,
 	std::complex<double> *efield,
-	int solvetype
+	int solvetype,
+	std::complex<double> *work
 ){
 	const std::complex<double> z_zero(0.);
 	const std::complex<double> z_one(1.);
@@ -2044,7 +4352,10 @@ void GetEFieldOnGrid(
 	int inxy[2] = { (int)nxy[0], (int)nxy[1] };
 	int inxy_rev[2] = { (int)nxy[1], (int)nxy[0] };
 
-	std::complex<double> *eh = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>) * 8*n2);
+	std::complex<double> *eh = work;
+	if(NULL == work){
+		eh = (std::complex<double>*)rcwa_malloc(sizeof(std::complex<double>) * 8*n2);
+	}
 
 	GetInPlaneFieldVector(n, kx, ky, omega, q, epsilon_inv, epstype, kp, phi, ab, eh, solvetype);
 	const std::complex<double> *hx  = &eh[3*n2+0];
@@ -2056,8 +4367,13 @@ void GetEFieldOnGrid(
 	std::complex<double> *to[6];
 	fft_plan plan[6];
 	for(unsigned i = 0; i < 6; ++i){
-		from[i] = fft_alloc_complex(N);
-		to[i] = fft_alloc_complex(N);
+		if(NULL == work){
+			from[i] = fft_alloc_complex(N);
+			to[i] = fft_alloc_complex(N);
+		}else{
+			from[i] = eh + 8*n2 + 2*i*N;
+			to[i] = from[i] + N;
+		}
 		memset(from[i], 0, sizeof(std::complex<double>) * N);
 		plan[i] = fft_plan_dft_2d(inxy_rev, from[i], to[i], 1);
 	}
@@ -2104,10 +4420,14 @@ void GetEFieldOnGrid(
 
 	for(unsigned i = 0; i < 6; ++i){
 		fft_plan_destroy(plan[i]);
-		fft_free(to[i]);
-		fft_free(from[i]);
+		if(NULL == work){
+			fft_free(to[i]);
+			fft_free(from[i]);
+		}
+	}
+	if(NULL == work){
+		rcwa_free(eh);
 	}
-	rcwa_free(eh);
 }
 
 
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <vector>
 #include "RS.h"
 
 int main()
@@ -120,18 +121,21 @@ int main()
 	//  print('')
     //end
 	int ret6;
-	double r[3], fE[6];
+	std::vector<double> r, fE;
 	for (double x=-0.5; x < 3.5; x += 0.02){
 		double z = -1;
 		// for (double z=-1; z < 1.5; z += 0.02)
 		{
-			r[0] = x;
-			r[1] = 0;
-			r[2] = z;
-			ret6 = Simulation_GetField(S, r, fE, NULL);
-			std::cout << "x:  " << x << ",   z:  " << z << ",    Ex: " << fE[0]<< ",    Ey: " << fE[1]<< ",    Ez: " << fE[2] << std::endl;
-
+			r.push_back(x);
+			r.push_back(0);
+			r.push_back(z);
 		}
 	}
+	const int npts = r.size()/3;
+	fE.resize(6*npts);
+	ret6 = RS_Simulation_GetFieldPoints(S, npts, &r[0], &fE[0], NULL);
+	for (int i = 0; i < npts; ++i){
+		std::cout << "x:  " << r[3*i+0] << ",   z:  " << r[3*i+2] << ",    Ex: " << fE[6*i+0]<< ",    Ey: " << fE[6*i+2]<< ",    Ez: " << fE[6*i+4] << std::endl;
+	}
 	
 }
\ No newline at end of file
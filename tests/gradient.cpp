@@ -0,0 +1,146 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "RS.h"
+
+// Checks the adjoint derivatives of RS_Simulation_GetGradient against
+// central differences of the solved outputs.
+
+enum{
+	P_THICKNESS,  // thickness of the uniform layer
+	P_EPSILON,    // real part of the epsilon of the patterned material
+	P_CENTER,     // x coordinate of the rectangle center
+	P_RADIUS,     // radius of the circle
+	P_VERTEX,     // x coordinate of the first polygon vertex
+	P_COUNT
+};
+
+static RS_Simulation* Build(const double *p)
+{
+	RS_real Lr[4] = { 1, 0, 0.2, 0.9 };
+	RS_Simulation *S = RS_Simulation_New(Lr, 21, NULL);
+
+	RS_real eps[2] = { p[P_EPSILON], 0.1 };
+	RS_MaterialID Si = RS_Simulation_SetMaterial(S, -1, "Silicon", RS_MATERIAL_TYPE_SCALAR_COMPLEX, eps);
+	eps[0] = 1; eps[1] = 0;
+	RS_MaterialID Vac = RS_Simulation_SetMaterial(S, -1, "Vacuum", RS_MATERIAL_TYPE_SCALAR_COMPLEX, eps);
+	eps[0] = 2.25; eps[1] = 0;
+	RS_MaterialID Glass = RS_Simulation_SetMaterial(S, -1, "Glass", RS_MATERIAL_TYPE_SCALAR_COMPLEX, eps);
+	eps[0] = 5; eps[1] = 0.2;
+	RS_MaterialID Y = RS_Simulation_SetMaterial(S, -1, "Y", RS_MATERIAL_TYPE_SCALAR_COMPLEX, eps);
+
+	RS_real t = 0.2;
+	RS_Simulation_SetLayer(S, -1, "AirAbove", &t, -1, Vac);
+	t = 0.3;
+	RS_LayerID A = RS_Simulation_SetLayer(S, -1, "Rods", &t, -1, Vac);
+	t = p[P_THICKNESS];
+	RS_Simulation_SetLayer(S, -1, "Film", &t, -1, Glass);
+	t = 0.2;
+	RS_LayerID C = RS_Simulation_SetLayer(S, -1, "Prisms", &t, -1, Vac);
+	t = 0.15;
+	RS_Simulation_SetLayer(S, -1, "GlassBelow", &t, -1, Glass);
+
+	RS_real center[2] = { p[P_CENTER], -0.03 }, halfwidths[2] = { 0.3, 0.25 };
+	RS_real angle = 0.04;
+	RS_Layer_SetRegionHalfwidths(S, A, Si, RS_REGION_TYPE_RECTANGLE, halfwidths, center, &angle);
+	RS_real center2[2] = { 0.02, 0.05 }, radius[2] = { p[P_RADIUS], p[P_RADIUS] };
+	angle = 0;
+	RS_Layer_SetRegionHalfwidths(S, A, Y, RS_REGION_TYPE_CIRCLE, radius, center2, &angle);
+	RS_real center3[2] = { 0.03, -0.02 };
+	RS_real vertices[8] = { p[P_VERTEX], -0.15, 0.25, -0.1, 0.2, 0.2, -0.15, 0.2 };
+	angle = 0.05;
+	RS_Layer_SetRegionVertices(S, C, Si, RS_REGION_TYPE_POLYGON, 4, vertices, center3, &angle);
+
+	double angleE[2] = { M_PI/180.*20, M_PI/180.*30 };
+	double pol_s[2] = { 1, 0 };
+	double pol_p[2] = { 0.5, 0.3 };
+	Simulation_MakeExcitationPlanewave(S, angleE, pol_s, pol_p, 0);
+	RS_real freq[2] = { 0.8, 0 };
+	RS_Simulation_SetFrequency(S, freq);
+	return S;
+}
+
+// Evaluates the output directly; v[1] is zero for a flux.
+static void Evaluate(const double *p, const RS_GradientOutput &out, double *v)
+{
+	RS_Simulation *S = Build(p);
+	if(RS_GRADIENT_AMPLITUDE == out.type){
+		const int n = S->n_G;
+		std::vector<double> forw(4*n), back(4*n);
+		Simulation_GetAmplitudes(S, &S->layer[out.layer], out.offset, &forw[0], &back[0]);
+		const double *a = (out.index < 2*n ? &forw[2*out.index] : &back[2*(out.index-2*n)]);
+		v[0] = a[0];
+		v[1] = a[1];
+	}else{
+		RS_real power[4];
+		RS_Simulation_GetPowerFlux(S, out.layer, &out.offset, power);
+		v[0] = power[RS_GRADIENT_FORWARD_FLUX == out.type ? 0 : 1];
+		v[1] = 0;
+	}
+	RS_Simulation_Destroy(S);
+}
+
+int main()
+{
+	const double p0[P_COUNT] = { 0.25, 12, 0.05, 0.12, -0.2 };
+	const char *names[P_COUNT] = { "thickness", "epsilon", "center", "radius", "vertex" };
+	const RS_GradientParameter params[P_COUNT] = {
+		{ RS_GRADIENT_THICKNESS, 2, 0, 0 },
+		{ RS_GRADIENT_EPSILON,   0, 0, 0 },
+		{ RS_GRADIENT_SHAPE,     1, 0, 0 },
+		{ RS_GRADIENT_SHAPE,     1, 1, 3 },
+		{ RS_GRADIENT_SHAPE,     3, 0, 3 }
+	};
+	RS_GradientOutput outputs[3] = {
+		{ RS_GRADIENT_FORWARD_FLUX,  4, 0.05, 0 },
+		{ RS_GRADIENT_BACKWARD_FLUX, 0, 0.1,  0 },
+		{ RS_GRADIENT_AMPLITUDE,     0, 0.07, 0 }
+	};
+	const char *kinds[3] = { "forward flux", "backward flux", "amplitude" };
+	{
+		RS_Simulation *S = Build(p0);
+		outputs[2].index = 2*S->n_G + 1; // a reflected order
+		RS_Simulation_Destroy(S);
+	}
+
+	const double h = 1e-5;
+	const double rtol = 1e-4;
+	int nfail = 0;
+	for(int o = 0; o < 3; ++o){
+		const bool amplitude = (RS_GRADIENT_AMPLITUDE == outputs[o].type);
+		double grad[2*P_COUNT];
+		RS_Simulation *S = Build(p0);
+		int ret = RS_Simulation_GetGradient(S, &outputs[o], P_COUNT, params, grad);
+		RS_Simulation_Destroy(S);
+		if(0 != ret){
+			std::cout << kinds[o] << ": RS_Simulation_GetGradient returned " << ret << std::endl;
+			++nfail;
+			continue;
+		}
+
+		double fd[2*P_COUNT];
+		double scale = 0;
+		for(int i = 0; i < P_COUNT; ++i){
+			double p[P_COUNT], vp[2], vm[2];
+			for(int j = 0; j < P_COUNT; ++j){ p[j] = p0[j]; }
+			p[i] = p0[i] + h;
+			Evaluate(p, outputs[o], vp);
+			p[i] = p0[i] - h;
+			Evaluate(p, outputs[o], vm);
+			fd[2*i+0] = (vp[0] - vm[0]) / (2*h);
+			fd[2*i+1] = (vp[1] - vm[1]) / (2*h);
+			scale = std::max(scale, std::hypot(fd[2*i+0], fd[2*i+1]));
+		}
+		for(int i = 0; i < P_COUNT; ++i){
+			const double ad[2] = { amplitude ? grad[2*i+0] : grad[i], amplitude ? grad[2*i+1] : 0 };
+			const double err = std::hypot(ad[0] - fd[2*i+0], ad[1] - fd[2*i+1]) / scale;
+			const bool ok = (err < rtol);
+			std::cout << kinds[o] << " / " << names[i] << ": adjoint (" << ad[0] << "," << ad[1]
+				<< ") difference (" << fd[2*i+0] << "," << fd[2*i+1] << ") error " << err
+				<< (ok ? "" : "  FAILED") << std::endl;
+			if(!ok){ ++nfail; }
+		}
+	}
+	return (0 == nfail ? 0 : 1);
+}